@@ -0,0 +1,298 @@
+// Asynchronous client for the bridge command set.
+//
+// Every command goes out tagged (RETURN_TAG in _return) and completes a
+// std::future when the answer with that tag comes back, so any number of
+// requests can be outstanding and long ones (WIFI_CONNECT, MQTT_CONNECT,
+// REST_REQUEST) complete out of order, once done on the bridge. Events
+// are dispatched on their callback field to the handler registered for
+// it.
+//
+// Firmware from before tags answers in order with callback 0 and right
+// away; those answers are matched to requests first in, first out. In
+// both cases the bridge runs commands in order, so an answer tells which
+// earlier requests it has read: one of those still unanswered that does
+// not finish later is failed as lost.
+//
+// Futures complete and handlers run on the client's reader thread. They
+// must not block on another future of the same client; requests they
+// issue skip the window instead of waiting for it to drain.
+#ifndef BRIDGE_CLIENT_HPP
+#define BRIDGE_CLIENT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bridge/protocol.hpp"
+#include "bridge/transport.hpp"
+
+namespace bridge {
+
+class Error : public std::runtime_error {
+public:
+	enum class Kind {
+		Timeout,	// no answer within Options::timeout
+		Lost,		// the bridge answered a later request first
+		Closed,		// the client shut down or the transport failed
+		Failed,		// answered, but without the data the call needs
+	};
+
+	Error(Kind kind, Cmd cmd, const std::string &what)
+		: std::runtime_error(std::string(cmd_name(cmd)) + ": " + what), kind_(kind), cmd_(cmd) {}
+	Kind kind() const { return kind_; }
+	Cmd cmd() const { return cmd_; }
+
+private:
+	Kind kind_;
+	Cmd cmd_;
+};
+
+struct Options {
+	// Requests the bridge has not read yet. It reads the UART into a 256
+	// byte ring and parses one frame at a time, more than that in flight
+	// gets dropped. A request larger than the byte limit is still sent,
+	// alone.
+	unsigned max_inflight = 8;
+	size_t max_inflight_bytes = 192;
+	std::chrono::milliseconds timeout{ 2000 };
+	// for the commands the bridge answers once done
+	std::chrono::milliseconds deferred_timeout{ 30000 };
+};
+
+struct MqttConfig {
+	std::string client_id;
+	std::string user;
+	std::string pass;
+	uint32_t keepalive = 120;
+	bool clean_session = true;
+	// outbound queue on the bridge in bytes, 0 for its default (2048)
+	uint32_t queue_size = 0;
+	// MQTT 5 with topic aliases instead of 3.1, see README.md
+	bool mqtt5 = false;
+	// largest MQTT packet in bytes, 0 for MQTT_BUF_SIZE (1024); up to 4096
+	// with mqtt5, 3.1 clients stay at MQTT_BUF_SIZE
+	uint32_t buf_size = 0;
+};
+
+// Data arrives padded to 4 bytes with NULs, the bridge does not send the
+// real length.
+struct MqttHandlers {
+	std::function<void()> connected;
+	std::function<void()> disconnected;
+	std::function<void()> published;
+	std::function<void(const std::string &topic, const Bytes &data)> data;
+	// After mqtt_data_size(), a bigger message comes in pieces with its
+	// offset and total length, the topic on the first piece only. Without
+	// data_part the client joins them and calls data with the message,
+	// unpadded.
+	std::function<void(const std::string &topic, uint32_t offset, uint32_t total, const Bytes &data)> data_part;
+	// The outbound queue filled past 3/4 (high set) or drained back to
+	// 1/4 of size; publishes fail once it is full.
+	std::function<void(bool high, uint32_t used, uint32_t size)> queue;
+	// The queue and packet size in effect, from the setup answer, before
+	// mqtt_setup() resolves. Not called by firmware from before buf_size.
+	std::function<void(uint32_t queue_size, uint32_t buf_size)> sizes;
+	// MQTT 5 reason codes, called along with disconnected and published:
+	// of a refused connect or the broker's DISCONNECT, and of the PUBACK
+	// (0x10 when nobody is subscribed, 0x80 and up refused). Always 0 on 3.1.
+	std::function<void(uint32_t reason)> disconnected_reason;
+	std::function<void(uint32_t reason)> published_reason;
+};
+
+// answer to a REST request; the body is padded to 4 bytes with NULs
+struct RestResponse {
+	uint32_t code;	// HTTP status, 0 when the request failed
+	std::string body;
+	// after rest_extract(): one raw JSON value per path, empty when not
+	// found, and no body
+	std::vector<std::string> values;
+};
+
+// indexed by metrics_id_e and metrics_hist_e of include/metrics.h
+struct Stats {
+	std::vector<uint32_t> metrics;
+	std::vector<uint32_t> hist;
+};
+
+// struct trace_rec_s of include/trace.h
+struct TraceRecord {
+	uint32_t ccount;
+	uint16_t ev;
+	uint16_t arg;
+};
+
+struct Trace {
+	uint32_t cpu_mhz;
+	std::vector<TraceRecord> records;
+};
+
+class Client {
+public:
+	using Handler = std::function<void(const Packet &)>;
+	// the returned value, or err set and ret 0
+	using Done = std::function<void(uint32_t ret, std::exception_ptr err)>;
+
+	struct Counters {
+		uint64_t requests = 0;
+		uint64_t answers = 0;
+		uint64_t events = 0;
+		uint64_t timeouts = 0;
+		uint64_t lost = 0;
+		uint64_t unsolicited = 0;	// answers or events nobody waits for
+		Decoder::Stats frames;
+	};
+
+	explicit Client(std::unique_ptr<Transport> transport, Options opts = Options());
+	~Client();
+	Client(const Client &) = delete;
+	Client &operator=(const Client &) = delete;
+
+	// Sends packet with _return set and resolves to the value the bridge
+	// returns. Blocks while the window is full, see Options.
+	std::future<uint32_t> call(Packet packet);
+	// the same with a completion callback instead of a future
+	void call(Packet packet, Done done);
+	// Registers h for events carrying the returned callback id.
+	uint32_t add_handler(Handler h);
+	void remove_handler(uint32_t id);
+
+	std::future<uint32_t> reset();
+	std::future<uint32_t> is_ready();
+	// Has the bridge send bulk frames (MQTT data, REST bodies) in pieces
+	// of this many bytes so answers and events get out in between, 0
+	// sends them whole. Resolves to the size in effect; firmware from
+	// before this does not answer.
+	std::future<uint32_t> tx_setup(uint32_t fragment);
+	// Resolves to the status that ends connecting (GotIp or a failure),
+	// on_status gets every status until the next wifi_connect.
+	std::future<uint32_t> wifi_connect(const std::string &ssid, const std::string &pass,
+					   std::function<void(WifiStatus)> on_status);
+
+	// resolves to the client handle, 0 when the bridge is out of clients
+	std::future<uint32_t> mqtt_setup(const MqttConfig &config, MqttHandlers handlers);
+	// resolves to 1 once the broker accepted the client, 0 if it dropped first
+	std::future<uint32_t> mqtt_connect(uint32_t handle, const std::string &host, uint32_t port,
+					   bool secure = false);
+	std::future<uint32_t> mqtt_disconnect(uint32_t handle);
+	std::future<uint32_t> mqtt_publish(uint32_t handle, const std::string &topic, const Bytes &data,
+					   uint32_t qos = 0, bool retain = false);
+	std::future<uint32_t> mqtt_publish(uint32_t handle, const std::string &topic, const std::string &data,
+					   uint32_t qos = 0, bool retain = false);
+	// The same in MQTT_PUB_PART pieces of at most part bytes, for messages
+	// over one frame. Resolves to the message length once queued, 0 when
+	// the bridge had no room for it.
+	std::future<uint32_t> mqtt_publish_parts(uint32_t handle, const std::string &topic, const Bytes &data,
+						 size_t part, uint32_t qos = 0, bool retain = false);
+	// data events of at most size bytes, see MqttHandlers; resolves to the
+	// size in effect
+	std::future<uint32_t> mqtt_data_size(uint32_t handle, uint32_t size);
+	std::future<uint32_t> mqtt_subscribe(uint32_t handle, const std::string &topic, uint32_t qos = 0);
+	// One SUBSCRIBE for all (topic, qos) pairs, answered on the SUBACK:
+	// resolves to its return codes, one per topic, 0x80 for a refused one.
+	std::future<Bytes> mqtt_subscribe_batch(uint32_t handle,
+						const std::vector<std::pair<std::string, uint32_t>> &topics);
+	// one UNSUBSCRIBE; resolves to the number of topics once acknowledged,
+	// 0 when the connection dropped first
+	std::future<uint32_t> mqtt_unsubscribe(uint32_t handle, const std::vector<std::string> &topics);
+	std::future<uint32_t> mqtt_lwt(uint32_t handle, const std::string &topic, const std::string &message,
+				       uint32_t qos = 0, bool retain = false);
+	// Edge filter rule for publishes to topic from any client, see
+	// README.md; deadband in thousandths, all 0 removes it. Resolves to 1,
+	// 0 when the bridge has no room for another rule.
+	std::future<uint32_t> mqtt_filter(const std::string &topic, uint32_t deadband, uint32_t min_ms,
+					  uint32_t heartbeat_ms, bool change);
+	// resolves to the publishes the topic's rule dropped so far
+	std::future<uint32_t> mqtt_filter_suppressed(const std::string &topic);
+	// Numbers published to topic from any client are summarized on the
+	// bridge, one record per window, see README.md; 0 stops. Resolves to
+	// 1, 0 when the bridge has no room for another series.
+	std::future<uint32_t> mqtt_aggregate(const std::string &topic, uint32_t window_ms);
+
+	// resolves to the client handle; a client runs one request at a time
+	std::future<uint32_t> rest_setup(const std::string &host, uint32_t port, bool secure = false);
+	std::future<RestResponse> rest_request(uint32_t handle, const std::string &method, const std::string &path,
+					       const std::string &body = std::string());
+	std::future<uint32_t> rest_set_header(uint32_t handle, RestHeader header, const std::string &value);
+	// JSON paths such as "main.temp" or "list[0].id" whose values the
+	// bridge picks out of the responses instead of sending the body, see
+	// README.md; none goes back to the body. Resolves to the number of
+	// paths, 0 when the bridge cannot hold them.
+	std::future<uint32_t> rest_extract(uint32_t handle, const std::vector<std::string> &paths);
+
+	std::future<Stats> stats();
+	// JSON metrics on topic every interval ms, 0 stops
+	std::future<uint32_t> stats_publish(uint32_t mqtt_handle, const std::string &topic, uint32_t interval);
+	std::future<Trace> trace();
+	// the same records as text on the bridge's UART1
+	std::future<uint32_t> trace_dump();
+	// the JSON report of mem_track_report()
+	std::future<std::string> mem();
+
+	// on_event until OtaEvent::Done or OtaEvent::Fail; the value is the
+	// bytes written so far for Progress, the image size for Done and the
+	// OTA_ERR code for Fail
+	std::future<uint32_t> ota(const std::string &host, uint32_t port, const std::string &path,
+				  std::function<void(OtaEvent ev, uint32_t value)> on_event);
+
+	Counters counters() const;
+
+private:
+	// the answer, or nullptr and err set
+	using Reply = std::function<void(const Packet *answer, std::exception_ptr err)>;
+
+	struct Pending {
+		uint32_t tag;
+		Cmd cmd;
+		size_t bytes;
+		bool read;	// the bridge has read it, out of the window
+		std::chrono::steady_clock::time_point deadline;
+		Reply reply;
+	};
+
+	struct RestClient;
+
+	void submit(Packet packet, Reply reply);
+	template <typename T>
+	std::future<T> call_reply(Packet packet, std::function<T(const Packet &)> decode);
+	void reader();
+	void on_packet(const Packet &p);
+	void on_answer(const Packet &p);
+	void expire();
+	void fail_all(Error::Kind kind, const std::string &what);
+	static void complete(Pending &p, const Packet *answer, std::exception_ptr err);
+
+	std::unique_ptr<Transport> transport_;
+	Options opts_;
+	std::mutex send_lock_;	// keeps pending_ in wire order
+	Decoder decoder_;	// reader thread only
+	std::thread reader_;
+
+	mutable std::mutex lock_;	// everything below
+	uint32_t seq_ = 0;
+	std::condition_variable window_;
+	std::deque<Pending> pending_;	// in wire order
+	unsigned inflight_ = 0;		// not read by the bridge yet
+	size_t inflight_bytes_ = 0;
+	std::map<uint32_t, Handler> handlers_;
+	std::map<uint32_t, std::shared_ptr<RestClient>> rest_;
+	uint32_t next_id_ = 1;
+	uint32_t wifi_id_ = 0;
+	Counters counters_;
+	bool closed_ = false;
+};
+
+} // namespace bridge
+
+#endif // BRIDGE_CLIENT_HPP
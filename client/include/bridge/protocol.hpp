@@ -0,0 +1,136 @@
+// Bridge protocol of modules/cmd.c: SLIP framed packets with a CRC16.
+//
+//   uint16 cmd, uint32 callback, uint32 _return, uint16 argc,
+//   argc x (uint16 len, len bytes), uint16 crc
+//
+// all little endian. The CRC covers everything before it, the SLIP start
+// (0x7E) and end (0x7F) bytes are escaped as 0x7D, byte ^ 0x20.
+#ifndef BRIDGE_PROTOCOL_HPP
+#define BRIDGE_PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bridge {
+
+// CMD_NAME in modules/include/cmd.h
+enum class Cmd : uint16_t {
+	Null = 0,
+	Reset,
+	IsReady,
+	WifiConnect,
+	MqttSetup,
+	MqttConnect,
+	MqttDisconnect,
+	MqttPublish,
+	MqttSubscribe,
+	MqttLwt,
+	MqttEvents,
+	RestSetup,
+	RestRequest,
+	RestSetHeader,
+	RestEvents,
+	Stats,
+	Trace,
+	Mem,
+	Ota,
+	OtaEvents,
+	TxSetup,
+	TxFragment,
+	MqttPubStart,
+	MqttPubPart,
+	MqttDataSize,
+	MqttSubBatch,
+	MqttUnsubBatch,
+	MqttFilter,
+	MqttAggregate,
+	RestExtract,
+};
+
+const char *cmd_name(Cmd cmd);
+
+// HEADER_TYPE in modules/include/rest.h
+enum class RestHeader : uint32_t {
+	Generic = 0,
+	ContentType,
+	UserAgent,
+};
+
+// station status reported by CMD_WIFI_CONNECT, as in user_interface.h
+enum class WifiStatus : uint8_t {
+	Idle = 0,
+	Connecting,
+	WrongPassword,
+	NoApFound,
+	ConnectFail,
+	GotIp,
+};
+
+// OTA_EVENT in modules/include/ota.h
+enum class OtaEvent : uint32_t {
+	Progress = 0,
+	Done,
+	Fail,
+};
+
+// _return bit of a tagged request, CMD_RETURN_TAG in cmd.h: the low bits
+// are an id that comes back in the callback field of the answer
+constexpr uint32_t RETURN_TAG = 0x80000000;
+
+using Bytes = std::vector<uint8_t>;
+
+struct Packet {
+	Cmd cmd = Cmd::Null;
+	uint32_t callback = 0;
+	uint32_t ret = 0;		// _return: "answer me" or a tag on requests, the value on answers
+	std::vector<Bytes> args;
+
+	Packet &arg(const void *data, size_t len);
+	Packet &arg(const std::string &s) { return arg(s.data(), s.size()); }
+	Packet &arg(const Bytes &b) { return arg(b.data(), b.size()); }
+	Packet &arg(uint32_t v);
+
+	uint32_t arg_u32(size_t i) const;
+	std::string arg_str(size_t i) const;	// trailing NUL padding removed
+};
+
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t acc = 0);
+
+// SLIP framed packet; args are padded to 4 bytes like the Arduino library does
+Bytes encode(const Packet &packet);
+
+// Byte stream to packets, rejects frames that are short, overrun their
+// args or fail the CRC. TX_FRAGMENT frames are joined back into the
+// packet they carry; a fragment that does not continue the one before
+// drops the packet in progress.
+class Decoder {
+public:
+	struct Stats {
+		uint64_t frames = 0;
+		uint64_t bad = 0;
+		uint64_t fragments = 0;
+	};
+
+	// appends the complete packets found in data to out
+	void feed(const uint8_t *data, size_t len, std::vector<Packet> &out);
+	const Stats &stats() const { return stats_; }
+	void reset();
+
+private:
+	static bool parse(const Bytes &raw, Packet &out);
+	bool join(const Packet &frag, Packet &out);
+
+	Bytes buf_;
+	Bytes frag_;		// the packet being joined
+	uint32_t frag_id_ = 0;
+	size_t frag_len_ = 0;
+	bool begun_ = false;
+	bool esc_ = false;
+	Stats stats_;
+};
+
+} // namespace bridge
+
+#endif // BRIDGE_PROTOCOL_HPP
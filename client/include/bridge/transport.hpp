@@ -0,0 +1,105 @@
+// Byte pipes the client runs over: a serial port (or the simulator's pty),
+// a recorder around another transport, and the replay of a recording.
+#ifndef BRIDGE_TRANSPORT_HPP
+#define BRIDGE_TRANSPORT_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "bridge/protocol.hpp"
+
+namespace bridge {
+
+// write() may be called from several threads, read() from one.
+class Transport {
+public:
+	virtual ~Transport() = default;
+
+	// all of it or throws std::system_error
+	virtual void write(const uint8_t *data, size_t len) = 0;
+	// bytes read, 0 on timeout, -1 once closed
+	virtual ssize_t read(uint8_t *buf, size_t len, int timeout_ms) = 0;
+	// wakes up a blocked read(), which returns -1 from then on
+	virtual void close() = 0;
+};
+
+// Raw 8N1 tty at the given baud rate.
+class SerialTransport : public Transport {
+public:
+	SerialTransport(const std::string &path, unsigned baud = 115200);
+	~SerialTransport() override;
+
+	void write(const uint8_t *data, size_t len) override;
+	ssize_t read(uint8_t *buf, size_t len, int timeout_ms) override;
+	void close() override;
+
+private:
+	int fd_ = -1;
+	int wake_[2] = { -1, -1 };
+	std::mutex wlock_;
+};
+
+// Passes everything through and logs it to a transcript file, one chunk a
+// line: "> hex" for bytes written, "< hex" for bytes read. Lines starting
+// with '#' are comments.
+class RecordingTransport : public Transport {
+public:
+	RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path);
+	~RecordingTransport() override;
+
+	void write(const uint8_t *data, size_t len) override;
+	ssize_t read(uint8_t *buf, size_t len, int timeout_ms) override;
+	void close() override;
+
+private:
+	void log(char dir, const uint8_t *data, size_t len);
+
+	std::unique_ptr<Transport> inner_;
+	FILE *file_;
+	std::mutex lock_;
+};
+
+// Plays a transcript back: the bytes written must match the "> " lines,
+// and each "< " line is handed to read() once everything written before
+// it in the recording has been written again. Chunking does not have to
+// match, only the byte streams.
+class TranscriptTransport : public Transport {
+public:
+	explicit TranscriptTransport(const std::string &path);
+
+	// throws std::runtime_error at the first byte that differs
+	void write(const uint8_t *data, size_t len) override;
+	ssize_t read(uint8_t *buf, size_t len, int timeout_ms) override;
+	void close() override;
+
+	// every line of the transcript has been written or read
+	bool done() const;
+
+private:
+	struct Chunk {
+		size_t after;	// bytes written before it in the recording
+		Bytes data;
+	};
+
+	void release();
+
+	Bytes expect_;	// "> " lines, concatenated
+	size_t written_ = 0;
+	std::vector<Chunk> replies_;
+	size_t next_ = 0;	// first reply not released yet
+	Bytes ready_;
+	size_t ready_off_ = 0;
+	bool closed_ = false;
+	mutable std::mutex lock_;
+	std::condition_variable cond_;
+};
+
+} // namespace bridge
+
+#endif // BRIDGE_TRANSPORT_HPP
@@ -0,0 +1,813 @@
+#include "bridge/client.hpp"
+
+#include <algorithm>
+
+namespace bridge {
+
+namespace {
+
+constexpr int READ_POLL_MS = 20;
+
+// commands the bridge answers once done when the request is tagged
+bool completes_later(Cmd cmd)
+{
+	return cmd == Cmd::WifiConnect || cmd == Cmd::MqttConnect || cmd == Cmd::RestRequest ||
+	       cmd == Cmd::MqttSubBatch || cmd == Cmd::MqttUnsubBatch;
+}
+
+std::vector<uint32_t> u32_array(const Packet &p, size_t i)
+{
+	std::vector<uint32_t> out;
+
+	if (i >= p.args.size())
+		return out;
+	const Bytes &a = p.args[i];
+	for (size_t off = 0; off + 4 <= a.size(); off += 4)
+		out.push_back(a[off] | a[off + 1] << 8 | a[off + 2] << 16 | uint32_t(a[off + 3]) << 24);
+	return out;
+}
+
+} // namespace
+
+// Firmware without tags answers REST_REQUEST right away and sends the
+// response as a REST_EVENTS event later, one request per client at a
+// time. Reader thread only.
+struct Client::RestClient {
+	std::deque<std::shared_ptr<std::promise<RestResponse>>> waiting;
+	bool extract = false;	// set and read on the reader thread only
+};
+
+static RestResponse rest_response(const Packet &p, bool extract)
+{
+	RestResponse r{ p.ret, std::string(), {} };
+	if (!extract)
+		r.body = p.arg_str(0);
+	else
+		for (size_t i = 0; i < p.args.size(); i++)
+			r.values.push_back(p.arg_str(i));
+	return r;
+}
+
+Client::Client(std::unique_ptr<Transport> transport, Options opts)
+	: transport_(std::move(transport)), opts_(opts)
+{
+	reader_ = std::thread(&Client::reader, this);
+}
+
+Client::~Client()
+{
+	transport_->close();
+	reader_.join();
+}
+
+void Client::complete(Pending &p, const Packet *answer, std::exception_ptr err)
+{
+	if (p.reply)
+		p.reply(answer, err);
+}
+
+void Client::submit(Packet packet, Reply reply)
+{
+	Cmd cmd = packet.cmd;
+	uint32_t tag;
+	Bytes frame;
+
+	{
+		std::unique_lock<std::mutex> guard(lock_);
+		if ((++seq_ & ~RETURN_TAG) == 0)
+			++seq_;
+		tag = RETURN_TAG | (seq_ & ~RETURN_TAG);
+		packet.ret = tag;
+		frame = encode(packet);
+		// The reader thread cannot wait for itself to drain the window.
+		// Nobody waits holding send_lock_, or a request from a handler
+		// would stop the reader.
+		if (std::this_thread::get_id() != reader_.get_id()) {
+			window_.wait(guard, [&] {
+				return closed_ || (inflight_ < opts_.max_inflight &&
+						   (inflight_ == 0 ||
+						    inflight_bytes_ + frame.size() <= opts_.max_inflight_bytes));
+			});
+		}
+		if (!closed_) {
+			inflight_++;
+			inflight_bytes_ += frame.size();
+			counters_.requests++;
+		}
+	}
+
+	std::lock_guard<std::mutex> order(send_lock_);
+	{
+		std::unique_lock<std::mutex> guard(lock_);
+		if (closed_) {
+			guard.unlock();
+			reply(nullptr, std::make_exception_ptr(Error(Error::Kind::Closed, cmd, "client closed")));
+			return;
+		}
+		auto timeout = completes_later(cmd) ? opts_.deferred_timeout : opts_.timeout;
+		pending_.push_back({ tag, cmd, frame.size(), false,
+				     std::chrono::steady_clock::now() + timeout, std::move(reply) });
+	}
+
+	try {
+		transport_->write(frame.data(), frame.size());
+	} catch (...) {
+		Pending p{};
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+				if (it->tag == tag) {
+					p = std::move(*it);
+					inflight_--;
+					inflight_bytes_ -= p.bytes;
+					pending_.erase(it);
+					break;
+				}
+			}
+			window_.notify_all();
+		}
+		// unless the reader failed it already
+		complete(p, nullptr, std::current_exception());
+	}
+}
+
+std::future<uint32_t> Client::call(Packet packet)
+{
+	auto prom = std::make_shared<std::promise<uint32_t>>();
+	std::future<uint32_t> f = prom->get_future();
+
+	submit(std::move(packet), [prom](const Packet *answer, std::exception_ptr err) {
+		if (err)
+			prom->set_exception(err);
+		else
+			prom->set_value(answer->ret);
+	});
+	return f;
+}
+
+void Client::call(Packet packet, Done done)
+{
+	submit(std::move(packet), [done](const Packet *answer, std::exception_ptr err) {
+		done(answer ? answer->ret : 0, err);
+	});
+}
+
+// One-shot callback id for commands that send their data as a separate
+// frame ahead of the answer: the future resolves from that frame, or
+// fails if the answer comes without it.
+template <typename T>
+std::future<T> Client::call_reply(Packet packet, std::function<T(const Packet &)> decode)
+{
+	struct State {
+		std::promise<T> prom;
+		std::atomic<bool> set{ false };
+	};
+	auto st = std::make_shared<State>();
+	std::future<T> f = st->prom.get_future();
+	Cmd cmd = packet.cmd;
+
+	uint32_t id = add_handler([st, decode](const Packet &ev) {
+		if (st->set.exchange(true))
+			return;
+		try {
+			st->prom.set_value(decode(ev));
+		} catch (...) {
+			st->prom.set_exception(std::current_exception());
+		}
+	});
+	packet.callback = id;
+	submit(std::move(packet), [this, st, id, cmd](const Packet *answer, std::exception_ptr err) {
+		remove_handler(id);
+		if (st->set.exchange(true))
+			return;
+		if (!err)
+			err = std::make_exception_ptr(Error(Error::Kind::Failed, cmd,
+							    "no data, returned " + std::to_string(answer->ret)));
+		st->prom.set_exception(err);
+	});
+	return f;
+}
+
+uint32_t Client::add_handler(Handler h)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	// ids stay clear of RETURN_TAG, answers carry that in the same field
+	while (next_id_ == 0 || (next_id_ & RETURN_TAG) || handlers_.count(next_id_))
+		next_id_ = (next_id_ + 1) & ~RETURN_TAG;
+	handlers_[next_id_] = std::move(h);
+	return next_id_++;
+}
+
+void Client::remove_handler(uint32_t id)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	handlers_.erase(id);
+}
+
+void Client::reader()
+{
+	uint8_t buf[512];
+	std::vector<Packet> packets;
+
+	for (;;) {
+		ssize_t n = transport_->read(buf, sizeof(buf), READ_POLL_MS);
+		if (n < 0)
+			break;
+		if (n > 0) {
+			packets.clear();
+			decoder_.feed(buf, n, packets);
+			{
+				std::lock_guard<std::mutex> guard(lock_);
+				counters_.frames = decoder_.stats();
+			}
+			for (const Packet &p : packets)
+				on_packet(p);
+		}
+		expire();
+	}
+	fail_all(Error::Kind::Closed, "transport closed");
+}
+
+void Client::on_packet(const Packet &p)
+{
+	// answers carry their tag, or callback 0 and no args from older firmware
+	if ((p.callback & RETURN_TAG) || (p.callback == 0 && p.args.empty())) {
+		on_answer(p);
+		return;
+	}
+
+	Handler h;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		auto it = handlers_.find(p.callback);
+		if (it == handlers_.end()) {
+			counters_.unsolicited++;
+			return;
+		}
+		counters_.events++;
+		h = it->second;
+	}
+	h(p);
+}
+
+void Client::on_answer(const Packet &p)
+{
+	bool tagged = p.callback & RETURN_TAG;
+	std::vector<Pending> lost;
+	std::deque<Pending> keep;
+	Pending hit{};
+	size_t at;
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		counters_.answers++;
+		for (at = 0; at < pending_.size(); at++) {
+			const Pending &e = pending_[at];
+			if (tagged ? e.tag == p.callback : e.cmd == p.cmd)
+				break;
+		}
+		if (at == pending_.size()) {
+			counters_.unsolicited++;
+			return;
+		}
+		// the bridge has read everything sent before it; what is still
+		// unanswered there is lost unless it finishes later
+		for (size_t i = 0; i < pending_.size(); i++) {
+			Pending &e = pending_[i];
+			if (i <= at && !e.read) {
+				e.read = true;
+				inflight_--;
+				inflight_bytes_ -= e.bytes;
+			}
+			if (i == at)
+				hit = std::move(e);
+			else if (i < at && !(tagged && completes_later(e.cmd)))
+				lost.push_back(std::move(e));
+			else
+				keep.push_back(std::move(e));
+		}
+		pending_.swap(keep);
+		counters_.lost += lost.size();
+		window_.notify_all();
+	}
+	for (Pending &l : lost)
+		complete(l, nullptr, std::make_exception_ptr(Error(Error::Kind::Lost, l.cmd,
+								   "no answer from the bridge")));
+	complete(hit, &p, nullptr);
+}
+
+void Client::expire()
+{
+	std::vector<Pending> expired;
+	auto now = std::chrono::steady_clock::now();
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		std::deque<Pending> keep;
+		if (std::none_of(pending_.begin(), pending_.end(),
+				 [now](const Pending &e) { return e.deadline <= now; }))
+			return;
+		for (Pending &e : pending_) {
+			if (e.deadline > now) {
+				keep.push_back(std::move(e));
+				continue;
+			}
+			if (!e.read) {
+				inflight_--;
+				inflight_bytes_ -= e.bytes;
+			}
+			expired.push_back(std::move(e));
+		}
+		pending_.swap(keep);
+		counters_.timeouts += expired.size();
+		window_.notify_all();
+	}
+	for (Pending &p : expired)
+		complete(p, nullptr, std::make_exception_ptr(Error(Error::Kind::Timeout, p.cmd, "timed out")));
+}
+
+void Client::fail_all(Error::Kind kind, const std::string &what)
+{
+	std::deque<Pending> failed;
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		closed_ = true;
+		failed.swap(pending_);
+		inflight_ = 0;
+		inflight_bytes_ = 0;
+		window_.notify_all();
+	}
+	for (Pending &p : failed)
+		complete(p, nullptr, std::make_exception_ptr(Error(kind, p.cmd, what)));
+}
+
+Client::Counters Client::counters() const
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	return counters_;
+}
+
+std::future<uint32_t> Client::reset()
+{
+	Packet p;
+	p.cmd = Cmd::Reset;
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::is_ready()
+{
+	Packet p;
+	p.cmd = Cmd::IsReady;
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::tx_setup(uint32_t fragment)
+{
+	Packet p;
+	p.cmd = Cmd::TxSetup;
+	p.arg(fragment);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::wifi_connect(const std::string &ssid, const std::string &pass,
+					   std::function<void(WifiStatus)> on_status)
+{
+	uint32_t id, old;
+
+	id = add_handler([on_status](const Packet &ev) {
+		if (on_status && !ev.args.empty() && !ev.args[0].empty())
+			on_status(static_cast<WifiStatus>(ev.args[0][0]));
+	});
+	{
+		// the bridge keeps one status callback
+		std::lock_guard<std::mutex> guard(lock_);
+		old = wifi_id_;
+		wifi_id_ = id;
+	}
+	if (old)
+		remove_handler(old);
+
+	Packet p;
+	p.cmd = Cmd::WifiConnect;
+	p.callback = id;
+	p.arg(ssid).arg(pass);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_setup(const MqttConfig &config, MqttHandlers handlers)
+{
+	auto h = std::make_shared<MqttHandlers>(std::move(handlers));
+	// the message being joined, reader thread only
+	auto topic = std::make_shared<std::string>();
+	auto joined = std::make_shared<Bytes>();
+	auto prom = std::make_shared<std::promise<uint32_t>>();
+	std::future<uint32_t> f = prom->get_future();
+	std::vector<uint32_t> ids = {
+		add_handler([h](const Packet &) { if (h->connected) h->connected(); }),
+		add_handler([h](const Packet &ev) {
+			if (h->disconnected)
+				h->disconnected();
+			if (h->disconnected_reason)
+				h->disconnected_reason(ev.ret);
+		}),
+		add_handler([h](const Packet &ev) {
+			if (h->published)
+				h->published();
+			if (h->published_reason)
+				h->published_reason(ev.ret);
+		}),
+		add_handler([h, topic, joined](const Packet &ev) {
+			if (ev.args.size() < 4) {
+				if (h->data)
+					h->data(ev.arg_str(0), ev.args.size() > 1 ? ev.args[1] : Bytes());
+				return;
+			}
+			uint32_t offset = ev.arg_u32(2), total = ev.arg_u32(3);
+			if (offset >= total)
+				return;
+			Bytes data = ev.args[1];
+			data.resize(std::min<size_t>(data.size(), total - offset));
+			if (offset == 0)
+				*topic = ev.arg_str(0);
+			if (h->data_part) {
+				h->data_part(*topic, offset, total, data);
+				return;
+			}
+			if (offset == 0)
+				joined->clear();
+			if (offset != joined->size())
+				return;		// a piece went missing, wait for the next message
+			joined->insert(joined->end(), data.begin(), data.end());
+			if (joined->size() == total && h->data)
+				h->data(*topic, *joined);
+		}),
+	};
+	// firmware from before queue sizing takes the first 9 args only, from
+	// before MQTT 5 the first 11, from before buf_size the first 12
+	bool queue = config.queue_size || h->queue;
+	if (queue)
+		ids.push_back(add_handler([h](const Packet &ev) {
+			if (h->queue)
+				h->queue(ev.arg_u32(0) != 0, ev.arg_u32(1), ev.arg_u32(2));
+		}));
+
+	Packet p;
+	p.cmd = Cmd::MqttSetup;
+	p.arg(config.client_id).arg(config.user).arg(config.pass);
+	p.arg(config.keepalive).arg(uint32_t(config.clean_session));
+	for (size_t i = 0; i < 4; i++)
+		p.arg(ids[i]);
+	if (queue || config.mqtt5 || config.buf_size)
+		p.arg(config.queue_size).arg(queue ? ids[4] : 0);
+	if (config.mqtt5 || config.buf_size)
+		p.arg(uint32_t(config.mqtt5 ? 5 : 0));
+	if (config.buf_size)
+		p.arg(config.buf_size);
+	submit(std::move(p), [this, prom, ids, h](const Packet *answer, std::exception_ptr err) {
+		if (err || answer->ret == 0)
+			for (uint32_t id : ids)
+				remove_handler(id);
+		if (err) {
+			prom->set_exception(err);
+			return;
+		}
+		if (answer->ret && answer->args.size() >= 2 && h->sizes)
+			h->sizes(answer->arg_u32(0), answer->arg_u32(1));
+		prom->set_value(answer->ret);
+	});
+	return f;
+}
+
+std::future<uint32_t> Client::mqtt_connect(uint32_t handle, const std::string &host, uint32_t port,
+					   bool secure)
+{
+	Packet p;
+	p.cmd = Cmd::MqttConnect;
+	p.arg(handle).arg(host).arg(port).arg(uint32_t(secure));
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_disconnect(uint32_t handle)
+{
+	Packet p;
+	p.cmd = Cmd::MqttDisconnect;
+	p.arg(handle);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_publish(uint32_t handle, const std::string &topic, const Bytes &data,
+					   uint32_t qos, bool retain)
+{
+	Packet p;
+	p.cmd = Cmd::MqttPublish;
+	p.arg(handle).arg(topic).arg(data).arg(uint32_t(data.size())).arg(qos).arg(uint32_t(retain));
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_publish(uint32_t handle, const std::string &topic, const std::string &data,
+					   uint32_t qos, bool retain)
+{
+	return mqtt_publish(handle, topic, Bytes(data.begin(), data.end()), qos, retain);
+}
+
+std::future<uint32_t> Client::mqtt_publish_parts(uint32_t handle, const std::string &topic, const Bytes &data,
+						 size_t part, uint32_t qos, bool retain)
+{
+	std::future<uint32_t> last;
+	size_t at = 0;
+
+	Packet p;
+	p.cmd = Cmd::MqttPubStart;
+	p.arg(handle).arg(topic).arg(uint32_t(data.size())).arg(qos).arg(uint32_t(retain));
+	call(std::move(p));
+	// parts after a failed start answer 0 as well, the last one tells
+	if (part == 0)
+		part = data.size();
+	do {
+		size_t n = std::min(part, data.size() - at);
+		Packet q;
+		q.cmd = Cmd::MqttPubPart;
+		q.arg(handle).arg(uint32_t(at)).arg(data.data() + at, n).arg(uint32_t(n));
+		last = call(std::move(q));
+		at += n;
+	} while (at < data.size());
+	return last;
+}
+
+std::future<uint32_t> Client::mqtt_data_size(uint32_t handle, uint32_t size)
+{
+	Packet p;
+	p.cmd = Cmd::MqttDataSize;
+	p.arg(handle).arg(size);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_subscribe(uint32_t handle, const std::string &topic, uint32_t qos)
+{
+	Packet p;
+	p.cmd = Cmd::MqttSubscribe;
+	p.arg(handle).arg(topic).arg(qos);
+	return call(std::move(p));
+}
+
+std::future<Bytes> Client::mqtt_subscribe_batch(uint32_t handle,
+						const std::vector<std::pair<std::string, uint32_t>> &topics)
+{
+	auto prom = std::make_shared<std::promise<Bytes>>();
+	std::future<Bytes> f = prom->get_future();
+	size_t n = topics.size();
+
+	Packet p;
+	p.cmd = Cmd::MqttSubBatch;
+	p.arg(handle);
+	for (auto &t : topics)
+		p.arg(t.first).arg(t.second);
+	submit(std::move(p), [prom, n](const Packet *answer, std::exception_ptr err) {
+		if (err) {
+			prom->set_exception(err);
+		} else if (answer->args.empty()) {
+			prom->set_exception(std::make_exception_ptr(Error(Error::Kind::Failed, Cmd::MqttSubBatch,
+				answer->ret ? "no SUBACK" : "rejected")));
+		} else {
+			Bytes codes = answer->args[0];
+			codes.resize(n);
+			prom->set_value(codes);
+		}
+	});
+	return f;
+}
+
+std::future<uint32_t> Client::mqtt_unsubscribe(uint32_t handle, const std::vector<std::string> &topics)
+{
+	Packet p;
+	p.cmd = Cmd::MqttUnsubBatch;
+	p.arg(handle);
+	for (auto &t : topics)
+		p.arg(t);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_lwt(uint32_t handle, const std::string &topic, const std::string &message,
+				       uint32_t qos, bool retain)
+{
+	Packet p;
+	p.cmd = Cmd::MqttLwt;
+	p.arg(handle).arg(topic).arg(message).arg(qos).arg(uint32_t(retain));
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_filter(const std::string &topic, uint32_t deadband, uint32_t min_ms,
+					  uint32_t heartbeat_ms, bool change)
+{
+	Packet p;
+	p.cmd = Cmd::MqttFilter;
+	p.arg(topic).arg(deadband).arg(min_ms).arg(heartbeat_ms).arg(uint32_t(change));
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_filter_suppressed(const std::string &topic)
+{
+	Packet p;
+	p.cmd = Cmd::MqttFilter;
+	p.arg(topic);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::mqtt_aggregate(const std::string &topic, uint32_t window_ms)
+{
+	Packet p;
+	p.cmd = Cmd::MqttAggregate;
+	p.arg(topic).arg(window_ms);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::rest_setup(const std::string &host, uint32_t port, bool secure)
+{
+	auto prom = std::make_shared<std::promise<uint32_t>>();
+	std::future<uint32_t> f = prom->get_future();
+	auto rc = std::make_shared<RestClient>();
+	uint32_t id = add_handler([rc](const Packet &ev) {
+		if (rc->waiting.empty())
+			return;
+		auto waiter = rc->waiting.front();
+		rc->waiting.pop_front();
+		waiter->set_value(rest_response(ev, rc->extract));
+	});
+
+	Packet p;
+	p.cmd = Cmd::RestSetup;
+	p.callback = id;
+	p.arg(host).arg(port).arg(uint32_t(secure));
+	submit(std::move(p), [this, prom, rc, id](const Packet *answer, std::exception_ptr err) {
+		if (err || answer->ret == 0) {
+			remove_handler(id);
+		} else {
+			std::lock_guard<std::mutex> guard(lock_);
+			rest_[answer->ret] = rc;
+		}
+		if (err)
+			prom->set_exception(err);
+		else
+			prom->set_value(answer->ret);
+	});
+	return f;
+}
+
+std::future<RestResponse> Client::rest_request(uint32_t handle, const std::string &method, const std::string &path,
+					       const std::string &body)
+{
+	auto prom = std::make_shared<std::promise<RestResponse>>();
+	std::future<RestResponse> f = prom->get_future();
+	std::shared_ptr<RestClient> rc;
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		auto it = rest_.find(handle);
+		if (it != rest_.end())
+			rc = it->second;
+	}
+
+	Packet p;
+	p.cmd = Cmd::RestRequest;
+	p.arg(handle).arg(method).arg(path);
+	if (!body.empty())
+		p.arg(uint32_t(body.size())).arg(body);
+	submit(std::move(p), [prom, rc](const Packet *answer, std::exception_ptr err) {
+		if (err) {
+			prom->set_exception(err);
+		} else if (answer->callback & RETURN_TAG) {
+			prom->set_value(rest_response(*answer, rc && rc->extract));
+		} else if (answer->ret == 0 || !rc) {
+			prom->set_exception(std::make_exception_ptr(Error(Error::Kind::Failed, Cmd::RestRequest,
+				answer->ret ? "client not set up here" : "rejected")));
+		} else {
+			// older firmware, the response follows as an event
+			rc->waiting.push_back(prom);
+		}
+	});
+	return f;
+}
+
+std::future<uint32_t> Client::rest_set_header(uint32_t handle, RestHeader header, const std::string &value)
+{
+	Packet p;
+	p.cmd = Cmd::RestSetHeader;
+	p.arg(handle).arg(static_cast<uint32_t>(header)).arg(value);
+	return call(std::move(p));
+}
+
+std::future<uint32_t> Client::rest_extract(uint32_t handle, const std::vector<std::string> &paths)
+{
+	auto prom = std::make_shared<std::promise<uint32_t>>();
+	std::future<uint32_t> f = prom->get_future();
+	std::shared_ptr<RestClient> rc;
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		auto it = rest_.find(handle);
+		if (it != rest_.end())
+			rc = it->second;
+	}
+
+	Packet p;
+	p.cmd = Cmd::RestExtract;
+	p.arg(handle);
+	for (auto &path : paths)
+		p.arg(path);
+	submit(std::move(p), [prom, rc](const Packet *answer, std::exception_ptr err) {
+		if (err) {
+			prom->set_exception(err);
+			return;
+		}
+		if (rc)
+			rc->extract = answer->ret != 0;
+		prom->set_value(answer->ret);
+	});
+	return f;
+}
+
+std::future<Stats> Client::stats()
+{
+	Packet p;
+	p.cmd = Cmd::Stats;
+	return call_reply<Stats>(std::move(p), [](const Packet &ev) {
+		Stats s;
+		s.metrics = u32_array(ev, 0);
+		s.hist = u32_array(ev, 1);
+		return s;
+	});
+}
+
+std::future<uint32_t> Client::stats_publish(uint32_t mqtt_handle, const std::string &topic, uint32_t interval)
+{
+	Packet p;
+	p.cmd = Cmd::Stats;
+	p.arg(mqtt_handle).arg(topic).arg(interval);
+	return call(std::move(p));
+}
+
+std::future<Trace> Client::trace()
+{
+	Packet p;
+	p.cmd = Cmd::Trace;
+	return call_reply<Trace>(std::move(p), [](const Packet &ev) {
+		Trace t;
+		std::vector<uint32_t> words = u32_array(ev, 0);
+		t.cpu_mhz = ev.ret;
+		for (size_t i = 0; i + 1 < words.size(); i += 2)
+			t.records.push_back({ words[i], uint16_t(words[i + 1]), uint16_t(words[i + 1] >> 16) });
+		return t;
+	});
+}
+
+std::future<uint32_t> Client::trace_dump()
+{
+	Packet p;
+	p.cmd = Cmd::Trace;
+	p.arg(uint32_t(1));
+	return call(std::move(p));
+}
+
+std::future<std::string> Client::mem()
+{
+	Packet p;
+	p.cmd = Cmd::Mem;
+	return call_reply<std::string>(std::move(p), [](const Packet &ev) { return ev.arg_str(0); });
+}
+
+std::future<uint32_t> Client::ota(const std::string &host, uint32_t port, const std::string &path,
+				  std::function<void(OtaEvent ev, uint32_t value)> on_event)
+{
+	auto prom = std::make_shared<std::promise<uint32_t>>();
+	std::future<uint32_t> f = prom->get_future();
+	auto id = std::make_shared<uint32_t>(0);
+
+	*id = add_handler([this, on_event, id](const Packet &ev) {
+		OtaEvent e = static_cast<OtaEvent>(ev.ret);
+		if (on_event)
+			on_event(e, ev.arg_u32(0));
+		if (e == OtaEvent::Done || e == OtaEvent::Fail)
+			remove_handler(*id);
+	});
+
+	Packet p;
+	p.cmd = Cmd::Ota;
+	p.callback = *id;
+	p.arg(host).arg(port).arg(path);
+	// 0 when an update is already running
+	submit(std::move(p), [this, prom, id](const Packet *answer, std::exception_ptr err) {
+		if (err || answer->ret == 0)
+			remove_handler(*id);
+		if (err)
+			prom->set_exception(err);
+		else
+			prom->set_value(answer->ret);
+	});
+	return f;
+}
+
+} // namespace bridge
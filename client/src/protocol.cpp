@@ -0,0 +1,236 @@
+#include "bridge/protocol.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace bridge {
+
+namespace {
+
+constexpr uint8_t SLIP_START = 0x7E;
+constexpr uint8_t SLIP_END = 0x7F;
+constexpr uint8_t SLIP_REPL = 0x7D;
+constexpr size_t HEADER_LEN = 12;
+constexpr size_t FRAME_MAX = 4096;	// well above the bridge's 2048 byte rx buffer
+
+void put16(Bytes &out, uint16_t v)
+{
+	out.push_back(v);
+	out.push_back(v >> 8);
+}
+
+void put32(Bytes &out, uint32_t v)
+{
+	put16(out, v);
+	put16(out, v >> 16);
+}
+
+uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | uint32_t(get16(p + 2)) << 16;
+}
+
+void slip_put(Bytes &out, uint8_t b)
+{
+	if (b == SLIP_START || b == SLIP_END || b == SLIP_REPL) {
+		out.push_back(SLIP_REPL);
+		out.push_back(b ^ 0x20);
+	} else {
+		out.push_back(b);
+	}
+}
+
+} // namespace
+
+const char *cmd_name(Cmd cmd)
+{
+	static const char *const names[] = {
+		"NULL", "RESET", "IS_READY", "WIFI_CONNECT", "MQTT_SETUP",
+		"MQTT_CONNECT", "MQTT_DISCONNECT", "MQTT_PUBLISH", "MQTT_SUBSCRIBE",
+		"MQTT_LWT", "MQTT_EVENTS", "REST_SETUP", "REST_REQUEST",
+		"REST_SETHEADER", "REST_EVENTS", "STATS", "TRACE", "MEM", "OTA",
+		"OTA_EVENTS", "TX_SETUP", "TX_FRAGMENT", "MQTT_PUB_START",
+		"MQTT_PUB_PART", "MQTT_DATA_SIZE", "MQTT_SUB_BATCH", "MQTT_UNSUB_BATCH",
+		"MQTT_FILTER", "MQTT_AGGREGATE", "REST_EXTRACT",
+	};
+	size_t i = static_cast<size_t>(cmd);
+	return i < sizeof(names) / sizeof(names[0]) ? names[i] : "?";
+}
+
+Packet &Packet::arg(const void *data, size_t len)
+{
+	auto p = static_cast<const uint8_t *>(data);
+	args.emplace_back(p, p + len);
+	return *this;
+}
+
+Packet &Packet::arg(uint32_t v)
+{
+	Bytes b;
+	put32(b, v);
+	args.push_back(std::move(b));
+	return *this;
+}
+
+uint32_t Packet::arg_u32(size_t i) const
+{
+	if (i >= args.size() || args[i].size() < 4)
+		return 0;
+	return get32(args[i].data());
+}
+
+std::string Packet::arg_str(size_t i) const
+{
+	if (i >= args.size())
+		return std::string();
+	std::string s(args[i].begin(), args[i].end());
+	while (!s.empty() && s.back() == '\0')
+		s.pop_back();
+	return s;
+}
+
+// CITT polynomial, bit for bit what modules/crc16.c computes
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t acc)
+{
+	for (size_t i = 0; i < len; i++) {
+		acc ^= data[i];
+		acc = (acc >> 8) | (acc << 8);
+		acc ^= (acc & 0xff00) << 4;
+		acc ^= (acc >> 8) >> 4;
+		acc ^= (acc & 0xff00) >> 5;
+	}
+	return acc;
+}
+
+Bytes encode(const Packet &packet)
+{
+	Bytes raw, out;
+
+	put16(raw, static_cast<uint16_t>(packet.cmd));
+	put32(raw, packet.callback);
+	put32(raw, packet.ret);
+	put16(raw, packet.args.size());
+	for (const auto &a : packet.args) {
+		size_t pad = (4 - a.size() % 4) % 4;
+		put16(raw, a.size() + pad);
+		raw.insert(raw.end(), a.begin(), a.end());
+		raw.insert(raw.end(), pad, 0);
+	}
+	put16(raw, crc16(raw.data(), raw.size()));
+
+	out.reserve(raw.size() + raw.size() / 8 + 2);
+	out.push_back(SLIP_START);
+	for (uint8_t b : raw)
+		slip_put(out, b);
+	out.push_back(SLIP_END);
+	return out;
+}
+
+void Decoder::reset()
+{
+	buf_.clear();
+	frag_.clear();
+	begun_ = false;
+	esc_ = false;
+}
+
+void Decoder::feed(const uint8_t *data, size_t len, std::vector<Packet> &out)
+{
+	for (size_t i = 0; i < len; i++) {
+		uint8_t b = data[i];
+
+		if (b == SLIP_START) {
+			buf_.clear();
+			begun_ = true;
+			esc_ = false;
+		} else if (b == SLIP_END) {
+			if (!begun_)
+				continue;
+			Packet p;
+			stats_.frames++;
+			if (!parse(buf_, p)) {
+				stats_.bad++;
+			} else if (p.cmd != Cmd::TxFragment) {
+				out.push_back(std::move(p));
+			} else {
+				Packet whole;
+				stats_.fragments++;
+				if (join(p, whole))
+					out.push_back(std::move(whole));
+			}
+			begun_ = false;
+		} else if (!begun_) {
+			// UART noise between frames
+		} else if (b == SLIP_REPL) {
+			esc_ = true;
+		} else {
+			if (esc_)
+				b ^= 0x20;
+			esc_ = false;
+			if (buf_.size() < FRAME_MAX)
+				buf_.push_back(b);
+			else
+				begun_ = false;
+		}
+	}
+}
+
+// callback: frame id, ret: frame length << 16 | offset, the last
+// fragment is padded past the length
+bool Decoder::join(const Packet &frag, Packet &out)
+{
+	size_t len = frag.ret >> 16, off = frag.ret & 0xffff;
+
+	if (frag.args.size() != 1 || off >= len)
+		return false;
+	if (off == 0) {
+		if (!frag_.empty())
+			stats_.bad++;
+		frag_.clear();
+		frag_id_ = frag.callback;
+		frag_len_ = len;
+	} else if (frag.callback != frag_id_ || len != frag_len_ || off != frag_.size()) {
+		frag_.clear();
+		stats_.bad++;
+		return false;
+	}
+	const Bytes &data = frag.args[0];
+	frag_.insert(frag_.end(), data.begin(), data.begin() + std::min(data.size(), len - off));
+	if (frag_.size() < len)
+		return false;
+	bool ok = parse(frag_, out);
+	if (!ok)
+		stats_.bad++;
+	frag_.clear();
+	return ok;
+}
+
+bool Decoder::parse(const Bytes &raw, Packet &out)
+{
+	const uint8_t *p = raw.data();
+	size_t len = raw.size(), off = HEADER_LEN;
+
+	if (len < HEADER_LEN + 2)
+		return false;
+	out.cmd = static_cast<Cmd>(get16(p));
+	out.callback = get32(p + 2);
+	out.ret = get32(p + 6);
+	uint16_t argc = get16(p + 10);
+	for (uint16_t i = 0; i < argc; i++) {
+		if (off + 2 > len - 2)
+			return false;
+		uint16_t n = get16(p + off);
+		if (n > len - 2 - off - 2)
+			return false;
+		out.args.emplace_back(p + off + 2, p + off + 2 + n);
+		off += 2 + n;
+	}
+	return off == len - 2 && crc16(p, off) == get16(p + off);
+}
+
+} // namespace bridge
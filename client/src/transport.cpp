@@ -0,0 +1,259 @@
+#include "bridge/transport.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <poll.h>
+#include <stdexcept>
+#include <system_error>
+#include <termios.h>
+#include <unistd.h>
+
+namespace bridge {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string &what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+speed_t baud_to_speed(unsigned baud)
+{
+	switch (baud) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 921600: return B921600;
+	}
+	throw std::invalid_argument("unsupported baud rate " + std::to_string(baud));
+}
+
+int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+} // namespace
+
+SerialTransport::SerialTransport(const std::string &path, unsigned baud)
+{
+	struct termios tio;
+	speed_t speed = baud_to_speed(baud);
+
+	fd_ = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd_ < 0)
+		throw_errno(path);
+	if (tcgetattr(fd_, &tio) == 0) {
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tio.c_cc[VMIN] = 0;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(fd_, TCSANOW, &tio);
+		tcflush(fd_, TCIOFLUSH);
+	}
+	if (pipe2(wake_, O_CLOEXEC | O_NONBLOCK) < 0) {
+		::close(fd_);
+		throw_errno("pipe");
+	}
+}
+
+SerialTransport::~SerialTransport()
+{
+	::close(fd_);
+	::close(wake_[0]);
+	::close(wake_[1]);
+}
+
+void SerialTransport::write(const uint8_t *data, size_t len)
+{
+	std::lock_guard<std::mutex> guard(wlock_);
+
+	while (len > 0) {
+		ssize_t n = ::write(fd_, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw_errno("uart write");
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+ssize_t SerialTransport::read(uint8_t *buf, size_t len, int timeout_ms)
+{
+	struct pollfd fds[2] = {
+		{ fd_, POLLIN, 0 },
+		{ wake_[0], POLLIN, 0 },
+	};
+
+	int n = poll(fds, 2, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	if (fds[1].revents)
+		return -1;
+	if (n == 0)
+		return 0;
+	if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -1;
+	ssize_t r = ::read(fd_, buf, len);
+	if (r < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+	return r == 0 ? -1 : r;
+}
+
+void SerialTransport::close()
+{
+	ssize_t r = ::write(wake_[1], "x", 1);
+	(void)r;
+}
+
+RecordingTransport::RecordingTransport(std::unique_ptr<Transport> inner, const std::string &path)
+	: inner_(std::move(inner)), file_(fopen(path.c_str(), "w"))
+{
+	if (file_ == nullptr)
+		throw_errno(path);
+	fprintf(file_, "# bridge transcript, > written, < read\n");
+}
+
+RecordingTransport::~RecordingTransport()
+{
+	fclose(file_);
+}
+
+void RecordingTransport::log(char dir, const uint8_t *data, size_t len)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	fprintf(file_, "%c ", dir);
+	for (size_t i = 0; i < len; i++)
+		fprintf(file_, "%02x", data[i]);
+	fputc('\n', file_);
+}
+
+void RecordingTransport::write(const uint8_t *data, size_t len)
+{
+	// logged first so a reply can never show up before its request
+	log('>', data, len);
+	inner_->write(data, len);
+}
+
+ssize_t RecordingTransport::read(uint8_t *buf, size_t len, int timeout_ms)
+{
+	ssize_t n = inner_->read(buf, len, timeout_ms);
+
+	if (n > 0)
+		log('<', buf, n);
+	return n;
+}
+
+void RecordingTransport::close()
+{
+	inner_->close();
+}
+
+TranscriptTransport::TranscriptTransport(const std::string &path)
+{
+	std::ifstream in(path);
+	std::string line;
+	unsigned lineno = 0;
+
+	if (!in)
+		throw std::runtime_error(path + ": cannot open");
+	while (std::getline(in, line)) {
+		lineno++;
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (line.size() < 2 || (line[0] != '>' && line[0] != '<') || line[1] != ' ' ||
+		    line.size() % 2 != 0)
+			throw std::runtime_error(path + ":" + std::to_string(lineno) + ": bad line");
+		Bytes data;
+		for (size_t i = 2; i < line.size(); i += 2) {
+			int hi = hex_nibble(line[i]), lo = hex_nibble(line[i + 1]);
+			if (hi < 0 || lo < 0)
+				throw std::runtime_error(path + ":" + std::to_string(lineno) + ": bad hex");
+			data.push_back(hi << 4 | lo);
+		}
+		if (line[0] == '>')
+			expect_.insert(expect_.end(), data.begin(), data.end());
+		else
+			replies_.push_back({ expect_.size(), std::move(data) });
+	}
+	release();
+}
+
+// with lock_ held
+void TranscriptTransport::release()
+{
+	bool more = false;
+
+	while (next_ < replies_.size() && replies_[next_].after <= written_) {
+		const Bytes &d = replies_[next_++].data;
+		ready_.insert(ready_.end(), d.begin(), d.end());
+		more = true;
+	}
+	if (more)
+		cond_.notify_all();
+}
+
+void TranscriptTransport::write(const uint8_t *data, size_t len)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	for (size_t i = 0; i < len; i++, written_++) {
+		if (written_ >= expect_.size())
+			throw std::runtime_error("transcript: write past the end of the recording");
+		if (expect_[written_] != data[i])
+			throw std::runtime_error("transcript: write differs at byte " +
+						 std::to_string(written_));
+	}
+	release();
+}
+
+ssize_t TranscriptTransport::read(uint8_t *buf, size_t len, int timeout_ms)
+{
+	std::unique_lock<std::mutex> guard(lock_);
+
+	cond_.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+		       [this] { return closed_ || ready_off_ < ready_.size(); });
+	if (ready_off_ == ready_.size()) {
+		ready_.clear();
+		ready_off_ = 0;
+		return closed_ ? -1 : 0;
+	}
+	size_t n = std::min(len, ready_.size() - ready_off_);
+	memcpy(buf, ready_.data() + ready_off_, n);
+	ready_off_ += n;
+	return n;
+}
+
+void TranscriptTransport::close()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	closed_ = true;
+	cond_.notify_all();
+}
+
+bool TranscriptTransport::done() const
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	return written_ == expect_.size() && next_ == replies_.size() &&
+	       ready_off_ == ready_.size();
+}
+
+} // namespace bridge
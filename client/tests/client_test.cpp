@@ -0,0 +1,192 @@
+// Checks the client against a bridge, or a transcript of one.
+//
+//   client_test [--uart PATH] [--baud N] [--record FILE | --replay FILE]
+//
+// Pipelines IS_READY and MQTT_DATA_SIZE requests past the window and
+// checks every answer reaches its own future, takes the sizes from a
+// tagged MQTT_SETUP answer, the WiFi status events of a WIFI_CONNECT,
+// and decodes STATS against include/metrics.h. make test runs it on
+// tests/client_test.txt and against sim/bridge_sim; after a change to
+// what it sends, record the transcript again from a fresh bridge_sim:
+//
+//   client_test --uart /tmp/bridge0 --record tests/client_test.txt
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <getopt.h>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "bridge/client.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// include/user_config.h and include/metrics.h
+constexpr uint32_t QUEUE_BUFFER_SIZE = 2048;
+constexpr size_t METRIC_NUM = 30;
+constexpr size_t METRIC_HIST_NUM = 3;
+constexpr size_t METRICS_HIST_BUCKETS = 20;
+enum {
+	METRIC_UART_RX_BYTES = 0,
+	METRIC_PROTO_FRAMES = 3,
+	METRIC_HEAP_FREE = 12,
+	METRIC_HEAP_LOW = 13,
+	METRIC_TX_SPILLS = 18,
+};
+
+unsigned checks, failed;
+
+#define CHECK(expr) check(expr, #expr, __LINE__)
+
+void check(bool ok, const char *what, int line)
+{
+	checks++;
+	if (!ok) {
+		failed++;
+		fprintf(stderr, "client_test.cpp:%d: %s\n", line, what);
+	}
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--uart PATH] [--baud N] [--record FILE | --replay FILE]\n", prog);
+}
+
+// Twice the window of requests, none waited for until all are sent, with
+// a different answer each. data events are at most the client's buffer,
+// at least CMD_TX_FRAG_MIN and a multiple of 4.
+void pipelined(Client &client, uint32_t handle)
+{
+	static const uint32_t asked[] = { 16, 100, 101, 1000, 2048, 4000, 8, 0 };
+	static const uint32_t size[] = { 16, 100, 100, 1000, 2048, 2048, 16, 0 };
+	std::vector<std::future<uint32_t>> ready, sized;
+
+	for (size_t i = 0; i < sizeof(asked) / sizeof(asked[0]); i++) {
+		ready.push_back(client.is_ready());
+		sized.push_back(client.mqtt_data_size(handle, asked[i]));
+	}
+	for (size_t i = 0; i < ready.size(); i++) {
+		CHECK(ready[i].get() == 1);
+		CHECK(sized[i].get() == size[i]);
+	}
+}
+
+void wifi_events(Client &client)
+{
+	std::mutex lock;
+	std::vector<WifiStatus> seen;
+
+	uint32_t ret = client.wifi_connect("client_test", "client_test", [&](WifiStatus s) {
+		std::lock_guard<std::mutex> guard(lock);
+		seen.push_back(s);
+	}).get();
+	// the status that ends connecting comes before the answer
+	std::lock_guard<std::mutex> guard(lock);
+	CHECK(ret == uint32_t(WifiStatus::GotIp));
+	CHECK(!seen.empty() && seen.back() == WifiStatus::GotIp);
+	for (WifiStatus s : seen)
+		CHECK(s == WifiStatus::Connecting || s == WifiStatus::GotIp);
+}
+
+void stats(Client &client)
+{
+	Client::Counters k = client.counters();
+	Stats s = client.stats().get();
+
+	CHECK(s.metrics.size() == METRIC_NUM);
+	CHECK(s.hist.size() == METRIC_HIST_NUM * METRICS_HIST_BUCKETS);
+	if (s.metrics.size() != METRIC_NUM || s.hist.size() != METRIC_HIST_NUM * METRICS_HIST_BUCKETS)
+		return;
+	// this STATS counts itself, its run time is not in yet
+	CHECK(s.metrics[METRIC_PROTO_FRAMES] == k.requests + 1);
+	CHECK(std::accumulate(s.hist.begin(), s.hist.begin() + METRICS_HIST_BUCKETS, 0u) == k.answers);
+	CHECK(s.metrics[METRIC_UART_RX_BYTES] > s.metrics[METRIC_PROTO_FRAMES]);
+	CHECK(s.metrics[METRIC_HEAP_FREE] > 0);
+	CHECK(s.metrics[METRIC_HEAP_LOW] <= s.metrics[METRIC_HEAP_FREE]);
+	CHECK(s.metrics[METRIC_TX_SPILLS] == 0);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "uart", required_argument, nullptr, 'u' },
+		{ "baud", required_argument, nullptr, 'b' },
+		{ "record", required_argument, nullptr, 'r' },
+		{ "replay", required_argument, nullptr, 'p' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+	std::string uart = "/tmp/bridge0", record, replay_path;
+	unsigned baud = 115200;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "u:b:r:p:h", longopts, nullptr)) != -1) {
+		switch (c) {
+		case 'u': uart = optarg; break;
+		case 'b': baud = strtoul(optarg, nullptr, 0); break;
+		case 'r': record = optarg; break;
+		case 'p': replay_path = optarg; break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+
+	std::unique_ptr<Transport> transport;
+	TranscriptTransport *replay = nullptr;
+	try {
+		if (!replay_path.empty()) {
+			replay = new TranscriptTransport(replay_path);
+			transport.reset(replay);
+		} else {
+			transport.reset(new SerialTransport(uart, baud));
+			if (!record.empty())
+				transport.reset(new RecordingTransport(std::move(transport), record));
+		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	Client client(std::move(transport));
+	try {
+		CHECK(client.is_ready().get() == 1);
+
+		MqttConfig config;
+		MqttHandlers h;
+		uint32_t queue = 0, buf = 0;
+		config.client_id = "client_test";
+		config.mqtt5 = true;
+		config.buf_size = 2048;
+		h.sizes = [&](uint32_t q, uint32_t b) {
+			queue = q;
+			buf = b;
+		};
+		uint32_t handle = client.mqtt_setup(config, h).get();
+		CHECK(handle != 0);
+		// the queue grows to two buffers
+		CHECK(buf == 2048);
+		CHECK(queue == 2 * buf && queue > QUEUE_BUFFER_SIZE);
+
+		pipelined(client, handle);
+		wifi_events(client);
+		stats(client);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "client_test: %s\n", e.what());
+		return 1;
+	}
+
+	Client::Counters k = client.counters();
+	CHECK(k.timeouts == 0 && k.lost == 0 && k.unsolicited == 0);
+	CHECK(k.frames.bad == 0);
+	if (replay)
+		CHECK(replay->done());
+	printf("%u checks, %u failed\n", checks, failed);
+	return failed ? 1 : 0;
+}
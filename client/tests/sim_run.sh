@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs a client tool against a simulated bridge on a pty of its own:
+#
+#   sim_run.sh BRIDGE_SIM COMMAND [ARGS..]
+#
+# COMMAND gets --uart PTY appended; its exit status is the script's.
+sim=$1
+shift
+if [ ! -x "$sim" ]; then
+	echo "no $sim, build it with make -C ../sim" >&2
+	exit 1
+fi
+dir=$(mktemp -d)
+"$sim" -u "$dir/uart0" -b 0 -l "$dir/uart1.log" -t 60 >"$dir/sim.log" 2>&1 &
+pid=$!
+n=0
+while [ ! -e "$dir/uart0" ]; do
+	n=$((n + 1))
+	if [ $n -gt 50 ] || ! kill -0 $pid 2>/dev/null; then
+		echo "$sim did not start:" >&2
+		cat "$dir/sim.log" >&2
+		kill $pid 2>/dev/null
+		rm -rf "$dir"
+		exit 1
+	fi
+	sleep 0.1
+done
+"$@" --uart "$dir/uart0"
+status=$?
+kill $pid
+wait $pid 2>/dev/null
+rm -rf "$dir"
+exit $status
@@ -0,0 +1,390 @@
+// Requests per second through the bridge with 1..W requests in flight.
+//
+//   bridge_bench [--uart PATH] [--baud N] [-n REQUESTS] [-w 1,4,8]
+//                [-s BYTES] [--rest K] [--http-port PORT]
+//                [--bulk] [--mqtt-port PORT] [--fragment BYTES]
+//                [--record FILE | --replay FILE]
+//
+// Each request is an IS_READY, with an ignored argument of BYTES to make
+// the frames bigger. --rest keeps K REST requests to 127.0.0.1:PORT in
+// flight meanwhile, one per REST client, to show the slow ones do not
+// hold up the rest. --bulk subscribes to /bench/bulk, which
+// sim_broker.py --flood fills, so data frames compete with the answers;
+// --fragment has the bridge cut those into pieces. --record keeps a
+// transcript of the run, --replay runs the same arguments against it
+// without a bridge (not with --rest or --bulk, their timing is not
+// repeatable).
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bridge/client.hpp"
+
+using namespace bridge;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Args {
+	std::string uart = "/tmp/bridge0";
+	unsigned baud = 115200;
+	unsigned requests = 1000;
+	std::vector<unsigned> windows = { 1, 2, 4, 8 };
+	size_t size = 0;
+	unsigned rest = 0;
+	unsigned http_port = 18080;
+	bool bulk = false;
+	unsigned mqtt_port = 11883;
+	unsigned fragment = 0;
+	std::string record;
+	std::string replay;
+};
+
+void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [--uart PATH] [--baud N] [-n REQUESTS] [-w W,W..] [-s BYTES]\n"
+		"          [--rest K] [--http-port PORT] [--bulk] [--mqtt-port PORT]\n"
+		"          [--fragment BYTES] [--record FILE | --replay FILE]\n", prog);
+}
+
+std::vector<unsigned> parse_list(const char *s)
+{
+	std::vector<unsigned> out;
+
+	for (const char *p = s; *p; ) {
+		char *end;
+		unsigned long v = strtoul(p, &end, 0);
+		if (end == p || v == 0)
+			return std::vector<unsigned>();
+		out.push_back(v);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return out;
+}
+
+double percentile(std::vector<double> &v, double pct)
+{
+	if (v.empty())
+		return 0;
+	size_t i = std::min(v.size() - 1, size_t(pct / 100 * v.size()));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+struct Latency {
+	std::mutex lock;
+	std::vector<double> ms;
+	unsigned ok = 0;
+	unsigned failed = 0;
+
+	void add(Clock::time_point t0, bool good)
+	{
+		add(std::chrono::duration<double, std::milli>(Clock::now() - t0).count(), good);
+	}
+
+	void add(double v, bool good)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (good) {
+			ok++;
+			ms.push_back(v);
+		} else {
+			failed++;
+		}
+	}
+
+	void print(const char *name, unsigned sent, double secs)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		double max = ms.empty() ? 0 : *std::max_element(ms.begin(), ms.end());
+		double p50 = percentile(ms, 50), p99 = percentile(ms, 99);
+		printf("%-6s %8u %8u %7u %9.0f %8.2f %8.2f %8.2f\n", name, sent, ok, failed,
+		       ok / secs, p50, p99, max);
+	}
+};
+
+// K REST clients with a request each in flight until stop is set
+class RestLoad {
+public:
+	RestLoad(Client &client, const Args &args, Latency &lat) : client_(client), args_(args), lat_(lat) {}
+
+	~RestLoad() { stop(); }
+
+	void start()
+	{
+		for (unsigned i = 0; i < args_.rest; i++) {
+			uint32_t h = client_.rest_setup("127.0.0.1", args_.http_port).get();
+			if (h == 0)
+				throw std::runtime_error("bridge is out of REST clients");
+			threads_.emplace_back([this, h] {
+				while (!stop_) {
+					auto t0 = Clock::now();
+					sent_++;
+					try {
+						RestResponse r = client_.rest_request(h, "GET", "/bench").get();
+						lat_.add(t0, r.code == 200);
+					} catch (const std::exception &) {
+						lat_.add(t0, false);
+					}
+				}
+			});
+		}
+	}
+
+	void stop()
+	{
+		stop_ = true;
+		for (auto &t : threads_)
+			t.join();
+		threads_.clear();
+	}
+
+	unsigned sent() const { return sent_; }
+
+private:
+	Client &client_;
+	const Args &args_;
+	Latency &lat_;
+	std::vector<std::thread> threads_;
+	std::atomic<bool> stop_{ false };
+	std::atomic<unsigned> sent_{ 0 };
+};
+
+// Counts the messages sim_broker.py --flood publishes, each led by its
+// send time as a big-endian double of seconds since the epoch.
+class BulkLoad {
+public:
+	BulkLoad(Client &client, const Args &args, Latency &lat) : client_(client), args_(args), lat_(lat) {}
+
+	void start()
+	{
+		MqttConfig config;
+		MqttHandlers h;
+		config.client_id = "bench";
+		h.data = [this](const std::string &, const Bytes &data) { on_data(data); };
+		handle_ = client_.mqtt_setup(config, h).get();
+		if (handle_ == 0)
+			throw std::runtime_error("bridge is out of MQTT clients");
+		if (client_.mqtt_connect(handle_, "127.0.0.1", args_.mqtt_port).get() != 1)
+			throw std::runtime_error("broker did not take the client");
+		client_.mqtt_subscribe(handle_, "/bench/bulk").get();
+	}
+
+	void stop() { stop_ = true; }
+
+	unsigned received() const { return received_; }
+
+private:
+	// reader thread
+	void on_data(const Bytes &data)
+	{
+		if (stop_)
+			return;
+		received_++;
+		if (data.size() < 8) {
+			lat_.add(0.0, false);
+			return;
+		}
+		uint64_t bits = 0;
+		for (int i = 0; i < 8; i++)
+			bits = bits << 8 | data[i];
+		double sent;
+		memcpy(&sent, &bits, sizeof(sent));
+		double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+		lat_.add((now - sent) * 1000, true);
+	}
+
+	Client &client_;
+	const Args &args_;
+	Latency &lat_;
+	uint32_t handle_ = 0;
+	std::atomic<bool> stop_{ false };
+	std::atomic<unsigned> received_{ 0 };
+};
+
+// REST needs an IP, the simulated AP takes any SSID
+bool wifi_up(Client &client)
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	bool up = false;
+
+	client.wifi_connect("bench", "bench", [&](WifiStatus s) {
+		std::lock_guard<std::mutex> guard(lock);
+		up = up || s == WifiStatus::GotIp;
+		cond.notify_all();
+	});
+	std::unique_lock<std::mutex> guard(lock);
+	return cond.wait_for(guard, std::chrono::seconds(10), [&] { return up; });
+}
+
+// keeps at most window requests outstanding, below the client's own limit
+void run(Client &client, const Args &args, unsigned window)
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	Latency lat;
+	unsigned inflight = 0;
+	Packet req;
+
+	req.cmd = Cmd::IsReady;
+	if (args.size)
+		req.arg(Bytes(args.size, 0x55));
+
+	auto start = Clock::now();
+	for (unsigned i = 0; i < args.requests; i++) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [&] { return inflight < window; });
+			inflight++;
+		}
+		auto t0 = Clock::now();
+		client.call(req, [&, t0](uint32_t, std::exception_ptr err) {
+			lat.add(t0, !err);
+			std::lock_guard<std::mutex> guard(lock);
+			inflight--;
+			cond.notify_all();
+		});
+	}
+	std::unique_lock<std::mutex> guard(lock);
+	cond.wait(guard, [&] { return inflight == 0; });
+
+	double secs = std::chrono::duration<double>(Clock::now() - start).count();
+	lat.print(std::to_string(window).c_str(), args.requests, secs);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "uart", required_argument, nullptr, 'u' },
+		{ "baud", required_argument, nullptr, 'b' },
+		{ "record", required_argument, nullptr, 'r' },
+		{ "replay", required_argument, nullptr, 'p' },
+		{ "rest", required_argument, nullptr, 'R' },
+		{ "http-port", required_argument, nullptr, 'H' },
+		{ "bulk", no_argument, nullptr, 'B' },
+		{ "mqtt-port", required_argument, nullptr, 'M' },
+		{ "fragment", required_argument, nullptr, 'F' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+	Args args;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "u:b:n:w:s:r:p:h", longopts, nullptr)) != -1) {
+		switch (c) {
+		case 'u': args.uart = optarg; break;
+		case 'b': args.baud = strtoul(optarg, nullptr, 0); break;
+		case 'n': args.requests = strtoul(optarg, nullptr, 0); break;
+		case 'w': args.windows = parse_list(optarg); break;
+		case 's': args.size = strtoul(optarg, nullptr, 0); break;
+		case 'r': args.record = optarg; break;
+		case 'p': args.replay = optarg; break;
+		case 'R': args.rest = strtoul(optarg, nullptr, 0); break;
+		case 'H': args.http_port = strtoul(optarg, nullptr, 0); break;
+		case 'B': args.bulk = true; break;
+		case 'M': args.mqtt_port = strtoul(optarg, nullptr, 0); break;
+		case 'F': args.fragment = strtoul(optarg, nullptr, 0); break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	if (args.windows.empty() || args.requests == 0 ||
+	    ((args.rest || args.bulk) && !args.replay.empty())) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	std::unique_ptr<Transport> transport;
+	TranscriptTransport *replay = nullptr;
+	try {
+		if (!args.replay.empty()) {
+			replay = new TranscriptTransport(args.replay);
+			transport.reset(replay);
+		} else {
+			transport.reset(new SerialTransport(args.uart, args.baud));
+			if (!args.record.empty())
+				transport.reset(new RecordingTransport(std::move(transport), args.record));
+		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	Options opts;
+	opts.max_inflight = *std::max_element(args.windows.begin(), args.windows.end());
+	Client client(std::move(transport), opts);
+
+	try {
+		client.is_ready().get();
+		Stats s = client.stats().get();
+		std::string mem = client.mem().get();
+		printf("bridge on %s: %zu metrics, mem report %zu bytes\n",
+		       replay ? args.replay.c_str() : args.uart.c_str(), s.metrics.size(), mem.size());
+	} catch (const std::exception &e) {
+		fprintf(stderr, "bridge not answering: %s\n", e.what());
+		return 1;
+	}
+
+	Latency rest_lat, bulk_lat;
+	RestLoad rest(client, args, rest_lat);
+	BulkLoad bulk(client, args, bulk_lat);
+	try {
+		if (args.fragment)
+			printf("bulk frames in %u byte fragments\n", client.tx_setup(args.fragment).get());
+		if ((args.rest || args.bulk) && !wifi_up(client))
+			throw std::runtime_error("bridge got no IP");
+		if (args.rest)
+			rest.start();
+		if (args.bulk)
+			bulk.start();
+	} catch (const std::exception &e) {
+		fprintf(stderr, "setup: %s\n", e.what());
+		return 1;
+	}
+	auto start = Clock::now();
+
+	printf("%u x IS_READY, %zu byte arg", args.requests, args.size);
+	if (args.rest)
+		printf(", %u REST requests in flight", args.rest);
+	if (args.bulk)
+		printf(", MQTT data on /bench/bulk");
+	printf("\n%-6s %8s %8s %7s %9s %8s %8s %8s\n", "window", "sent", "ok", "failed", "req/s",
+	       "p50 ms", "p99 ms", "max ms");
+	for (unsigned w : args.windows)
+		run(client, args, w);
+	double secs = std::chrono::duration<double>(Clock::now() - start).count();
+	if (args.rest) {
+		rest.stop();
+		rest_lat.print("rest", rest.sent(), secs);
+	}
+	if (args.bulk) {
+		bulk.stop();
+		bulk_lat.print("bulk", bulk.received(), secs);
+	}
+
+	Client::Counters k = client.counters();
+	printf("frames %llu, fragments %llu, bad %llu, lost %llu, timeouts %llu, unsolicited %llu\n",
+	       (unsigned long long)k.frames.frames, (unsigned long long)k.frames.fragments,
+	       (unsigned long long)k.frames.bad,
+	       (unsigned long long)k.lost, (unsigned long long)k.timeouts,
+	       (unsigned long long)k.unsolicited);
+	if (replay && !replay->done()) {
+		fprintf(stderr, "replay: transcript not used up\n");
+		return 1;
+	}
+	return 0;
+}
@@ -14,6 +14,9 @@
 #include "driver/uart.h"
 #include "osapi.h"
 #include "driver/uart_register.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hot.h"
 
 
 // UartDev is defined and initialized in rom code.
@@ -105,9 +108,11 @@ uart_tx_one_char(uint8 uart, uint8 TxChar)
     }
 
     WRITE_PERI_REG(UART_FIFO(uart) , TxChar);
+    if (uart == UART0)
+      metrics_inc(METRIC_UART_TX_BYTES);
     return OK;
 }
-void ICACHE_FLASH_ATTR
+void HOT_ATTR
 uart0_write(char c)
 {
 	while (true)
@@ -119,6 +124,7 @@ uart0_write(char c)
 	}
 
 	WRITE_PERI_REG(UART_FIFO(0) , c);
+	metrics_inc(METRIC_UART_TX_BYTES);
 }
 
 /******************************************************************************
@@ -183,6 +189,38 @@ uart0_tx_buffer(uint8 *buf, uint16 len)
   }
 }
 
+/******************************************************************************
+ * FunctionName : uart1_tx_buffer
+ * Description  : use uart1 to transfer buffer as is, no newline translation
+ * Parameters   : const uint8 *buf - point to send buffer
+ *                uint16 len - buffer len
+ * Returns      :
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart1_tx_buffer(const uint8 *buf, uint16 len)
+{
+  uint16 i;
+
+  for (i = 0; i < len; i++)
+  {
+    uart_tx_one_char(UART1, buf[i]);
+  }
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_fifo_free
+ * Description  : free room in the tx fifo, writes up to this size won't block
+ * Parameters   : uint8 uart - UART0 or UART1
+ * Returns      : bytes
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart_tx_fifo_free(uint8 uart)
+{
+  uint32 fifo_cnt = READ_PERI_REG(UART_STATUS(uart)) >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT;
+
+  return fifo_cnt < 126 ? 126 - fifo_cnt : 0;
+}
+
 /******************************************************************************
  * FunctionName : uart0_sendStr
  * Description  : use uart0 to transfer buffer
@@ -214,7 +252,9 @@ uart0_rx_intr_handler(void *para)
 
   uint8 RcvChar;
   uint8 uart_no = UART0;//UartDev.buff_uart_no;
+  uint16 rcv_cnt = 0;
 
+  TRACE(TRACE_ISR_ENTER, 0);
 
 	if(UART_FRM_ERR_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_FRM_ERR_INT_ST))
 	{
@@ -230,6 +270,8 @@ uart0_rx_intr_handler(void *para)
 		{
 			WRITE_PERI_REG(0X60000914, 0x73); //WTD
 			RcvChar = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+			metrics_inc(METRIC_UART_RX_BYTES);
+			rcv_cnt++;
 			neurite_cmd_input(RcvChar);
 		}
 
@@ -241,6 +283,8 @@ uart0_rx_intr_handler(void *para)
 		{
 			WRITE_PERI_REG(0X60000914, 0x73); //WTD
 			RcvChar = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+			metrics_inc(METRIC_UART_RX_BYTES);
+			rcv_cnt++;
 			neurite_cmd_input(RcvChar);
 		}
 
@@ -254,6 +298,7 @@ uart0_rx_intr_handler(void *para)
 	{
 	  WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_TOUT_INT_CLR);
 	}
+	TRACE(TRACE_ISR_EXIT, rcv_cnt);
 	ETS_UART_INTR_ENABLE();
 
 
@@ -0,0 +1,51 @@
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+#include "c_types.h"
+#include "mqtt.h"
+
+/*
+ * Windowed aggregation: on a topic with a series set up, numeric
+ * publishes are not sent but folded into the series, and when its window
+ * closes one summary record goes to the same topic instead:
+ *
+ *   {"min":21.5,"max":22.25,"mean":21.8,"count":100,"last":22}
+ *
+ * Values are read like edge_filter_value() does, in thousandths; a
+ * publish that does not lead with a number, or one of +-2147483.647 and
+ * beyond, goes out as it is. A series
+ * holds min, max, sum, count and last only, whatever the rate. The
+ * summary is published with the client, qos and retain of the last
+ * sample, and a window without samples publishes nothing.
+ *
+ * aggregate_flush() closes a client's open windows early, on reconnect,
+ * so the broker hears what came in while the client was away.
+ */
+#define AGGREGATE_SERIES	8
+#define AGGREGATE_TOPIC_LEN	64
+#define AGGREGATE_MIN_MS	100
+#define AGGREGATE_MAX_MS	3600000
+
+struct aggregate_s {
+	char topic[AGGREGATE_TOPIC_LEN];
+	uint32_t window_ms;
+	os_timer_t timer;
+	/* the window so far, values in thousandths */
+	uint32_t count;
+	int32_t min;
+	int32_t max;
+	int32_t last;
+	sint64 sum;
+	/* where the summary goes */
+	MQTT_Client *client;
+	uint8_t qos;
+	uint8_t retain;
+};
+
+/* window_ms 0 flushes and removes the series; 0 on success */
+int aggregate_set(const char *topic, uint32_t window_ms);
+/* true when the publish was taken into a series and must not be sent */
+bool aggregate_add(MQTT_Client *client, const char *topic, const char *data, uint16_t len, int qos, int retain);
+void aggregate_flush(MQTT_Client *client);
+
+#endif /* __AGGREGATE_H__ */
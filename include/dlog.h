@@ -0,0 +1,84 @@
+#ifndef __DLOG_H__
+#define __DLOG_H__
+
+#include "c_types.h"
+
+/*
+ * Deferred binary logging, built in with `make DLOG=1` (NEURITE_DLOG).
+ *
+ * A log site stores the address of its format string plus the raw
+ * arguments into a RAM ring, nothing is formatted on the device. The
+ * format strings live in flash (.irom.text) and never get read back, the
+ * address is their id. An idle task drains the ring as binary frames on
+ * UART1 while the tx fifo has room, and tools/dlog_decode.py rebuilds
+ * the text using the ELF.
+ *
+ * Arguments are stored as 32 bit words, at most DLOG_MAX_ARGS. A %s
+ * argument is only a pointer by the time it is decoded, the decoder can
+ * resolve it for string literals but not for RAM buffers.
+ *
+ * Frame on the wire: DLOG_SYNC, word count, then little endian words
+ * { fmt id, timestamp us, header, args or hex bytes }.
+ */
+#define DLOG_SYNC		0xD1
+#define DLOG_MAX_ARGS		8
+#define DLOG_HEX_MAX		64	/* bytes kept from a dlog_hex() buffer */
+#define DLOG_RING_WORDS		512	/* power of two */
+
+/* header word */
+#define DLOG_HDR(level, nargs, nhex) \
+	(((uint32_t)(level) << 16) | ((uint32_t)(nhex) << 8) | (nargs))
+
+#ifdef NEURITE_DLOG
+
+#define DLOG_FMT_ATTR		__attribute__((section(".irom.text"), aligned(4)))
+
+#define DLOG_STR_(x)		#x
+#define DLOG_STR(x)		DLOG_STR_(x)
+#define DLOG_CAT_(a, b)		a##b
+#define DLOG_CAT(a, b)		DLOG_CAT_(a, b)
+
+#define DLOG_NARGS(args...)	DLOG_NARGS_(0, ##args, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define DLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...)	n
+
+#define DLOG_W0()
+#define DLOG_W1(a)		(uint32_t)(a)
+#define DLOG_W2(a, b...)	(uint32_t)(a), DLOG_W1(b)
+#define DLOG_W3(a, b...)	(uint32_t)(a), DLOG_W2(b)
+#define DLOG_W4(a, b...)	(uint32_t)(a), DLOG_W3(b)
+#define DLOG_W5(a, b...)	(uint32_t)(a), DLOG_W4(b)
+#define DLOG_W6(a, b...)	(uint32_t)(a), DLOG_W5(b)
+#define DLOG_W7(a, b...)	(uint32_t)(a), DLOG_W6(b)
+#define DLOG_W8(a, b...)	(uint32_t)(a), DLOG_W7(b)
+#define DLOG_WORDS(args...)	DLOG_CAT(DLOG_W, DLOG_NARGS(args))(args)
+
+/* the file and line are part of the format string, so they cost no RAM */
+#define DLOG_FMT(tag, msg) \
+	tag "/" __FILE__ ":" DLOG_STR(__LINE__) ": " msg
+
+#define dlog(level, tag, msg, args...) \
+	do { \
+		static const char __dlog_fmt[] DLOG_FMT_ATTR = DLOG_FMT(tag, msg); \
+		const uint32_t __dlog_args[] = { 0, DLOG_WORDS(args) }; \
+		dlog_write(__dlog_fmt, DLOG_HDR(level, DLOG_NARGS(args), 0), \
+				&__dlog_args[1]); \
+	} while (0)
+
+/* msg takes no arguments, the bytes follow it in hex */
+#define dlog_hex(level, tag, msg, buf, len) \
+	do { \
+		static const char __dlog_fmt[] DLOG_FMT_ATTR = DLOG_FMT(tag, msg); \
+		dlog_write_hex(__dlog_fmt, (level), (const uint8_t *)(buf), (len)); \
+	} while (0)
+
+void dlog_init(void);
+void dlog_write(const char *fmt, uint32_t hdr, const uint32_t *args);
+void dlog_write_hex(const char *fmt, uint8_t level, const uint8_t *buf, uint16_t len);
+
+#else
+
+#define dlog_init()		do { } while (0)
+
+#endif /* NEURITE_DLOG */
+
+#endif /* __DLOG_H__ */
@@ -98,5 +98,8 @@ typedef struct {
 void uart_init(UartBautRate uart0_br, UartBautRate uart1_br);
 void uart0_sendStr(const char *str);
 void uart0_write(char c);
+void uart1_write_char(char c);
+void uart1_tx_buffer(const uint8 *buf, uint16 len);
+uint16 uart_tx_fifo_free(uint8 uart);
 #endif
 
@@ -0,0 +1,58 @@
+#ifndef __EDGE_FILTER_H__
+#define __EDGE_FILTER_H__
+
+#include "c_types.h"
+
+/*
+ * Edge filter: per topic rules that drop uplink publishes which carry
+ * nothing new, checked right before a message is handed to MQTT.
+ *
+ * A reading that leads with a decimal number ("21.5", "-3", "7 lux")
+ * is compared by value, in thousandths, up to +-2147483.647 where it
+ * saturates; anything else by a hash of the payload. Against the last reading that went out, a rule
+ *
+ * - rate limits: nothing goes out within min_ms of it
+ * - lets one through anyway once heartbeat_ms passed, so a steady value
+ *   still shows up (on the next reading, nothing is sent on its own)
+ * - with EDGE_FILTER_CHANGE, drops a reading equal to it; with a
+ *   deadband, one within deadband of it
+ *
+ * Times are system_get_time() deltas, so EDGE_FILTER_MAX_MS at most; it
+ * wraps after 71.6 minutes, and a timer every EDGE_FILTER_AGE_MS marks a
+ * rule whose last reading is older than EDGE_FILTER_MAX_MS before then.
+ */
+#define EDGE_FILTER_RULES	8
+#define EDGE_FILTER_TOPIC_LEN	64
+#define EDGE_FILTER_MAX_MS	3600000
+#define EDGE_FILTER_AGE_MS	600000
+#define EDGE_FILTER_VALUE_MAX	0x7FFFFFFF
+
+/* edge_filter_set() flags */
+#define EDGE_FILTER_CHANGE	0x01	/* publish on change only */
+
+struct edge_filter_s {
+	char topic[EDGE_FILTER_TOPIC_LEN];
+	uint32_t deadband;	/* thousandths */
+	uint32_t min_ms;
+	uint32_t heartbeat_ms;
+	uint8_t flags;
+	/* the last reading that went out */
+	uint8_t sent;
+	uint8_t numeric;
+	uint8_t aged;		/* at_us is EDGE_FILTER_MAX_MS or more ago */
+	int32_t value;		/* thousandths, or the payload hash */
+	uint32_t at_us;
+	/* counters */
+	uint32_t passed;
+	uint32_t suppressed;
+};
+
+/* a rule with all of deadband, min_ms, heartbeat_ms and flags 0 is removed; 0 on success */
+int edge_filter_set(const char *topic, uint32_t deadband, uint32_t min_ms, uint32_t heartbeat_ms, uint8_t flags);
+const struct edge_filter_s *edge_filter_get(const char *topic);
+/* true when the publish should go out; topics without a rule always do */
+bool edge_filter_pass(const char *topic, const char *data, uint16_t len);
+/* the decimal number data leads with, in thousandths; false when there is none */
+bool edge_filter_value(const char *data, uint16_t len, int32_t *value);
+
+#endif /* __EDGE_FILTER_H__ */
@@ -0,0 +1,28 @@
+#ifndef __HOT_H__
+#define __HOT_H__
+
+#include "c_types.h"
+
+/*
+ * Hot path placement.
+ *
+ * HOT_ATTR marks the code that runs per byte or from the UART ISR: SLIP
+ * encode and decode, CRC16, uart0_write and the rx ring producers. By
+ * default it stays in flash like the rest (ICACHE_FLASH_ATTR) and runs
+ * through the instruction cache. `make IRAM_HOT=1` moves it to IRAM,
+ * which costs IRAM out of a 32KB budget shared with the SDK, so check
+ * `make iram-report` when adding to the set.
+ *
+ * HOT_ATTR_KEEP is for hot code that was in IRAM already (no attribute,
+ * e.g. CRC16): it joins .text.hot with IRAM_HOT and stays where it was
+ * without, so the default build does not push it out to flash.
+ */
+#ifdef NEURITE_IRAM_HOT
+#define HOT_ATTR	__attribute__((section(".text.hot")))
+#define HOT_ATTR_KEEP	HOT_ATTR
+#else
+#define HOT_ATTR	ICACHE_FLASH_ATTR
+#define HOT_ATTR_KEEP
+#endif
+
+#endif /* __HOT_H__ */
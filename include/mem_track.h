@@ -0,0 +1,92 @@
+#ifndef __MEM_TRACK_H__
+#define __MEM_TRACK_H__
+
+#include "c_types.h"
+#include "mem.h"
+
+/*
+ * Heap and stack instrumentation, built in with `make MEMTRACK=1`
+ * (NEURITE_MEM_TRACK). The Makefile force-includes this header so every
+ * os_malloc/os_zalloc/os_realloc/os_free in the tree, the MQTT library
+ * included, goes through the tracker with its file and line.
+ *
+ * Live blocks are kept in a fixed table and folded into per call site
+ * stats: live count and bytes, total allocations and the average
+ * lifetime of freed blocks. Blocks allocated or freed inside the SDK
+ * libraries are not seen.
+ *
+ * mem_track_report() also works without tracking, it probes the heap
+ * for its largest free block, and reports how deep the stack has gone
+ * below the point mem_track_init() was called from. The free block
+ * sizes are only probed in the tracking build, as that holds on to the
+ * largest blocks, most of the heap, while it runs.
+ */
+#define MEM_TRACK_BLOCKS	128	/* live blocks tracked, extra ones are only counted */
+#define MEM_TRACK_SITES		48
+#define MEM_TRACK_TOP		8	/* sites in a report */
+#define MEM_TRACK_STACK_PAINT	2048	/* bytes painted below the init stack pointer */
+
+/* raw allocator, expanded before the redefinitions below */
+static inline void *mem_raw_malloc(size_t size)
+{
+	return os_malloc(size);
+}
+
+static inline void *mem_raw_zalloc(size_t size)
+{
+	return os_zalloc(size);
+}
+
+static inline void *mem_raw_realloc(void *ptr, size_t size)
+{
+	return os_realloc(ptr, size);
+}
+
+static inline void mem_raw_free(void *ptr)
+{
+	os_free(ptr);
+}
+
+static inline uint32_t mem_stack_pointer(void)
+{
+	uint32_t sp;
+#ifdef __xtensa__
+	__asm__ __volatile__("mov %0, a1" : "=a"(sp));
+#elif __SIZEOF_POINTER__ > 4
+	/* a 64 bit host stack does not fit, no stack tracking there */
+	sp = 0;
+#else
+	sp = (uint32_t)(size_t)&sp;
+#endif
+	return sp;
+}
+
+void mem_track_init(void);
+void mem_stack_probe(void);
+uint16_t mem_track_report(char *buf, uint16_t size);
+
+#ifdef NEURITE_MEM_TRACK
+
+void *mem_track_malloc(size_t size, bool zero, const char *file, uint16_t line);
+void *mem_track_realloc(void *ptr, size_t size, const char *file, uint16_t line);
+void mem_track_free(void *ptr);
+
+#undef os_malloc
+#undef os_zalloc
+#undef os_realloc
+#undef os_free
+#define os_malloc(s)		mem_track_malloc((s), false, __FILE__, __LINE__)
+#define os_zalloc(s)		mem_track_malloc((s), true, __FILE__, __LINE__)
+#define os_realloc(p, s)	mem_track_realloc((p), (s), __FILE__, __LINE__)
+#define os_free(p)		mem_track_free(p)
+
+/* call at the top of task and timer handlers to catch their stack depth */
+#define MEM_STACK_PROBE()	mem_stack_probe()
+
+#else
+
+#define MEM_STACK_PROBE()	do { } while (0)
+
+#endif /* NEURITE_MEM_TRACK */
+
+#endif /* __MEM_TRACK_H__ */
@@ -0,0 +1,90 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "c_types.h"
+#include "mqtt.h"
+
+/*
+ * Runtime metrics, fixed slots so updating one is a single add.
+ * Counters only grow, gauges hold the last sampled value.
+ * Append new slots right before the _NUM markers, MCU side tools
+ * index the raw arrays by these values.
+ */
+enum metrics_id_e {
+	/* counters */
+	METRIC_UART_RX_BYTES = 0,
+	METRIC_UART_TX_BYTES,
+	METRIC_RX_RB_DROPS,
+	METRIC_PROTO_FRAMES,
+	METRIC_PROTO_CRC_ERR,
+	METRIC_MQTT_PUB,
+	METRIC_MQTT_PUB_FAIL,
+	METRIC_MQTT_PUB_ACK,
+	METRIC_MQTT_RECV,
+	METRIC_REST_REQ,
+	METRIC_REST_RESP,
+	METRIC_WIFI_CONNECT,
+	/* gauges */
+	METRIC_HEAP_FREE,
+	METRIC_HEAP_LOW,
+	METRIC_UPTIME_S,
+	/* counters */
+	METRIC_DLOG_DROPS,
+	METRIC_PROTO_BAD_FRAME,
+	METRIC_TX_FRAGS,
+	METRIC_TX_SPILLS,
+	/* gauges, of the MQTT client whose outbound queue changed last */
+	METRIC_MQTT_QUEUE,
+	METRIC_MQTT_QUEUE_PEAK,
+	/* counters */
+	METRIC_MQTT_QUEUE_HIGH,
+	METRIC_MQTT_RESUBSCRIBE,
+	METRIC_MQTT_SESSION_KEPT,
+	METRIC_MQTT_ALIAS_SAVED,	/* topic bytes MQTT 5 topic aliases kept off the air */
+	METRIC_MQTT_INFLIGHT_WAIT,	/* publishes held for the broker's Receive Maximum */
+	METRIC_FILTER_PASSED,		/* publishes an edge filter rule let through */
+	METRIC_FILTER_SUPPRESSED,	/* and those it dropped */
+	METRIC_AGG_SAMPLES,		/* publishes folded into an aggregation window */
+	METRIC_AGG_WINDOWS,		/* summary records published */
+	METRIC_NUM
+};
+
+/*
+ * log2 histograms, bucket i counts samples in [2^i, 2^(i+1)),
+ * the last bucket is open ended.
+ */
+enum metrics_hist_e {
+	METRIC_HIST_CMD_EXEC_US = 0,
+	METRIC_HIST_REST_RTT_MS,
+	METRIC_HIST_WIFI_IP_MS,
+	METRIC_HIST_NUM
+};
+
+#define METRICS_HIST_BUCKETS	20
+
+extern uint32_t g_metrics[METRIC_NUM];
+
+static inline void metrics_add(enum metrics_id_e id, uint32_t n)
+{
+	g_metrics[id] += n;
+}
+
+static inline void metrics_inc(enum metrics_id_e id)
+{
+	g_metrics[id]++;
+}
+
+static inline void metrics_set(enum metrics_id_e id, uint32_t v)
+{
+	g_metrics[id] = v;
+}
+
+void metrics_hist_add(enum metrics_hist_e hid, uint32_t value);
+void metrics_sample(void);
+void metrics_init(void);
+const uint32_t *metrics_hist(void);
+uint16_t metrics_format(char *buf, uint16_t size);
+uint16_t metrics_format_hist(char *buf, uint16_t size);
+void metrics_publish_start(MQTT_Client *client, const char *topic, uint32_t interval_s);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,84 @@
+#ifndef __MQTT5_H__
+#define __MQTT5_H__
+
+#include "c_types.h"
+#include "mqtt.h"
+
+/*
+ * MQTT 5 on top of an esp_mqtt MQTT_Client, which only speaks 3.1/3.1.1.
+ *
+ * mqtt5_init() switches a client over: from then on user/mqtt5.c runs its
+ * connection instead of the library and frames packets the MQTT 5 way,
+ * reusing the client's buffers, outbound queue, timer and callbacks. What
+ * it adds:
+ *
+ * - topic aliases: the first publishes to a topic on a connection carry
+ *   it with an alias, later ones the alias only, up to the broker's Topic
+ *   Alias Maximum; aliases the broker assigns are resolved for dataCb
+ * - Receive Maximum: QoS 1/2 publishes stop going out while the broker's
+ *   limit of them is unacknowledged
+ * - Maximum Packet Size both ways: the broker is told in_buffer_length, and
+ *   a publish over the broker's limit fails instead of getting the
+ *   connection closed
+ * - reason codes: mqtt5_reason() holds the one of the last CONNACK,
+ *   PUBACK or broker DISCONNECT when the callbacks run
+ *
+ * Packets are queued without aliases, they are applied as each one goes
+ * out since an alias only lasts for its connection. Acks and pings skip
+ * the queue, so a publish held for the Receive Maximum does not hold up
+ * the broker's flow or the keepalive.
+ *
+ * The mqtt5_ send functions take 3.1 clients too and hand those to the
+ * library, so callers need not tell the two apart.
+ */
+#define MQTT5_ALIASES		8	/* topic aliases each way */
+#define MQTT5_RECEIVE_MAX	8	/* QoS 1/2 publishes the broker may have unacked with us */
+#define MQTT5_PUB_PROPS		4	/* property length and topic alias, added to a PUBLISH */
+/* acks and pings waiting to go out ahead of the queue: one per publish the broker may have unacked each way, and a ping */
+#define MQTT5_CTRL_BUF		(4 * 2 * MQTT5_RECEIVE_MAX + 2)
+
+/* reason codes the bridge looks at, the rest pass through */
+#define MQTT5_RC_SUCCESS		0x00
+#define MQTT5_RC_NO_SUBSCRIBERS		0x10
+#define MQTT5_RC_PACKET_TOO_LARGE	0x95
+
+/* a SUBACK with its reason codes, or UNSUBACK with theirs, came in */
+typedef void (*mqtt5_ack_cb)(MQTT_Client *client, uint8_t type, uint16_t id,
+			     const uint8_t *codes, uint16_t n);
+
+struct mqtt5_s {
+	struct mqtt5_s *next;
+	MQTT_Client *client;
+	mqtt5_ack_cb ack_cb;
+	/* the broker's limits from CONNACK */
+	uint16_t recv_max;
+	uint16_t alias_max;
+	uint32_t packet_max;
+	uint16_t inflight;	/* QoS 1/2 publishes not acked yet */
+	uint16_t held;		/* length of the QoS 1/2 publish in out_buffer waiting for inflight, 0 none */
+	uint32_t rx_skip;	/* bytes left of a packet over in_buffer, dropped as they come */
+	uint8_t ctrl[MQTT5_CTRL_BUF];	/* acks and pings, they need not wait behind a held publish */
+	uint16_t ctrl_len;
+	uint16_t ctrl_out;	/* of those, the ones with espconn */
+	uint8_t reason;
+	uint8_t disc_reason;	/* of a refused CONNACK or broker DISCONNECT, for the disconnect */
+	uint8_t sending;	/* a packet is with espconn until the sent callback */
+	uint8_t sent_type;	/* its first byte, to tell a QoS 0 publish */
+	char *tx_alias[MQTT5_ALIASES];	/* topic of alias i + 1 on this connection */
+	char *rx_alias[MQTT5_ALIASES];
+};
+
+int mqtt5_init(MQTT_Client *client, mqtt5_ack_cb ack_cb);
+struct mqtt5_s *mqtt5_get(MQTT_Client *client);
+uint8_t mqtt5_reason(MQTT_Client *client);
+/* the broker kept the session of a clean session off connect, for connectedCb */
+BOOL mqtt5_session_present(MQTT_Client *client);
+
+void mqtt5_connect(MQTT_Client *client);
+void mqtt5_disconnect(MQTT_Client *client);
+BOOL mqtt5_publish(MQTT_Client *client, const char *topic, const char *data, int data_len, int qos, int retain);
+BOOL mqtt5_subscribe(MQTT_Client *client, char *topic, uint8_t qos);
+/* after QUEUE_Puts() of a packet built elsewhere */
+void mqtt5_kick(MQTT_Client *client);
+
+#endif /* __MQTT5_H__ */
@@ -0,0 +1,82 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "c_types.h"
+
+/*
+ * Hot path tracing, built in with `make TRACE=1` (NEURITE_TRACE).
+ *
+ * Each TRACE() stores the CPU cycle counter, an event id and a 16 bit
+ * argument into a RAM ring, cheap enough for the UART ISR. The ring is
+ * dumped as text on UART1 or returned by CMD_TRACE, and
+ * tools/trace_report.py turns it into per-stage latencies.
+ */
+enum trace_ev_e {
+	TRACE_NONE = 0,
+	TRACE_ISR_ENTER,
+	TRACE_ISR_EXIT,		/* arg: bytes drained from the rx fifo */
+	TRACE_FRAME_DONE,	/* arg: frame length */
+	TRACE_CRC_DONE,		/* arg: 1 if crc matched */
+	TRACE_DISPATCH,		/* arg: command */
+	TRACE_DISPATCH_DONE,	/* arg: command */
+	TRACE_PUB_QUEUED,	/* arg: payload length */
+	TRACE_MQTT_DATA,	/* arg: payload length */
+	TRACE_TX_DONE,		/* arg: command, last byte is in the tx fifo */
+	TRACE_EV_NUM
+};
+
+#ifdef NEURITE_TRACE
+
+#define TRACE_RING_SIZE		256	/* power of two */
+
+struct trace_rec_s {
+	uint32_t ccount;
+	uint16_t ev;
+	uint16_t arg;
+};
+
+extern struct trace_rec_s g_trace_ring[TRACE_RING_SIZE];
+extern uint32_t g_trace_head;
+
+static inline uint32_t trace_ccount(void)
+{
+#ifdef __xtensa__
+	uint32_t r;
+	__asm__ __volatile__("rsr %0, ccount" : "=a"(r));
+	return r;
+#else
+	extern uint32 system_get_time(void);
+	return system_get_time();
+#endif
+}
+
+static inline void trace_rec(uint16_t ev, uint16_t arg)
+{
+	struct trace_rec_s *r;
+#ifdef __xtensa__
+	uint32_t ps;
+	__asm__ __volatile__("rsil %0, 15" : "=a"(ps));
+#endif
+	r = &g_trace_ring[g_trace_head++ & (TRACE_RING_SIZE - 1)];
+	r->ccount = trace_ccount();
+	r->ev = ev;
+	r->arg = arg;
+#ifdef __xtensa__
+	__asm__ __volatile__("wsr %0, ps; rsync" :: "a"(ps) : "memory");
+#endif
+}
+
+#define TRACE(ev, arg)		trace_rec((ev), (arg))
+
+void trace_init(uint32_t dump_interval_ms);
+uint16_t trace_snapshot(struct trace_rec_s *out, uint16_t max);
+void trace_dump_uart1(void);
+
+#else
+
+#define TRACE(ev, arg)		do { } while (0)
+#define trace_init(ms)		do { } while (0)
+
+#endif /* NEURITE_TRACE */
+
+#endif /* __TRACE_H__ */
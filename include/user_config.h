@@ -2,7 +2,16 @@
 #define _USER_CONFIG_H_
 
 #define CFG_HOLDER	0x00FF55A4	/* Change this value to load default configurations */
+#ifdef NEURITE_OTA
+/* both stores sit in the gap between the OTA slots, 0x7C000-0x80FFF, see below */
+#define CFG_LOCATION	0x7E		/* Please don't change or if you know what you doing */
+#define NEURITE_CFG_LOCATION	0x7C	/* Versioned config store, takes two sectors */
+#else
 #define CFG_LOCATION	0x3C		/* Please don't change or if you know what you doing */
+#define NEURITE_CFG_LOCATION	0x3A	/* Versioned config store, takes two sectors */
+#endif
+#define CFG_SECTORS		3	/* two copies and the save flag of modules/config.c */
+#define NEURITE_CFG_SECTORS	2
 #define CLIENT_SSL_ENABLE
 
 /*DEFAULT CONFIGURATIONS*/
@@ -20,12 +29,66 @@
 #define STA_PASS	"NO-PASS"
 #define STA_TYPE	AUTH_WPA2_PSK
 
+#define NEURITE_WIFI_FAST_TIMEOUT	3000	/* ms a cached BSSID/channel attempt gets before a full scan */
+#define NEURITE_WIFI_LEASE_BOOTS	16	/* boots a cached DHCP lease is reused before asking again */
+//#define NEURITE_WIFI_STATIC_IP		/* reuse the cached DHCP lease as static IP */
+#define NEURITE_WIFI_GW_PINGS		2	/* pings the gateway of a static IP gets to answer, 1 s each */
+
 #define MQTT_RECONNECT_TIMEOUT	5
 
+#define NEURITE_STATS_TOPIC	"/neuro/%s/stats"
+#define NEURITE_STATS_INTERVAL	60	/* seconds between metrics publishes, 0 to disable */
+
+/* with make TRACE=1, dump the trace ring on UART1 this often, 0 to disable */
+#define NEURITE_TRACE_DUMP_MS	5000
+
+/* object pools and per-request arena, see modules/include/pool.h */
+#define POOL_REST_CLIENTS	1	/* clients past these come from the heap */
+#define POOL_MQTT_CLIENTS	1
+#define POOL_STR_SIZE		64	/* host, header and lwt strings */
+#define POOL_STR_COUNT		8
+#define ARENA_SIZE		2304	/* rx buffer plus padding for every arg */
+
+/* delta OTA (make OTA=1) slots, SDK boot layout for 512KB+512KB, see modules/ota.c */
+#define OTA_SLOT1_ADDR		0x01000
+#define OTA_SLOT2_ADDR		0x81000
+#define OTA_SLOT_SIZE		0x7B000
+
+/* sectors first .. first + n - 1 overlap the OTA slot at address slot */
+#define CFG_IN_SLOT(first, n, slot) \
+	((first) + (n) > (slot) / 0x1000 && (first) < ((slot) + OTA_SLOT_SIZE) / 0x1000)
+#if defined(NEURITE_OTA) && \
+	(CFG_IN_SLOT(CFG_LOCATION, CFG_SECTORS, OTA_SLOT1_ADDR) || \
+	 CFG_IN_SLOT(CFG_LOCATION, CFG_SECTORS, OTA_SLOT2_ADDR) || \
+	 CFG_IN_SLOT(NEURITE_CFG_LOCATION, NEURITE_CFG_SECTORS, OTA_SLOT1_ADDR) || \
+	 CFG_IN_SLOT(NEURITE_CFG_LOCATION, NEURITE_CFG_SECTORS, OTA_SLOT2_ADDR))
+#error "a config sector lies inside an OTA slot, writing either would erase the other"
+#endif
+
 #define DEFAULT_SECURITY	0
 #define QUEUE_BUFFER_SIZE	2048
 
 #define PROTOCOL_NAMEv31	/*MQTT version 3.1 compatible with Mosquitto v0.15*/
 //PROTOCOL_NAMEv311		/*MQTT version 3.11 compatible with https://eclipse.org/paho/clients/testing/*/
+//#define NEURITE_MQTT5		/* neurite talks MQTT 5 through user/mqtt5.c, see include/mqtt5.h */
+/*
+ * neurite connects with clean session off and only subscribes when the
+ * broker did not keep its session; a 3.1 CONNACK cannot say so, this
+ * takes PROTOCOL_NAMEv311 or NEURITE_MQTT5
+ */
+//#define NEURITE_MQTT_KEEP_SESSION
+/* edge filter rule on neurite's uplink topic, see include/edge_filter.h; all 0 is none */
+#define NEURITE_FILTER_DEADBAND		0	/* thousandths */
+#define NEURITE_FILTER_MIN_MS		0
+#define NEURITE_FILTER_HEARTBEAT_MS	0
+#define NEURITE_FILTER_FLAGS		0	/* EDGE_FILTER_CHANGE */
+/* summarize numbers on neurite's uplink topic per window, see include/aggregate.h; 0 is off */
+#define NEURITE_AGGREGATE_MS		0
 //#define INFO
+#ifdef NEURITE_DLOG
+/* INFO() of modules/ and the MQTT library goes to the deferred log as well, see include/dlog.h */
+#include "user_utils.h"
+#undef INFO
+#define INFO(msg, args...)	log_info(msg, ##args)
+#endif
 #endif
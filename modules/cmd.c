@@ -18,16 +18,32 @@
 #include "crc16.h"
 #include "mqtt_app.h"
 #include "rest.h"
+#include "ota.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pool.h"
+#include "mem_track.h"
+#include "hot.h"
+#ifdef NEURITE_DLOG
+#include "user_utils.h"
+#endif
 
 #define SLIP_START	0x7E
 #define SLIP_END	0x7F
 #define SLIP_REPL	0x7D
 #define SLIP_ESC(x)	(x ^ 0x20)
 
+#define CMD_HEADER_LEN	12	/* cmd, callback, _return, argc */
+#define CMD_CRC_LEN	2
+
 static void ICACHE_FLASH_ATTR
 CMD_Task(os_event_t *events);
 uint32_t ICACHE_FLASH_ATTR CMD_Reset(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR CMD_IsReady(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR CMD_Stats(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR CMD_Trace(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR CMD_Mem(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR CMD_TxSetup(PACKET_CMD *cmd);
 const CMD_LIST commands[] =
 {
 	{CMD_RESET, CMD_Reset},
@@ -39,10 +55,23 @@ const CMD_LIST commands[] =
 	{CMD_MQTT_PUBLISH, MQTTAPP_Publish},
 	{CMD_MQTT_SUBSCRIBE, MQTTAPP_Subscribe},
 	{CMD_MQTT_LWT, MQTTAPP_Lwt},
+	{CMD_MQTT_PUB_START, MQTTAPP_PubStart},
+	{CMD_MQTT_PUB_PART, MQTTAPP_PubPart},
+	{CMD_MQTT_DATA_SIZE, MQTTAPP_DataSize},
+	{CMD_MQTT_SUB_BATCH, MQTTAPP_SubBatch},
+	{CMD_MQTT_UNSUB_BATCH, MQTTAPP_UnsubBatch},
+	{CMD_MQTT_FILTER, MQTTAPP_Filter},
+	{CMD_MQTT_AGGREGATE, MQTTAPP_Aggregate},
 
 	{CMD_REST_SETUP, REST_Setup},
 	{CMD_REST_REQUEST, REST_Request},
 	{CMD_REST_SETHEADER, REST_SetHeader},
+	{CMD_REST_EXTRACT, REST_Extract},
+	{CMD_STATS, CMD_Stats},
+	{CMD_TRACE, CMD_Trace},
+	{CMD_MEM, CMD_Mem},
+	{CMD_OTA, OTA_Start},
+	{CMD_TX_SETUP, CMD_TxSetup},
 	{CMD_NULL, NULL}
 };
 
@@ -53,6 +82,9 @@ uint8_t			rxBuf[256];
 PROTO_PARSER 	rxProto;
 uint8_t 		protoRxBuf[2048];
 
+/* set by CMD_Defer while the current command runs */
+static uint8_t	cmdDeferred;
+
 
 
 uint32_t ICACHE_FLASH_ATTR CMD_Reset(PACKET_CMD *cmd)
@@ -66,9 +98,94 @@ uint32_t ICACHE_FLASH_ATTR CMD_IsReady(PACKET_CMD *cmd)
 	INFO("CMD: Check ready\r\n");
 	return 1;
 }
+/*
+ * No args: send counters/gauges and histograms as two raw uint32 arrays,
+ * indexed by metrics_id_e and metrics_hist_e.
+ * client, topic, interval: publish JSON metrics periodically, 0 stops.
+ */
+uint32_t ICACHE_FLASH_ATTR CMD_Stats(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	uint32_t client_ptr, interval, *snap;
+	uint8_t *topic;
+	uint16_t len, crc;
 
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) == 3){
+		CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+		len = CMD_ArgLen(&req);
+		topic = (uint8_t*)ARENA_Alloc(len + 1);
+		if(topic == NULL)
+			return 0;
+		CMD_PopArgs(&req, topic);
+		topic[len] = 0;
+		CMD_PopArgs(&req, (uint8_t*)&interval);
+		metrics_publish_start((MQTT_Client*)client_ptr, topic, interval);
+		return 1;
+	}
 
-ICACHE_FLASH_ATTR
+	INFO("CMD: Stats\r\n");
+	metrics_sample();
+	/* uart0_write counts into g_metrics, send a copy that holds still */
+	snap = (uint32_t*)ARENA_Alloc(sizeof(g_metrics));
+	if(snap == NULL)
+		return 0;
+	os_memcpy(snap, g_metrics, sizeof(g_metrics));
+	crc = CMD_ResponseStart(CMD_STATS, cmd->callback, METRIC_NUM, 2);
+	crc = CMD_ResponseBody(crc, (uint8_t*)snap, sizeof(g_metrics));
+	crc = CMD_ResponseBody(crc, (uint8_t*)metrics_hist(), METRIC_HIST_NUM * METRICS_HIST_BUCKETS * sizeof(uint32_t));
+	CMD_ResponseEnd(crc);
+	return 1;
+}
+
+/*
+ * No args: send the pending trace records as one raw array of
+ * struct trace_rec_s, returns the CPU clock in MHz (0 if tracing is not
+ * built in). One arg: dump them as text on UART1 instead.
+ */
+uint32_t ICACHE_FLASH_ATTR CMD_Trace(PACKET_CMD *cmd)
+{
+#ifdef NEURITE_TRACE
+	struct trace_rec_s *rec;
+	uint16_t n, crc;
+
+	if(cmd->argc == 1){
+		trace_dump_uart1();
+		return system_get_cpu_freq();
+	}
+
+	rec = (struct trace_rec_s*)ARENA_Alloc(TRACE_RING_SIZE * sizeof(struct trace_rec_s));
+	if(rec == NULL)
+		return 0;
+	n = trace_snapshot(rec, TRACE_RING_SIZE);
+	crc = CMD_ResponseStart(CMD_TRACE, cmd->callback, system_get_cpu_freq(), 1);
+	crc = CMD_ResponseBody(crc, (uint8_t*)rec, n * sizeof(struct trace_rec_s));
+	CMD_ResponseEnd(crc);
+	return system_get_cpu_freq();
+#else
+	return 0;
+#endif
+}
+/*
+ * Heap and stack report as JSON in one body arg, see mem_track_report().
+ * Returns the report length.
+ */
+uint32_t ICACHE_FLASH_ATTR CMD_Mem(PACKET_CMD *cmd)
+{
+	char *report;
+	uint16_t len, crc;
+
+	report = (char*)ARENA_Alloc(CMD_MEM_REPORT_SIZE);
+	if(report == NULL)
+		return 0;
+	len = mem_track_report(report, CMD_MEM_REPORT_SIZE);
+	crc = CMD_ResponseStart(CMD_MEM, cmd->callback, 0, 1);
+	crc = CMD_ResponseBody(crc, (uint8_t*)report, len);
+	CMD_ResponseEnd(crc);
+	return len;
+}
+
+HOT_ATTR
 void CMD_ProtoWrite(uint8_t data)
 {
 	switch(data){
@@ -82,7 +199,7 @@ void CMD_ProtoWrite(uint8_t data)
 		uart0_write(data);
 	}
 }
-ICACHE_FLASH_ATTR
+HOT_ATTR
 void CMD_ProtoWriteBuf(uint8_t *data, uint32_t len)
 {
 	uint8_t* data_send = data;
@@ -90,64 +207,369 @@ void CMD_ProtoWriteBuf(uint8_t *data, uint32_t len)
 		CMD_ProtoWrite(*data_send++);
 	}
 }
+
+/*
+ * TX lanes, see cmd.h. A lane is a ring of frames, each a 16 bit length
+ * and the packet as it is CRCed, before escaping. head and tail run
+ * free over the power of two size.
+ */
+typedef struct {
+	uint8_t		*buf;
+	uint16_t	mask;
+	uint16_t	head;		/* next byte written */
+	uint16_t	tail;		/* next byte sent */
+	uint16_t	frames;		/* complete ones, the one going out included */
+	uint16_t	len;		/* of the frame at tail */
+	uint16_t	left;		/* of it not sent yet, 0 before it starts */
+	uint16_t	frag;		/* its fragment size, 0 when it goes whole */
+} CMD_TX_LANE;
+
+static uint8_t txCtrlBuf[CMD_TX_CTRL_SIZE];
+static uint8_t txBulkBuf[CMD_TX_BULK_SIZE];
+static CMD_TX_LANE txLanes[CMD_LANES] = {
+	{ txCtrlBuf, CMD_TX_CTRL_SIZE - 1 },
+	{ txBulkBuf, CMD_TX_BULK_SIZE - 1 },
+};
+
+/* the frame between CMD_ResponseStart and CMD_ResponseEnd */
+static struct {
+	uint8_t		lane;
+	uint8_t		spill;		/* outgrew the lane, goes straight to the UART */
+	uint16_t	at;		/* its length */
+} txBuild;
+
+/* the unit on the wire, a whole frame or one fragment of it */
+enum { TX_IDLE = 0, TX_HEAD, TX_BODY, TX_TAIL };
+static struct {
+	uint8_t		state;
+	uint8_t		lane;
+	uint8_t		pad;
+	uint16_t	left;		/* body bytes */
+	uint16_t	crc;		/* of the fragment frame */
+	uint16_t	frag_size;	/* CMD_TX_SETUP, 0 sends bulk frames whole */
+	uint32_t	frag_id;
+} txPump;
+static os_timer_t txTimer;
+
+/* start byte, header and arg length escaped; padding, CRC and end byte */
+#define TX_HEAD_MAX	(1 + 2 * (CMD_HEADER_LEN + 2))
+#define TX_TAIL_MAX	(3 + 2 * CMD_CRC_LEN + 1)
+#define TX_ROOM_ANY	0xFFFF		/* uart0_write waits for the FIFO */
+
+static inline uint16_t
+cmd_tx_used(const CMD_TX_LANE *l)
+{
+	return l->head - l->tail;
+}
+
+static inline uint8_t
+cmd_tx_cost(uint8_t c)
+{
+	return (c == SLIP_START || c == SLIP_END || c == SLIP_REPL) ? 2 : 1;
+}
+
+/* escaped, returns the room left */
+static uint16_t HOT_ATTR
+cmd_tx_out(const uint8_t *data, uint16_t len, uint16_t room)
+{
+	while(len--){
+		room -= cmd_tx_cost(*data);
+		CMD_ProtoWrite(*data++);
+	}
+	return room;
+}
+
+/* takes the next unit if none is on the wire, control lane first */
+static bool ICACHE_FLASH_ATTR
+cmd_tx_next(void)
+{
+	CMD_TX_LANE *l;
+	uint8_t i;
+
+	if(txPump.state != TX_IDLE)
+		return true;
+	for(i = 0; i < CMD_LANES && txLanes[i].frames == 0; i++)
+		;
+	if(i == CMD_LANES)
+		return false;
+	l = &txLanes[i];
+	if(l->left == 0){
+		l->len = l->buf[l->tail & l->mask] | l->buf[(l->tail + 1) & l->mask] << 8;
+		l->tail += 2;
+		l->left = l->len;
+		l->frag = 0;
+		if(i != CMD_LANE_CTRL && txPump.frag_size && l->len > txPump.frag_size)
+			l->frag = txPump.frag_size;
+	}
+	txPump.lane = i;
+	txPump.left = l->frag && l->left > l->frag ? l->frag : l->left;
+	txPump.state = TX_HEAD;
+	return true;
+}
+
+/*
+ * Writes the unit on the wire until it is done or room, what the FIFO
+ * takes without waiting, runs out. Returns the room left.
+ */
+static uint16_t HOT_ATTR
+cmd_tx_step(uint16_t room)
+{
+	CMD_TX_LANE *l = &txLanes[txPump.lane];
+	uint8_t head[CMD_HEADER_LEN + 2], zero[3] = { 0 }, c;
+	uint32_t v;
+
+	if(txPump.state == TX_HEAD){
+		if(room < TX_HEAD_MAX)
+			return room;
+		uart0_write(SLIP_START);
+		room--;
+		if(l->frag){
+			/* PACKET_CMD of a CMD_TX_FRAGMENT with one arg, little endian */
+			txPump.pad = (4 - txPump.left % 4) % 4;
+			head[0] = CMD_TX_FRAGMENT;
+			head[1] = CMD_TX_FRAGMENT >> 8;
+			os_memcpy(&head[2], &txPump.frag_id, 4);
+			v = (uint32_t)l->len << 16 | (l->len - l->left);
+			os_memcpy(&head[6], &v, 4);
+			head[10] = 1;
+			head[11] = 0;
+			head[12] = txPump.left + txPump.pad;
+			head[13] = (txPump.left + txPump.pad) >> 8;
+			txPump.crc = crc16_data(head, sizeof(head), 0);
+			room = cmd_tx_out(head, sizeof(head), room);
+		}
+		txPump.state = TX_BODY;
+	}
+	while(txPump.state == TX_BODY){
+		if(txPump.left == 0){
+			txPump.state = TX_TAIL;
+			break;
+		}
+		if(room < 2)
+			return room;
+		c = l->buf[l->tail++ & l->mask];
+		room = cmd_tx_out(&c, 1, room);
+		if(l->frag)
+			txPump.crc = crc16_data(&c, 1, txPump.crc);
+		txPump.left--;
+		l->left--;
+	}
+	if(room < TX_TAIL_MAX)
+		return room;
+	if(l->frag){
+		room = cmd_tx_out(zero, txPump.pad, room);
+		txPump.crc = crc16_data(zero, txPump.pad, txPump.crc);
+		room = cmd_tx_out((uint8_t*)&txPump.crc, 2, room);
+		metrics_inc(METRIC_TX_FRAGS);
+	}
+	uart0_write(SLIP_END);
+	room--;
+	if(l->left == 0){
+		l->frames--;
+		if(l->frag)
+			txPump.frag_id++;
+	}
+	txPump.state = TX_IDLE;
+	return room;
+}
+
+/* sends what the FIFO takes, then comes back from a timer for the rest */
+static void ICACHE_FLASH_ATTR
+cmd_tx_pump(void *arg)
+{
+	uint16_t room;
+
+	while(cmd_tx_next()){
+		room = uart_tx_fifo_free(UART0);
+		if(room < TX_HEAD_MAX){
+			os_timer_disarm(&txTimer);
+			os_timer_arm(&txTimer, CMD_TX_RETRY_MS, 0);
+			return;
+		}
+		cmd_tx_step(room);
+	}
+}
+
+/*
+ * The lane is full: send what is queued ahead of the frame being built
+ * until there is room. If the frame fills the lane alone, it goes out
+ * whole right now, and the rest of it as it is written.
+ */
+static void ICACHE_FLASH_ATTR
+cmd_tx_room(CMD_TX_LANE *l)
+{
+	uint16_t i;
+
+	while(cmd_tx_used(l) > l->mask && l->frames && cmd_tx_next())
+		cmd_tx_step(TX_ROOM_ANY);
+	if(cmd_tx_used(l) <= l->mask)
+		return;
+	/* a unit of the other lane is not cut short */
+	if(txPump.state != TX_IDLE)
+		cmd_tx_step(TX_ROOM_ANY);
+	metrics_inc(METRIC_TX_SPILLS);
+	uart0_write(SLIP_START);
+	for(i = l->tail + 2; i != l->head; i++)
+		CMD_ProtoWrite(l->buf[i & l->mask]);
+	l->head = l->tail;
+	txBuild.spill = 1;
+}
+
+/* appends to the frame being built, returns the CRC over what went in */
+static uint16_t HOT_ATTR
+cmd_tx_write(const uint8_t *data, uint16_t len, uint16_t crc)
+{
+	CMD_TX_LANE *l = &txLanes[txBuild.lane];
+	uint8_t c;
+
+	while(len--){
+		c = *data++;	/* read once, the CRC has to match what went out */
+		crc = crc16_data(&c, 1, crc);
+		if(!txBuild.spill && cmd_tx_used(l) > l->mask)
+			cmd_tx_room(l);
+		if(txBuild.spill)
+			CMD_ProtoWrite(c);
+		else
+			l->buf[l->head++ & l->mask] = c;
+	}
+	return crc;
+}
+
+static uint16_t ICACHE_FLASH_ATTR
+cmd_tx_start(uint8_t lane, uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc)
+{
+	uint16_t crc = 0;
+
+	txBuild.lane = lane;
+	txBuild.spill = 0;
+	txBuild.at = txLanes[lane].head;
+	cmd_tx_write((uint8_t*)&crc, 2, 0);	/* the length, once known */
+	crc = cmd_tx_write((uint8_t*)&cmd, 2, crc);
+	crc = cmd_tx_write((uint8_t*)&callback, 4, crc);
+	crc = cmd_tx_write((uint8_t*)&_return, 4, crc);
+	crc = cmd_tx_write((uint8_t*)&argc, 2, crc);
+	return crc;
+}
+
+/* answers and events */
 ICACHE_FLASH_ATTR
 uint16_t CMD_ResponseStart(uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc)
 {
-  uint16_t crc = 0;
-  uart0_write(SLIP_START);
-  CMD_ProtoWriteBuf((uint8_t*)&cmd, 2);
-  crc = crc16_data((uint8_t*)&cmd, 2, crc);
-  CMD_ProtoWriteBuf((uint8_t*)&callback, 4);
-  crc = crc16_data((uint8_t*)&callback, 4, crc);
-  CMD_ProtoWriteBuf((uint8_t*)&_return, 4);
-  crc = crc16_data((uint8_t*)&_return, 4, crc);
-  CMD_ProtoWriteBuf((uint8_t*)&argc, 2);
-  crc = crc16_data((uint8_t*)&argc, 2, crc);
-  return crc;
+	return cmd_tx_start(CMD_LANE_CTRL, cmd, callback, _return, argc);
 }
+
+/* data that may wait behind control frames, and be fragmented */
 ICACHE_FLASH_ATTR
+uint16_t CMD_BulkStart(uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc)
+{
+	return cmd_tx_start(CMD_LANE_BULK, cmd, callback, _return, argc);
+}
+
+HOT_ATTR
 uint16 CMD_ResponseBody(uint16_t crc_in, uint8_t* data, uint16_t len)
 {
-  uint8_t temp = 0;
+  uint8_t temp[3] = { 0 };
   uint16_t pad_len = len;
   while(pad_len % 4 != 0)
     pad_len++;
 
-  CMD_ProtoWriteBuf((uint8_t*)&pad_len, 2);
-  crc_in = crc16_data((uint8_t*)&pad_len, 2, crc_in);
-  while(len --){
-	  CMD_ProtoWrite(*data);
-    crc_in = crc16_data((uint8_t*)data, 1, crc_in);
-    data ++;
-    if(pad_len > 0) pad_len --;
-  }
-
-  while(pad_len --){
-	  CMD_ProtoWrite(temp);
-    crc_in = crc16_data((uint8_t*)&temp, 1, crc_in);
-  }
+  crc_in = cmd_tx_write((uint8_t*)&pad_len, 2, crc_in);
+  crc_in = cmd_tx_write(data, len, crc_in);
+  crc_in = cmd_tx_write(temp, pad_len - len, crc_in);
   return crc_in;
 }
 ICACHE_FLASH_ATTR
 uint16_t CMD_ResponseEnd(uint16_t crc)
 {
-	CMD_ProtoWriteBuf((uint8_t*)&crc, 2);
-	uart0_write(SLIP_END);
+	CMD_TX_LANE *l = &txLanes[txBuild.lane];
+	uint16_t len;
+
+	cmd_tx_write((uint8_t*)&crc, 2, 0);
+	if(txBuild.spill){
+		uart0_write(SLIP_END);
+		txBuild.spill = 0;
+	} else {
+		len = l->head - txBuild.at - 2;
+		l->buf[txBuild.at & l->mask] = len;
+		l->buf[(txBuild.at + 1) & l->mask] = len >> 8;
+		l->frames++;
+	}
+	cmd_tx_pump(NULL);
 	return 0;
 }
 
+/*
+ * One arg: the fragment size for bulk frames, 0 sends them whole.
+ * Returns the size in effect, rounded down to 4 bytes.
+ */
+uint32_t ICACHE_FLASH_ATTR CMD_TxSetup(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	uint32_t size;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 1)
+		return txPump.frag_size;
+	CMD_PopArgs(&req, (uint8_t*)&size);
+	if(size > CMD_TX_BULK_SIZE)
+		size = CMD_TX_BULK_SIZE;
+	if(size && size < CMD_TX_FRAG_MIN)
+		size = CMD_TX_FRAG_MIN;
+	/* frames already going out in pieces keep theirs */
+	txPump.frag_size = size & ~3;
+	INFO("CMD: TX fragments of %d\r\n", txPump.frag_size);
+	return txPump.frag_size;
+}
+
+/*
+ * For a command that finishes after it returns: a tagged request gets no
+ * answer from CMD_Exec, the module sends it with CMD_Complete (or
+ * CMD_ResponseStart with the tag as callback, for answers with args)
+ * once done. Returns that tag, or 0 for an untagged request, which is
+ * answered right away as before. Call it only on the way to success.
+ */
+uint32_t ICACHE_FLASH_ATTR
+CMD_Defer(PACKET_CMD *cmd)
+{
+	uint32_t tag = cmd->_return;
+
+	if(!(tag & CMD_RETURN_TAG))
+		return 0;
+	cmdDeferred = 1;
+	return tag;
+}
+
+void ICACHE_FLASH_ATTR
+CMD_Complete(uint16_t cmd, uint32_t tag, uint32_t ret)
+{
+	uint16_t crc;
+
+	INFO("CMD: Complete %d, tag: %08X, return value: %d\r\n", cmd, tag, ret);
+	crc = CMD_ResponseStart(cmd, tag, ret, 0);
+	CMD_ResponseEnd(crc);
+}
+
 LOCAL uint32_t ICACHE_FLASH_ATTR
 CMD_Exec(const CMD_LIST *scp, PACKET_CMD *packet)
 {
-	uint32_t ret;
+	uint32_t ret, t;
 	uint16_t crc = 0;
 	while (scp->sc_name != CMD_NULL){
 		if(scp->sc_name == packet->cmd) {
+			t = system_get_time();
+			TRACE(TRACE_DISPATCH, packet->cmd);
+			cmdDeferred = 0;
 			ret = scp->sc_function(packet);
-			if(packet->_return){
+			TRACE(TRACE_DISPATCH_DONE, packet->cmd);
+			/* request temporaries are done with */
+			ARENA_Reset();
+			metrics_hist_add(METRIC_HIST_CMD_EXEC_US, system_get_time() - t);
+			if(packet->_return && !cmdDeferred){
 				INFO("CMD: Response return value: %d, cmd: %d\r\n", ret, packet->cmd);
-				crc = CMD_ResponseStart(packet->cmd, 0, ret, 0);
+				crc = CMD_ResponseStart(packet->cmd,
+						(packet->_return & CMD_RETURN_TAG) ? packet->_return : 0, ret, 0);
 				CMD_ResponseEnd(crc);
+				TRACE(TRACE_TX_DONE, packet->cmd);
 			}
 
 			return ret;
@@ -157,40 +579,78 @@ CMD_Exec(const CMD_LIST *scp, PACKET_CMD *packet)
 	return 0;
 }
 
+/* arg lengths can sit at odd offsets, a 16 bit load there faults on the chip */
+static inline uint16_t
+CMD_Get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
 static void ICACHE_FLASH_ATTR
 protoCompletedCb()
 {
 	uint16_t crc = 0, argc, len, resp_crc, argn = 0;
-	uint8_t *data_ptr;
+	uint8_t *data_ptr, *crc_ptr;
 	PACKET_CMD *packet;
 	packet = (PACKET_CMD*)protoRxBuf;
+	TRACE(TRACE_FRAME_DONE, rxProto.dataLen);
+	metrics_inc(METRIC_PROTO_FRAMES);
+
+	/*
+	 * PROTO calls back on every end byte, also one without a start byte
+	 * (the buffer still holds the last command) and after the buffer
+	 * overflowed (the tail was dropped).
+	 */
+	if(!rxProto.isBegin || rxProto.dataLen < CMD_HEADER_LEN + CMD_CRC_LEN ||
+			rxProto.dataLen >= rxProto.bufSize){
+		INFO("CMD: bad frame, len: %d\r\n", rxProto.dataLen);
+		metrics_inc(METRIC_PROTO_BAD_FRAME);
+		return;
+	}
+	crc_ptr = protoRxBuf + rxProto.dataLen - CMD_CRC_LEN;
 
 	data_ptr = (uint8_t*)&packet->args ;
-	crc = crc16_data((uint8_t*)&packet->cmd, 12, crc);
+	crc = crc16_data((uint8_t*)&packet->cmd, CMD_HEADER_LEN, crc);
 	argc = packet->argc;
 
 	INFO("CMD: %d, cb: %d, ret: %d, argc: %d\r\n", packet->cmd, packet->callback, packet->_return, packet->argc);
 
 	while(argc--){
-		len = *((uint16_t*)data_ptr);
+		/* CMD_PopArgs trusts the lengths, they have to stay inside the frame */
+		if(crc_ptr - data_ptr < 2 || CMD_Get16(data_ptr) > crc_ptr - data_ptr - 2){
+			INFO("CMD: arg %d past the end of the frame\r\n", argn);
+			metrics_inc(METRIC_PROTO_BAD_FRAME);
+			return;
+		}
+		len = CMD_Get16(data_ptr);
 		INFO("Arg[%d](len %d): ", argn++, len);
 		crc = crc16_data(data_ptr, 2, crc);
 		data_ptr += 2;
 		crc = crc16_data(data_ptr, len, crc);
+#ifdef NEURITE_DLOG
+		dlog_hex(LOG_INFO, "I", "arg", data_ptr, len);
+		data_ptr += len;
+#else
 		while(len --){
 		  INFO("%02X ", *data_ptr);
 		  data_ptr ++;
 		}
 		INFO("\r\n");
+#endif
 	}
-	resp_crc =  *(uint16_t*)data_ptr;
+	if(data_ptr != crc_ptr){
+		INFO("CMD: %d bytes after the args\r\n", (int)(crc_ptr - data_ptr));
+		metrics_inc(METRIC_PROTO_BAD_FRAME);
+		return;
+	}
+	resp_crc = CMD_Get16(data_ptr);
 	INFO("Read CRC: %04X, calculated crc: %04X\r\n", resp_crc, crc);
 
+	TRACE(TRACE_CRC_DONE, crc == resp_crc);
 	if(crc != resp_crc) {
 
 		INFO("ESP: Invalid CRC\r\n");
-
-		INFO("");
+		metrics_inc(METRIC_PROTO_CRC_ERR);
 		return;
 	}
 	CMD_Exec(commands, packet);
@@ -201,15 +661,19 @@ CMD_Init()
 {
 	RINGBUF_Init(&rxRb, rxBuf, sizeof(rxBuf));
 	PROTO_Init(&rxProto, protoCompletedCb, protoRxBuf, sizeof(protoRxBuf));
+	os_timer_disarm(&txTimer);
+	os_timer_setfn(&txTimer, (os_timer_func_t *)cmd_tx_pump, NULL);
+	metrics_init();
 
 	system_os_task(CMD_Task, CMD_TASK_PRIO, cmdRecvQueue, CMD_TASK_QUEUE_SIZE);
 	system_os_post(CMD_TASK_PRIO, 0, 0);
 }
 
-void ICACHE_FLASH_ATTR
+void HOT_ATTR
 CMD_Input(uint8_t data)
 {
-	RINGBUF_Put(&rxRb, data);
+	if(RINGBUF_Put(&rxRb, data) != 0)
+		metrics_inc(METRIC_RX_RB_DROPS);
 	system_os_post(CMD_TASK_PRIO, 0, 0);
 }
 
@@ -217,6 +681,7 @@ static void ICACHE_FLASH_ATTR
 CMD_Task(os_event_t *events)
 {
 	uint8_t c;
+	MEM_STACK_PROBE();
 	while(RINGBUF_Get(&rxRb, &c) == 0){
 		PROTO_ParseByte(&rxProto, c);
 	}
@@ -239,7 +704,7 @@ int32_t ICACHE_FLASH_ATTR CMD_PopArgs(REQUEST *req, uint8_t *data)
 	if(req->arg_num >= req->cmd->argc)
 		return -1;
 
-	length = *(uint16_t*)req->arg_ptr;
+	length = CMD_Get16(req->arg_ptr);
 
 	req->arg_ptr += 2;
 
@@ -252,5 +717,5 @@ int32_t ICACHE_FLASH_ATTR CMD_PopArgs(REQUEST *req, uint8_t *data)
 }
 uint16_t CMD_ArgLen(REQUEST *req)
 {
-	return *(uint16_t*)req->arg_ptr;
+	return CMD_Get16(req->arg_ptr);
 }
@@ -41,9 +41,12 @@
  *
  */
 
+#include "hot.h"
+#include "crc16.h"
+
 /* CITT CRC16 polynomial ^16 + ^12 + ^5 + 1 */
 /*---------------------------------------------------------------------------*/
-unsigned short
+unsigned short HOT_ATTR_KEEP
 crc16_add(unsigned char b, unsigned short acc)
 {
   /*
@@ -62,7 +65,7 @@ crc16_add(unsigned char b, unsigned short acc)
   return acc;
 }
 /*---------------------------------------------------------------------------*/
-unsigned short
+unsigned short HOT_ATTR_KEEP
 crc16_data(const unsigned char *data, int len, unsigned short acc)
 {
   int i;
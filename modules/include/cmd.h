@@ -11,6 +11,37 @@
 
 #define CMD_TASK_QUEUE_SIZE 1
 #define CMD_TASK_PRIO		1
+#define CMD_MEM_REPORT_SIZE	1024
+
+/*
+ * _return with this bit set tags the request: the low bits are an id the
+ * MCU picks, and the answer carries the whole value back in its callback
+ * field instead of 0. Commands that finish later (CMD_Defer) answer
+ * tagged requests once done, out of order with everything else. Plain
+ * nonzero _return values keep the in-order answers with callback 0.
+ */
+#define CMD_RETURN_TAG		0x80000000
+
+/*
+ * Frames to the MCU queue on one of two lanes and a pump writes them
+ * out as the UART FIFO drains, control frames (answers and events)
+ * first. Bulk frames (MQTT data, REST bodies) are cut into
+ * CMD_TX_FRAGMENT frames once the MCU sets a fragment size with
+ * CMD_TX_SETUP, so control frames get out between the pieces; without
+ * it they go out whole, as before. Order holds within a lane only. A
+ * frame that outgrows its lane is written straight through, the way
+ * every frame used to be.
+ */
+#define CMD_TX_CTRL_SIZE	256	/* powers of two */
+#define CMD_TX_BULK_SIZE	2048
+#define CMD_TX_FRAG_MIN		16
+#define CMD_TX_RETRY_MS		1	/* FIFO full, 126 bytes take 11ms at 115200 */
+
+typedef enum {
+	CMD_LANE_CTRL = 0,
+	CMD_LANE_BULK,
+	CMD_LANES
+} CMD_LANE;
 
 typedef struct __attribute((__packed__)) {
 	uint16_t len;
@@ -47,7 +78,23 @@ typedef enum
 	CMD_REST_SETUP,
 	CMD_REST_REQUEST,
 	CMD_REST_SETHEADER,
-	CMD_REST_EVENTS
+	CMD_REST_EVENTS,
+	CMD_STATS,
+	CMD_TRACE,
+	CMD_MEM,
+	CMD_OTA,
+	CMD_OTA_EVENTS,
+	CMD_TX_SETUP,
+	/* callback: frame id, _return: frame length << 16 | offset, one arg */
+	CMD_TX_FRAGMENT,
+	CMD_MQTT_PUB_START,
+	CMD_MQTT_PUB_PART,
+	CMD_MQTT_DATA_SIZE,
+	CMD_MQTT_SUB_BATCH,
+	CMD_MQTT_UNSUB_BATCH,
+	CMD_MQTT_FILTER,
+	CMD_MQTT_AGGREGATE,
+	CMD_REST_EXTRACT
 }CMD_NAME;
 
 typedef uint32_t (*cmdfunc_t)(PACKET_CMD *cmd);
@@ -62,9 +109,13 @@ void CMD_Init();
 void CMD_Input(uint8_t data);
 
 uint16_t CMD_ResponseStart(uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc);
+uint16_t CMD_BulkStart(uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc);
 uint16 CMD_ResponseBody(uint16_t crc_in, uint8_t* data, uint16_t len);
 uint16_t CMD_ResponseEnd(uint16_t crc);
 
+uint32_t CMD_Defer(PACKET_CMD *cmd);
+void CMD_Complete(uint16_t cmd, uint32_t tag, uint32_t ret);
+
 void CMD_Response(uint16_t cmd, uint32_t callback, uint32_t _return, uint16_t argc, ARGS* args[]);
 void CMD_Request(REQUEST *req, PACKET_CMD* cmd);
 uint32_t CMD_GetArgc(REQUEST *req);
@@ -0,0 +1,56 @@
+/*
+ * json_path.h
+ *
+ * Streaming extraction of a few values from a JSON document, for REST
+ * responses too big to forward. The document is fed in chunks as it
+ * arrives and never held: state is the stack of open containers and the
+ * key being read, whatever the document size.
+ *
+ * Paths are keys joined with '.', with [i] for array elements:
+ * "main.temp", "weather[0].description", "[2].id". Each path takes the
+ * first value it matches, as raw JSON text without whitespace outside
+ * strings, so a string keeps its quotes and an object or array comes
+ * whole. While one value is captured, paths inside it are not looked for.
+ * Keys longer than JSON_PATH_KEY_LEN never match, and containers nested
+ * deeper than JSON_PATH_DEPTH end the document. A value that does not
+ * fit what is left of out is left out.
+ */
+
+#ifndef MODULES_JSON_PATH_H_
+#define MODULES_JSON_PATH_H_
+
+#include "c_types.h"
+
+#define JSON_PATH_MAX		8	/* paths per document */
+#define JSON_PATH_DEPTH		12
+#define JSON_PATH_KEY_LEN	32
+
+typedef struct {
+	const char *paths;	/* n NUL terminated paths back to back */
+	uint8_t n;
+	uint8_t found;		/* bit i: path i has its value */
+	uint8_t state;
+	uint8_t depth;		/* open containers */
+	uint8_t key_len;	/* JSON_PATH_KEY_LEN + 1 once too long */
+	char key[JSON_PATH_KEY_LEN];
+	/* per open container: arrays bit, element index, paths matched down to it */
+	uint16_t arrays;
+	uint16_t index[JSON_PATH_DEPTH];
+	uint8_t match[JSON_PATH_DEPTH + 1];
+	/* the value being captured */
+	int8_t capture;		/* path, -1 none */
+	uint8_t capture_depth;
+	uint8_t overflow;	/* it did not fit out, dropped at its end */
+	uint8_t *out;
+	uint16_t out_size;
+	uint16_t out_len;
+	uint16_t off[JSON_PATH_MAX];
+	uint16_t len[JSON_PATH_MAX];
+} JSON_PATH;
+
+void JSONPATH_Init(JSON_PATH *jp, const char *paths, uint8_t n, uint8_t *out, uint16_t out_size);
+void JSONPATH_Feed(JSON_PATH *jp, const uint8_t *data, uint16_t len);
+/* every path has its value, or the document ended */
+BOOL JSONPATH_Done(JSON_PATH *jp);
+
+#endif /* MODULES_JSON_PATH_H_ */
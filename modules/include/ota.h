@@ -0,0 +1,46 @@
+/*
+ * ota.h
+ *
+ * Delta firmware updates over HTTP into the inactive slot, see ota.c
+ * for the delta layout and tools/ota_diff.py to make one.
+ */
+
+#ifndef MODULES_OTA_H_
+#define MODULES_OTA_H_
+
+#include "c_types.h"
+#include "cmd.h"
+
+#define OTA_MAGIC	0x544c444e	/* "NDLT" */
+#define OTA_VERSION	1
+#define OTA_HDR_SIZE	48
+
+typedef enum {
+	OTA_OP_END = 0,
+	OTA_OP_COPY,
+	OTA_OP_ADD,
+	OTA_OP_DATA
+} OTA_OP;
+
+/* CMD_OTA_EVENTS _return, the one arg is a uint32_t */
+typedef enum {
+	OTA_EV_PROGRESS = 0,	/* bytes of the new image written */
+	OTA_EV_DONE,		/* verified, image size; reboots into it shortly */
+	OTA_EV_FAIL		/* OTA_ERR, the running image is untouched */
+} OTA_EVENT;
+
+typedef enum {
+	OTA_ERR_NONE = 0,
+	OTA_ERR_HTTP,		/* connection failed or status not 200 */
+	OTA_ERR_FORMAT,
+	OTA_ERR_SIZE,		/* image larger than OTA_SLOT_SIZE */
+	OTA_ERR_BASE,		/* delta not made against the running image */
+	OTA_ERR_FLASH,
+	OTA_ERR_TRUNCATED,
+	OTA_ERR_OVERRUN,	/* peer ignored flow control */
+	OTA_ERR_VERIFY
+} OTA_ERR;
+
+uint32_t OTA_Start(PACKET_CMD *cmd);
+
+#endif /* MODULES_OTA_H_ */
@@ -0,0 +1,49 @@
+/*
+ * pool.h
+ *
+ * Fixed size object pools and the per-request arena.
+ *
+ * Objects that live as long as the client (REST/MQTT clients, their
+ * strings) come from pools defined with POOL_DEFINE, sized in
+ * user_config.h. A pool never fragments the heap, an object that doesn't
+ * fit a block or finds the pool empty falls back to os_zalloc and
+ * POOL_Free tells the two apart.
+ *
+ * Temporaries needed only while a command runs come from the arena,
+ * CMD_Exec resets it once the command returns. Nothing taken from the
+ * arena may be kept past that point.
+ */
+
+#ifndef MODULES_POOL_H_
+#define MODULES_POOL_H_
+
+#include "c_types.h"
+
+typedef struct {
+	uint8_t *mem;
+	uint16_t block_size;
+	uint16_t count;
+	uint16_t next;		/* blocks never handed out start here */
+	uint16_t used;
+	uint16_t peak;
+	uint16_t fallback;	/* allocations that went to the heap */
+	void *free_list;
+} POOL;
+
+#define POOL_BLOCK_SIZE(size)	((((size) + 3) / 4) * 4)
+
+#define POOL_DEFINE(name, size, n) \
+	static uint32_t name##Mem[POOL_BLOCK_SIZE(size) / 4 * (n)]; \
+	POOL name = { (uint8_t*)name##Mem, POOL_BLOCK_SIZE(size), (n), 0, 0, 0, 0, NULL }
+
+/* shared pool for client owned strings, see POOL_STR_SIZE */
+extern POOL strPool;
+
+void *POOL_Alloc(POOL *pool, uint16_t size);
+void POOL_Free(POOL *pool, void *ptr);
+
+void *ARENA_Alloc(uint16_t size);
+void ARENA_Reset(void);
+uint16_t ARENA_Peak(void);
+
+#endif /* MODULES_POOL_H_ */
@@ -10,12 +10,23 @@
 #include "c_types.h"
 #include "ip_addr.h"
 #include "cmd.h"
+#include "json_path.h"
 typedef enum {
   HEADER_GENERIC = 0,
   HEADER_CONTENT_TYPE,
   HEADER_USER_AGENT
 } HEADER_TYPE;
 
+/*
+ * Streamed response body for clients driven from the firmware itself
+ * (REST_Get), called per received chunk and once with len 0 when the
+ * connection closes or fails.
+ */
+typedef void (*REST_BODY_CB)(void *arg, uint32_t status, uint8_t *data, uint16_t len);
+
+/* long enough for "transfer-encoding:chunked" */
+#define REST_HDR_LINE	26
+
 
 typedef struct {
 	uint8_t* host;
@@ -29,9 +40,35 @@ typedef struct {
 	uint8_t* content_type;
 	uint8_t* user_agent;
 	uint32_t resp_cb;
+	uint32_t req_tag;	/* CMD_Defer tag of the request in flight */
+	uint32_t req_start;
+	REST_BODY_CB body_cb;
+	void *body_arg;
+	uint32_t status;
+	uint8_t in_status;
+	uint8_t in_body;
+	uint8_t line_blank;
+	/* Transfer-Encoding: chunked, the body is de-chunked before it is used */
+	char hdr_line[REST_HDR_LINE];	/* the header line so far, lower case without blanks */
+	uint8_t hdr_len;
+	uint8_t chunked;
+	uint8_t chunk_st;
+	uint32_t chunk_left;
+	/* REST_Extract paths, the response carries their values instead of the body */
+	uint8_t *paths;
+	uint8_t paths_n;
+	uint8_t extract_done;
+	JSON_PATH *json;
 } REST_CLIENT;
 
 uint32_t REST_Setup(PACKET_CMD *cmd);
 uint32_t REST_Request(PACKET_CMD *cmd);
 uint32_t REST_SetHeader(PACKET_CMD *cmd);
+uint32_t REST_Extract(PACKET_CMD *cmd);
+
+REST_CLIENT *REST_Open(const uint8_t *host, uint32_t port, uint32_t security);
+uint32_t REST_Get(REST_CLIENT *client, const uint8_t *path, REST_BODY_CB body_cb, void *arg);
+void REST_Hold(REST_CLIENT *client, uint8_t hold);
+void REST_Close(REST_CLIENT *client);
+void REST_Free(REST_CLIENT *client);
 #endif /* MODULES_INCLUDE_API_H_ */
@@ -0,0 +1,283 @@
+/*
+ * json_path.c
+ *
+ * Streaming JSON value extraction, see json_path.h.
+ */
+#include "osapi.h"
+#include "json_path.h"
+
+enum {
+	JP_VALUE = 0,		/* a value is next */
+	JP_VALUE_OR_CLOSE,	/* after '[' */
+	JP_KEY_OR_CLOSE,	/* after '{' */
+	JP_KEY_START,		/* after ',' in an object */
+	JP_KEY,
+	JP_KEY_ESC,
+	JP_COLON,
+	JP_STRING,
+	JP_STRING_ESC,
+	JP_LITERAL,
+	JP_AFTER,		/* a value ended, ',' or a close is next */
+	JP_END
+};
+
+#define JP_IS_ARRAY(jp, d)	(((jp)->arrays >> (d)) & 1)
+
+static const char* ICACHE_FLASH_ATTR
+path_get(JSON_PATH *jp, uint8_t i)
+{
+	const char *p = jp->paths;
+
+	while(i--)
+		p += os_strlen(p) + 1;
+	return p;
+}
+
+/* segment at p into seg and len, NULL at the end of the path */
+static const char* ICACHE_FLASH_ATTR
+path_next(const char *p, const char **seg, uint16_t *len, BOOL *is_index)
+{
+	if(*p == '.')
+		p++;
+	if(*p == 0)
+		return NULL;
+	*is_index = *p == '[';
+	if(*is_index)
+		p++;
+	*seg = p;
+	while(*p && *p != '.' && *p != '[' && *p != ']')
+		p++;
+	*len = p - *seg;
+	if(*p == ']')
+		p++;
+	return p;
+}
+
+/* mask of paths that go on matching at container depth d, with full set to those ending there */
+static uint8_t ICACHE_FLASH_ATTR
+member_match(JSON_PATH *jp, uint8_t d, uint8_t *full)
+{
+	uint8_t i, s, m = 0, candidates = jp->match[d] & ~jp->found;
+	uint16_t len, k;
+	uint32_t index;
+	const char *p, *seg;
+	BOOL is_index;
+
+	*full = 0;
+	for(i = 0; i < jp->n; i++){
+		if(!(candidates & (1 << i)))
+			continue;
+		p = path_get(jp, i);
+		for(s = 0; s < d && p; s++)
+			p = path_next(p, &seg, &len, &is_index);
+		if(p == NULL)
+			continue;
+		if(is_index != JP_IS_ARRAY(jp, d - 1))
+			continue;
+		if(is_index){
+			for(index = 0, k = 0; k < len && seg[k] >= '0' && seg[k] <= '9'; k++)
+				index = index * 10 + seg[k] - '0';
+			if(k == 0 || k != len || index != jp->index[d - 1])
+				continue;
+		} else if(jp->key_len > JSON_PATH_KEY_LEN || len != jp->key_len ||
+				os_memcmp(seg, jp->key, len) != 0){
+			continue;
+		}
+		m |= 1 << i;
+		if(path_next(p, &seg, &len, &is_index) == NULL)
+			*full |= 1 << i;
+	}
+	return m;
+}
+
+static void ICACHE_FLASH_ATTR
+emit(JSON_PATH *jp, char c)
+{
+	if(jp->capture < 0)
+		return;
+	if(jp->out_len < jp->out_size)
+		jp->out[jp->out_len++] = c;
+	else
+		jp->overflow = 1;
+}
+
+/* c opens a value at the current depth, returns the paths that go on inside it */
+static uint8_t ICACHE_FLASH_ATTR
+value_start(JSON_PATH *jp)
+{
+	uint8_t i, m, full;
+
+	if(jp->capture >= 0)
+		return 0;
+	if(jp->depth == 0)
+		return (1 << jp->n) - 1;
+	m = member_match(jp, jp->depth, &full);
+	for(i = 0; full && i < jp->n; i++){
+		if(full & (1 << i)){
+			jp->capture = i;
+			jp->capture_depth = jp->depth;
+			jp->off[i] = jp->out_len;
+			break;
+		}
+	}
+	return m & ~full;
+}
+
+static void ICACHE_FLASH_ATTR
+value_end(JSON_PATH *jp)
+{
+	int8_t i = jp->capture;
+
+	if(i >= 0 && jp->depth == jp->capture_depth){
+		if(jp->overflow){
+			jp->out_len = jp->off[i];
+		} else {
+			jp->len[i] = jp->out_len - jp->off[i];
+			jp->found |= 1 << i;
+		}
+		jp->capture = -1;
+		jp->overflow = 0;
+	}
+	jp->state = jp->depth == 0 ? JP_END : JP_AFTER;
+}
+
+static void ICACHE_FLASH_ATTR
+push(JSON_PATH *jp, BOOL array, uint8_t next)
+{
+	if(jp->depth == JSON_PATH_DEPTH){
+		jp->state = JP_END;
+		return;
+	}
+	if(array)
+		jp->arrays |= 1 << jp->depth;
+	else
+		jp->arrays &= ~(1 << jp->depth);
+	jp->index[jp->depth] = 0;
+	jp->depth++;
+	jp->match[jp->depth] = next;
+	jp->state = array ? JP_VALUE_OR_CLOSE : JP_KEY_OR_CLOSE;
+}
+
+static void ICACHE_FLASH_ATTR
+json_close(JSON_PATH *jp, char c)
+{
+	emit(jp, c);
+	jp->depth--;
+	value_end(jp);
+}
+
+void ICACHE_FLASH_ATTR
+JSONPATH_Init(JSON_PATH *jp, const char *paths, uint8_t n, uint8_t *out, uint16_t out_size)
+{
+	os_memset(jp, 0, sizeof(JSON_PATH));
+	jp->paths = paths;
+	jp->n = n < JSON_PATH_MAX ? n : JSON_PATH_MAX;
+	jp->capture = -1;
+	jp->out = out;
+	jp->out_size = out_size;
+}
+
+void ICACHE_FLASH_ATTR
+JSONPATH_Feed(JSON_PATH *jp, const uint8_t *data, uint16_t len)
+{
+	uint16_t j;
+	uint8_t next;
+	char c;
+	BOOL space;
+
+	for(j = 0; j < len && !JSONPATH_Done(jp); j++){
+		c = data[j];
+		space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+		switch(jp->state){
+		case JP_VALUE_OR_CLOSE:
+			if(c == ']'){
+				json_close(jp, c);
+				break;
+			}
+			/* fall through */
+		case JP_VALUE:
+			if(space)
+				break;
+			next = value_start(jp);
+			emit(jp, c);
+			if(c == '{' || c == '[')
+				push(jp, c == '[', next);
+			else if(c == '"')
+				jp->state = JP_STRING;
+			else
+				jp->state = JP_LITERAL;
+			break;
+		case JP_KEY_OR_CLOSE:
+			if(c == '}'){
+				json_close(jp, c);
+				break;
+			}
+			/* fall through */
+		case JP_KEY_START:
+			if(c == '"'){
+				emit(jp, c);
+				jp->key_len = 0;
+				jp->state = JP_KEY;
+			}
+			break;
+		case JP_KEY:
+		case JP_KEY_ESC:
+			emit(jp, c);
+			if(jp->state == JP_KEY && c == '"'){
+				jp->state = JP_COLON;
+				break;
+			}
+			jp->state = jp->state == JP_KEY && c == '\\' ? JP_KEY_ESC : JP_KEY;
+			if(jp->key_len < JSON_PATH_KEY_LEN)
+				jp->key[jp->key_len++] = c;
+			else
+				jp->key_len = JSON_PATH_KEY_LEN + 1;
+			break;
+		case JP_COLON:
+			if(c == ':'){
+				emit(jp, c);
+				jp->state = JP_VALUE;
+			}
+			break;
+		case JP_STRING:
+			emit(jp, c);
+			if(c == '\\')
+				jp->state = JP_STRING_ESC;
+			else if(c == '"')
+				value_end(jp);
+			break;
+		case JP_STRING_ESC:
+			emit(jp, c);
+			jp->state = JP_STRING;
+			break;
+		case JP_LITERAL:
+			if(!space && c != ',' && c != '}' && c != ']'){
+				emit(jp, c);
+				break;
+			}
+			value_end(jp);
+			if(jp->state == JP_END || space)
+				break;
+			/* fall through, c follows the literal */
+		case JP_AFTER:
+			if(c == ','){
+				emit(jp, c);
+				if(JP_IS_ARRAY(jp, jp->depth - 1)){
+					jp->index[jp->depth - 1]++;
+					jp->state = JP_VALUE;
+				} else {
+					jp->state = JP_KEY_START;
+				}
+			} else if(c == '}' || c == ']'){
+				json_close(jp, c);
+			}
+			break;
+		}
+	}
+}
+
+BOOL ICACHE_FLASH_ATTR
+JSONPATH_Done(JSON_PATH *jp)
+{
+	return jp->state == JP_END || (jp->n && jp->found == (1 << jp->n) - 1);
+}
@@ -9,8 +9,284 @@
 #include "osapi.h"
 #include "mem.h"
 #include "debug.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pool.h"
+#include "mqtt5.h"
+#include "edge_filter.h"
+#include "aggregate.h"
+#include "user_config.h"
+
+/* a client and its callbacks in one pool block */
+typedef struct {
+	MQTT_Client client;
+	MQTT_CALLBACK callback;
+} MQTT_SLOT;
+
+POOL_DEFINE(mqttPool, sizeof(MQTT_SLOT), POOL_MQTT_CLIENTS);
+
 uint32_t connectedCb = 0, disconnectCb = 0, publishedCb = 0, dataCb = 0;
 
+/*
+ * After the outbound queue grew or shrank: the event when it crosses the
+ * high watermark, and again once it drained to the low one. Args: 1 above
+ * high or 0 back at low, bytes queued, queue size.
+ */
+static void ICACHE_FLASH_ATTR
+mqtt_queue_check(MQTT_Client *client)
+{
+	MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
+	uint32_t used = client->msgQueue.rb.fill_cnt, size = client->msgQueue.rb.size, full;
+	uint16_t crc;
+
+	metrics_set(METRIC_MQTT_QUEUE, used);
+	if(used > g_metrics[METRIC_MQTT_QUEUE_PEAK])
+		metrics_set(METRIC_MQTT_QUEUE_PEAK, used);
+	if(!cb->queueFull && used >= cb->queueHigh)
+		metrics_inc(METRIC_MQTT_QUEUE_HIGH);
+	else if(!(cb->queueFull && used <= cb->queueLow))
+		return;
+	cb->queueFull = !cb->queueFull;
+	if(cb->queueCb == 0)
+		return;
+	full = cb->queueFull;
+	crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->queueCb, 0, 3);
+	crc = CMD_ResponseBody(crc, (uint8_t*)&full, 4);
+	crc = CMD_ResponseBody(crc, (uint8_t*)&used, 4);
+	crc = CMD_ResponseBody(crc, (uint8_t*)&size, 4);
+	CMD_ResponseEnd(crc);
+}
+
+/* a SUBACK (with its return codes) or UNSUBACK (codes NULL) came in; refused is 0x80 and up */
+static void ICACHE_FLASH_ATTR
+mqtt_sub_ack(MQTT_CALLBACK *cb, uint16_t id, const uint8_t *codes, uint16_t n)
+{
+	uint16_t crc, i, granted = 0;
+
+	if(cb->subTag == 0 || id != cb->subId)
+		return;
+	if(codes == NULL){
+		CMD_Complete(cb->subCmd, cb->subTag, cb->subTopics);
+	} else {
+		for(i = 0; i < n; i++)
+			if(codes[i] < 0x80)
+				granted++;
+		crc = CMD_ResponseStart(cb->subCmd, cb->subTag, granted, 1);
+		crc = CMD_ResponseBody(crc, (uint8_t*)codes, n);
+		CMD_ResponseEnd(crc);
+	}
+	cb->subTag = 0;
+}
+
+/* the body of a SUBACK or UNSUBACK: packet id, then the return codes */
+static void ICACHE_FLASH_ATTR
+mqtt_ack_body(MQTT_CALLBACK *cb, uint8_t type, const uint8_t *p, uint32_t rl)
+{
+	if(rl < 2)
+		return;
+	if(type == MQTT_MSG_TYPE_SUBACK)
+		mqtt_sub_ack(cb, p[0] << 8 | p[1], p + 2, rl - 2);
+	else
+		mqtt_sub_ack(cb, p[0] << 8 | p[1], NULL, 0);
+}
+
+/*
+ * Runs ahead of the library's receive callback, which drops SUBACK and
+ * UNSUBACK, to answer the batch they acknowledge. It follows every packet
+ * of the stream: a fixed header cut by the end of a segment is carried
+ * into the next, the rest of a packet is skipped there, and an ack cut
+ * in two is gathered first.
+ */
+static void ICACHE_FLASH_ATTR
+mqtt_recv(void *arg, char *pdata, unsigned short len)
+{
+	struct espconn *pCon = (struct espconn*)arg;
+	MQTT_Client *client = (MQTT_Client*)pCon->reverse;
+	MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
+	uint8_t *p = (uint8_t*)pdata, type;
+	uint32_t at = 0, i, n, rl, mul;
+
+	while(at < len){
+		if(cb->rxSkip){
+			n = cb->rxSkip < len - at ? cb->rxSkip : len - at;
+			if(cb->rxAck)
+				os_memcpy(cb->rxAck + cb->rxAckLen - cb->rxSkip, p + at, n);
+			cb->rxSkip -= n;
+			at += n;
+			if(cb->rxSkip == 0 && cb->rxAck){
+				mqtt_ack_body(cb, cb->rxAckType, cb->rxAck, cb->rxAckLen);
+				os_free(cb->rxAck);
+				cb->rxAck = NULL;
+			}
+			continue;
+		}
+		/* fixed header: type and flags, then up to 4 bytes of remaining length */
+		cb->rxHead[cb->rxHeadLen++] = p[at++];
+		if(cb->rxHeadLen == 1 ||
+				((cb->rxHead[cb->rxHeadLen - 1] & 0x80) && cb->rxHeadLen < sizeof(cb->rxHead)))
+			continue;
+		rl = 0;
+		for(i = 1, mul = 1; i < cb->rxHeadLen; i++, mul *= 128)
+			rl += (cb->rxHead[i] & 0x7F) * mul;
+		type = cb->rxHead[0] >> 4;
+		cb->rxHeadLen = 0;
+		if(type != MQTT_MSG_TYPE_SUBACK && type != MQTT_MSG_TYPE_UNSUBACK){
+			cb->rxSkip = rl;
+			continue;
+		}
+		if(rl <= len - at){
+			mqtt_ack_body(cb, type, p + at, rl);
+			at += rl;
+			continue;
+		}
+		/* the rest is in the next segment */
+		if(rl <= client->mqtt_state.in_buffer_length)
+			cb->rxAck = (uint8_t*)os_malloc(rl);
+		if(cb->rxAck == NULL)
+			INFO("MQTT: %d byte ack dropped\r\n", rl);
+		cb->rxAckType = type;
+		cb->rxAckLen = rl;
+		cb->rxSkip = rl;
+	}
+	cb->libRecv(arg, pdata, len);
+}
+
+/* MQTT 5 clients get their acks from user/mqtt5.c instead of mqtt_recv() */
+static void ICACHE_FLASH_ATTR
+mqtt_ack5(MQTT_Client *client, uint8_t type, uint16_t id, const uint8_t *codes, uint16_t n)
+{
+	mqtt_sub_ack((MQTT_CALLBACK*)client->user_data, id, type == MQTT_MSG_TYPE_SUBACK ? codes : NULL, n);
+}
+
+/*
+ * The subscription table: what MQTT_SUBSCRIBE and the batches subscribed
+ * to, as SUBSCRIBE payload entries (topic length, topic, qos), so it goes
+ * back to the broker as one packet after a reconnect.
+ */
+static uint8_t* ICACHE_FLASH_ATTR
+mqtt_subs_find(MQTT_CALLBACK *cb, const uint8_t *topic, uint16_t len)
+{
+	uint16_t at = 0, n;
+
+	while(at < cb->subsLen){
+		n = cb->subs[at] << 8 | cb->subs[at + 1];
+		if(n == len && os_memcmp(cb->subs + at + 2, topic, len) == 0)
+			return cb->subs + at;
+		at += 3 + n;
+	}
+	return NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+mqtt_subs_add(MQTT_Client *client, const uint8_t *topic, uint16_t len, uint8_t qos)
+{
+	MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
+	uint8_t *e = mqtt_subs_find(cb, topic, len), *subs;
+
+	if(e){
+		e[2 + len] = qos;
+		return;
+	}
+	/* all of it has to fit the one SUBSCRIBE that restores it */
+	if(MQTTAPP_SUB_HEAD + cb->subsLen + 3 + len > client->mqtt_state.out_buffer_length){
+		INFO("MQTT: subscription table full, not restoring %d byte topic\r\n", len);
+		return;
+	}
+	subs = (uint8_t*)os_malloc(cb->subsLen + 3 + len);
+	if(subs == NULL)
+		return;
+	if(cb->subs){
+		os_memcpy(subs, cb->subs, cb->subsLen);
+		os_free(cb->subs);
+	}
+	e = subs + cb->subsLen;
+	e[0] = len >> 8;
+	e[1] = len;
+	os_memcpy(e + 2, topic, len);
+	e[2 + len] = qos;
+	cb->subs = subs;
+	cb->subsLen += 3 + len;
+}
+
+static void ICACHE_FLASH_ATTR
+mqtt_subs_remove(MQTT_CALLBACK *cb, const uint8_t *topic, uint16_t len)
+{
+	uint8_t *e = mqtt_subs_find(cb, topic, len);
+
+	if(e == NULL)
+		return;
+	os_memmove(e, e + 3 + len, cb->subs + cb->subsLen - e - 3 - len);
+	cb->subsLen -= 3 + len;
+	if(cb->subsLen == 0){
+		os_free(cb->subs);
+		cb->subs = NULL;
+	}
+}
+
+/*
+ * Frames the topic list that follows MQTTAPP_SUB_HEAD bytes of room in
+ * buf as a SUBSCRIBE or UNSUBSCRIBE and queues it. Returns the packet
+ * id, 0 when the queue is full.
+ */
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_sub_queue(MQTT_Client *client, uint8_t type, uint8_t *buf, uint16_t len)
+{
+	uint16_t id, n;
+	uint8_t *p = buf + MQTTAPP_SUB_HEAD;
+
+	id = ++client->mqtt_state.mqtt_connection.message_id;
+	if(id == 0)
+		id = ++client->mqtt_state.mqtt_connection.message_id;
+	/* backwards from the topics: MQTT 5 properties (none), packet id, fixed header */
+	if(mqtt5_get(client))
+		*--p = 0;
+	*--p = id;
+	*--p = id >> 8;
+	/* the remaining length takes 2 bytes below 16K */
+	n = buf + MQTTAPP_SUB_HEAD + len - p;
+	if(n < 128){
+		*--p = n;
+	} else {
+		*--p = n >> 7;
+		*--p = (n & 0x7F) | 0x80;
+	}
+	*--p = type << 4 | 2;	/* qos 1, as the spec wants */
+	if(QUEUE_Puts(&client->msgQueue, p, buf + MQTTAPP_SUB_HEAD + len - p) == -1){
+		INFO("MQTT: queue full\r\n");
+		return 0;
+	}
+	mqtt5_kick(client);
+	mqtt_queue_check(client);
+	return id;
+}
+
+/*
+ * After a connect: the table in one SUBSCRIBE, unless the broker kept the
+ * session. Only MQTT 5 and PROTOCOL_NAMEv311 tell, a 3.1 client with clean
+ * session off gets the SUBSCRIBE on every connect all the same.
+ */
+static void ICACHE_FLASH_ATTR
+mqtt_subs_restore(MQTT_Client *client)
+{
+	MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
+	uint8_t *buf;
+
+	if(cb->subsLen == 0)
+		return;
+	if(mqtt5_session_present(client)){
+		INFO("MQTT: session present, subscriptions kept\r\n");
+		metrics_inc(METRIC_MQTT_SESSION_KEPT);
+		return;
+	}
+	buf = (uint8_t*)os_malloc(MQTTAPP_SUB_HEAD + cb->subsLen);
+	if(buf == NULL)
+		return;
+	os_memcpy(buf + MQTTAPP_SUB_HEAD, cb->subs, cb->subsLen);
+	if(mqtt_sub_queue(client, MQTT_MSG_TYPE_SUBSCRIBE, buf, cb->subsLen))
+		metrics_inc(METRIC_MQTT_RESUBSCRIBE);
+	os_free(buf);
+}
+
 void mqttConnectedCb(uint32_t *args)
 {
     MQTT_Client* client = (MQTT_Client*)args;
@@ -21,8 +297,25 @@ void mqttConnectedCb(uint32_t *args)
     			callback->disconnectedCb,
     			callback->publishedCb,
     			callback->dataCb);
+    /* every connect makes a new connection, put mqtt_recv in front of it */
+    if(mqtt5_get(client) == NULL && client->pCon->recv_callback != mqtt_recv){
+    	callback->libRecv = client->pCon->recv_callback;
+    	callback->rxSkip = 0;
+    	callback->rxHeadLen = 0;
+    	if(callback->rxAck)
+    		os_free(callback->rxAck);
+    	callback->rxAck = NULL;
+    	espconn_regist_recvcb(client->pCon, mqtt_recv);
+    }
+    /* before the event, so what the MCU publishes next finds them in place */
+    mqtt_subs_restore(client);
+    aggregate_flush(client);
     uint16_t crc = CMD_ResponseStart(CMD_MQTT_EVENTS, callback->connectedCb, 0, 0);
     CMD_ResponseEnd(crc);
+    if(callback->connectTag){
+    	CMD_Complete(CMD_MQTT_CONNECT, callback->connectTag, 1);
+    	callback->connectTag = 0;
+    }
 }
 
 void mqttDisconnectedCb(uint32_t *args)
@@ -30,8 +323,18 @@ void mqttDisconnectedCb(uint32_t *args)
     MQTT_Client* client = (MQTT_Client*)args;
     MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
     INFO("MQTT: Disconnected\r\n");
-    uint16_t crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->disconnectedCb, 0, 0);
+    /* MQTT 5: the reason of a refused connect or the broker's DISCONNECT */
+    uint16_t crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->disconnectedCb, mqtt5_reason(client), 0);
 	CMD_ResponseEnd(crc);
+    if(cb->connectTag){
+    	CMD_Complete(CMD_MQTT_CONNECT, cb->connectTag, 0);
+    	cb->connectTag = 0;
+    }
+    /* its ack is not coming on this connection */
+    if(cb->subTag){
+    	CMD_Complete(cb->subCmd, cb->subTag, 0);
+    	cb->subTag = 0;
+    }
 }
 
 void mqttPublishedCb(uint32_t *args)
@@ -39,60 +342,119 @@ void mqttPublishedCb(uint32_t *args)
     MQTT_Client* client = (MQTT_Client*)args;
     MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
     INFO("MQTT: Published\r\n");
-    uint16_t crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->publishedCb, 0, 0);
+    metrics_inc(METRIC_MQTT_PUB_ACK);
+    /* MQTT 5: the PUBACK reason code, 0x10 when nobody was subscribed */
+    uint16_t crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->publishedCb, mqtt5_reason(client), 0);
     CMD_ResponseEnd(crc);
+    /* sent, so out of the queue */
+    mqtt_queue_check(client);
 }
 
 void mqttDataCb(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t data_len)
 {
 	uint16_t crc = 0;
+	uint32_t at, len;
 
 
 	MQTT_Client* client = (MQTT_Client*)args;
 	MQTT_CALLBACK *cb = (MQTT_CALLBACK*)client->user_data;
 
-	crc = CMD_ResponseStart(CMD_MQTT_EVENTS, cb->dataCb, 0, 2);
-	crc = CMD_ResponseBody(crc, (uint8_t*)topic, topic_len);
-	crc = CMD_ResponseBody(crc, (uint8_t*)data, data_len);
-	CMD_ResponseEnd(crc);
+	metrics_inc(METRIC_MQTT_RECV);
+	TRACE(TRACE_MQTT_DATA, data_len);
+	if(cb->dataSize == 0 || data_len <= cb->dataSize){
+		crc = CMD_BulkStart(CMD_MQTT_EVENTS, cb->dataCb, 0, 2);
+		crc = CMD_ResponseBody(crc, (uint8_t*)topic, topic_len);
+		crc = CMD_ResponseBody(crc, (uint8_t*)data, data_len);
+		CMD_ResponseEnd(crc);
+		TRACE(TRACE_TX_DONE, CMD_MQTT_EVENTS);
+		return;
+	}
+
+	/* in pieces: the topic (first piece only), data, offset and total length */
+	for(at = 0; at < data_len; at += len){
+		len = data_len - at < cb->dataSize ? data_len - at : cb->dataSize;
+		crc = CMD_BulkStart(CMD_MQTT_EVENTS, cb->dataCb, 0, 4);
+		crc = CMD_ResponseBody(crc, (uint8_t*)topic, at ? 0 : topic_len);
+		crc = CMD_ResponseBody(crc, (uint8_t*)data + at, len);
+		crc = CMD_ResponseBody(crc, (uint8_t*)&at, 4);
+		crc = CMD_ResponseBody(crc, (uint8_t*)&data_len, 4);
+		CMD_ResponseEnd(crc);
+	}
+	TRACE(TRACE_TX_DONE, CMD_MQTT_EVENTS);
+}
 
+/*
+ * The in and out buffers of an MQTT 5 client at size, both or neither:
+ * the client keeps its MQTT_BUF_SIZE ones without the memory for them.
+ */
+static void ICACHE_FLASH_ATTR
+mqtt_buffers(MQTT_Client *client, uint32_t size)
+{
+	uint8_t *in, *out;
+
+	in = (uint8_t*)os_zalloc(size);
+	out = in ? (uint8_t*)os_zalloc(size) : NULL;
+	if(out == NULL){
+		INFO("MQTT: no memory for %d byte buffers\r\n", size);
+		if(in)
+			os_free(in);
+		return;
+	}
+	os_free(client->mqtt_state.in_buffer);
+	os_free(client->mqtt_state.out_buffer);
+	client->mqtt_state.in_buffer = in;
+	client->mqtt_state.in_buffer_length = size;
+	client->mqtt_state.out_buffer = out;
+	client->mqtt_state.out_buffer_length = size;
+	mqtt_msg_init(&client->mqtt_state.mqtt_connection, out, size);
 }
+
+/*
+ * Client id, user, password, keepalive, clean session and the four
+ * callbacks, then the outbound queue size and its watermark callback,
+ * then the protocol level, then the in and out buffer size. Returns the
+ * client handle, 0 on failure. A tagged request is answered with the
+ * handle and two args, the queue and buffer sizes in effect: the
+ * defaults when there is no memory for the sizes asked.
+ */
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Setup(PACKET_CMD *cmd)
 {
 	REQUEST req;
+	MQTT_SLOT *slot;
 	MQTT_Client *client;
-	uint8_t *client_id, *user_data, *pass_data;
-	uint16_t len;
-	uint32_t keepalive, clean_seasion, cb_data;
+	uint8_t *client_id, *user_data, *pass_data, *queue_buf;
+	uint16_t len, crc;
+	uint32_t keepalive, clean_seasion, cb_data, queue_size = 0, protocol = 0, buf_size = 0, tag;
 	MQTT_CALLBACK *callback;
 
 
 	CMD_Request(&req, cmd);
-	if(CMD_GetArgc(&req) != 9)
+	/* 11 with the outbound queue size and its watermark callback, 12 with the protocol level, 13 with the buffer size */
+	if(CMD_GetArgc(&req) != 9 && CMD_GetArgc(&req) != 11 && CMD_GetArgc(&req) != 12 && CMD_GetArgc(&req) != 13)
 		return 0;
 
-	client = (MQTT_Client*)os_zalloc(sizeof(MQTT_Client));
+	slot = (MQTT_SLOT*)POOL_Alloc(&mqttPool, sizeof(MQTT_SLOT));
 
-	if(client == NULL)
+	if(slot == NULL)
 		return 0;
 
-	os_memset(client, 0, sizeof(MQTT_Client));
+	client = &slot->client;
 
-	/*Get client id*/
+	/*Get client id, MQTT_InitClient keeps its own copies*/
 	len = CMD_ArgLen(&req);
-	client_id = (uint8_t*)os_zalloc(len + 1);
+	client_id = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, client_id);
 	client_id[len] = 0;
 
 	/*Get username*/
 	len = CMD_ArgLen(&req);
-	user_data = (uint8_t*)os_zalloc(len + 1);
+	user_data = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, user_data);
 	user_data[len] = 0;
 
 	/*Get password*/
 	len = CMD_ArgLen(&req);
-	pass_data = (uint8_t*)os_zalloc(len + 1);
+	pass_data = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, pass_data);
 	pass_data[len] = 0;
 
@@ -104,7 +466,7 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Setup(PACKET_CMD *cmd)
 	INFO("MQTT: clientid = %s, user = %s, pass = %s, keepalive = %d, session = %d\r\n", client_id, user_data, pass_data, keepalive, clean_seasion);
 	MQTT_InitClient(client, client_id, user_data, pass_data, keepalive, clean_seasion);
 
-	callback = (MQTT_CALLBACK*)os_zalloc(sizeof(MQTT_CALLBACK));
+	callback = &slot->callback;
 
 
 	CMD_PopArgs(&req, (uint8_t*)&cb_data);
@@ -115,6 +477,50 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Setup(PACKET_CMD *cmd)
 	callback->publishedCb = cb_data;
 	CMD_PopArgs(&req, (uint8_t*)&cb_data);
 	callback->dataCb = cb_data;
+	if(CMD_GetArgc(&req) >= 11){
+		CMD_PopArgs(&req, (uint8_t*)&queue_size);
+		CMD_PopArgs(&req, (uint8_t*)&cb_data);
+		callback->queueCb = cb_data;
+	}
+	if(CMD_GetArgc(&req) >= 12)
+		CMD_PopArgs(&req, (uint8_t*)&protocol);
+	if(CMD_GetArgc(&req) == 13)
+		CMD_PopArgs(&req, (uint8_t*)&buf_size);
+	/* 5 for MQTT 5, anything else is the library's PROTOCOL_NAMEv31 */
+	if(protocol == 5 && mqtt5_init(client, mqtt_ack5) != 0)
+		INFO("MQTT: no memory for MQTT 5, staying on 3.1\r\n");
+#ifndef PROTOCOL_NAMEv311
+	if(!client->connect_info.clean_session && mqtt5_get(client) == NULL)
+		INFO("MQTT: 3.1 has no session present, subscriptions go out on every connect\r\n");
+#endif
+	if(buf_size > MQTT_BUF_SIZE){
+		if(buf_size > MQTTAPP_BUF_MAX)
+			buf_size = MQTTAPP_BUF_MAX;
+		if(mqtt5_get(client))
+			mqtt_buffers(client, buf_size);
+		else
+			INFO("MQTT: 3.1 stays at %d byte packets\r\n", MQTT_BUF_SIZE);
+	}
+	buf_size = client->mqtt_state.out_buffer_length;
+	/* a bigger buffer takes a bigger queue than the default */
+	if(queue_size || client->msgQueue.rb.size < 2 * buf_size){
+		if(queue_size < 2 * buf_size)
+			queue_size = 2 * buf_size;
+		if(queue_size > MQTTAPP_QUEUE_MAX)
+			queue_size = MQTTAPP_QUEUE_MAX;
+		/* MQTT_InitClient made the default one, which stays without memory for this */
+		queue_buf = (uint8_t*)os_zalloc(queue_size);
+		if(queue_buf == NULL){
+			INFO("MQTT: no memory for a %d byte queue\r\n", queue_size);
+		} else {
+			os_free(client->msgQueue.buf);
+			client->msgQueue.buf = queue_buf;
+			RINGBUF_Init(&client->msgQueue.rb, queue_buf, queue_size);
+		}
+	}
+	queue_size = client->msgQueue.rb.size;
+	callback->queueHigh = queue_size * MQTTAPP_QUEUE_HIGH / 100;
+	callback->queueLow = queue_size * MQTTAPP_QUEUE_LOW / 100;
 
 
 	client->user_data = callback;
@@ -124,10 +530,14 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Setup(PACKET_CMD *cmd)
 	client->publishedCb = mqttPublishedCb;
 	client->dataCb = mqttDataCb;
 
-	os_free(client_id);
-	os_free(user_data);
-	os_free(pass_data);
-
+	/* a tagged request learns the sizes in effect along with the handle */
+	tag = CMD_Defer(cmd);
+	if(tag){
+		crc = CMD_ResponseStart(CMD_MQTT_SETUP, tag, (uint32_t)client, 2);
+		crc = CMD_ResponseBody(crc, (uint8_t*)&queue_size, 4);
+		crc = CMD_ResponseBody(crc, (uint8_t*)&buf_size, 4);
+		CMD_ResponseEnd(crc);
+	}
 	return (uint32_t)client;
 }
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Lwt(PACKET_CMD *cmd)
@@ -147,18 +557,16 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Lwt(PACKET_CMD *cmd)
 	INFO("MQTT: lwt client addr = %d\r\n", client_ptr);
 
 	/*Get topic*/
-	if(client->connect_info.will_topic)
-		os_free(client->connect_info.will_topic);
+	POOL_Free(&strPool, client->connect_info.will_topic);
 	len = CMD_ArgLen(&req);
-	client->connect_info.will_topic = (uint8_t*)os_zalloc(len + 1);
+	client->connect_info.will_topic = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 	CMD_PopArgs(&req, client->connect_info.will_topic);
 	client->connect_info.will_topic[len] = 0;
 
 	/*Get message*/
-	if(client->connect_info.will_message)
-		os_free(client->connect_info.will_message);
+	POOL_Free(&strPool, client->connect_info.will_message);
 	len = CMD_ArgLen(&req);
-	client->connect_info.will_message = (uint8_t*)os_zalloc(len + 1);
+	client->connect_info.will_message = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 	CMD_PopArgs(&req, client->connect_info.will_message);
 	client->connect_info.will_message[len] = 0;
 
@@ -177,6 +585,8 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Lwt(PACKET_CMD *cmd)
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Connect(PACKET_CMD *cmd)
 {
 	MQTT_Client *client;
+	MQTT_CALLBACK *callback;
+	uint32_t client_ptr;
 	REQUEST req;
 	uint16_t len;
 	uint32_t security;
@@ -185,26 +595,33 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Connect(PACKET_CMD *cmd)
 	if(CMD_GetArgc(&req) != 4)
 		return 0;
 
-	CMD_PopArgs(&req, (uint8_t*)&client);
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
 
 	/*Get host name*/
 	len = CMD_ArgLen(&req);
 
-	if(client->host)
-		os_free(client->host);
-	client->host = (uint8_t*)os_zalloc(len + 1);
+	POOL_Free(&strPool, client->host);
+	client->host = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 	CMD_PopArgs(&req, client->host);
 	client->host[len] = 0;
 
 	CMD_PopArgs(&req, (uint8_t*)&client->port);
 	CMD_PopArgs(&req, (uint8_t*)&security);
 	client->security = security;
-	MQTT_Connect(client);
+
+	/* a tagged request is answered once the broker accepts the client */
+	callback = (MQTT_CALLBACK*)client->user_data;
+	if(callback->connectTag)
+		CMD_Complete(CMD_MQTT_CONNECT, callback->connectTag, 0);
+	callback->connectTag = CMD_Defer(cmd);
+	mqtt5_connect(client);
 	return 1;
 }
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Disconnect(PACKET_CMD *cmd)
 {
 	MQTT_Client *client;
+	uint32_t client_ptr;
 	REQUEST req;
 	uint16_t len;
 
@@ -212,15 +629,17 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Disconnect(PACKET_CMD *cmd)
 	CMD_Request(&req, cmd);
 	if(CMD_GetArgc(&req) != 1)
 		return 0;
-	CMD_PopArgs(&req, (uint8_t*)&client);
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
 
-	MQTT_Disconnect(client);
+	mqtt5_disconnect(client);
 	return 1;
 }
 
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Publish(PACKET_CMD *cmd)
 {
 	MQTT_Client *client;
+	uint32_t client_ptr;
 	REQUEST req;
 	uint16_t len;
 	uint8_t *topic, *data;
@@ -229,12 +648,13 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Publish(PACKET_CMD *cmd)
 	CMD_Request(&req, cmd);
 	if(CMD_GetArgc(&req) != 6)
 		return 0;
-	CMD_PopArgs(&req, (uint8_t*)&client);
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
 
 	/*Get topic*/
 	len = CMD_ArgLen(&req);
 
-	topic = (uint8_t*)os_zalloc(len + 1);
+	topic = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, topic);
 	topic[len] = 0;
 
@@ -242,7 +662,7 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Publish(PACKET_CMD *cmd)
 	/*Get data*/
 	len = CMD_ArgLen(&req);
 
-	data = (uint8_t*)os_zalloc(len);
+	data = (uint8_t*)ARENA_Alloc(len);
 	CMD_PopArgs(&req, data);
 
 	/*Get data length*/
@@ -251,15 +671,23 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Publish(PACKET_CMD *cmd)
 	CMD_PopArgs(&req, (uint8_t*)&qos);
 	CMD_PopArgs(&req, (uint8_t*)&retain);
 
-	MQTT_Publish(client, topic, data, data_len, qos, retain);
-	os_free(topic);
-	os_free(data);
+	/* taken into a series or dropped by a rule: nothing to publish, and no published event */
+	if(aggregate_add(client, (char*)topic, (char*)data, data_len, qos, retain) ||
+			!edge_filter_pass((char*)topic, (char*)data, data_len))
+		return 1;
+	if(mqtt5_publish(client, topic, data, data_len, qos, retain))
+		metrics_inc(METRIC_MQTT_PUB);
+	else
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+	TRACE(TRACE_PUB_QUEUED, data_len);
+	mqtt_queue_check(client);
 	return 1;
 
 }
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Subscribe(PACKET_CMD *cmd)
 {
 	MQTT_Client *client;
+	uint32_t client_ptr;
 	REQUEST req;
 	uint16_t len;
 	uint8_t *topic;
@@ -268,19 +696,326 @@ uint32_t ICACHE_FLASH_ATTR MQTTAPP_Subscribe(PACKET_CMD *cmd)
 	CMD_Request(&req, cmd);
 	if(CMD_GetArgc(&req) != 3)
 		return 0;
-	CMD_PopArgs(&req, (uint8_t*)&client);
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
 
 	/*Get topic*/
 	len = CMD_ArgLen(&req);
 
-	topic = (uint8_t*)os_zalloc(len + 1);
+	topic = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, topic);
 	topic[len] = 0;
 	CMD_PopArgs(&req, (uint8_t*)&qos);
 
 	INFO("MQTT: topic = %s, qos = %d \r\n", topic, qos);
-	MQTT_Subscribe(client, topic, qos);
-	os_free(topic);
+	if(mqtt5_subscribe(client, (char*)topic, qos))
+		mqtt_subs_add(client, topic, os_strlen((char*)topic), qos);
+	mqtt_queue_check(client);
 	return 1;
 }
 
+static void ICACHE_FLASH_ATTR
+mqtt_pub_drop(MQTT_CALLBACK *cb)
+{
+	if(cb->pubBuf)
+		os_free(cb->pubBuf);
+	cb->pubBuf = NULL;
+}
+
+/*
+ * A publish too big for one frame, or for the MCU to build in one go:
+ * client, topic, payload length, qos and retain. MQTT_PUB_PART sends the
+ * payload after it. Returns 1, or 0 when it would not fit the client's
+ * out buffer.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_PubStart(PACKET_CMD *cmd)
+{
+	MQTT_Client *client;
+	MQTT_CALLBACK *cb;
+	uint32_t client_ptr, data_len, qos, retain, size;
+	REQUEST req;
+	uint16_t len;
+	uint8_t *topic;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 5)
+		return 0;
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
+	cb = (MQTT_CALLBACK*)client->user_data;
+
+	len = CMD_ArgLen(&req);
+	topic = (uint8_t*)ARENA_Alloc(len + 1);
+	if(topic == NULL)
+		return 0;
+	CMD_PopArgs(&req, topic);
+	topic[len] = 0;
+	len = os_strlen((char*)topic);	/* without the padding */
+	CMD_PopArgs(&req, (uint8_t*)&data_len);
+	CMD_PopArgs(&req, (uint8_t*)&qos);
+	CMD_PopArgs(&req, (uint8_t*)&retain);
+
+	/* one publish at a time per client, a new start drops the last */
+	mqtt_pub_drop(cb);
+	size = client->mqtt_state.out_buffer_length;
+	if(data_len > size || len + data_len + MQTTAPP_PUB_OVERHEAD +
+			(mqtt5_get(client) ? MQTT5_PUB_PROPS : 0) > size){
+		INFO("MQTT: publish of %d on %s too big\r\n", data_len, topic);
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+		return 0;
+	}
+	cb->pubBuf = (uint8_t*)os_malloc(len + 1 + data_len);
+	if(cb->pubBuf == NULL){
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+		return 0;
+	}
+	os_memcpy(cb->pubBuf, topic, len + 1);
+	cb->pubTopicLen = len;
+	cb->pubLen = data_len;
+	cb->pubAt = 0;
+	cb->pubQos = qos;
+	cb->pubRetain = retain;
+	return 1;
+}
+
+/*
+ * Client, offset, data and its length. Parts come in order; the one that
+ * completes the payload publishes it. Returns the payload bytes in so
+ * far, 0 when the part does not follow on (the publish is dropped) or
+ * the message could not be queued.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_PubPart(PACKET_CMD *cmd)
+{
+	MQTT_Client *client;
+	MQTT_CALLBACK *cb;
+	uint32_t client_ptr, offset, data_len;
+	REQUEST req;
+	uint16_t len;
+	uint8_t *data;
+	BOOL ok;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 4)
+		return 0;
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
+	cb = (MQTT_CALLBACK*)client->user_data;
+	CMD_PopArgs(&req, (uint8_t*)&offset);
+
+	len = CMD_ArgLen(&req);
+	data = (uint8_t*)ARENA_Alloc(len);
+	if(data == NULL)
+		return 0;
+	CMD_PopArgs(&req, data);
+	CMD_PopArgs(&req, (uint8_t*)&data_len);
+
+	if(cb->pubBuf == NULL)
+		return 0;
+	if(offset != cb->pubAt || data_len > len || data_len > cb->pubLen - cb->pubAt){
+		INFO("MQTT: publish part at %d, expected %d\r\n", offset, cb->pubAt);
+		mqtt_pub_drop(cb);
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+		return 0;
+	}
+	os_memcpy(cb->pubBuf + cb->pubTopicLen + 1 + cb->pubAt, data, data_len);
+	cb->pubAt += data_len;
+	if(cb->pubAt < cb->pubLen)
+		return cb->pubAt;
+
+	if(aggregate_add(client, (char*)cb->pubBuf, (char*)cb->pubBuf + cb->pubTopicLen + 1, cb->pubLen,
+			cb->pubQos, cb->pubRetain) ||
+			!edge_filter_pass((char*)cb->pubBuf, (char*)cb->pubBuf + cb->pubTopicLen + 1, cb->pubLen)){
+		mqtt_pub_drop(cb);
+		return cb->pubLen;
+	}
+	ok = mqtt5_publish(client, (char*)cb->pubBuf, (char*)cb->pubBuf + cb->pubTopicLen + 1,
+			cb->pubLen, cb->pubQos, cb->pubRetain);
+	metrics_inc(ok ? METRIC_MQTT_PUB : METRIC_MQTT_PUB_FAIL);
+	TRACE(TRACE_PUB_QUEUED, cb->pubLen);
+	mqtt_pub_drop(cb);
+	mqtt_queue_check(client);
+	return ok ? cb->pubLen : 0;
+}
+
+/*
+ * Client and the largest data event the MCU takes: bigger messages come
+ * as several events with the offset and total length, 0 sends them
+ * whole. Returns the size in effect, a multiple of 4.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_DataSize(PACKET_CMD *cmd)
+{
+	MQTT_Client *client;
+	MQTT_CALLBACK *cb;
+	uint32_t client_ptr, size;
+	REQUEST req;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 2)
+		return 0;
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
+	cb = (MQTT_CALLBACK*)client->user_data;
+	CMD_PopArgs(&req, (uint8_t*)&size);
+
+	if(size > client->mqtt_state.in_buffer_length)
+		size = client->mqtt_state.in_buffer_length;
+	if(size && size < CMD_TX_FRAG_MIN)
+		size = CMD_TX_FRAG_MIN;
+	cb->dataSize = size & ~3;
+	INFO("MQTT: data events of %d\r\n", cb->dataSize);
+	return cb->dataSize;
+}
+
+/* one SUBSCRIBE or UNSUBSCRIBE for every topic of the request */
+static uint32_t ICACHE_FLASH_ATTR
+mqtt_batch(PACKET_CMD *cmd, uint16_t name)
+{
+	MQTT_Client *client;
+	MQTT_CALLBACK *cb;
+	uint32_t client_ptr, qos, argc, size;
+	REQUEST req;
+	uint16_t len, at, id, i, topics;
+	uint8_t *buf, per = name == CMD_MQTT_SUB_BATCH ? 2 : 1;
+
+	CMD_Request(&req, cmd);
+	argc = CMD_GetArgc(&req);
+	if(argc < 1u + per || (argc - 1) % per)
+		return 0;
+	topics = (argc - 1) / per;
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (MQTT_Client*)client_ptr;
+	cb = (MQTT_CALLBACK*)client->user_data;
+
+	size = client->mqtt_state.out_buffer_length;
+	buf = (uint8_t*)os_malloc(size);
+	if(buf == NULL)
+		return 0;
+	at = MQTTAPP_SUB_HEAD;
+	for(i = 0; i < topics; i++){
+		len = CMD_ArgLen(&req);
+		if(at + 2 + len + 1 > size){
+			INFO("MQTT: %d topics do not fit one packet\r\n", topics);
+			os_free(buf);
+			return 0;
+		}
+		CMD_PopArgs(&req, buf + at + 2);
+		while(len && buf[at + 1 + len] == 0)
+			len--;		/* the padding */
+		buf[at] = len >> 8;
+		buf[at + 1] = len;
+		at += 2 + len;
+		if(per == 2){
+			CMD_PopArgs(&req, (uint8_t*)&qos);
+			buf[at++] = qos;
+		}
+	}
+	id = mqtt_sub_queue(client, per == 2 ? MQTT_MSG_TYPE_SUBSCRIBE : MQTT_MSG_TYPE_UNSUBSCRIBE,
+			buf, at - MQTTAPP_SUB_HEAD);
+	if(id == 0){
+		os_free(buf);
+		return 0;
+	}
+	/* the table follows what went to the broker */
+	for(at = MQTTAPP_SUB_HEAD, i = 0; i < topics; i++){
+		len = buf[at] << 8 | buf[at + 1];
+		if(per == 2)
+			mqtt_subs_add(client, buf + at + 2, len, buf[at + 2 + len]);
+		else
+			mqtt_subs_remove(cb, buf + at + 2, len);
+		at += 2 + len + per - 1;
+	}
+	os_free(buf);
+	INFO("MQTT: %d topics in packet %d\r\n", topics, id);
+
+	/* one batch waits for its ack at a time, an earlier one is not coming back */
+	if(cb->subTag)
+		CMD_Complete(cb->subCmd, cb->subTag, 0);
+	cb->subTag = CMD_Defer(cmd);
+	cb->subId = id;
+	cb->subCmd = name;
+	cb->subTopics = topics;
+	return topics;
+}
+
+/*
+ * Client, then topic and qos pairs, in one SUBSCRIBE. A tagged request is
+ * answered on the SUBACK with the number of topics granted and one arg of
+ * the return codes, 0x80 (or another MQTT 5 reason from 0x80 up) for a
+ * refused topic. Otherwise returns the
+ * number of topics sent; 0 when they do not fit one packet or the queue.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_SubBatch(PACKET_CMD *cmd)
+{
+	return mqtt_batch(cmd, CMD_MQTT_SUB_BATCH);
+}
+
+/* Client and topics in one UNSUBSCRIBE, answered the same on the UNSUBACK, without codes */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_UnsubBatch(PACKET_CMD *cmd)
+{
+	return mqtt_batch(cmd, CMD_MQTT_UNSUB_BATCH);
+}
+
+/*
+ * Topic, deadband (thousandths), min interval and heartbeat in ms, and
+ * EDGE_FILTER_ flags: the edge filter rule for publishes to the topic,
+ * from any client. All four 0 removes it. Returns 1, 0 when the rule
+ * table is full. With the topic alone, returns the publishes the rule
+ * suppressed so far.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_Filter(PACKET_CMD *cmd)
+{
+	const struct edge_filter_s *rule;
+	REQUEST req;
+	uint16_t len, argc;
+	uint8_t *topic;
+	uint32_t deadband = 0, min_ms = 0, heartbeat_ms = 0, flags = 0;
+
+	CMD_Request(&req, cmd);
+	argc = CMD_GetArgc(&req);
+	if(argc != 1 && argc != 5)
+		return 0;
+
+	len = CMD_ArgLen(&req);
+	topic = (uint8_t*)ARENA_Alloc(len + 1);
+	if(topic == NULL)
+		return 0;
+	CMD_PopArgs(&req, topic);
+	topic[len] = 0;
+
+	if(argc == 1){
+		rule = edge_filter_get((char*)topic);
+		return rule ? rule->suppressed : 0;
+	}
+	CMD_PopArgs(&req, (uint8_t*)&deadband);
+	CMD_PopArgs(&req, (uint8_t*)&min_ms);
+	CMD_PopArgs(&req, (uint8_t*)&heartbeat_ms);
+	CMD_PopArgs(&req, (uint8_t*)&flags);
+	return edge_filter_set((char*)topic, deadband, min_ms, heartbeat_ms, flags) == 0;
+}
+
+/*
+ * Topic and window in ms: publishes of numbers to the topic, from any
+ * client, are aggregated and one summary record goes out per window.
+ * A window of 0 publishes what is pending and stops. Returns 1, 0 when
+ * all series are taken.
+ */
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_Aggregate(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	uint16_t len;
+	uint8_t *topic;
+	uint32_t window_ms;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 2)
+		return 0;
+
+	len = CMD_ArgLen(&req);
+	topic = (uint8_t*)ARENA_Alloc(len + 1);
+	if(topic == NULL)
+		return 0;
+	CMD_PopArgs(&req, topic);
+	topic[len] = 0;
+	CMD_PopArgs(&req, (uint8_t*)&window_ms);
+	return aggregate_set((char*)topic, window_ms) == 0;
+}
@@ -15,12 +15,71 @@ typedef struct {
 	uint32_t disconnectedCb;
 	uint32_t publishedCb;
 	uint32_t dataCb;
+	uint32_t connectTag;	/* CMD_Defer tag of MQTT_CONNECT until connected */
+	uint32_t dataSize;	/* MQTT_DATA_SIZE, data events in pieces of this, 0 whole */
+	uint32_t queueCb;	/* outbound queue watermark events, 0 for none */
+	uint16_t queueHigh;	/* bytes queued that raise the event */
+	uint16_t queueLow;	/* and that clear it again */
+	uint8_t queueFull;	/* above high, not yet back to low */
+	/* the SUB/UNSUB batch waiting for its ack */
+	uint32_t subTag;	/* CMD_Defer tag, 0 for none */
+	uint16_t subId;		/* packet id */
+	uint16_t subCmd;	/* CMD_MQTT_SUB_BATCH or CMD_MQTT_UNSUB_BATCH */
+	uint16_t subTopics;
+	/* the library's receive callback, which mqtt_app.c runs behind its own */
+	espconn_recv_callback libRecv;
+	uint32_t rxSkip;	/* bytes of a packet the last TCP segment did not end */
+	uint8_t rxHead[5];	/* a fixed header it cut: type, up to 4 length bytes */
+	uint8_t rxHeadLen;
+	uint8_t rxAckType;	/* a SUBACK or UNSUBACK it cut, gathered in rxAck */
+	uint8_t *rxAck;
+	uint16_t rxAckLen;
+	/* subscriptions restored after a reconnect, see mqtt_subs_add() */
+	uint8_t *subs;
+	uint16_t subsLen;
+	/* the publish MQTT_PUB_START began, topic then payload */
+	uint8_t *pubBuf;
+	uint16_t pubTopicLen;
+	uint16_t pubLen;	/* of the payload */
+	uint16_t pubAt;		/* payload bytes in so far */
+	uint8_t pubQos;
+	uint8_t pubRetain;
 }MQTT_CALLBACK;
+
+/*
+ * MQTT_SETUP outbound queue size, QUEUE_BUFFER_SIZE by default. The queue
+ * holds messages SLIP escaped, watermarks are in percent of it. The least
+ * takes a packet of the client's buffer size with most of it escaped.
+ */
+#define MQTTAPP_QUEUE_MAX	16384
+#define MQTTAPP_QUEUE_HIGH	75
+#define MQTTAPP_QUEUE_LOW	25
+
+/*
+ * MQTT_SETUP in and out buffer size, the largest packet either way,
+ * MQTT_BUF_SIZE by default. Only an MQTT 5 client takes more: the library
+ * runs 3.1 clients and copies their packets through MQTT_BUF_SIZE buffers
+ * of its own.
+ */
+#define MQTTAPP_BUF_MAX		4096
+
+/* SUBSCRIBE and UNSUBSCRIBE fixed header, packet id and MQTT 5 properties */
+#define MQTTAPP_SUB_HEAD	6
+
+/* PUBLISH fixed header, topic length and packet id around topic and payload */
+#define MQTTAPP_PUB_OVERHEAD	9
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Connect(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Disconnect(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Setup(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Publish(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Subscribe(PACKET_CMD *cmd);
 uint32_t ICACHE_FLASH_ATTR MQTTAPP_Lwt(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_PubStart(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_PubPart(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_DataSize(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_SubBatch(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_UnsubBatch(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_Filter(PACKET_CMD *cmd);
+uint32_t ICACHE_FLASH_ATTR MQTTAPP_Aggregate(PACKET_CMD *cmd);
 
 #endif /* MODULES_MQTT_APP_H_ */
@@ -0,0 +1,578 @@
+/*
+ * ota.c
+ *
+ * Delta OTA. CMD_OTA names an HTTP host, port and path serving a delta
+ * made by tools/ota_diff.py against the running image. The body is
+ * streamed through the REST client and applied into the inactive slot
+ * a sector at a time, the running slot is the source of COPY and ADD.
+ *
+ * Delta layout, little endian:
+ *   header  "NDLT", u16 version, u16 flags, u32 old_size, u32 new_size,
+ *           old_md5[16], new_md5[16]
+ *   ops     OTA_OP_COPY u32 src, u32 len         new = old[src..]
+ *           OTA_OP_ADD  u32 src, u32 len, segs   new = old[src..] + diff
+ *           OTA_OP_DATA u32 len, len bytes       new = bytes
+ *           OTA_OP_END
+ *   an ADD segment is u8 skip, u8 cnt, cnt diff bytes: skip bytes are
+ *   taken unchanged, the cnt after them get a diff byte added. Images
+ *   linked for the other slot differ mostly by a constant in their
+ *   literal pools, which ADD turns into a byte or two per word.
+ *
+ * Nothing is written before the running image hashes to old_md5, and
+ * the boot flag is only flipped once the written slot reads back as
+ * new_md5. A failed or cut off update leaves the device as it was.
+ *
+ * Work is done from a timer, one flash sector per run, with the peer
+ * held off while the body ring is full.
+ */
+#include "user_interface.h"
+#include "osapi.h"
+#include "mem.h"
+#include "spi_flash.h"
+#include "upgrade.h"
+#include "user_config.h"
+#include "debug.h"
+#include "cmd.h"
+#include "rest.h"
+#include "pool.h"
+#include "ota.h"
+
+#ifdef NEURITE_OTA
+
+#define OTA_SECTOR		SPI_FLASH_SEC_SIZE
+#define OTA_RX_SIZE		4096		/* body ring */
+#define OTA_RX_HOLD		(OTA_RX_SIZE - 2 * 1460)	/* hold the peer past this */
+#define OTA_OLD_CACHE		64		/* bytes of the running image read at once */
+#define OTA_PROGRESS_SECTORS	16
+#define OTA_REBOOT_MS		500		/* lets the DONE event out */
+
+/* MD5 routines in ROM */
+struct MD5Context {
+	uint32_t buf[4];
+	uint32_t bits[2];
+	uint8_t in[64];
+};
+extern void MD5Init(struct MD5Context *ctx);
+extern void MD5Update(struct MD5Context *ctx, const void *buf, uint32_t len);
+extern void MD5Final(uint8_t digest[16], struct MD5Context *ctx);
+
+typedef enum {
+	OTA_ST_HEADER = 0,
+	OTA_ST_BASE,		/* hashing the running image */
+	OTA_ST_PATCH,
+	OTA_ST_VERIFY,		/* hashing the written slot */
+	OTA_ST_DONE,
+	OTA_ST_FAIL
+} OTA_STATE;
+
+typedef enum {
+	OTA_P_OP = 0,
+	OTA_P_ARGS,
+	OTA_P_DATA,
+	OTA_P_ADD_SKIP,
+	OTA_P_ADD_CNT,
+	OTA_P_ADD_BYTES,
+	OTA_P_END
+} OTA_PARSE;
+
+typedef struct {
+	REST_CLIENT *client;
+	uint32_t callback;
+	OTA_STATE state;
+	uint8_t closed;		/* connection gone, the client may be freed */
+	uint8_t held;
+	uint8_t scheduled;
+	uint8_t flash_err;
+	os_timer_t timer;
+
+	uint8_t *rx;
+	uint16_t rx_head, rx_tail, rx_len;
+
+	uint8_t hdr[OTA_HDR_SIZE];
+	uint16_t hdr_len;
+	uint32_t old_size, new_size;
+	uint32_t old_addr, new_addr;
+
+	OTA_PARSE parse;
+	uint8_t op;
+	uint8_t args[8];
+	uint8_t args_len, args_need;
+	uint32_t src;		/* next byte of the running image */
+	uint32_t op_left;	/* ADD/DATA output bytes left */
+	uint32_t copy_left;	/* unchanged bytes to take before parsing on */
+	uint8_t add_left;
+
+	uint32_t cache[OTA_OLD_CACHE / 4];
+	uint32_t cache_addr;
+
+	uint32_t *sect;		/* output sector, also the BASE/VERIFY read buffer */
+	uint16_t fill;
+	uint32_t out;		/* bytes of the new image produced */
+	uint32_t pos;		/* BASE/VERIFY progress */
+	struct MD5Context md5;
+} OTA_CTX;
+
+static OTA_CTX *ota;
+static os_timer_t otaRebootTimer;
+
+static uint32_t ICACHE_FLASH_ATTR
+ota_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void ICACHE_FLASH_ATTR
+ota_event(OTA_EVENT ev, uint32_t value)
+{
+	uint16_t crc;
+
+	crc = CMD_ResponseStart(CMD_OTA_EVENTS, ota->callback, ev, 1);
+	crc = CMD_ResponseBody(crc, (uint8_t*)&value, 4);
+	CMD_ResponseEnd(crc);
+}
+
+static void ICACHE_FLASH_ATTR
+ota_fail(OTA_ERR err)
+{
+	INFO("OTA: failed, error %d at %d\r\n", err, ota->out);
+	ota->state = OTA_ST_FAIL;
+	system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+	ota_event(OTA_EV_FAIL, err);
+	if(!ota->closed)
+		REST_Close(ota->client);
+}
+
+static void ICACHE_FLASH_ATTR
+ota_free(void)
+{
+	os_timer_disarm(&ota->timer);
+	REST_Free(ota->client);
+	os_free(ota->rx);
+	os_free(ota->sect);
+	os_free(ota);
+	ota = NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+ota_kick(void)
+{
+	if(ota->scheduled)
+		return;
+	ota->scheduled = 1;
+	os_timer_arm(&ota->timer, 1, 0);
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_rx_get(void)
+{
+	uint8_t c = ota->rx[ota->rx_tail];
+
+	ota->rx_tail = (ota->rx_tail + 1) % OTA_RX_SIZE;
+	ota->rx_len--;
+	return c;
+}
+
+static void ICACHE_FLASH_ATTR
+ota_body(void *arg, uint32_t status, uint8_t *data, uint16_t len)
+{
+	uint16_t n;
+
+	if(len == 0){
+		ota->closed = 1;
+		if(ota->state == OTA_ST_HEADER && status != 200)
+			ota_fail(OTA_ERR_HTTP);
+		ota_kick();
+		return;
+	}
+	if(ota->state >= OTA_ST_VERIFY)
+		return;
+	if(status != 200){
+		ota_fail(OTA_ERR_HTTP);
+		return;
+	}
+	if(len > OTA_RX_SIZE - ota->rx_len){
+		ota_fail(OTA_ERR_OVERRUN);
+		return;
+	}
+	while(len){
+		n = OTA_RX_SIZE - ota->rx_head;
+		if(n > len)
+			n = len;
+		os_memcpy(ota->rx + ota->rx_head, data, n);
+		ota->rx_head = (ota->rx_head + n) % OTA_RX_SIZE;
+		ota->rx_len += n;
+		data += n;
+		len -= n;
+	}
+	if(!ota->held && ota->rx_len > OTA_RX_HOLD){
+		REST_Hold(ota->client, 1);
+		ota->held = 1;
+	}
+	ota_kick();
+}
+
+/* MD5 of size bytes at addr, a sector per call. 0 once ota->md5 is final */
+static uint8_t ICACHE_FLASH_ATTR
+ota_hash(uint32_t addr, uint32_t size, uint8_t *digest)
+{
+	uint32_t n = size - ota->pos;
+
+	if(n == 0){
+		MD5Final(digest, &ota->md5);
+		return 0;
+	}
+	if(n > OTA_SECTOR)
+		n = OTA_SECTOR;
+	if(spi_flash_read(addr + ota->pos, ota->sect, (n + 3) & ~3) != SPI_FLASH_RESULT_OK)
+		ota->flash_err = 1;
+	MD5Update(&ota->md5, ota->sect, n);
+	ota->pos += n;
+	return 1;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_header(void)
+{
+	while(ota->hdr_len < OTA_HDR_SIZE && ota->rx_len)
+		ota->hdr[ota->hdr_len++] = ota_rx_get();
+	if(ota->hdr_len < OTA_HDR_SIZE)
+		return 0;
+
+	if(ota_le32(ota->hdr) != OTA_MAGIC || (ota->hdr[4] | (ota->hdr[5] << 8)) != OTA_VERSION){
+		ota_fail(OTA_ERR_FORMAT);
+		return 0;
+	}
+	ota->old_size = ota_le32(ota->hdr + 8);
+	ota->new_size = ota_le32(ota->hdr + 12);
+	if(ota->old_size > OTA_SLOT_SIZE || ota->new_size > OTA_SLOT_SIZE || ota->new_size == 0){
+		ota_fail(OTA_ERR_SIZE);
+		return 0;
+	}
+	INFO("OTA: delta %d -> %d bytes\r\n", ota->old_size, ota->new_size);
+	MD5Init(&ota->md5);
+	ota->pos = 0;
+	ota->state = OTA_ST_BASE;
+	return 1;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_base(void)
+{
+	uint8_t digest[16];
+
+	if(ota_hash(ota->old_addr, ota->old_size, digest))
+		return 1;
+	if(ota->flash_err){
+		ota_fail(OTA_ERR_FLASH);
+		return 0;
+	}
+	if(os_memcmp(digest, ota->hdr + 16, 16) != 0){
+		ota_fail(OTA_ERR_BASE);
+		return 0;
+	}
+	ota->cache_addr = 0xffffffff;
+	ota->parse = OTA_P_OP;
+	ota->state = OTA_ST_PATCH;
+	return 1;
+}
+
+/* byte of the running image, through a small read cache */
+static uint8_t ICACHE_FLASH_ATTR
+ota_old(uint32_t off)
+{
+	uint32_t base = off & ~(OTA_OLD_CACHE - 1);
+
+	if(base != ota->cache_addr){
+		if(spi_flash_read(ota->old_addr + base, ota->cache, OTA_OLD_CACHE) != SPI_FLASH_RESULT_OK)
+			ota->flash_err = 1;
+		ota->cache_addr = base;
+	}
+	return ((uint8_t*)ota->cache)[off - base];
+}
+
+static void ICACHE_FLASH_ATTR
+ota_put(uint8_t c)
+{
+	((uint8_t*)ota->sect)[ota->fill++] = c;
+	ota->out++;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_flush(void)
+{
+	uint32_t addr = ota->new_addr + ota->out - ota->fill;
+	uint16_t len = (ota->fill + 3) & ~3;
+
+	os_memset((uint8_t*)ota->sect + ota->fill, 0xff, len - ota->fill);
+	if(spi_flash_erase_sector(addr / OTA_SECTOR) != SPI_FLASH_RESULT_OK ||
+			spi_flash_write(addr, ota->sect, len) != SPI_FLASH_RESULT_OK){
+		ota_fail(OTA_ERR_FLASH);
+		return 0;
+	}
+	ota->fill = 0;
+	if((ota->out / OTA_SECTOR) % OTA_PROGRESS_SECTORS == 0)
+		ota_event(OTA_EV_PROGRESS, ota->out);
+	return 1;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_op_start(void)
+{
+	uint32_t len;
+
+	if(ota->op == OTA_OP_DATA){
+		len = ota_le32(ota->args);
+	} else {
+		ota->src = ota_le32(ota->args);
+		len = ota_le32(ota->args + 4);
+		if(ota->src > ota->old_size || len > ota->old_size - ota->src)
+			return 0;
+	}
+	if(len == 0 || len > ota->new_size - ota->out)
+		return 0;
+
+	switch(ota->op){
+	case OTA_OP_COPY:
+		ota->copy_left = len;
+		ota->parse = OTA_P_OP;
+		break;
+	case OTA_OP_ADD:
+		ota->op_left = len;
+		ota->parse = OTA_P_ADD_SKIP;
+		break;
+	default:
+		ota->op_left = len;
+		ota->parse = OTA_P_DATA;
+		break;
+	}
+	return 1;
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_parse(uint8_t c)
+{
+	switch(ota->parse){
+	case OTA_P_OP:
+		ota->op = c;
+		ota->args_len = 0;
+		if(c == OTA_OP_END){
+			ota->parse = OTA_P_END;
+			return 1;
+		}
+		if(c == OTA_OP_DATA)
+			ota->args_need = 4;
+		else if(c == OTA_OP_COPY || c == OTA_OP_ADD)
+			ota->args_need = 8;
+		else
+			break;
+		ota->parse = OTA_P_ARGS;
+		return 1;
+	case OTA_P_ARGS:
+		ota->args[ota->args_len++] = c;
+		if(ota->args_len < ota->args_need)
+			return 1;
+		if(ota_op_start())
+			return 1;
+		break;
+	case OTA_P_DATA:
+		ota_put(c);
+		if(--ota->op_left == 0)
+			ota->parse = OTA_P_OP;
+		return 1;
+	case OTA_P_ADD_SKIP:
+		if(c > ota->op_left)
+			break;
+		ota->copy_left = c;
+		ota->op_left -= c;
+		ota->parse = OTA_P_ADD_CNT;
+		return 1;
+	case OTA_P_ADD_CNT:
+		if(c > ota->op_left)
+			break;
+		ota->add_left = c;
+		if(c)
+			ota->parse = OTA_P_ADD_BYTES;
+		else
+			ota->parse = ota->op_left ? OTA_P_ADD_SKIP : OTA_P_OP;
+		return 1;
+	case OTA_P_ADD_BYTES:
+		ota_put(ota_old(ota->src++) + c);
+		ota->op_left--;
+		if(--ota->add_left == 0)
+			ota->parse = ota->op_left ? OTA_P_ADD_SKIP : OTA_P_OP;
+		return 1;
+	default:
+		break;
+	}
+	ota_fail(OTA_ERR_FORMAT);
+	return 0;
+}
+
+/* fills and writes at most one sector */
+static uint8_t ICACHE_FLASH_ATTR
+ota_patch(void)
+{
+	while(ota->fill < OTA_SECTOR){
+		if(ota->copy_left){
+			ota_put(ota_old(ota->src++));
+			ota->copy_left--;
+			continue;
+		}
+		if(ota->parse == OTA_P_END || ota->rx_len == 0)
+			break;
+		if(!ota_parse(ota_rx_get()))
+			return 0;
+	}
+	if(ota->flash_err){
+		ota_fail(OTA_ERR_FLASH);
+		return 0;
+	}
+	if(ota->held && ota->rx_len < OTA_RX_SIZE / 4){
+		REST_Hold(ota->client, 0);
+		ota->held = 0;
+	}
+	if(ota->fill == OTA_SECTOR || (ota->parse == OTA_P_END && ota->fill))
+		return ota_flush();
+	if(ota->parse != OTA_P_END)
+		return 0;
+
+	if(ota->out != ota->new_size){
+		ota_fail(OTA_ERR_FORMAT);
+		return 0;
+	}
+	if(!ota->closed)
+		REST_Close(ota->client);
+	MD5Init(&ota->md5);
+	ota->pos = 0;
+	ota->state = OTA_ST_VERIFY;
+	return 1;
+}
+
+static void ICACHE_FLASH_ATTR
+ota_reboot(void *arg)
+{
+	system_upgrade_reboot();
+}
+
+static uint8_t ICACHE_FLASH_ATTR
+ota_verify(void)
+{
+	uint8_t digest[16];
+
+	if(ota_hash(ota->new_addr, ota->new_size, digest))
+		return 1;
+	if(ota->flash_err || os_memcmp(digest, ota->hdr + 32, 16) != 0){
+		ota_fail(ota->flash_err ? OTA_ERR_FLASH : OTA_ERR_VERIFY);
+		return 0;
+	}
+	INFO("OTA: verified, booting 0x%x\r\n", ota->new_addr);
+	/* the boot loader picks the other slot from here on */
+	system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+	ota->state = OTA_ST_DONE;
+	ota_event(OTA_EV_DONE, ota->new_size);
+	os_timer_disarm(&otaRebootTimer);
+	os_timer_setfn(&otaRebootTimer, ota_reboot, NULL);
+	os_timer_arm(&otaRebootTimer, OTA_REBOOT_MS, 0);
+	return 0;
+}
+
+static void ICACHE_FLASH_ATTR
+ota_step(void *arg)
+{
+	uint8_t more = 0;
+
+	ota->scheduled = 0;
+	switch(ota->state){
+	case OTA_ST_HEADER:
+		more = ota_header();
+		break;
+	case OTA_ST_BASE:
+		more = ota_base();
+		break;
+	case OTA_ST_PATCH:
+		more = ota_patch();
+		break;
+	case OTA_ST_VERIFY:
+		more = ota_verify();
+		break;
+	default:
+		break;
+	}
+	if(!more && ota->closed && (ota->state == OTA_ST_HEADER || ota->state == OTA_ST_PATCH))
+		ota_fail(OTA_ERR_TRUNCATED);
+
+	if(ota->state == OTA_ST_FAIL){
+		if(ota->closed)
+			ota_free();
+	} else if(more){
+		ota_kick();
+	}
+}
+
+uint32_t ICACHE_FLASH_ATTR
+OTA_Start(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	uint8_t *host, *path;
+	uint32_t port;
+	uint16_t len;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 3 || ota != NULL)
+		return 0;
+
+	len = CMD_ArgLen(&req);
+	host = (uint8_t*)ARENA_Alloc(len + 1);
+	CMD_PopArgs(&req, host);
+	host[len] = 0;
+
+	CMD_PopArgs(&req, (uint8_t*)&port);
+
+	len = CMD_ArgLen(&req);
+	path = (uint8_t*)ARENA_Alloc(len + 1);
+	CMD_PopArgs(&req, path);
+	path[len] = 0;
+
+	ota = (OTA_CTX*)os_zalloc(sizeof(OTA_CTX));
+	if(ota == NULL)
+		return 0;
+	ota->rx = (uint8_t*)os_malloc(OTA_RX_SIZE);
+	ota->sect = (uint32_t*)os_malloc(OTA_SECTOR);
+	ota->client = REST_Open(host, port, 0);
+	if(ota->rx == NULL || ota->sect == NULL || ota->client == NULL){
+		if(ota->client)
+			REST_Free(ota->client);
+		os_free(ota->rx);
+		os_free(ota->sect);
+		os_free(ota);
+		ota = NULL;
+		return 0;
+	}
+	ota->callback = cmd->callback;
+
+	if(system_upgrade_userbin_check() == UPGRADE_FW_BIN1){
+		ota->old_addr = OTA_SLOT1_ADDR;
+		ota->new_addr = OTA_SLOT2_ADDR;
+	} else {
+		ota->old_addr = OTA_SLOT2_ADDR;
+		ota->new_addr = OTA_SLOT1_ADDR;
+	}
+	system_upgrade_flag_set(UPGRADE_FLAG_START);
+	os_timer_disarm(&ota->timer);
+	os_timer_setfn(&ota->timer, ota_step, NULL);
+
+	INFO("OTA: %s:%d%s into 0x%x\r\n", host, port, path, ota->new_addr);
+	REST_Get(ota->client, path, ota_body, ota);
+	return 1;
+}
+
+#else
+
+uint32_t ICACHE_FLASH_ATTR
+OTA_Start(PACKET_CMD *cmd)
+{
+	INFO("OTA: not built in, make OTA=1\r\n");
+	return 0;
+}
+
+#endif /* NEURITE_OTA */
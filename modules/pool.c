@@ -0,0 +1,92 @@
+/*
+ * pool.c
+ *
+ * Fixed size object pools and the per-request arena, see pool.h.
+ */
+#include "user_interface.h"
+#include "osapi.h"
+#include "mem.h"
+#include "user_config.h"
+#include "debug.h"
+#include "pool.h"
+
+POOL_DEFINE(strPool, POOL_STR_SIZE, POOL_STR_COUNT);
+
+static uint32_t arenaMem[ARENA_SIZE / 4];
+static uint16_t arenaTop;
+static uint16_t arenaPeak;
+
+/* zeroed block, from the heap if size doesn't fit or the pool is empty */
+void* ICACHE_FLASH_ATTR
+POOL_Alloc(POOL *pool, uint16_t size)
+{
+	uint8_t *block = NULL;
+
+	if(size <= pool->block_size){
+		if(pool->free_list){
+			block = (uint8_t*)pool->free_list;
+			pool->free_list = *(void**)block;
+		} else if(pool->next < pool->count){
+			block = pool->mem + pool->next * pool->block_size;
+			pool->next++;
+		}
+	}
+	if(block == NULL){
+		pool->fallback++;
+		return os_zalloc(size);
+	}
+	if(++pool->used > pool->peak)
+		pool->peak = pool->used;
+	os_memset(block, 0, pool->block_size);
+	return block;
+}
+
+void ICACHE_FLASH_ATTR
+POOL_Free(POOL *pool, void *ptr)
+{
+	uint8_t *p = (uint8_t*)ptr;
+
+	if(p == NULL)
+		return;
+	if(p < pool->mem || p >= pool->mem + pool->count * pool->block_size){
+		os_free(p);
+		return;
+	}
+	*(void**)p = pool->free_list;
+	pool->free_list = p;
+	pool->used--;
+}
+
+/*
+ * Zeroed, word aligned. ARENA_SIZE covers the largest command the rx
+ * buffer can hold, so NULL means a handler asked for more than its args.
+ */
+void* ICACHE_FLASH_ATTR
+ARENA_Alloc(uint16_t size)
+{
+	uint8_t *p;
+
+	size = POOL_BLOCK_SIZE(size);
+	if(size > sizeof(arenaMem) - arenaTop){
+		INFO("ARENA: out of space, %d + %d\r\n", arenaTop, size);
+		return NULL;
+	}
+	p = (uint8_t*)arenaMem + arenaTop;
+	arenaTop += size;
+	if(arenaTop > arenaPeak)
+		arenaPeak = arenaTop;
+	os_memset(p, 0, size);
+	return p;
+}
+
+void ICACHE_FLASH_ATTR
+ARENA_Reset(void)
+{
+	arenaTop = 0;
+}
+
+uint16_t ICACHE_FLASH_ATTR
+ARENA_Peak(void)
+{
+	return arenaPeak;
+}
@@ -15,6 +15,95 @@
 #include "espconn.h"
 #include "os_type.h"
 #include "debug.h"
+#include "metrics.h"
+#include "pool.h"
+
+#define REST_DATA_SIZE	1024
+#define REST_PATHS_SIZE	128	/* REST_Extract paths, NUL terminated */
+
+/* everything a client needs but its strings, in one pool block */
+typedef struct {
+	REST_CLIENT client;
+	struct espconn conn;
+	esp_tcp tcp;
+	uint8_t data[REST_DATA_SIZE];
+	uint8_t paths[REST_PATHS_SIZE];
+	JSON_PATH json;
+} REST_SLOT;
+
+POOL_DEFINE(restPool, sizeof(REST_SLOT), POOL_REST_CLIENTS);
+
+static void rest_connect(REST_CLIENT *client);
+
+/* where rest_dechunk() is in a chunked body */
+enum {
+	CHUNK_SIZE = 0,
+	CHUNK_EXT,	/* to the end of the size line */
+	CHUNK_DATA,
+	CHUNK_CRLF,	/* after the data */
+	CHUNK_END	/* the last chunk came, trailers follow */
+};
+
+/* a tagged REST_Request is answered with the response, others get a REST_EVENTS event */
+static void ICACHE_FLASH_ATTR
+rest_respond(REST_CLIENT *client, uint32_t code, uint8_t *body, uint16_t len)
+{
+	uint16_t crc;
+
+	if(client->req_tag)
+		crc = CMD_BulkStart(CMD_REST_REQUEST, client->req_tag, code, len ? 1 : 0);
+	else
+		crc = CMD_BulkStart(CMD_REST_EVENTS, client->resp_cb, code, len ? 1 : 0);
+	if(len)
+		crc = CMD_ResponseBody(crc, body, len);
+	CMD_ResponseEnd(crc);
+	client->req_tag = 0;
+}
+
+/* the request ended without a response, a tagged one is answered with 0 */
+static void ICACHE_FLASH_ATTR
+rest_abort(REST_CLIENT *client)
+{
+	if(client->req_tag == 0)
+		return;
+	CMD_Complete(CMD_REST_REQUEST, client->req_tag, 0);
+	client->req_tag = 0;
+}
+
+/*
+ * body_cb of a REST_Request with paths: the body goes through the JSON
+ * extractor, and once every path has its value or the connection closed
+ * the response carries one arg per path, empty for a path not found.
+ * client->data is free for the values by then, the request went out.
+ */
+static void ICACHE_FLASH_ATTR
+rest_extract_body(void *arg, uint32_t status, uint8_t *data, uint16_t len)
+{
+	REST_CLIENT *client = (REST_CLIENT*)arg;
+	JSON_PATH *jp = client->json;
+	uint16_t crc, i;
+
+	if(client->extract_done)
+		return;
+	if(len){
+		JSONPATH_Feed(jp, data, len);
+		if(!JSONPATH_Done(jp))
+			return;
+	}
+	client->extract_done = 1;
+	INFO("REST: status = %d, %d of %d paths\r\n", status, jp->found, client->paths_n);
+	if(client->req_tag)
+		crc = CMD_BulkStart(CMD_REST_REQUEST, client->req_tag, status, client->paths_n);
+	else
+		crc = CMD_BulkStart(CMD_REST_EVENTS, client->resp_cb, status, client->paths_n);
+	for(i = 0; i < client->paths_n; i++)
+		crc = CMD_ResponseBody(crc, jp->out + jp->off[i], (jp->found & (1 << i)) ? jp->len[i] : 0);
+	CMD_ResponseEnd(crc);
+	client->req_tag = 0;
+	/* the rest of the body is of no use */
+	if(len)
+		REST_Close(client);
+}
 
 void ICACHE_FLASH_ATTR
 tcpclient_discon_cb(void *arg)
@@ -23,7 +112,138 @@ tcpclient_discon_cb(void *arg)
 	struct espconn *pespconn = (struct espconn *)arg;
 	REST_CLIENT* client = (REST_CLIENT *)pespconn->reverse;
 
+	/* first, a body_cb may still answer the request */
+	if(client->body_cb)
+		client->body_cb(client->body_arg, client->status, NULL, 0);
+	rest_abort(client);
+}
 
+static void ICACHE_FLASH_ATTR
+rest_stream_start(REST_CLIENT *client, REST_BODY_CB body_cb, void *arg)
+{
+	client->body_cb = body_cb;
+	client->body_arg = arg;
+	client->status = 0;
+	client->in_status = 0;
+	client->in_body = 0;
+	client->line_blank = 0;
+	client->hdr_len = 0;
+	client->chunked = 0;
+	client->chunk_st = CHUNK_SIZE;
+	client->chunk_left = 0;
+}
+
+/* one char of the status line or headers, a whole line tells whether the body is chunked */
+static void ICACHE_FLASH_ATTR
+rest_header_char(REST_CLIENT *client, char c)
+{
+	if(c == '\n'){
+		/* REST_HDR_LINE is a line too long to be the one */
+		if(client->hdr_len < REST_HDR_LINE){
+			client->hdr_line[client->hdr_len] = 0;
+			if(os_strcmp(client->hdr_line, "transfer-encoding:chunked") == 0)
+				client->chunked = 1;
+		}
+		client->hdr_len = 0;
+	} else if(c != ' ' && c != '\t' && c != '\r'){
+		if(client->hdr_len < REST_HDR_LINE - 1)
+			client->hdr_line[client->hdr_len++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+		else
+			client->hdr_len = REST_HDR_LINE;
+	}
+}
+
+/*
+ * The chunk data of a chunked body moved to the front of data, in place;
+ * returns how much there is. Size lines and chunks may span packets.
+ */
+static uint16_t ICACHE_FLASH_ATTR
+rest_dechunk(REST_CLIENT *client, uint8_t *data, uint16_t len)
+{
+	uint16_t i = 0, out = 0, n;
+	uint8_t c;
+
+	while(i < len){
+		switch(client->chunk_st){
+		case CHUNK_SIZE:
+			c = data[i++];
+			if(c >= '0' && c <= '9')
+				n = c - '0';
+			else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+				n = (c | 0x20) - 'a' + 10;
+			else
+				n = 16;
+			if(n < 16 && client->chunk_left < 0x10000000){
+				client->chunk_left = client->chunk_left * 16 + n;
+			} else if(n < 16){
+				INFO("REST: chunk too large\r\n");
+				client->chunk_st = CHUNK_END;
+			} else if(c == '\n'){
+				client->chunk_st = client->chunk_left ? CHUNK_DATA : CHUNK_END;
+			} else {
+				client->chunk_st = CHUNK_EXT;
+			}
+			break;
+		case CHUNK_EXT:
+			if(data[i++] == '\n')
+				client->chunk_st = client->chunk_left ? CHUNK_DATA : CHUNK_END;
+			break;
+		case CHUNK_DATA:
+			n = len - i < client->chunk_left ? len - i : client->chunk_left;
+			os_memmove(data + out, data + i, n);
+			out += n;
+			i += n;
+			client->chunk_left -= n;
+			if(client->chunk_left == 0)
+				client->chunk_st = CHUNK_CRLF;
+			break;
+		case CHUNK_CRLF:
+			if(data[i++] == '\n')
+				client->chunk_st = CHUNK_SIZE;
+			break;
+		default:
+			i = len;
+			break;
+		}
+	}
+	return out;
+}
+
+/* status line and headers may span packets, the body goes to body_cb as it comes */
+static void ICACHE_FLASH_ATTR
+rest_stream_recv(REST_CLIENT *client, char *pdata, unsigned short len)
+{
+	uint16_t j, n;
+	char c;
+
+	for(j = 0; j < len && !client->in_body; j++){
+		c = pdata[j];
+		rest_header_char(client, c);
+		if(client->in_status == 0 && c == ' '){
+			client->in_status = 1;
+		} else if(client->in_status == 1){
+			if(c >= '0' && c <= '9')
+				client->status = client->status * 10 + c - '0';
+			else
+				client->in_status = 2;
+		}
+		if(c == '\n' && client->line_blank){
+			client->in_body = 1;
+			metrics_inc(METRIC_REST_RESP);
+			metrics_hist_add(METRIC_HIST_REST_RTT_MS, (system_get_time() - client->req_start) / 1000);
+		}
+		if(c == '\n')
+			client->line_blank = 1;
+		else if(c != '\r')
+			client->line_blank = 0;
+	}
+	if(!client->in_body || j == len)
+		return;
+	n = len - j;
+	if(client->chunked)
+		n = rest_dechunk(client, (uint8_t*)pdata + j, n);
+	if(n)
+		client->body_cb(client->body_arg, client->status, (uint8_t*)pdata + j, n);
 }
 
 
@@ -36,11 +256,17 @@ tcpclient_recv(void *arg, char *pdata, unsigned short len)
 	char statusCode[4];
 	int i = 0, j;
 	uint32_t code = 0;
-	uint16_t crc;
 
 	struct espconn *pCon = (struct espconn*)arg;
 	REST_CLIENT *client = (REST_CLIENT *)pCon->reverse;
 
+	if(client->body_cb){
+		rest_stream_recv(client, pdata, len);
+		return;
+	}
+	rest_stream_start(client, NULL, NULL);
+	metrics_inc(METRIC_REST_RESP);
+	metrics_hist_add(METRIC_HIST_REST_RTT_MS, (system_get_time() - client->req_start) / 1000);
 	for(j=0 ;j<len; j++){
 		char c = pdata[j];
 
@@ -58,18 +284,15 @@ tcpclient_recv(void *arg, char *pdata, unsigned short len)
 		 if(httpBody){
 			 //only write response if its not null
 			 uint32_t body_len = len - j;
+			 if(client->chunked)
+				 body_len = rest_dechunk(client, (uint8_t*)&pdata[j], body_len);
 			 INFO("REST: status = %d, body_len = %d\r\n",code, body_len);
-			 if(body_len == 0){
-				 crc = CMD_ResponseStart(CMD_REST_EVENTS, client->resp_cb, code, 0);
-			 } else {
-				 crc = CMD_ResponseStart(CMD_REST_EVENTS, client->resp_cb, code, 1);
-				 crc = CMD_ResponseBody(crc, &pdata[j], body_len);
-			 }
-			 CMD_ResponseEnd(crc);
+			 rest_respond(client, code, (uint8_t*)&pdata[j], body_len);
 			 break;
 		}
 		else
 		{
+			rest_header_char(client, c);
 			if (c == '\n' && currentLineIsBlank) {
 				httpBody = true;
 			}
@@ -120,6 +343,10 @@ tcpclient_recon_cb(void *arg, sint8 errType)
 	struct espconn *pCon = (struct espconn *)arg;
 	REST_CLIENT* client = (REST_CLIENT *)pCon->reverse;
 
+	INFO("REST: connection error %d\r\n", errType);
+	if(client->body_cb)
+		client->body_cb(client->body_arg, client->status, NULL, 0);
+	rest_abort(client);
 }
 LOCAL void ICACHE_FLASH_ATTR
 rest_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
@@ -129,6 +356,9 @@ rest_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 	if(ipaddr == NULL)
 	{
 		INFO("REST DNS: Found, but got no ip, try to reconnect\r\n");
+		if(client->body_cb)
+			client->body_cb(client->body_arg, 0, NULL, 0);
+		rest_abort(client);
 		return;
 	}
 
@@ -150,54 +380,40 @@ rest_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 		INFO("REST: connecting...\r\n");
 	}
 }
-uint32_t ICACHE_FLASH_ATTR REST_Setup(PACKET_CMD *cmd)
+/* client on a pool slot, host is copied */
+REST_CLIENT* ICACHE_FLASH_ATTR
+REST_Open(const uint8_t *host, uint32_t port, uint32_t security)
 {
-	REQUEST req;
+	REST_SLOT *slot;
 	REST_CLIENT *client;
-	uint8_t *rest_host;
-	uint16_t len;
-	uint32_t port, security;
+	uint16_t len = os_strlen((const char*)host);
 
-	CMD_Request(&req, cmd);
-	if(CMD_GetArgc(&req) != 3)
-		return 0;
-
-	len = CMD_ArgLen(&req);
-	rest_host = (uint8_t*)os_zalloc(len + 1);
-	CMD_PopArgs(&req, rest_host);
-	rest_host[len] = 0;
+	slot = (REST_SLOT*)POOL_Alloc(&restPool, sizeof(REST_SLOT));
+	if(slot == NULL)
+		return NULL;
+	client = &slot->client;
 
-	client = (REST_CLIENT*)os_zalloc(sizeof(REST_CLIENT));
-	os_memset(client, 0, sizeof(REST_CLIENT));
-	if(client == NULL)
-		return 0;
-
-	CMD_PopArgs(&req, (uint8_t*)&port);
-
-	CMD_PopArgs(&req, (uint8_t*)&security);
-
-	client->resp_cb = cmd->callback;
-
-	client->host = rest_host;
+	client->host = (uint8_t*)POOL_Alloc(&strPool, len + 1);
+	os_memcpy(client->host, host, len + 1);
 	client->port = port;
 	client->security = security;
 	client->ip.addr = 0;
 
-	client->data = (uint8_t*)os_zalloc(1024);
+	client->data = slot->data;
 
-	client->header = (uint8_t*)os_zalloc(4);
+	client->header = (uint8_t*)POOL_Alloc(&strPool, 4);
 	client->header[0] = 0;
 
-	client->content_type = (uint8_t*)os_zalloc(22);
+	client->content_type = (uint8_t*)POOL_Alloc(&strPool, 22);
 	os_sprintf(client->content_type, "x-www-form-urlencoded");
 	client->content_type[21] = 0;
 
-	client->user_agent = (uint8_t*)os_zalloc(17);
+	client->user_agent = (uint8_t*)POOL_Alloc(&strPool, 18);
 	os_sprintf(client->user_agent, "ESPDRUINO@tuanpmt");
-	client->user_agent[16] = 0;
+	client->user_agent[17] = 0;
 
-	client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
-	client->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
+	client->pCon = &slot->conn;
+	client->pCon->proto.tcp = &slot->tcp;
 
 	client->pCon->type = ESPCONN_TCP;
 	client->pCon->state = ESPCONN_NONE;
@@ -206,6 +422,50 @@ uint32_t ICACHE_FLASH_ATTR REST_Setup(PACKET_CMD *cmd)
 
 	client->pCon->reverse = client;
 
+	client->paths = slot->paths;
+	client->json = &slot->json;
+
+	return client;
+}
+
+/* closes nothing, call once the connection is gone */
+void ICACHE_FLASH_ATTR
+REST_Free(REST_CLIENT *client)
+{
+	POOL_Free(&strPool, client->host);
+	POOL_Free(&strPool, client->header);
+	POOL_Free(&strPool, client->content_type);
+	POOL_Free(&strPool, client->user_agent);
+	/* the client is the first member of its slot */
+	POOL_Free(&restPool, client);
+}
+
+uint32_t ICACHE_FLASH_ATTR REST_Setup(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	REST_CLIENT *client;
+	uint8_t *rest_host;
+	uint16_t len;
+	uint32_t port, security;
+
+	CMD_Request(&req, cmd);
+	if(CMD_GetArgc(&req) != 3)
+		return 0;
+
+	len = CMD_ArgLen(&req);
+	rest_host = (uint8_t*)ARENA_Alloc(len + 1);
+	CMD_PopArgs(&req, rest_host);
+	rest_host[len] = 0;
+
+	CMD_PopArgs(&req, (uint8_t*)&port);
+
+	CMD_PopArgs(&req, (uint8_t*)&security);
+
+	client = REST_Open(rest_host, port, security);
+	if(client == NULL)
+		return 0;
+	client->resp_cb = cmd->callback;
+
 	return (uint32_t)client;
 }
 uint32_t ICACHE_FLASH_ATTR REST_SetHeader(PACKET_CMD *cmd)
@@ -229,25 +489,22 @@ uint32_t ICACHE_FLASH_ATTR REST_SetHeader(PACKET_CMD *cmd)
 
 	switch(header_index) {
 	case HEADER_GENERIC:
-		if(client->header)
-			os_free(client->header);
-		client->header = (uint8_t*)os_zalloc(len + 1);
+		POOL_Free(&strPool, client->header);
+		client->header = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 		CMD_PopArgs(&req, (uint8_t*)client->header);
 		client->header[len] = 0;
 		INFO("Set header: %s\r\n", client->header);
 		break;
 	case HEADER_CONTENT_TYPE:
-		if(client->content_type)
-			os_free(client->content_type);
-		client->content_type = (uint8_t*)os_zalloc(len + 1);
+		POOL_Free(&strPool, client->content_type);
+		client->content_type = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 		CMD_PopArgs(&req, (uint8_t*)client->content_type);
 		client->content_type[len] = 0;
 		INFO("Set content_type: %s\r\n", client->content_type);
 		break;
 	case HEADER_USER_AGENT:
-		if(client->user_agent)
-			os_free(client->user_agent);
-		client->user_agent = (uint8_t*)os_zalloc(len + 1);
+		POOL_Free(&strPool, client->user_agent);
+		client->user_agent = (uint8_t*)POOL_Alloc(&strPool, len + 1);
 		CMD_PopArgs(&req, (uint8_t*)client->user_agent);
 		client->user_agent[len] = 0;
 		INFO("Set user_agent: %s\r\n", client->user_agent);
@@ -256,6 +513,48 @@ uint32_t ICACHE_FLASH_ATTR REST_SetHeader(PACKET_CMD *cmd)
 	return 1;
 
 }
+/*
+ * Client, then JSON paths (see json_path.h) for its responses: from now
+ * on a response carries the value of each path as one arg, raw JSON or
+ * empty when not found, instead of the body. The body may then be any
+ * size, it is read as it arrives and the connection closed once every
+ * path has its value. No paths goes back to the body. Returns the number
+ * of paths, 0 when they do not fit REST_PATHS_SIZE or are too many.
+ */
+uint32_t ICACHE_FLASH_ATTR REST_Extract(PACKET_CMD *cmd)
+{
+	REQUEST req;
+	REST_CLIENT *client;
+	uint16_t len, at = 0, argc, i;
+	uint32_t client_ptr;
+
+	CMD_Request(&req, cmd);
+	argc = CMD_GetArgc(&req);
+	if(argc < 1)
+		return 0;
+	CMD_PopArgs(&req, (uint8_t*)&client_ptr);
+	client = (REST_CLIENT*)client_ptr;
+
+	client->paths_n = 0;
+	if(argc - 1 > JSON_PATH_MAX)
+		return 0;
+	for(i = 1; i < argc; i++){
+		len = CMD_ArgLen(&req);
+		if(len == 0 || at + len + 1 > REST_PATHS_SIZE)
+			return 0;
+		CMD_PopArgs(&req, client->paths + at);
+		client->paths[at + len] = 0;
+		/* a host may pad it with NULs */
+		len = os_strlen((char*)client->paths + at);
+		if(len == 0)
+			return 0;
+		at += len + 1;
+	}
+	client->paths_n = argc - 1;
+	INFO("REST: %d paths\r\n", client->paths_n);
+	return client->paths_n;
+}
+
 uint32_t ICACHE_FLASH_ATTR REST_Request(PACKET_CMD *cmd)
 {
 
@@ -276,14 +575,14 @@ uint32_t ICACHE_FLASH_ATTR REST_Request(PACKET_CMD *cmd)
 
 	//method
 	len = CMD_ArgLen(&req);
-	method = (uint8_t*)os_zalloc(len + 1);
+	method = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, method);
 	method[len] = 0;
 
 
 	//path
 	len = CMD_ArgLen(&req);
-	path = (uint8_t*)os_zalloc(len + 1);
+	path = (uint8_t*)ARENA_Alloc(len + 1);
 	CMD_PopArgs(&req, path);
 	path[len] = 0;
 
@@ -295,7 +594,7 @@ uint32_t ICACHE_FLASH_ATTR REST_Request(PACKET_CMD *cmd)
 		CMD_PopArgs(&req, (uint8_t*)&realLen);
 
 		len = CMD_ArgLen(&req);
-		body = (uint8_t*)os_zalloc(len + 1);
+		body = (uint8_t*)ARENA_Alloc(len + 1);
 		CMD_PopArgs(&req, body);
 		body[len] = 0;
 	}
@@ -325,7 +624,69 @@ uint32_t ICACHE_FLASH_ATTR REST_Request(PACKET_CMD *cmd)
 		client->data_len += 4;
 	}
 
+	client->body_cb = NULL;
+	if(client->paths_n){
+		rest_stream_start(client, rest_extract_body, client);
+		client->extract_done = 0;
+		JSONPATH_Init(client->json, (char*)client->paths, client->paths_n, client->data, REST_DATA_SIZE);
+	}
+
+	/* one request per client, an earlier tagged one is not coming back */
+	rest_abort(client);
+	client->req_tag = CMD_Defer(cmd);
+	rest_connect(client);
+	return 1;
+}
+
+/*
+ * GET path with the body streamed to body_cb instead of one CMD response,
+ * for requests the firmware makes on its own. client->data holds the
+ * request, so path plus headers must fit REST_DATA_SIZE.
+ */
+uint32_t ICACHE_FLASH_ATTR
+REST_Get(REST_CLIENT *client, const uint8_t *path, REST_BODY_CB body_cb, void *arg)
+{
+	rest_stream_start(client, body_cb, arg);
+
+	INFO("REQ: method: GET, path: %s\r\n", path);
+	client->data_len = os_sprintf(client->data, "GET %s HTTP/1.1\r\n"
+												"Host: %s\r\n"
+												"%s"
+												"Connection: close\r\n"
+												"User-Agent: %s\r\n\r\n",
+												path,
+												client->host,
+												client->header,
+												client->user_agent);
+	rest_connect(client);
+	return 1;
+}
+
+/* flow control for streamed bodies, the peer is held off while hold is set */
+void ICACHE_FLASH_ATTR
+REST_Hold(REST_CLIENT *client, uint8_t hold)
+{
+	if(hold)
+		espconn_recv_hold(client->pCon);
+	else
+		espconn_recv_unhold(client->pCon);
+}
+
+void ICACHE_FLASH_ATTR
+REST_Close(REST_CLIENT *client)
+{
+	if(client->security)
+		espconn_secure_disconnect(client->pCon);
+	else
+		espconn_disconnect(client->pCon);
+}
+
+static void ICACHE_FLASH_ATTR
+rest_connect(REST_CLIENT *client)
+{
 	client->pCon->state = ESPCONN_NONE;
+	client->req_start = system_get_time();
+	metrics_inc(METRIC_REST_REQ);
 	espconn_regist_connectcb(client->pCon, tcpclient_connect_cb);
 	espconn_regist_reconcb(client->pCon, tcpclient_recon_cb);
 
@@ -342,8 +703,4 @@ uint32_t ICACHE_FLASH_ATTR REST_Request(PACKET_CMD *cmd)
 		INFO("REST: Connect to domain %s:%d\r\n", client->host, client->port);
 		espconn_gethostbyname(client->pCon, client->host, &client->ip, rest_dns_found);
 	}
-	os_free(method);
-	os_free(path);
-	if(body) os_free(body);
-	return 1;
 }
@@ -15,53 +15,58 @@
 #include "cmd.h"
 #include "debug.h"
 
-static ETSTimer WiFiLinker;
 uint32_t wifiCb = NULL;
-static uint8_t wifiStatus = STATION_IDLE, lastWifiStatus = STATION_IDLE;
-static void ICACHE_FLASH_ATTR wifi_check_ip(void *arg)
-{
-	struct ip_info ipConfig;
+static uint8_t wifiStatus = STATION_IDLE;
+/* CMD_Defer tag of WIFI_CONNECT, answered with the first status past connecting */
+static uint32_t wifiTag;
 
-	os_timer_disarm(&WiFiLinker);
-	wifi_get_ip_info(STATION_IF, &ipConfig);
-	wifiStatus = wifi_station_get_connect_status();
-	if (wifiStatus == STATION_GOT_IP && ipConfig.ip.addr != 0)
-	{
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 2000, 0);
+static void ICACHE_FLASH_ATTR wifi_report_status(uint8_t status)
+{
+	if(status == wifiStatus)
+		return;
+	wifiStatus = status;
+	if(wifiCb){
+		uint16_t crc = CMD_ResponseStart(CMD_WIFI_CONNECT, wifiCb, 0, 1);
+		crc = CMD_ResponseBody(crc, (uint8_t*)&wifiStatus, 1);
+		CMD_ResponseEnd(crc);
 	}
-	else
-	{
-		if(wifi_station_get_connect_status() == STATION_WRONG_PASSWORD)
-		{
-			INFO("STATION_WRONG_PASSWORD\r\n");
-			wifi_station_connect();
-		}
-		else if(wifi_station_get_connect_status() == STATION_NO_AP_FOUND)
-		{
-			INFO("STATION_NO_AP_FOUND\r\n");
-			wifi_station_connect();
-		}
-		else if(wifi_station_get_connect_status() == STATION_CONNECT_FAIL)
-		{
-			INFO("STATION_CONNECT_FAIL\r\n");
-			wifi_station_connect();
-		}
-		else
-		{
-			INFO("STATION_IDLE\r\n");
-		}
-
-		os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-		os_timer_arm(&WiFiLinker, 500, 0);
+	if(wifiTag && status != STATION_CONNECTING){
+		CMD_Complete(CMD_WIFI_CONNECT, wifiTag, status);
+		wifiTag = 0;
 	}
-	if(wifiStatus != lastWifiStatus){
-		lastWifiStatus = wifiStatus;
-		if(wifiCb){
-			uint16_t crc = CMD_ResponseStart(CMD_WIFI_CONNECT, wifiCb, 0, 1);
-			crc = CMD_ResponseBody(crc, (uint8_t*)&wifiStatus, 1);
-			CMD_ResponseEnd(crc);
+}
+
+static void ICACHE_FLASH_ATTR wifi_handle_event(System_Event_t *evt)
+{
+	switch(evt->event){
+	case EVENT_STAMODE_CONNECTED:
+		INFO("STATION_CONNECTED, ch: %d\r\n", evt->event_info.connected.channel);
+		wifi_report_status(STATION_CONNECTING);
+		break;
+	case EVENT_STAMODE_GOT_IP:
+		INFO("STATION_GOT_IP\r\n");
+		wifi_report_status(STATION_GOT_IP);
+		break;
+	case EVENT_STAMODE_DISCONNECTED:
+		/* the SDK reconnect policy takes care of retrying */
+		switch(evt->event_info.disconnected.reason){
+		case REASON_NO_AP_FOUND:
+			INFO("STATION_NO_AP_FOUND\r\n");
+			wifi_report_status(STATION_NO_AP_FOUND);
+			break;
+		case REASON_AUTH_FAIL:
+		case REASON_HANDSHAKE_TIMEOUT:
+			INFO("STATION_WRONG_PASSWORD\r\n");
+			wifi_report_status(STATION_WRONG_PASSWORD);
+			break;
+		default:
+			INFO("STATION_CONNECT_FAIL, reason: %d\r\n", evt->event_info.disconnected.reason);
+			wifi_report_status(STATION_CONNECT_FAIL);
+			break;
 		}
+		break;
+	default:
+		break;
 	}
 }
 
@@ -89,11 +94,13 @@ WIFI_Connect(PACKET_CMD *cmd)
 		return 0xFFFFFFFF;
 
 	wifiCb = cmd->callback;
+	wifiStatus = STATION_IDLE;
+	if(wifiTag)
+		CMD_Complete(CMD_WIFI_CONNECT, wifiTag, STATION_IDLE);
+	wifiTag = CMD_Defer(cmd);
 	wifi_station_set_config(&stationConf);
-
-	os_timer_disarm(&WiFiLinker);
-	os_timer_setfn(&WiFiLinker, (os_timer_func_t *)wifi_check_ip, NULL);
-	os_timer_arm(&WiFiLinker, 1000, 0);
+	wifi_set_event_handler_cb(wifi_handle_event);
+	wifi_station_set_reconnect_policy(TRUE);
 
 	wifi_station_set_auto_connect(TRUE);
 	wifi_station_connect();
@@ -0,0 +1,18 @@
+/*
+ * user_init of the serial bridge (modules/), which has no main of its
+ * own in this tree. Runs cmd.c behind UART0 like the bridge firmware.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "cmd.h"
+#include "sim.h"
+
+void ICACHE_FLASH_ATTR user_init(void)
+{
+	sim_uart_set_rx(CMD_Input);
+	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+	os_delay_us(100000);
+	CMD_Init();
+}
@@ -0,0 +1,63 @@
+/*
+ * Host stand-in for the SDK's c_types.h, see sim/README.md.
+ */
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t		uint8;
+typedef int8_t		sint8;
+typedef int8_t		int8;
+typedef uint16_t	uint16;
+typedef int16_t		sint16;
+typedef int16_t		int16;
+typedef uint32_t	uint32;
+typedef int32_t		sint32;
+typedef int32_t		int32;
+typedef int64_t		sint64;
+typedef uint64_t	uint64;
+typedef float		real32;
+typedef double		real64;
+
+typedef unsigned char	u_char;
+typedef uint8		u8;
+typedef int8		s8;
+typedef uint16		u16;
+typedef int16		s16;
+typedef uint32		u32;
+typedef int32		s32;
+typedef uint8		u8_t;
+typedef uint16		u16_t;
+typedef uint32		u32_t;
+
+#define __le16		u16
+
+#define BOOL		bool
+#define TRUE		true
+#define FALSE		false
+
+#define LOCAL		static
+
+#define BIT(nr)		(1UL << (nr))
+
+typedef enum {
+	OK = 0,
+	FAIL,
+	PENDING,
+	BUSY,
+	CANCEL,
+} STATUS;
+
+/* one address space on the host, the section attributes go away */
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define DMEM_ATTR
+#define SHMEM_ATTR
+#define STORE_ATTR	__attribute__((aligned(4)))
+
+#define __packed	__attribute__((packed))
+
+#endif /* _C_TYPES_H_ */
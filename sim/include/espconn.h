@@ -0,0 +1,104 @@
+/*
+ * Host stand-in for the SDK's espconn.h, TCP client side only. The
+ * connections map onto non-blocking sockets, see sim_espconn.c.
+ */
+#ifndef __ESPCONN_H__
+#define __ESPCONN_H__
+
+#include "c_types.h"
+#include "ip_addr.h"
+
+typedef sint8 err_t;
+
+typedef void *espconn_handle;
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+#define ESPCONN_OK		0	/* No error, everything OK. */
+#define ESPCONN_MEM		-1	/* Out of memory error. */
+#define ESPCONN_TIMEOUT		-3	/* Timeout. */
+#define ESPCONN_RTE		-4	/* Routing problem. */
+#define ESPCONN_INPROGRESS	-5	/* Operation in progress */
+#define ESPCONN_MAXNUM		-7	/* Total number exceeds the set maximum */
+#define ESPCONN_ABRT		-8	/* Connection aborted. */
+#define ESPCONN_RST		-9	/* Connection reset. */
+#define ESPCONN_CLSD		-10	/* Connection closed. */
+#define ESPCONN_CONN		-11	/* Not connected. */
+#define ESPCONN_ARG		-12	/* Illegal argument. */
+#define ESPCONN_IF		-14	/* UDP send error */
+#define ESPCONN_ISCONN		-15	/* Already connected. */
+
+enum espconn_type {
+	ESPCONN_INVALID = 0,
+	ESPCONN_TCP = 0x10,
+	ESPCONN_UDP = 0x20,
+};
+
+enum espconn_state {
+	ESPCONN_NONE,
+	ESPCONN_WAIT,
+	ESPCONN_LISTEN,
+	ESPCONN_CONNECT,
+	ESPCONN_WRITE,
+	ESPCONN_READ,
+	ESPCONN_CLOSE
+};
+
+typedef struct _esp_tcp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+	espconn_connect_callback connect_callback;
+	espconn_reconnect_callback reconnect_callback;
+	espconn_connect_callback disconnect_callback;
+	espconn_connect_callback write_finish_fn;
+} esp_tcp;
+
+typedef struct _esp_udp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+} esp_udp;
+
+struct espconn {
+	enum espconn_type type;
+	enum espconn_state state;
+	union {
+		esp_tcp *tcp;
+		esp_udp *udp;
+	} proto;
+	espconn_recv_callback recv_callback;
+	espconn_sent_callback sent_callback;
+	uint8 link_cnt;
+	void *reverse;
+};
+
+typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr, void *callback_arg);
+
+sint8 espconn_connect(struct espconn *espconn);
+sint8 espconn_disconnect(struct espconn *espconn);
+sint8 espconn_delete(struct espconn *espconn);
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb);
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb);
+sint8 espconn_regist_write_finish(struct espconn *espconn, espconn_connect_callback write_finish_fn);
+sint8 espconn_recv_hold(struct espconn *pespconn);
+sint8 espconn_recv_unhold(struct espconn *pespconn);
+uint32 espconn_port(void);
+err_t espconn_gethostbyname(struct espconn *pespconn, const char *hostname, ip_addr_t *addr, dns_found_callback found);
+
+/* no TLS in the simulator, these run the plain connection */
+sint8 espconn_secure_connect(struct espconn *espconn);
+sint8 espconn_secure_disconnect(struct espconn *espconn);
+sint8 espconn_secure_sent(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_secure_send(struct espconn *espconn, uint8 *psent, uint16 length);
+
+#endif /* __ESPCONN_H__ */
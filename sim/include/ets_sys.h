@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for the SDK's ets_sys.h.
+ */
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+
+#include "c_types.h"
+#include "eagle_soc.h"
+#include "os_type.h"
+
+/* the UART "ISR" runs from the event loop between tasks, see sim.c */
+#define ETS_UART_INTR_ATTACH(func, arg)
+#define ETS_UART_INTR_ENABLE()
+#define ETS_UART_INTR_DISABLE()
+#define ETS_INTR_LOCK()
+#define ETS_INTR_UNLOCK()
+
+void ets_intr_lock(void);
+void ets_intr_unlock(void);
+
+#endif /* _ETS_SYS_H */
@@ -0,0 +1,37 @@
+/*
+ * Host stand-in for the SDK's (lwIP) ip_addr.h.
+ */
+#ifndef __IP_ADDR_H__
+#define __IP_ADDR_H__
+
+#include "c_types.h"
+
+struct ip_addr {
+	uint32 addr;
+};
+
+typedef struct ip_addr ip_addr_t;
+
+struct ip_info {
+	struct ip_addr ip;
+	struct ip_addr netmask;
+	struct ip_addr gw;
+};
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+	(ipaddr)->addr = ((uint32)((d) & 0xff) << 24) | \
+			 ((uint32)((c) & 0xff) << 16) | \
+			 ((uint32)((b) & 0xff) << 8) | \
+			  (uint32)((a) & 0xff)
+
+#define ip4_addr1(ipaddr)	(((u8_t *)(ipaddr))[0])
+#define ip4_addr2(ipaddr)	(((u8_t *)(ipaddr))[1])
+#define ip4_addr3(ipaddr)	(((u8_t *)(ipaddr))[2])
+#define ip4_addr4(ipaddr)	(((u8_t *)(ipaddr))[3])
+
+#define IP2STR(ipaddr)	ip4_addr1(ipaddr), ip4_addr2(ipaddr), ip4_addr3(ipaddr), ip4_addr4(ipaddr)
+#define IPSTR		"%d.%d.%d.%d"
+
+uint32 ipaddr_addr(const char *cp);
+
+#endif /* __IP_ADDR_H__ */
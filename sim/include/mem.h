@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the SDK's mem.h. The heap is a fixed arena like the
+ * device's, see sim_mem.c.
+ */
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include "c_types.h"
+
+void *pvPortMalloc(size_t sz, const char *file, int line);
+void *pvPortCalloc(size_t count, size_t size, const char *file, int line);
+void *pvPortZalloc(size_t sz, const char *file, int line);
+void *pvPortRealloc(void *p, size_t n, const char *file, int line);
+void vPortFree(void *p, const char *file, int line);
+
+#define os_malloc(s)		pvPortMalloc(s, __FILE__, __LINE__)
+#define os_calloc(c, s)		pvPortCalloc(c, s, __FILE__, __LINE__)
+#define os_zalloc(s)		pvPortZalloc(s, __FILE__, __LINE__)
+#define os_realloc(p, s)	pvPortRealloc(p, s, __FILE__, __LINE__)
+#define os_free(s)		vPortFree(s, __FILE__, __LINE__)
+
+#endif /* __MEM_H__ */
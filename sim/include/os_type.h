@@ -0,0 +1,36 @@
+/*
+ * Host stand-in for the SDK's os_type.h.
+ */
+#ifndef _OS_TYPE_H_
+#define _OS_TYPE_H_
+
+#include "c_types.h"
+
+typedef uint32_t ETSSignal;
+typedef uint32_t ETSParam;
+
+typedef struct ETSEventTag {
+	ETSSignal sig;
+	ETSParam  par;
+} ETSEvent;
+
+typedef void (*ETSTask)(ETSEvent *e);
+
+typedef void ETSTimerFunc(void *timer_arg);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_	*timer_next;
+	uint32_t		timer_expire;	/* ms since boot, see sim.c */
+	uint32_t		timer_period;
+	ETSTimerFunc		*timer_func;
+	void			*timer_arg;
+} ETSTimer;
+
+#define os_signal_t	ETSSignal
+#define os_param_t	ETSParam
+#define os_event_t	ETSEvent
+#define os_task_t	ETSTask
+#define os_timer_t	ETSTimer
+#define os_timer_func_t	ETSTimerFunc
+
+#endif /* _OS_TYPE_H_ */
@@ -0,0 +1,49 @@
+/*
+ * Host stand-in for the SDK's osapi.h.
+ */
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "os_type.h"
+#include "user_config.h"
+
+#define os_bzero	ets_bzero
+#define os_delay_us	ets_delay_us
+#define os_install_putc1	ets_install_putc1
+#define os_memcmp	memcmp
+#define os_memcpy	memcpy
+#define os_memmove	memmove
+#define os_memset	memset
+#define os_strcat	strcat
+#define os_strchr	strchr
+#define os_strcmp	strcmp
+#define os_strcpy	strcpy
+#define os_strlen	strlen
+#define os_strncmp	strncmp
+#define os_strncpy	strncpy
+#define os_strstr	strstr
+#define os_sprintf	sprintf
+#define os_snprintf	snprintf
+#define os_printf	ets_printf
+
+#define os_timer_arm(t, ms, repeat)	ets_timer_arm_new(t, ms, repeat, 1)
+#define os_timer_arm_us(t, us, repeat)	ets_timer_arm_new(t, us, repeat, 0)
+#define os_timer_disarm			ets_timer_disarm
+#define os_timer_setfn			ets_timer_setfn
+
+void ets_bzero(void *s, size_t n);
+void ets_delay_us(uint32_t us);
+void ets_install_putc1(void *routine);
+int ets_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void ets_timer_arm_new(ETSTimer *ptimer, uint32_t time, bool repeat_flag, bool ms_flag);
+void ets_timer_disarm(ETSTimer *ptimer);
+void ets_timer_setfn(ETSTimer *ptimer, ETSTimerFunc *pfunction, void *parg);
+
+unsigned long os_random(void);
+int os_get_random(unsigned char *buf, size_t len);
+
+#endif /* _OSAPI_H_ */
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the SDK's upgrade.h. The simulator always runs the
+ * user1 slot, a finished upgrade ends the process like a reboot would.
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "c_types.h"
+
+#define UPGRADE_FLAG_IDLE	0x00
+#define UPGRADE_FLAG_START	0x01
+#define UPGRADE_FLAG_FINISH	0x02
+
+#define UPGRADE_FW_BIN1		0x00
+#define UPGRADE_FW_BIN2		0x01
+
+uint8 system_upgrade_userbin_check(void);
+void system_upgrade_flag_set(uint8 flag);
+uint8 system_upgrade_flag_check(void);
+void system_upgrade_reboot(void);
+
+#endif /* __UPGRADE_H__ */
@@ -0,0 +1,163 @@
+/*
+ * Host stand-in for the SDK's user_interface.h. Station mode only: the
+ * simulated AP accepts any SSID and hands out the loopback address.
+ */
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+#include "os_type.h"
+#include "ip_addr.h"
+#include "spi_flash.h"
+
+enum {
+	USER_TASK_PRIO_0 = 0,
+	USER_TASK_PRIO_1,
+	USER_TASK_PRIO_2,
+	USER_TASK_PRIO_MAX
+};
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+
+void system_restart(void);
+void system_init_done_cb(void (*cb)(void));
+
+uint32 system_get_time(void);
+uint32 system_get_rtc_time(void);
+uint32 system_get_chip_id(void);
+uint32 system_get_free_heap_size(void);
+uint8 system_get_cpu_freq(void);
+bool system_update_cpu_freq(uint8 freq);
+void system_print_meminfo(void);
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+
+#include "upgrade.h"
+
+#define NULL_MODE	0x00
+#define STATION_MODE	0x01
+#define SOFTAP_MODE	0x02
+#define STATIONAP_MODE	0x03
+
+#define STATION_IF	0x00
+#define SOFTAP_IF	0x01
+
+typedef enum _auth_mode {
+	AUTH_OPEN = 0,
+	AUTH_WEP,
+	AUTH_WPA_PSK,
+	AUTH_WPA2_PSK,
+	AUTH_WPA_WPA2_PSK,
+	AUTH_MAX
+} AUTH_MODE;
+
+struct station_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 bssid_set;
+	uint8 bssid[6];
+};
+
+enum {
+	STATION_IDLE = 0,
+	STATION_CONNECTING,
+	STATION_WRONG_PASSWORD,
+	STATION_NO_AP_FOUND,
+	STATION_CONNECT_FAIL,
+	STATION_GOT_IP
+};
+
+uint8 wifi_get_opmode(void);
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_set_opmode_current(uint8 opmode);
+bool wifi_station_get_config(struct station_config *config);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+uint8 wifi_station_get_connect_status(void);
+bool wifi_station_get_auto_connect(void);
+bool wifi_station_set_auto_connect(uint8 set);
+bool wifi_station_set_reconnect_policy(bool set);
+bool wifi_station_dhcpc_start(void);
+bool wifi_station_dhcpc_stop(void);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr);
+uint8 wifi_get_channel(void);
+bool wifi_set_channel(uint8 channel);
+sint8 wifi_station_get_rssi(void);
+
+enum {
+	EVENT_STAMODE_CONNECTED = 0,
+	EVENT_STAMODE_DISCONNECTED,
+	EVENT_STAMODE_AUTHMODE_CHANGE,
+	EVENT_STAMODE_GOT_IP,
+	EVENT_STAMODE_DHCP_TIMEOUT,
+	EVENT_SOFTAPMODE_STACONNECTED,
+	EVENT_SOFTAPMODE_STADISCONNECTED,
+	EVENT_SOFTAPMODE_PROBEREQRECVED,
+	EVENT_MAX
+};
+
+enum {
+	REASON_UNSPECIFIED		= 1,
+	REASON_AUTH_EXPIRE		= 2,
+	REASON_AUTH_LEAVE		= 3,
+	REASON_ASSOC_EXPIRE		= 4,
+	REASON_ASSOC_TOOMANY		= 5,
+	REASON_NOT_AUTHED		= 6,
+	REASON_NOT_ASSOCED		= 7,
+	REASON_ASSOC_LEAVE		= 8,
+	REASON_ASSOC_NOT_AUTHED		= 9,
+	REASON_4WAY_HANDSHAKE_TIMEOUT	= 15,
+	REASON_BEACON_TIMEOUT		= 200,
+	REASON_NO_AP_FOUND		= 201,
+	REASON_AUTH_FAIL		= 202,
+	REASON_ASSOC_FAIL		= 203,
+	REASON_HANDSHAKE_TIMEOUT	= 204,
+};
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+	uint8 old_mode;
+	uint8 new_mode;
+} Event_StaMode_AuthMode_Change_t;
+
+typedef struct {
+	struct ip_addr ip;
+	struct ip_addr mask;
+	struct ip_addr gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+	Event_StaMode_Connected_t		connected;
+	Event_StaMode_Disconnected_t		disconnected;
+	Event_StaMode_AuthMode_Change_t		auth_change;
+	Event_StaMode_Got_IP_t			got_ip;
+} Event_Info_u;
+
+typedef struct _esp_event {
+	uint32 event;
+	Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+
+#endif /* __USER_INTERFACE_H__ */
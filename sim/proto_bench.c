@@ -0,0 +1,265 @@
+/*
+ * Cost of the MCU -> bridge receive path: every byte through
+ * PROTO_ParseByte, every frame through protoCompletedCb with its CRC
+ * and arg walk, the way CMD_Task feeds them.
+ *
+ * Frames have the shape of the real commands. Only IS_READY is
+ * dispatched, the others go out as CMD_NULL so esp_mqtt and the REST
+ * client stay out of the numbers. os_printf output (UART1 on the chip)
+ * is counted, not written.
+ *
+ * Each mix also checks the parser's verdicts: frames completed, frames
+ * rejected as malformed or by CRC. A mismatch exits with 1.
+ *
+ *   proto_bench [-t SECS]
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "cmd.h"
+#include "proto.h"
+#include "metrics.h"
+#include "proto_frame.h"
+#include "sim.h"
+
+#define BENCH_STREAM_SIZE	(256 * 1024)
+#define BENCH_TOPIC		"/neuro/chatroom/bench"
+
+extern PROTO_PARSER rxProto;
+
+enum bench_frame_e {
+	FRAME_READY,
+	FRAME_PUB64,
+	FRAME_PUB1K,
+	FRAME_ESCAPED,
+	FRAME_NUM
+};
+
+enum bench_damage_e {
+	DAMAGE_NONE,
+	DAMAGE_CRC,		/* one bit of the CRC */
+	DAMAGE_TRUNCATED,	/* end byte halfway through */
+	DAMAGE_RESTART,		/* stray start byte halfway through */
+	DAMAGE_LONE_END,	/* end byte between frames */
+	DAMAGE_OVERSIZE,	/* more than protoRxBuf holds */
+	DAMAGE_NUM
+};
+
+struct bench_mix_s {
+	const char *name;
+	uint8_t weight[FRAME_NUM];	/* frame kinds, relative */
+	uint8_t damage_pct;		/* frames damaged, spread over the kinds */
+};
+
+static const struct bench_mix_s g_mixes[] = {
+	{ "ready",	{ 1, 0, 0, 0 }, 0 },
+	{ "pub64",	{ 0, 1, 0, 0 }, 0 },
+	{ "pub1k",	{ 0, 0, 1, 0 }, 0 },
+	{ "escaped",	{ 0, 0, 0, 1 }, 0 },
+	{ "mixed",	{ 3, 5, 1, 1 }, 0 },
+	{ "corrupt",	{ 3, 5, 1, 1 }, 12 },
+};
+
+struct bench_stream_s {
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t frames;	/* end bytes, protoCompletedCb calls */
+	uint32_t rejected;	/* malformed or bad CRC */
+};
+
+static uint32_t g_log_bytes;
+
+static void bench_putc(char c)
+{
+	g_log_bytes++;
+}
+
+static uint16_t bench_packet(uint8_t *out, enum bench_frame_e kind)
+{
+	static uint8_t data[1024];
+	static uint8_t escaped[256];
+	uint32_t client = 0x3fff1000, len, qos = 0, retain = 0;
+	struct proto_arg_s args[6] = {
+		{ &client, 4 },
+		{ BENCH_TOPIC, sizeof(BENCH_TOPIC) - 1 },
+		{ data, 64 },
+		{ &len, 4 },
+		{ &qos, 4 },
+		{ &retain, 4 },
+	};
+	uint16_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+	for (i = 0; i < sizeof(escaped); i++)
+		escaped[i] = 0x7D + i % 3;
+
+	switch (kind) {
+	case FRAME_READY:
+		return proto_packet(out, PROTO_FRAME_MAX, CMD_IS_READY, 0, 0, 0, NULL);
+	case FRAME_PUB1K:
+		args[2].len = sizeof(data);
+		break;
+	case FRAME_ESCAPED:
+		args[2].data = escaped;
+		args[2].len = sizeof(escaped);
+		break;
+	default:
+		break;
+	}
+	len = args[2].len;
+	return proto_packet(out, PROTO_FRAME_MAX, CMD_NULL, 0, 0, 6, args);
+}
+
+static void bench_put(struct bench_stream_s *s, const uint8_t *p, uint32_t len)
+{
+	os_memcpy(s->buf + s->len, p, len);
+	s->len += len;
+}
+
+/* one frame of kind, damaged or not, appended to the stream */
+static void bench_frame(struct bench_stream_s *s, enum bench_frame_e kind, enum bench_damage_e damage)
+{
+	static uint8_t packet[PROTO_FRAME_MAX], slip[2 * PROTO_FRAME_MAX + 2];
+	static const uint8_t end = 0x7F, start = 0x7E;
+	uint16_t plen, len, half;
+	uint32_t i;
+
+	plen = bench_packet(packet, kind);
+	if (damage == DAMAGE_CRC)
+		packet[plen - 1] ^= 0x01;
+	len = proto_slip(slip, sizeof(slip), packet, plen);
+	half = len / 2;
+
+	s->frames++;
+	switch (damage) {
+	case DAMAGE_NONE:
+		bench_put(s, slip, len);
+		return;
+	case DAMAGE_CRC:
+		bench_put(s, slip, len);
+		break;
+	case DAMAGE_TRUNCATED:
+		bench_put(s, slip, half);
+		bench_put(s, &end, 1);
+		break;
+	case DAMAGE_RESTART:
+		bench_put(s, slip, half);
+		bench_put(s, &start, 1);
+		bench_put(s, slip + half, len - half);
+		break;
+	case DAMAGE_LONE_END:
+		bench_put(s, slip, len);
+		bench_put(s, &end, 1);
+		s->frames++;
+		break;
+	case DAMAGE_OVERSIZE:
+		/* a pub1k frame with its data repeated past the 2048 byte buffer */
+		bench_put(s, slip, len - 3);
+		for (i = 0; i < 2; i++)
+			bench_put(s, slip + 16, len - 19);
+		bench_put(s, slip + len - 3, 3);
+		break;
+	default:
+		break;
+	}
+	s->rejected++;
+}
+
+static void bench_build(struct bench_stream_s *s, const struct bench_mix_s *mix)
+{
+	uint32_t total = 0, pick, n = 0;
+	enum bench_frame_e kind;
+	enum bench_damage_e damage;
+
+	for (kind = 0; kind < FRAME_NUM; kind++)
+		total += mix->weight[kind];
+	os_memset(s, 0, sizeof(*s));
+	s->buf = malloc(BENCH_STREAM_SIZE + 4 * PROTO_FRAME_MAX);
+	/* fixed pattern rather than random, every run feeds the same bytes */
+	while (s->len < BENCH_STREAM_SIZE) {
+		pick = (n * 7) % total;
+		for (kind = 0; pick >= mix->weight[kind]; kind++)
+			pick -= mix->weight[kind];
+		damage = DAMAGE_NONE;
+		if (mix->damage_pct && (n * 37) % 100 < mix->damage_pct)
+			damage = 1 + (n / 3) % (DAMAGE_NUM - 1);
+		if (damage == DAMAGE_OVERSIZE)
+			kind = FRAME_PUB1K;
+		bench_frame(s, kind, damage);
+		n++;
+	}
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_run(const struct bench_mix_s *mix, double secs)
+{
+	struct bench_stream_s s;
+	uint32_t frames, rejected, passes = 0, i, log0;
+	double t0, t;
+
+	bench_build(&s, mix);
+	frames = g_metrics[METRIC_PROTO_FRAMES];
+	rejected = g_metrics[METRIC_PROTO_CRC_ERR] + g_metrics[METRIC_PROTO_BAD_FRAME];
+	log0 = g_log_bytes;
+	t0 = now_s();
+	do {
+		for (i = 0; i < s.len; i++)
+			PROTO_ParseByte(&rxProto, s.buf[i]);
+		passes++;
+		t = now_s() - t0;
+	} while (t < secs);
+
+	frames = g_metrics[METRIC_PROTO_FRAMES] - frames;
+	rejected = g_metrics[METRIC_PROTO_CRC_ERR] + g_metrics[METRIC_PROTO_BAD_FRAME] - rejected;
+	printf("%-8s %7.1f %8.1f %10.0f %7u %7u %9.0f  %s\n", mix->name,
+			s.len * passes / t / 1e6, t * 1e9 / ((double)s.len * passes),
+			frames / t, s.frames, s.rejected,
+			(double)(g_log_bytes - log0) / frames,
+			frames == s.frames * passes && rejected == s.rejected * passes ? "ok" : "MISMATCH");
+	free(s.buf);
+	return frames == s.frames * passes && rejected == s.rejected * passes ? 0 : 1;
+}
+
+void user_init(void)
+{
+	CMD_Init();
+}
+
+int main(int argc, char **argv)
+{
+	double secs = 0.5;
+	uint32_t i;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "t:h")) != -1) {
+		switch (c) {
+		case 't':
+			secs = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t SECS per mix]\n", argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	sim_boot();
+	user_init();
+	os_install_putc1(bench_putc);
+
+	printf("%-8s %7s %8s %10s %7s %7s %9s\n", "mix", "MB/s", "ns/byte",
+			"frames/s", "frames", "bad", "log B/fr");
+	for (i = 0; i < sizeof(g_mixes) / sizeof(g_mixes[0]); i++)
+		ret |= bench_run(&g_mixes[i], secs);
+	return ret;
+}
@@ -0,0 +1,79 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "crc16.h"
+#include "proto_frame.h"
+
+#define SLIP_START	0x7E
+#define SLIP_END	0x7F
+#define SLIP_REPL	0x7D
+
+static uint16_t put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return 2;
+}
+
+static uint16_t put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+	return 4;
+}
+
+uint16_t proto_packet(uint8_t *out, uint16_t size, uint16_t cmd, uint32_t callback,
+		uint32_t ret, uint16_t argc, const struct proto_arg_s *args)
+{
+	uint32_t n = 0, i, pad;
+
+	if (size < 14)
+		return 0;
+	n += put16(out + n, cmd);
+	n += put32(out + n, callback);
+	n += put32(out + n, ret);
+	n += put16(out + n, argc);
+	for (i = 0; i < argc; i++) {
+		pad = (4 - args[i].len % 4) % 4;
+		if (n + 2 + args[i].len + pad + 2 > size)
+			return 0;
+		n += put16(out + n, args[i].len + pad);
+		os_memcpy(out + n, args[i].data, args[i].len);
+		n += args[i].len;
+		os_memset(out + n, 0, pad);
+		n += pad;
+	}
+	n += 2;
+	proto_packet_seal(out, n);
+	return n;
+}
+
+void proto_packet_seal(uint8_t *packet, uint16_t len)
+{
+	if (len >= 2)
+		put16(packet + len - 2, crc16_data(packet, len - 2, 0));
+}
+
+uint16_t proto_slip(uint8_t *out, uint16_t size, const uint8_t *packet, uint16_t len)
+{
+	uint32_t n = 0, i;
+
+	if (size < 2)
+		return 0;
+	out[n++] = SLIP_START;
+	for (i = 0; i < len; i++) {
+		if (n + 3 > size)
+			return 0;
+		switch (packet[i]) {
+		case SLIP_START:
+		case SLIP_END:
+		case SLIP_REPL:
+			out[n++] = SLIP_REPL;
+			out[n++] = packet[i] ^ 0x20;
+			break;
+		default:
+			out[n++] = packet[i];
+		}
+	}
+	out[n++] = SLIP_END;
+	return n;
+}
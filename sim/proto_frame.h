@@ -0,0 +1,27 @@
+#ifndef __PROTO_FRAME_H__
+#define __PROTO_FRAME_H__
+
+#include "c_types.h"
+
+/*
+ * MCU side encoder of the bridge protocol (modules/cmd.c) for the
+ * parser benchmark and fuzzer. Args are padded to 4 bytes the way the
+ * Arduino library sends them.
+ */
+
+#define PROTO_FRAME_MAX		4096	/* raw packet, before SLIP escaping */
+
+struct proto_arg_s {
+	const void *data;
+	uint16_t len;
+};
+
+/* raw packet with its CRC, returns the length or 0 if it does not fit */
+uint16_t proto_packet(uint8_t *out, uint16_t size, uint16_t cmd, uint32_t callback,
+		uint32_t ret, uint16_t argc, const struct proto_arg_s *args);
+/* SLIP start, escaped packet, end; returns the length or 0 if it does not fit */
+uint16_t proto_slip(uint8_t *out, uint16_t size, const uint8_t *packet, uint16_t len);
+/* CRC of a raw packet over everything but the last two bytes, stored there */
+void proto_packet_seal(uint8_t *packet, uint16_t len);
+
+#endif /* __PROTO_FRAME_H__ */
@@ -0,0 +1,249 @@
+/*
+ * Fuzz harness for the MCU -> bridge receive path, PROTO_ParseByte and
+ * protoCompletedCb.
+ *
+ * The first input byte picks the mode. Even: the rest is a raw byte
+ * stream for the SLIP parser. Odd: the rest is a packet that gets a
+ * valid CRC and SLIP framing, so the arg walk and the dispatch are
+ * reached as well. In both the command of every frame is mapped onto
+ * one that takes no client handle; handles are pointers by design and
+ * are not validated.
+ *
+ * Built with libFuzzer (make fuzz LIBFUZZER=1 CC=clang) or with the
+ * mutation driver below (make fuzz), both under ASan and UBSan.
+ *
+ *   proto_fuzz [-n RUNS] [-s SEED]	mutate the built-in seeds
+ *   proto_fuzz FILE...			replay inputs, e.g. fuzz-crash.bin
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sanitizer/common_interface_defs.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "cmd.h"
+#include "proto.h"
+#include "proto_frame.h"
+#include "sim.h"
+
+#define FUZZ_INPUT_MAX		(2 * PROTO_FRAME_MAX)
+#define FUZZ_CRASH_FILE		"fuzz-crash.bin"
+
+extern PROTO_PARSER rxProto;
+
+static const uint16_t g_safe_cmds[] = { CMD_NULL, CMD_IS_READY, CMD_MEM, CMD_TRACE };
+
+static void fuzz_putc(char c)
+{
+}
+
+static uint8_t fuzz_safe_cmd(uint8_t cmd)
+{
+	uint8_t i, n = sizeof(g_safe_cmds) / sizeof(g_safe_cmds[0]);
+
+	for (i = 0; i < n; i++)
+		if (cmd == g_safe_cmds[i])
+			return cmd;
+	return g_safe_cmds[cmd % n];
+}
+
+/* every byte through the parser, the first two of a frame (cmd) mapped */
+static void fuzz_feed(const uint8_t *p, size_t len)
+{
+	uint8_t c, v;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = p[i];
+		if (rxProto.isBegin && rxProto.dataLen < 2 && c != 0x7D && c != 0x7E && c != 0x7F) {
+			v = rxProto.isEsc ? c ^ 0x20 : c;
+			v = rxProto.dataLen == 0 ? fuzz_safe_cmd(v) : 0;
+			c = rxProto.isEsc ? v ^ 0x20 : v;
+		}
+		PROTO_ParseByte(&rxProto, c);
+	}
+}
+
+void user_init(void)
+{
+	CMD_Init();
+}
+
+static void fuzz_init(void)
+{
+	static bool done;
+
+	if (done)
+		return;
+	done = true;
+	sim_boot();
+	user_init();
+	os_install_putc1(fuzz_putc);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static uint8_t packet[PROTO_FRAME_MAX], slip[2 * PROTO_FRAME_MAX + 2];
+	uint16_t len;
+
+	fuzz_init();
+	rxProto.isBegin = 0;
+	rxProto.isEsc = 0;
+	rxProto.dataLen = 0;
+	if (size < 1 || size > FUZZ_INPUT_MAX)
+		return 0;
+
+	if (!(data[0] & 1)) {
+		fuzz_feed(data + 1, size - 1);
+		return 0;
+	}
+	len = size - 1 < sizeof(packet) ? size - 1 : sizeof(packet);
+	os_memcpy(packet, data + 1, len);
+	if (len >= 2) {
+		packet[0] = fuzz_safe_cmd(packet[0]);
+		packet[1] = 0;
+	}
+	proto_packet_seal(packet, len);
+	len = proto_slip(slip, sizeof(slip), packet, len);
+	fuzz_feed(slip, len);
+	return 0;
+}
+
+#ifndef PROTO_FUZZ_LIBFUZZER
+
+static uint8_t g_input[FUZZ_INPUT_MAX];
+static size_t g_input_len;
+
+static void fuzz_save_crash(void)
+{
+	FILE *f = fopen(FUZZ_CRASH_FILE, "wb");
+
+	if (f) {
+		fwrite(g_input, 1, g_input_len, f);
+		fclose(f);
+		fprintf(stderr, "input saved to %s\n", FUZZ_CRASH_FILE);
+	}
+}
+
+static size_t fuzz_seed(uint8_t *out, uint32_t n)
+{
+	static const char topic[] = "/neuro/chatroom";
+	static uint8_t data[300];
+	uint32_t client = 0x3fff1000, num = sizeof(data), zero = 0;
+	struct proto_arg_s args[6] = {
+		{ &client, 4 }, { topic, sizeof(topic) - 1 }, { data, sizeof(data) },
+		{ &num, 4 }, { &zero, 4 }, { &zero, 4 },
+	};
+	uint8_t packet[PROTO_FRAME_MAX];
+	uint16_t len;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+	len = proto_packet(packet, sizeof(packet), n % 4 ? CMD_MQTT_PUBLISH : CMD_IS_READY,
+			n, n & 2, n % 4 ? 6 : 0, args);
+	/* odd: packet for the framed mode, even: the SLIP stream itself */
+	if (n & 1) {
+		out[0] = 1;
+		os_memcpy(out + 1, packet, len);
+		return len + 1;
+	}
+	out[0] = 0;
+	return proto_slip(out + 1, FUZZ_INPUT_MAX - 1, packet, len) + 1;
+}
+
+static void fuzz_mutate(uint8_t *buf, size_t *len)
+{
+	static const uint8_t special[] = { 0x00, 0x7D, 0x7E, 0x7F, 0xFF, 0x20 };
+	size_t pos = *len > 1 ? 1 + rand() % (*len - 1) : 0, n;
+
+	switch (rand() % 7) {
+	case 0:
+		buf[pos] ^= 1 << (rand() % 8);
+		break;
+	case 1:
+		buf[pos] = special[rand() % sizeof(special)];
+		break;
+	case 2:
+		if (*len < FUZZ_INPUT_MAX) {
+			memmove(buf + pos + 1, buf + pos, *len - pos);
+			buf[pos] = rand();
+			(*len)++;
+		}
+		break;
+	case 3:
+		if (*len > 1) {
+			memmove(buf + pos, buf + pos + 1, *len - pos - 1);
+			(*len)--;
+		}
+		break;
+	case 4:
+		*len = pos + 1;
+		break;
+	case 5:
+		/* a length or argc field, the mutations that matter most */
+		buf[1 + (rand() % 16)] = rand();
+		break;
+	case 6:
+		n = rand() % 64;
+		if (*len + n <= FUZZ_INPUT_MAX && pos + n <= *len) {
+			memmove(buf + pos + n, buf + pos, *len - pos);
+			(*len) += n;
+		}
+		break;
+	}
+}
+
+static int fuzz_replay(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	g_input_len = fread(g_input, 1, sizeof(g_input), f);
+	fclose(f);
+	LLVMFuzzerTestOneInput(g_input, g_input_len);
+	printf("%s: %u bytes, ok\n", path, (unsigned)g_input_len);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t runs = 100000, seed = 1, i, k;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (c) {
+		case 'n':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n RUNS] [-s SEED] [FILE...]\n", argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	__sanitizer_set_death_callback(fuzz_save_crash);
+	if (optind < argc) {
+		for (; optind < argc; optind++)
+			ret |= fuzz_replay(argv[optind]);
+		return ret;
+	}
+
+	srand(seed);
+	for (i = 0; i < runs; i++) {
+		g_input_len = fuzz_seed(g_input, i);
+		for (k = 1 + rand() % 8; k > 0; k--)
+			fuzz_mutate(g_input, &g_input_len);
+		LLVMFuzzerTestOneInput(g_input, g_input_len);
+	}
+	printf("%u runs, seed %u: no crashes\n", runs, seed);
+	return 0;
+}
+
+#endif /* PROTO_FUZZ_LIBFUZZER */
@@ -0,0 +1,419 @@
+/*
+ * Event loop and SDK task/timer model of the host simulator.
+ *
+ * The NonOS SDK runs one task at a time to completion: three task
+ * priorities with fixed size queues, os_timer callbacks and the lwIP
+ * and UART interrupts in between. sim_loop() does the same with poll()
+ * standing in for the interrupts, so anything that blocks here would
+ * have tripped the watchdog on the device as well.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "sim.h"
+
+#define SIM_WATCH_MAX	64
+#define SIM_WDT_MS	500	/* the SDK soft watchdog fires at ~3s, warn well before */
+
+struct sim_task_s {
+	os_task_t task;
+	os_event_t *queue;
+	uint8_t qlen;
+	uint8_t head;
+	uint8_t count;
+};
+
+struct sim_watch_s {
+	int fd;
+	short events;
+	sim_fd_cb_fp cb;
+	void *arg;
+};
+
+struct sim_defer_s {
+	sim_defer_fp fn;
+	void *arg;
+	struct sim_defer_s *next;
+};
+
+struct sim_opts_s sim_opts = {
+	.baud = -1,
+	.heap_size = 48 * 1024,
+	.chip_id = 0x00c0ffee,
+	.wifi_delay_ms = 200,
+	.tcp_mss = 1460,
+	.resolve = "127.0.0.1",
+};
+struct sim_stats_s sim_stats;
+
+static struct sim_task_s g_tasks[USER_TASK_PRIO_MAX];
+static struct sim_watch_s g_watch[SIM_WATCH_MAX];
+static int g_nwatch;
+static ETSTimer *g_timers;
+static struct sim_defer_s *g_defer_head, *g_defer_tail;
+static uint64_t g_boot_us;
+static volatile sig_atomic_t g_stop;
+static int g_exit_status = -1;
+
+void user_init(void);
+
+uint64_t sim_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - g_boot_us;
+}
+
+static inline uint32_t sim_now_ms(void)
+{
+	return (uint32_t)(sim_now_us() / 1000);
+}
+
+void sim_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void sim_request_exit(int status)
+{
+	if (g_exit_status < 0)
+		g_exit_status = status;
+}
+
+/* tasks */
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen)
+{
+	struct sim_task_s *t;
+
+	if (prio >= USER_TASK_PRIO_MAX || task == NULL || queue == NULL || qlen == 0)
+		return false;
+	t = &g_tasks[prio];
+	if (t->task == task)
+		return true;
+	if (t->task != NULL) {
+		/* two modules picked the same priority, only one of them would run */
+		sim_log("task prio %d already taken by %p, refusing %p", prio, t->task, task);
+		return false;
+	}
+	t->task = task;
+	t->queue = queue;
+	t->qlen = qlen;
+	t->head = 0;
+	t->count = 0;
+	return true;
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+	struct sim_task_s *t;
+	os_event_t *e;
+
+	if (prio >= USER_TASK_PRIO_MAX || g_tasks[prio].task == NULL)
+		return false;
+	t = &g_tasks[prio];
+	if (t->count == t->qlen) {
+		sim_stats.post_refused++;
+		return false;
+	}
+	e = &t->queue[(t->head + t->count) % t->qlen];
+	e->sig = sig;
+	e->par = par;
+	t->count++;
+	return true;
+}
+
+static void wdt_check(uint64_t t, const char *what, void *fn)
+{
+	uint64_t dt = sim_now_us() - t;
+	if (dt > SIM_WDT_MS * 1000) {
+		sim_stats.wdt_warns++;
+		sim_log("%s %p ran %u ms without yielding", what, fn, (unsigned)(dt / 1000));
+	}
+}
+
+/* one event of the highest priority task that has one */
+static bool run_task(void)
+{
+	struct sim_task_s *t;
+	os_event_t e;
+	uint64_t t0;
+	int prio;
+
+	for (prio = USER_TASK_PRIO_MAX - 1; prio >= 0; prio--) {
+		t = &g_tasks[prio];
+		if (t->count == 0)
+			continue;
+		e = t->queue[t->head];
+		t->head = (t->head + 1) % t->qlen;
+		t->count--;
+		t0 = sim_now_us();
+		t->task(&e);
+		wdt_check(t0, "task", t->task);
+		sim_stats.task_runs++;
+		return true;
+	}
+	return false;
+}
+
+/* timers, kept in an unsorted list through timer_next */
+
+static void timer_unlink(ETSTimer *ptimer)
+{
+	ETSTimer **pp;
+	for (pp = &g_timers; *pp; pp = &(*pp)->timer_next) {
+		if (*pp == ptimer) {
+			*pp = ptimer->timer_next;
+			break;
+		}
+	}
+	ptimer->timer_next = NULL;
+}
+
+static bool timer_armed(ETSTimer *ptimer)
+{
+	ETSTimer *t;
+	for (t = g_timers; t; t = t->timer_next)
+		if (t == ptimer)
+			return true;
+	return false;
+}
+
+void ets_timer_setfn(ETSTimer *ptimer, ETSTimerFunc *pfunction, void *parg)
+{
+	if (timer_armed(ptimer)) {
+		sim_log("timer %p set while armed, disarm it first", ptimer);
+		timer_unlink(ptimer);
+	}
+	ptimer->timer_func = pfunction;
+	ptimer->timer_arg = parg;
+	ptimer->timer_period = 0;
+	ptimer->timer_next = NULL;
+}
+
+void ets_timer_arm_new(ETSTimer *ptimer, uint32_t time, bool repeat_flag, bool ms_flag)
+{
+	uint32_t ms = ms_flag ? time : (time + 999) / 1000;
+
+	if (timer_armed(ptimer))
+		timer_unlink(ptimer);
+	ptimer->timer_expire = sim_now_ms() + ms;
+	ptimer->timer_period = repeat_flag ? (ms ? ms : 1) : 0;
+	ptimer->timer_next = g_timers;
+	g_timers = ptimer;
+}
+
+void ets_timer_disarm(ETSTimer *ptimer)
+{
+	timer_unlink(ptimer);
+}
+
+static bool run_timers(void)
+{
+	ETSTimer *t;
+	uint32_t now = sim_now_ms();
+	uint64_t t0;
+
+	for (t = g_timers; t; t = t->timer_next) {
+		if ((int32_t)(t->timer_expire - now) > 0)
+			continue;
+		if (t->timer_period)
+			t->timer_expire += t->timer_period;
+		else
+			timer_unlink(t);
+		if (t->timer_func == NULL)
+			return true;
+		t0 = sim_now_us();
+		t->timer_func(t->timer_arg);
+		wdt_check(t0, "timer", t->timer_func);
+		sim_stats.timer_runs++;
+		/* the callback may have changed the list, one per round */
+		return true;
+	}
+	return false;
+}
+
+/* ms until the next timer, -1 for none */
+static int timers_timeout(void)
+{
+	ETSTimer *t;
+	uint32_t now = sim_now_ms();
+	int32_t d, best = -1;
+
+	for (t = g_timers; t; t = t->timer_next) {
+		d = (int32_t)(t->timer_expire - now);
+		if (d < 0)
+			d = 0;
+		if (best < 0 || d < best)
+			best = d;
+	}
+	return best;
+}
+
+/* deferred calls, for callbacks the SDK makes asynchronously */
+
+void sim_defer(sim_defer_fp fn, void *arg)
+{
+	struct sim_defer_s *d = malloc(sizeof(*d));
+	if (d == NULL)
+		abort();
+	d->fn = fn;
+	d->arg = arg;
+	d->next = NULL;
+	if (g_defer_tail)
+		g_defer_tail->next = d;
+	else
+		g_defer_head = d;
+	g_defer_tail = d;
+}
+
+static bool run_deferred(void)
+{
+	struct sim_defer_s *d = g_defer_head;
+
+	if (d == NULL)
+		return false;
+	g_defer_head = d->next;
+	if (g_defer_head == NULL)
+		g_defer_tail = NULL;
+	d->fn(d->arg);
+	free(d);
+	return true;
+}
+
+/* file descriptors, the interrupt sources */
+
+void sim_watch(int fd, short events, sim_fd_cb_fp cb, void *arg)
+{
+	int i;
+
+	for (i = 0; i < g_nwatch; i++)
+		if (g_watch[i].fd == fd)
+			break;
+	if (events == 0) {
+		if (i < g_nwatch)
+			g_watch[i] = g_watch[--g_nwatch];
+		return;
+	}
+	if (i == g_nwatch) {
+		if (g_nwatch == SIM_WATCH_MAX) {
+			sim_log("too many descriptors");
+			abort();
+		}
+		g_nwatch++;
+	}
+	g_watch[i].fd = fd;
+	g_watch[i].events = events;
+	g_watch[i].cb = cb;
+	g_watch[i].arg = arg;
+}
+
+static void poll_fds(int timeout)
+{
+	struct pollfd pfd[SIM_WATCH_MAX];
+	struct sim_watch_s w;
+	int i, j, n = g_nwatch;
+
+	for (i = 0; i < n; i++) {
+		pfd[i].fd = g_watch[i].fd;
+		pfd[i].events = g_watch[i].events;
+		pfd[i].revents = 0;
+	}
+	if (poll(pfd, n, timeout) <= 0)
+		return;
+	for (i = 0; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		/* an earlier callback may have dropped or replaced this one */
+		for (j = 0; j < g_nwatch; j++)
+			if (g_watch[j].fd == pfd[i].fd)
+				break;
+		if (j == g_nwatch || !(pfd[i].revents & (g_watch[j].events | POLLERR | POLLHUP)))
+			continue;
+		w = g_watch[j];
+		w.cb(w.fd, pfd[i].revents, w.arg);
+	}
+}
+
+static void sim_loop(void)
+{
+	bool busy;
+	int timeout;
+	uint64_t end = sim_opts.run_secs ? sim_now_us() + (uint64_t)sim_opts.run_secs * 1000000 : 0;
+
+	while (!g_stop && g_exit_status < 0) {
+		busy = run_deferred();
+		busy |= run_timers();
+		busy |= run_task();
+		sim_uart_flush();
+		timeout = busy ? 0 : timers_timeout();
+		if (end) {
+			uint64_t now = sim_now_us();
+			if (now >= end)
+				break;
+			if (timeout < 0 || (uint64_t)timeout > (end - now) / 1000)
+				timeout = (end - now) / 1000 + 1;
+		}
+		poll_fds(timeout);
+	}
+}
+
+static void on_signal(int sig)
+{
+	g_stop = 1;
+}
+
+static void print_stats(void)
+{
+	sim_log("tasks %u, posts refused %u, timers %u, wdt warnings %u",
+			sim_stats.task_runs, sim_stats.post_refused,
+			sim_stats.timer_runs, sim_stats.wdt_warns);
+	sim_log("uart0 rx %u, tx %u, tx lost %u bytes; tcp rx %u, tx %u bytes",
+			sim_stats.uart_rx, sim_stats.uart_tx, sim_stats.uart_tx_lost,
+			sim_stats.tcp_rx, sim_stats.tcp_tx);
+	sim_log("heap %u of %u free, lowest %u, %u failed allocations",
+			sim_mem_free(), sim_opts.heap_size,
+			sim_stats.heap_min_free, sim_stats.heap_fail);
+}
+
+/* the SDK start up to user_init(), after the options are set */
+void sim_boot(void)
+{
+	g_boot_us = sim_now_us();
+	sim_mem_init(sim_opts.heap_size);
+	sim_flash_open();
+	sim_sys_boot();
+}
+
+/* user_init() and the loop until a signal, restart or -t, returns the exit code */
+int sim_run(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	user_init();
+	sim_sys_init_done();
+	sim_loop();
+
+	sim_uart_flush();
+	print_stats();
+	sim_uart_close();
+	if (g_exit_status == SIM_EXIT_RESTART)
+		sim_log("restart requested");
+	return g_exit_status < 0 ? 0 : g_exit_status;
+}
@@ -0,0 +1,81 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include "c_types.h"
+
+/*
+ * Linux host simulator for the firmware, see sim/README.md.
+ *
+ * One thread runs the SDK model: the three task priorities, os_timer,
+ * espconn over sockets and UART0 on a pty. Everything the firmware
+ * calls back into is dispatched from sim_loop(), so the code under test
+ * keeps the run-to-completion rules it has on the device.
+ */
+
+#define SIM_PORT_MAPS		8
+#define SIM_EXIT_RESTART	3	/* system_restart(), a wrapper may start us again */
+
+struct sim_opts_s {
+	const char *uart_link;		/* symlink to the UART0 pty slave */
+	const char *uart1_log;		/* UART1 output, NULL for stderr */
+	const char *flash_file;		/* NULL keeps the flash in memory */
+	const char *resolve;		/* every host name resolves here, NULL for DNS */
+	int32_t baud;			/* UART0 pacing, -1 for uart_init's rate, 0 for none */
+	uint32_t heap_size;
+	uint32_t chip_id;
+	uint32_t wifi_delay_ms;		/* association plus DHCP */
+	uint32_t tcp_mss;		/* most bytes one recv callback gets */
+	uint32_t run_secs;		/* 0 runs until a signal */
+	bool gw_down;			/* the gateway does not answer pings */
+	int port_map[SIM_PORT_MAPS][2];
+};
+
+struct sim_stats_s {
+	uint32_t task_runs;
+	uint32_t post_refused;		/* system_os_post on a full queue */
+	uint32_t timer_runs;
+	uint32_t wdt_warns;		/* callbacks that ran past SIM_WDT_MS */
+	uint32_t uart_rx;
+	uint32_t uart_tx;
+	uint32_t uart_tx_lost;		/* nobody drained the pty */
+	uint32_t tcp_tx;
+	uint32_t tcp_rx;
+	uint32_t heap_min_free;
+	uint32_t heap_fail;
+};
+
+extern struct sim_opts_s sim_opts;
+extern struct sim_stats_s sim_stats;
+
+#define sim_log(fmt, args...)	sim_printf("sim: " fmt "\n", ##args)
+void sim_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* event loop, sim.c */
+typedef void (*sim_fd_cb_fp)(int fd, short revents, void *arg);
+typedef void (*sim_defer_fp)(void *arg);
+
+void sim_boot(void);
+int sim_run(void);
+uint64_t sim_now_us(void);
+void sim_watch(int fd, short events, sim_fd_cb_fp cb, void *arg);
+void sim_defer(sim_defer_fp fn, void *arg);
+void sim_request_exit(int status);
+
+/* sim_uart.c */
+void sim_uart_flush(void);
+void sim_uart_close(void);
+void sim_uart_set_rx(void (*rx)(uint8_t c));
+
+/* sim_mem.c */
+void sim_mem_init(uint32_t size);
+uint32_t sim_mem_free(void);
+
+/* sim_sys.c */
+void sim_flash_open(void);
+void sim_sys_boot(void);
+void sim_sys_init_done(void);
+
+/* sim_espconn.c */
+int sim_port_map(int port);
+
+#endif /* __SIM_H__ */
@@ -0,0 +1,500 @@
+/*
+ * espconn TCP client over non-blocking sockets.
+ *
+ * Callbacks keep the SDK's timing: connect, sent and disconnect come
+ * later from the loop, never from inside the call that caused them, and
+ * a connection deleted from a callback is only freed once the loop is
+ * done with it. Data being sent is held in the firmware heap, as lwIP's
+ * pbufs would be.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+#include "espconn.h"
+#include "sim.h"
+
+#define SIM_TCP_MSS		1460	/* the chip's, and the most -m takes */
+
+struct sim_conn_s {
+	struct espconn *e;
+	int fd;
+	bool connected;
+	bool hold;
+	bool deleted;
+	uint8_t *tx;		/* one espconn_sent in flight, like the SDK allows */
+	uint16_t tx_len;
+	uint16_t tx_off;
+	struct sim_conn_s *next;
+};
+
+struct sim_dns_s {
+	struct espconn *e;
+	dns_found_callback found;
+	ip_addr_t ip;
+	bool ok;
+	char name[];
+};
+
+static struct sim_conn_s *g_conns;
+static uint16_t g_local_port = 0x1000;
+
+static void conn_ready(int fd, short revents, void *arg);
+
+int sim_port_map(int port)
+{
+	int i;
+	for (i = 0; i < SIM_PORT_MAPS; i++)
+		if (sim_opts.port_map[i][0] == port && sim_opts.port_map[i][1])
+			return sim_opts.port_map[i][1];
+	return port;
+}
+
+static struct sim_conn_s *conn_find(struct espconn *e)
+{
+	struct sim_conn_s *c;
+	for (c = g_conns; c; c = c->next)
+		if (c->e == e && !c->deleted)
+			return c;
+	return NULL;
+}
+
+static void conn_reap(void *arg)
+{
+	struct sim_conn_s *c = arg, **pp;
+
+	for (pp = &g_conns; *pp; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	}
+	free(c);
+}
+
+static void conn_close_fd(struct sim_conn_s *c)
+{
+	if (c->fd >= 0) {
+		sim_watch(c->fd, 0, NULL, NULL);
+		close(c->fd);
+		c->fd = -1;
+	}
+	c->connected = false;
+	if (c->tx) {
+		os_free(c->tx);
+		c->tx = NULL;
+	}
+}
+
+static void conn_delete(struct sim_conn_s *c)
+{
+	conn_close_fd(c);
+	c->deleted = true;
+	sim_defer(conn_reap, c);
+}
+
+static void conn_update_watch(struct sim_conn_s *c)
+{
+	short ev = 0;
+
+	if (c->fd < 0)
+		return;
+	if (!c->connected || c->tx)
+		ev |= POLLOUT;
+	if (c->connected && !c->hold)
+		ev |= POLLIN;
+	if (ev == 0)
+		ev = POLLERR;	/* keep watching for resets while held */
+	sim_watch(c->fd, ev, conn_ready, c);
+}
+
+static sint8 errno_to_espconn(int err)
+{
+	switch (err) {
+	case ECONNREFUSED:
+	case ECONNRESET:
+		return ESPCONN_RST;
+	case ETIMEDOUT:
+		return ESPCONN_TIMEOUT;
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return ESPCONN_RTE;
+	default:
+		return ESPCONN_ABRT;
+	}
+}
+
+/* the connection failed or was reset: reconnect callback, like lwIP's err callback */
+static void conn_error(struct sim_conn_s *c, int err)
+{
+	struct espconn *e = c->e;
+
+	conn_close_fd(c);
+	e->state = ESPCONN_CLOSE;
+	if (e->type == ESPCONN_TCP && e->proto.tcp->reconnect_callback)
+		e->proto.tcp->reconnect_callback(e, errno_to_espconn(err));
+}
+
+static void conn_closed(struct sim_conn_s *c)
+{
+	struct espconn *e = c->e;
+
+	conn_close_fd(c);
+	e->state = ESPCONN_CLOSE;
+	if (e->proto.tcp->disconnect_callback)
+		e->proto.tcp->disconnect_callback(e);
+}
+
+static void conn_sent_done(struct sim_conn_s *c)
+{
+	struct espconn *e = c->e;
+
+	os_free(c->tx);
+	c->tx = NULL;
+	conn_update_watch(c);
+	if (e->sent_callback)
+		e->sent_callback(e);
+	if (!c->deleted && e->proto.tcp->write_finish_fn)
+		e->proto.tcp->write_finish_fn(e);
+}
+
+static void conn_flush(struct sim_conn_s *c)
+{
+	ssize_t n;
+
+	while (c->tx && c->tx_off < c->tx_len) {
+		n = send(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			conn_error(c, errno);
+			return;
+		}
+		c->tx_off += n;
+		sim_stats.tcp_tx += n;
+	}
+	if (c->tx)
+		conn_sent_done(c);
+}
+
+static void conn_ready(int fd, short revents, void *arg)
+{
+	struct sim_conn_s *c = arg;
+	struct espconn *e = c->e;
+	char buf[SIM_TCP_MSS];
+	socklen_t len;
+	ssize_t n;
+	int err;
+
+	if (!c->connected) {
+		err = 0;
+		len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			conn_error(c, err);
+			return;
+		}
+		c->connected = true;
+		e->state = ESPCONN_CONNECT;
+		conn_update_watch(c);
+		if (e->proto.tcp->connect_callback)
+			e->proto.tcp->connect_callback(e);
+		return;
+	}
+	if (c->hold && (revents & (POLLERR | POLLHUP))) {
+		err = 0;
+		len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		conn_error(c, err ? err : ECONNRESET);
+		return;
+	}
+	if ((revents & POLLOUT) && c->tx) {
+		conn_flush(c);
+		if (c->deleted || !c->connected)
+			return;
+	}
+	if ((revents & (POLLIN | POLLHUP | POLLERR)) && !c->hold) {
+		n = recv(fd, buf, sim_opts.tcp_mss < sizeof(buf) ? sim_opts.tcp_mss : sizeof(buf), 0);
+		if (n > 0) {
+			sim_stats.tcp_rx += n;
+			e->state = ESPCONN_READ;
+			if (e->recv_callback)
+				e->recv_callback(e, buf, n);
+		} else if (n == 0) {
+			conn_closed(c);
+		} else if (errno != EAGAIN && errno != EINTR) {
+			conn_error(c, errno);
+		}
+	}
+}
+
+static void conn_connect_failed(void *arg)
+{
+	struct sim_conn_s *c = arg;
+	if (!c->deleted)
+		conn_error(c, ENETUNREACH);
+}
+
+sint8 espconn_connect(struct espconn *e)
+{
+	struct sim_conn_s *c;
+	struct sockaddr_in sa;
+	esp_tcp *tcp;
+	int one = 1;
+
+	if (e == NULL || e->type != ESPCONN_TCP || e->proto.tcp == NULL)
+		return ESPCONN_ARG;
+	c = conn_find(e);
+	if (c && c->fd >= 0)
+		return ESPCONN_ISCONN;
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL)
+			return ESPCONN_MEM;
+		c->e = e;
+		c->next = g_conns;
+		g_conns = c;
+	}
+	tcp = e->proto.tcp;
+	c->hold = false;
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd < 0)
+		return ESPCONN_MEM;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	os_memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(sim_port_map(tcp->remote_port));
+	os_memcpy(&sa.sin_addr, tcp->remote_ip, 4);
+	if (tcp->local_port == 0)
+		tcp->local_port = espconn_port();
+	e->state = ESPCONN_WAIT;
+
+	if (connect(c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS) {
+		sim_defer(conn_connect_failed, c);
+		return ESPCONN_OK;
+	}
+	conn_update_watch(c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn *e, uint8 *psent, uint16 length)
+{
+	struct sim_conn_s *c = conn_find(e);
+
+	if (c == NULL || !c->connected || psent == NULL)
+		return ESPCONN_ARG;
+	if (c->tx)
+		return ESPCONN_MAXNUM;
+	c->tx = os_malloc(length ? length : 1);
+	if (c->tx == NULL)
+		return ESPCONN_MEM;
+	os_memcpy(c->tx, psent, length);
+	c->tx_len = length;
+	c->tx_off = 0;
+	e->state = ESPCONN_WRITE;
+	/* the sent callback comes from the loop, never from in here */
+	conn_update_watch(c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn *e, uint8 *psent, uint16 length)
+{
+	return espconn_sent(e, psent, length);
+}
+
+static void conn_disconnected(void *arg)
+{
+	struct sim_conn_s *c = arg;
+	struct espconn *e = c->e;
+
+	if (c->deleted || c->fd >= 0)
+		return;
+	if (e->proto.tcp->disconnect_callback)
+		e->proto.tcp->disconnect_callback(e);
+}
+
+sint8 espconn_disconnect(struct espconn *e)
+{
+	struct sim_conn_s *c = conn_find(e);
+
+	if (c == NULL || c->fd < 0)
+		return ESPCONN_ARG;
+	conn_close_fd(c);
+	e->state = ESPCONN_CLOSE;
+	sim_defer(conn_disconnected, c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_delete(struct espconn *e)
+{
+	struct sim_conn_s *c = conn_find(e);
+
+	if (c == NULL)
+		return ESPCONN_ARG;
+	conn_delete(c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn *e)
+{
+	struct sim_conn_s *c = conn_find(e);
+
+	if (c == NULL)
+		return ESPCONN_ARG;
+	c->hold = true;
+	conn_update_watch(c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn *e)
+{
+	struct sim_conn_s *c = conn_find(e);
+
+	if (c == NULL)
+		return ESPCONN_ARG;
+	c->hold = false;
+	conn_update_watch(c);
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *e, espconn_connect_callback connect_cb)
+{
+	if (e == NULL || e->proto.tcp == NULL)
+		return ESPCONN_ARG;
+	e->proto.tcp->connect_callback = connect_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *e, espconn_reconnect_callback recon_cb)
+{
+	if (e == NULL || e->proto.tcp == NULL)
+		return ESPCONN_ARG;
+	e->proto.tcp->reconnect_callback = recon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *e, espconn_connect_callback discon_cb)
+{
+	if (e == NULL || e->proto.tcp == NULL)
+		return ESPCONN_ARG;
+	e->proto.tcp->disconnect_callback = discon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_write_finish(struct espconn *e, espconn_connect_callback write_finish_fn)
+{
+	if (e == NULL || e->proto.tcp == NULL)
+		return ESPCONN_ARG;
+	e->proto.tcp->write_finish_fn = write_finish_fn;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *e, espconn_recv_callback recv_cb)
+{
+	if (e == NULL)
+		return ESPCONN_ARG;
+	e->recv_callback = recv_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *e, espconn_sent_callback sent_cb)
+{
+	if (e == NULL)
+		return ESPCONN_ARG;
+	e->sent_callback = sent_cb;
+	return ESPCONN_OK;
+}
+
+uint32 espconn_port(void)
+{
+	if (++g_local_port < 0x1000)
+		g_local_port = 0x1000;
+	return g_local_port;
+}
+
+/* DNS: answered from the loop, as if the resolver had been asked */
+
+static void dns_done(void *arg)
+{
+	struct sim_dns_s *d = arg;
+
+	d->found(d->name, d->ok ? &d->ip : NULL, d->e);
+	free(d);
+}
+
+err_t espconn_gethostbyname(struct espconn *e, const char *hostname, ip_addr_t *addr, dns_found_callback found)
+{
+	struct addrinfo hints, *res;
+	struct sim_dns_s *d;
+	struct in_addr in;
+
+	if (hostname == NULL || addr == NULL)
+		return ESPCONN_ARG;
+	/* literals are answered right away, like lwIP does */
+	if (inet_aton(hostname, &in)) {
+		addr->addr = in.s_addr;
+		return ESPCONN_OK;
+	}
+	d = calloc(1, sizeof(*d) + os_strlen(hostname) + 1);
+	if (d == NULL)
+		return ESPCONN_MEM;
+	d->e = e;
+	d->found = found;
+	os_strcpy(d->name, hostname);
+	if (sim_opts.resolve) {
+		d->ok = inet_aton(sim_opts.resolve, &in);
+		d->ip.addr = in.s_addr;
+	} else {
+		os_memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(hostname, NULL, &hints, &res) == 0) {
+			d->ip.addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+			d->ok = true;
+			freeaddrinfo(res);
+		}
+	}
+	sim_defer(dns_done, d);
+	return ESPCONN_INPROGRESS;
+}
+
+/* TLS */
+
+static void secure_warn(void)
+{
+	static bool warned;
+	if (!warned)
+		sim_log("no TLS in the simulator, secure connections run in plain text");
+	warned = true;
+}
+
+sint8 espconn_secure_connect(struct espconn *e)
+{
+	secure_warn();
+	return espconn_connect(e);
+}
+
+sint8 espconn_secure_disconnect(struct espconn *e)
+{
+	return espconn_disconnect(e);
+}
+
+sint8 espconn_secure_sent(struct espconn *e, uint8 *psent, uint16 length)
+{
+	return espconn_sent(e, psent, length);
+}
+
+sint8 espconn_secure_send(struct espconn *e, uint8 *psent, uint16 length)
+{
+	return espconn_sent(e, psent, length);
+}
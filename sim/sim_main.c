@@ -0,0 +1,90 @@
+/*
+ * Command line of the simulated firmware images, see README.md.
+ */
+#include <getopt.h>
+#include <stdlib.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "sim.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -u PATH     symlink to the UART0 pty\n"
+		"  -l FILE     UART1 output, default stderr\n"
+		"  -f FILE     flash image, kept in memory without\n"
+		"  -b BAUD     UART0 pacing, 0 for none, default the rate from uart_init\n"
+		"  -r ADDR     resolve every host name to ADDR (default 127.0.0.1), 'dns' for the system resolver\n"
+		"  -p FROM=TO  connect to port TO where the firmware asks for FROM, repeatable\n"
+		"  -H BYTES    heap size (default %u)\n"
+		"  -c ID       chip id\n"
+		"  -w MS       wifi association time (default %u)\n"
+		"  -m BYTES    largest TCP segment handed to the firmware (default %u)\n"
+		"  -G          the gateway does not answer pings\n"
+		"  -t SECS     exit after SECS seconds\n",
+		prog, sim_opts.heap_size, sim_opts.wifi_delay_ms, sim_opts.tcp_mss);
+}
+
+int main(int argc, char **argv)
+{
+	int c, nmap = 0;
+
+	while ((c = getopt(argc, argv, "u:l:f:b:r:p:H:c:w:m:t:Gh")) != -1) {
+		switch (c) {
+		case 'u':
+			sim_opts.uart_link = optarg;
+			break;
+		case 'l':
+			sim_opts.uart1_log = optarg;
+			break;
+		case 'f':
+			sim_opts.flash_file = optarg;
+			break;
+		case 'b':
+			sim_opts.baud = atoi(optarg);
+			break;
+		case 'r':
+			sim_opts.resolve = strcmp(optarg, "dns") ? optarg : NULL;
+			break;
+		case 'p':
+			if (nmap == SIM_PORT_MAPS ||
+					sscanf(optarg, "%d=%d", &sim_opts.port_map[nmap][0],
+						&sim_opts.port_map[nmap][1]) != 2) {
+				usage(argv[0]);
+				return 2;
+			}
+			nmap++;
+			break;
+		case 'H':
+			sim_opts.heap_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			sim_opts.chip_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			sim_opts.wifi_delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			sim_opts.tcp_mss = strtoul(optarg, NULL, 0);
+			if (sim_opts.tcp_mss == 0) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 't':
+			sim_opts.run_secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			sim_opts.gw_down = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 2;
+		}
+	}
+
+	sim_boot();
+	return sim_run();
+}
@@ -0,0 +1,105 @@
+/*
+ * The ROM's MD5 routines (RFC 1321), which modules/ota.c and the flasher
+ * stub in tools/stub/ call by their ROM names.
+ */
+#include <stdint.h>
+#include <string.h>
+
+struct MD5Context {
+	uint32_t buf[4];
+	uint32_t bits[2];
+	uint8_t in[64];
+};
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const uint8_t md5_r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static void md5_block(uint32_t h[4], const uint8_t *p)
+{
+	uint32_t m[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+	int i, g;
+
+	for (i = 0; i < 16; i++)
+		m[i] = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		t = a + f + md5_k[i] + m[g];
+		a = d;
+		d = c;
+		c = b;
+		b += (t << md5_r[(i / 16) * 4 + (i & 3)]) | (t >> (32 - md5_r[(i / 16) * 4 + (i & 3)]));
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+void MD5Init(struct MD5Context *ctx)
+{
+	ctx->buf[0] = 0x67452301;
+	ctx->buf[1] = 0xefcdab89;
+	ctx->buf[2] = 0x98badcfe;
+	ctx->buf[3] = 0x10325476;
+	ctx->bits[0] = 0;
+	ctx->bits[1] = 0;
+}
+
+void MD5Update(struct MD5Context *ctx, const void *buf, uint32_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t used = (ctx->bits[0] >> 3) & 63, n;
+
+	if ((ctx->bits[0] += len << 3) < (len << 3))
+		ctx->bits[1]++;
+	ctx->bits[1] += len >> 29;
+	while (len) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->in + used, p, n);
+		used += n;
+		p += n;
+		len -= n;
+		if (used == 64) {
+			md5_block(ctx->buf, ctx->in);
+			used = 0;
+		}
+	}
+}
+
+void MD5Final(uint8_t digest[16], struct MD5Context *ctx)
+{
+	static const uint8_t pad[64] = { 0x80 };
+	uint8_t len[8];
+	uint32_t used = (ctx->bits[0] >> 3) & 63;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		len[i] = ctx->bits[0] >> (i * 8);
+		len[i + 4] = ctx->bits[1] >> (i * 8);
+	}
+	MD5Update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+	MD5Update(ctx, len, 8);
+	for (i = 0; i < 16; i++)
+		digest[i] = ctx->buf[i / 4] >> ((i & 3) * 8);
+}
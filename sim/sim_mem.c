@@ -0,0 +1,153 @@
+/*
+ * The firmware heap: a fixed arena of the size the device has left
+ * after the SDK, so allocation failures show up under load the way
+ * they would on the device. First fit with coalescing, like the SDK's.
+ *
+ * The bridge hands pointers to the MCU as 32 bit handles, the arena is
+ * in .bss of a non-PIE binary so they survive a 64 bit host.
+ */
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+#include "sim.h"
+
+#define SIM_HEAP_MAX	(1024 * 1024)
+#define BLK_ALIGN	8
+
+struct blk_s {
+	uint32_t size;		/* including this header */
+	uint32_t used;
+	const char *file;	/* allocation site, for the double free report */
+	uint32_t line;
+	uint32_t pad;
+};
+
+static uint8_t g_heap[SIM_HEAP_MAX] __attribute__((aligned(BLK_ALIGN)));
+static uint32_t g_heap_size;
+static uint32_t g_heap_used;
+
+#define BLK_HDR		((uint32_t)sizeof(struct blk_s))
+#define BLK_AT(off)	((struct blk_s *)(g_heap + (off)))
+
+void sim_mem_init(uint32_t size)
+{
+	if ((uint64_t)(uintptr_t)g_heap + SIM_HEAP_MAX > 0xffffffffULL) {
+		sim_log("heap above 4GB, pointers won't fit 32 bit handles, build with -no-pie");
+		exit(1);
+	}
+	if (size > SIM_HEAP_MAX)
+		size = SIM_HEAP_MAX;
+	g_heap_size = size & ~(BLK_ALIGN - 1);
+	BLK_AT(0)->size = g_heap_size;
+	BLK_AT(0)->used = 0;
+	sim_stats.heap_min_free = g_heap_size;
+}
+
+uint32_t sim_mem_free(void)
+{
+	return g_heap_size - g_heap_used;
+}
+
+static void *blk_alloc(size_t sz, const char *file, int line)
+{
+	uint32_t need, off, next;
+	struct blk_s *b, *n;
+
+	if (sz > g_heap_size)
+		goto fail;
+	need = (BLK_HDR + (sz ? sz : 1) + BLK_ALIGN - 1) & ~(BLK_ALIGN - 1);
+	for (off = 0; off < g_heap_size; off += b->size) {
+		b = BLK_AT(off);
+		if (b->used)
+			continue;
+		/* merge the free run that starts here */
+		for (next = off + b->size; next < g_heap_size && !BLK_AT(next)->used; next = off + b->size)
+			b->size += BLK_AT(next)->size;
+		if (b->size < need)
+			continue;
+		if (b->size - need >= BLK_HDR + BLK_ALIGN) {
+			n = BLK_AT(off + need);
+			n->size = b->size - need;
+			n->used = 0;
+			b->size = need;
+		}
+		b->used = 1;
+		b->file = file;
+		b->line = line;
+		g_heap_used += b->size;
+		if (sim_mem_free() < sim_stats.heap_min_free)
+			sim_stats.heap_min_free = sim_mem_free();
+		return b + 1;
+	}
+fail:
+	/* the first few in full, later ones sampled, mem_track probes by failing */
+	if (sim_stats.heap_fail++ < 8 || sim_stats.heap_fail % 1000 == 0)
+		sim_log("heap: %zu bytes for %s:%d failed, %u free (%u failures)",
+				sz, file, line, sim_mem_free(), sim_stats.heap_fail);
+	return NULL;
+}
+
+static struct blk_s *blk_of(void *p, const char *file, int line)
+{
+	struct blk_s *b = (struct blk_s *)p - 1;
+
+	if ((uint8_t *)p < g_heap + BLK_HDR || (uint8_t *)p >= g_heap + g_heap_size ||
+			((uint8_t *)b - g_heap) % BLK_ALIGN) {
+		sim_log("heap: %s:%d frees %p, not a heap pointer", file, line, p);
+		abort();
+	}
+	if (!b->used) {
+		sim_log("heap: %s:%d frees %p twice, allocated at %s:%u", file, line, p, b->file, b->line);
+		abort();
+	}
+	return b;
+}
+
+void *pvPortMalloc(size_t sz, const char *file, int line)
+{
+	return blk_alloc(sz, file, line);
+}
+
+void *pvPortZalloc(size_t sz, const char *file, int line)
+{
+	void *p = blk_alloc(sz, file, line);
+	if (p)
+		os_memset(p, 0, sz);
+	return p;
+}
+
+void *pvPortCalloc(size_t count, size_t size, const char *file, int line)
+{
+	return pvPortZalloc(count * size, file, line);
+}
+
+void vPortFree(void *p, const char *file, int line)
+{
+	struct blk_s *b;
+
+	if (p == NULL)
+		return;
+	b = blk_of(p, file, line);
+	b->used = 0;
+	g_heap_used -= b->size;
+}
+
+void *pvPortRealloc(void *p, size_t n, const char *file, int line)
+{
+	struct blk_s *b;
+	void *q;
+	size_t old;
+
+	if (p == NULL)
+		return blk_alloc(n, file, line);
+	b = blk_of(p, file, line);
+	old = b->size - BLK_HDR;
+	if (n <= old)
+		return p;
+	q = blk_alloc(n, file, line);
+	if (q == NULL)
+		return NULL;
+	os_memcpy(q, p, old);
+	vPortFree(p, file, line);
+	return q;
+}
@@ -0,0 +1,148 @@
+/*
+ * Host build of the flasher stub in tools/stub/, run by tests/fake_rom.py
+ * when esptool.py starts the stub it loaded.
+ *
+ * UART0 is stdin/stdout, which the fake loader points at its pty. Flash is
+ * a file, written through as it changes and with the chip's rules: erase
+ * sets a sector to 0xff, a write can only clear bits. A read that fails,
+ * the host closing the port, ends the stub like a reset of the chip.
+ *
+ *   stub_sim -f FLASH [-s SIZE]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "stub.h"
+
+static int flash_fd = -1;
+static uint32_t flash_size = 0x100000;
+
+static uint8_t rx_buf[4096];
+static size_t rx_len, rx_pos;
+static uint8_t tx_buf[4096];
+static size_t tx_len;
+
+static void tx_flush(void)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < tx_len) {
+		n = write(STDOUT_FILENO, tx_buf + off, tx_len - off);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	tx_len = 0;
+}
+
+int stub_uart_rx(void)
+{
+	ssize_t n;
+
+	if (rx_pos == rx_len) {
+		/* whatever was answered goes out before we wait */
+		tx_flush();
+		n = read(STDIN_FILENO, rx_buf, sizeof(rx_buf));
+		if (n <= 0)
+			return -1;
+		rx_len = n;
+		rx_pos = 0;
+	}
+	return rx_buf[rx_pos++];
+}
+
+void stub_uart_tx(uint8_t c)
+{
+	if (tx_len == sizeof(tx_buf))
+		tx_flush();
+	tx_buf[tx_len++] = c;
+}
+
+/* a pty has no baud rate */
+void stub_uart_baud(uint32_t baud, uint32_t prior)
+{
+	tx_flush();
+}
+
+uint32_t stub_read_reg(uint32_t addr)
+{
+	return 0;
+}
+
+void stub_write_reg(uint32_t addr, uint32_t value, uint32_t mask, uint32_t delay_us)
+{
+}
+
+int stub_flash_erase(uint32_t sector)
+{
+	uint8_t ff[0x1000];
+
+	if ((sector + 1) * sizeof(ff) > flash_size)
+		return 1;
+	memset(ff, 0xff, sizeof(ff));
+	return pwrite(flash_fd, ff, sizeof(ff), sector * sizeof(ff)) != sizeof(ff);
+}
+
+int stub_flash_write(uint32_t addr, const uint32_t *data, uint32_t len)
+{
+	uint8_t old[0x4000];
+	const uint8_t *src = (const uint8_t *)data;
+	uint32_t i;
+
+	if ((addr & 3) || (len & 3) || len > sizeof(old) || addr + len > flash_size)
+		return 1;
+	if (pread(flash_fd, old, len, addr) != len)
+		return 1;
+	for (i = 0; i < len; i++)
+		old[i] &= src[i];
+	return pwrite(flash_fd, old, len, addr) != len;
+}
+
+int stub_flash_read(uint32_t addr, uint32_t *data, uint32_t len)
+{
+	if (addr + len > flash_size)
+		return 1;
+	return pread(flash_fd, data, len, addr) != len;
+}
+
+void stub_reboot(void)
+{
+	tx_flush();
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 's':
+			flash_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s -f FLASH [-s SIZE]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (path == NULL) {
+		fprintf(stderr, "usage: %s -f FLASH [-s SIZE]\n", argv[0]);
+		return 2;
+	}
+	flash_fd = open(path, O_RDWR);
+	if (flash_fd < 0) {
+		perror(path);
+		return 1;
+	}
+	stub_main();
+	tx_flush();
+	return 0;
+}
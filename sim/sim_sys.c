@@ -0,0 +1,279 @@
+/*
+ * system_*, flash, RTC memory and the rest of the SDK's small calls.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "spi_flash.h"
+#include "upgrade.h"
+#include "sim.h"
+
+#define SIM_FLASH_SIZE		0x100000	/* 1MB, the layout the OTA build links for */
+#define SIM_RTC_MEM_SIZE	768
+
+static uint8_t *g_flash;
+static int g_flash_fd = -1;
+static uint32_t g_rtc_mem[SIM_RTC_MEM_SIZE / 4];
+static uint8_t g_cpu_freq = 80;
+static uint8_t g_upgrade_flag = UPGRADE_FLAG_IDLE;
+static void (*g_init_done_cb)(void);
+static void (*g_putc1)(char c);
+
+/* system */
+
+uint32 system_get_time(void)
+{
+	return (uint32)sim_now_us();
+}
+
+uint32 system_get_rtc_time(void)
+{
+	/* ~5.75us per RTC tick on the device */
+	return (uint32)(sim_now_us() * 4 / 23);
+}
+
+uint32 system_get_chip_id(void)
+{
+	return sim_opts.chip_id;
+}
+
+uint32 system_get_free_heap_size(void)
+{
+	return sim_mem_free();
+}
+
+uint8 system_get_cpu_freq(void)
+{
+	return g_cpu_freq;
+}
+
+bool system_update_cpu_freq(uint8 freq)
+{
+	if (freq != 80 && freq != 160)
+		return false;
+	g_cpu_freq = freq;
+	return true;
+}
+
+void system_print_meminfo(void)
+{
+	os_printf("heap: %u of %u free\n", sim_mem_free(), sim_opts.heap_size);
+}
+
+void system_restart(void)
+{
+	/* like the SDK, the restart happens once the caller returns */
+	sim_request_exit(SIM_EXIT_RESTART);
+}
+
+void system_init_done_cb(void (*cb)(void))
+{
+	g_init_done_cb = cb;
+}
+
+static void init_done(void *arg)
+{
+	if (g_init_done_cb)
+		g_init_done_cb();
+}
+
+void sim_sys_init_done(void)
+{
+	sim_defer(init_done, NULL);
+}
+
+void sim_sys_boot(void)
+{
+	srandom(sim_opts.chip_id ^ (uint32_t)time(NULL));
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size)
+{
+	if (des_addr == NULL || src_addr * 4 + load_size > SIM_RTC_MEM_SIZE)
+		return false;
+	os_memcpy(des_addr, (uint8_t *)g_rtc_mem + src_addr * 4, load_size);
+	return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size)
+{
+	/* the first 64 blocks belong to the SDK */
+	if (src_addr == NULL || des_addr < 64 || des_addr * 4 + save_size > SIM_RTC_MEM_SIZE)
+		return false;
+	os_memcpy((uint8_t *)g_rtc_mem + des_addr * 4, src_addr, save_size);
+	return true;
+}
+
+/* upgrade, always running from user1 */
+
+uint8 system_upgrade_userbin_check(void)
+{
+	return UPGRADE_FW_BIN1;
+}
+
+void system_upgrade_flag_set(uint8 flag)
+{
+	g_upgrade_flag = flag;
+}
+
+uint8 system_upgrade_flag_check(void)
+{
+	return g_upgrade_flag;
+}
+
+void system_upgrade_reboot(void)
+{
+	sim_log("upgrade reboot, flag %d", g_upgrade_flag);
+	system_restart();
+}
+
+/* flash, NOR semantics: erase sets a sector to 0xff, writes only clear bits */
+
+void sim_flash_open(void)
+{
+	ssize_t n;
+
+	g_flash = malloc(SIM_FLASH_SIZE);
+	if (g_flash == NULL)
+		abort();
+	os_memset(g_flash, 0xff, SIM_FLASH_SIZE);
+	if (sim_opts.flash_file == NULL)
+		return;
+	g_flash_fd = open(sim_opts.flash_file, O_RDWR | O_CREAT, 0644);
+	if (g_flash_fd < 0) {
+		sim_log("%s: %s", sim_opts.flash_file, strerror(errno));
+		exit(1);
+	}
+	n = pread(g_flash_fd, g_flash, SIM_FLASH_SIZE, 0);
+	if (n < SIM_FLASH_SIZE) {
+		if (n < 0)
+			n = 0;
+		/* a new or short image reads as erased */
+		os_memset(g_flash + n, 0xff, SIM_FLASH_SIZE - n);
+		if (pwrite(g_flash_fd, g_flash + n, SIM_FLASH_SIZE - n, n) != SIM_FLASH_SIZE - n)
+			sim_log("%s: %s", sim_opts.flash_file, strerror(errno));
+	}
+}
+
+static void flash_sync(uint32 addr, uint32 size)
+{
+	if (g_flash_fd >= 0 && pwrite(g_flash_fd, g_flash + addr, size, addr) != (ssize_t)size)
+		sim_log("%s: %s", sim_opts.flash_file, strerror(errno));
+}
+
+uint32 spi_flash_get_id(void)
+{
+	return 0x1440e0;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+	uint32 addr = (uint32)sec * SPI_FLASH_SEC_SIZE;
+
+	if (addr + SPI_FLASH_SEC_SIZE > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	os_memset(g_flash + addr, 0xff, SPI_FLASH_SEC_SIZE);
+	flash_sync(addr, SPI_FLASH_SEC_SIZE);
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+	uint8_t *src = (uint8_t *)src_addr;
+	uint32 i;
+
+	if ((des_addr & 3) || (size & 3) || ((uintptr_t)src_addr & 3)) {
+		sim_log("unaligned flash write %x+%u", des_addr, size);
+		return SPI_FLASH_RESULT_ERR;
+	}
+	if (des_addr + size > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	for (i = 0; i < size; i++)
+		g_flash[des_addr + i] &= src[i];
+	flash_sync(des_addr, size);
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+	if ((src_addr & 3) || ((uintptr_t)des_addr & 3)) {
+		sim_log("unaligned flash read %x+%u", src_addr, size);
+		return SPI_FLASH_RESULT_ERR;
+	}
+	if (src_addr + size > SIM_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	os_memcpy(des_addr, g_flash + src_addr, size);
+	return SPI_FLASH_RESULT_OK;
+}
+
+/* ets and os helpers */
+
+void ets_bzero(void *s, size_t n)
+{
+	memset(s, 0, n);
+}
+
+void ets_delay_us(uint32_t us)
+{
+	/* a busy wait on the device, it holds up everything here too */
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+void ets_install_putc1(void *routine)
+{
+	g_putc1 = (void (*)(char))routine;
+}
+
+int ets_printf(const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int i, n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(buf))
+		n = sizeof(buf) - 1;
+	for (i = 0; i < n; i++) {
+		if (g_putc1)
+			g_putc1(buf[i]);
+		else
+			fputc(buf[i], stderr);
+	}
+	return n;
+}
+
+void ets_intr_lock(void)
+{
+}
+
+void ets_intr_unlock(void)
+{
+}
+
+unsigned long os_random(void)
+{
+	return (unsigned long)random();
+}
+
+int os_get_random(unsigned char *buf, size_t len)
+{
+	while (len--)
+		*buf++ = random();
+	return 0;
+}
+
+uint32 ipaddr_addr(const char *cp)
+{
+	return inet_addr(cp);
+}
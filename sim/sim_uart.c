@@ -0,0 +1,285 @@
+/*
+ * driver/uart.c for the simulator: UART0 is a pty, UART1 a log file.
+ *
+ * Both directions are paced at the configured baud rate, 10 bit times
+ * per byte. RX only reads what the line could have delivered so a fast
+ * writer is held back by the pty like hardware flow control would, TX
+ * blocks once the 128 byte FIFO is full the way uart0_write spins.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "driver/uart.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hot.h"
+#include "sim.h"
+
+#define UART_FIFO_SIZE		128
+#define UART_TX_BUF		4096
+#define UART_TX_WAIT_MS		20	/* then the bytes are dropped, nobody reads the pty */
+
+extern void neurite_cmd_input(uint8_t data) __attribute__((weak));
+
+struct sim_uart_s {
+	int master;
+	int slave;		/* held open so the pty survives readers coming and going */
+	FILE *log;
+	uint32_t baud;
+	/* TX line model */
+	uint64_t tx_free_at;	/* us the last queued byte leaves the wire */
+	uint8_t tx_buf[UART_TX_BUF];
+	uint16_t tx_len;
+	/* RX budget */
+	uint64_t rx_at;
+	uint32_t rx_credit;
+	bool rx_paused;
+	ETSTimer rx_timer;
+	void (*rx)(uint8_t c);
+};
+
+static struct sim_uart_s g_uart = {
+	.master = -1,
+	.slave = -1,
+};
+
+static void uart_rx_ready(int fd, short revents, void *arg);
+
+void sim_uart_set_rx(void (*rx)(uint8_t c))
+{
+	g_uart.rx = rx;
+}
+
+static inline uint32_t byte_us(void)
+{
+	return g_uart.baud ? 10000000 / g_uart.baud : 0;
+}
+
+static void uart_open(void)
+{
+	struct termios tio;
+	const char *name;
+
+	g_uart.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (g_uart.master < 0 || grantpt(g_uart.master) < 0 || unlockpt(g_uart.master) < 0) {
+		sim_log("pty: %s", strerror(errno));
+		exit(1);
+	}
+	name = ptsname(g_uart.master);
+	g_uart.slave = open(name, O_RDWR | O_NOCTTY);
+	if (g_uart.slave < 0) {
+		sim_log("%s: %s", name, strerror(errno));
+		exit(1);
+	}
+	tcgetattr(g_uart.slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(g_uart.slave, TCSANOW, &tio);
+	fcntl(g_uart.master, F_SETFL, fcntl(g_uart.master, F_GETFL) | O_NONBLOCK);
+
+	if (sim_opts.uart_link) {
+		unlink(sim_opts.uart_link);
+		if (symlink(name, sim_opts.uart_link) < 0)
+			sim_log("%s: %s", sim_opts.uart_link, strerror(errno));
+	}
+	sim_log("UART0 on %s%s%s", name, sim_opts.uart_link ? " -> " : "",
+			sim_opts.uart_link ? sim_opts.uart_link : "");
+
+	g_uart.log = stderr;
+	if (sim_opts.uart1_log) {
+		g_uart.log = fopen(sim_opts.uart1_log, "a");
+		if (g_uart.log == NULL) {
+			sim_log("%s: %s", sim_opts.uart1_log, strerror(errno));
+			exit(1);
+		}
+		setvbuf(g_uart.log, NULL, _IOLBF, 0);
+	}
+	if (g_uart.rx == NULL)
+		g_uart.rx = neurite_cmd_input;
+	g_uart.rx_at = sim_now_us();
+	sim_watch(g_uart.master, POLLIN, uart_rx_ready, NULL);
+}
+
+void sim_uart_close(void)
+{
+	if (g_uart.master < 0)
+		return;
+	close(g_uart.master);
+	close(g_uart.slave);
+	if (sim_opts.uart_link)
+		unlink(sim_opts.uart_link);
+	if (g_uart.log && g_uart.log != stderr)
+		fclose(g_uart.log);
+	g_uart.master = -1;
+}
+
+/* TX */
+
+void sim_uart_flush(void)
+{
+	struct pollfd pfd;
+	uint16_t off = 0;
+	ssize_t n;
+
+	while (off < g_uart.tx_len) {
+		n = write(g_uart.master, g_uart.tx_buf + off, g_uart.tx_len - off);
+		if (n > 0) {
+			off += n;
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			break;
+		pfd.fd = g_uart.master;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, UART_TX_WAIT_MS) <= 0)
+			break;
+	}
+	sim_stats.uart_tx_lost += g_uart.tx_len - off;
+	g_uart.tx_len = 0;
+}
+
+static void uart_tx_one_char(uint8 uart, uint8 c)
+{
+	uint64_t now, fifo_us;
+
+	if (uart == UART1) {
+		/* line endings normalised for the log file */
+		if (c != '\r')
+			fputc(c, g_uart.log);
+		return;
+	}
+	if (g_uart.baud) {
+		now = sim_now_us();
+		fifo_us = (uint64_t)UART_FIFO_SIZE * byte_us();
+		if (g_uart.tx_free_at < now)
+			g_uart.tx_free_at = now;
+		if (g_uart.tx_free_at - now > fifo_us)
+			ets_delay_us(g_uart.tx_free_at - now - fifo_us);
+		g_uart.tx_free_at += byte_us();
+	}
+	if (g_uart.tx_len == UART_TX_BUF)
+		sim_uart_flush();
+	g_uart.tx_buf[g_uart.tx_len++] = c;
+	sim_stats.uart_tx++;
+	metrics_inc(METRIC_UART_TX_BYTES);
+}
+
+void HOT_ATTR uart0_write(char c)
+{
+	uart_tx_one_char(UART0, c);
+}
+
+void ICACHE_FLASH_ATTR uart1_write_char(char c)
+{
+	uart_tx_one_char(UART1, c);
+}
+
+void ICACHE_FLASH_ATTR uart0_write_char(char c)
+{
+	if (c == '\n' || c == '\r') {
+		uart_tx_one_char(UART0, '\r');
+		uart_tx_one_char(UART0, '\n');
+	} else {
+		uart_tx_one_char(UART0, c);
+	}
+}
+
+void ICACHE_FLASH_ATTR uart0_tx_buffer(uint8 *buf, uint16 len)
+{
+	uint16 i;
+	for (i = 0; i < len; i++)
+		uart_tx_one_char(UART0, buf[i]);
+}
+
+void ICACHE_FLASH_ATTR uart1_tx_buffer(const uint8 *buf, uint16 len)
+{
+	fwrite(buf, 1, len, g_uart.log);
+}
+
+uint16 ICACHE_FLASH_ATTR uart_tx_fifo_free(uint8 uart)
+{
+	uint64_t now, queued;
+
+	if (uart == UART1 || g_uart.baud == 0)
+		return UART_FIFO_SIZE - 2;
+	now = sim_now_us();
+	queued = g_uart.tx_free_at > now ? (g_uart.tx_free_at - now) / byte_us() : 0;
+	return queued < UART_FIFO_SIZE - 2 ? UART_FIFO_SIZE - 2 - queued : 0;
+}
+
+void ICACHE_FLASH_ATTR uart0_sendStr(const char *str)
+{
+	while (*str)
+		uart_tx_one_char(UART0, *str++);
+}
+
+/* RX, the interrupt handler */
+
+static void uart_rx_resume(void *arg)
+{
+	g_uart.rx_paused = false;
+	sim_watch(g_uart.master, POLLIN, uart_rx_ready, NULL);
+}
+
+static void uart_rx_ready(int fd, short revents, void *arg)
+{
+	uint8_t buf[UART_FIFO_SIZE];
+	uint32_t want = sizeof(buf);
+	uint64_t now;
+	ssize_t n, i;
+
+	if (g_uart.baud) {
+		now = sim_now_us();
+		g_uart.rx_credit += (now - g_uart.rx_at) / byte_us();
+		g_uart.rx_at += (now - g_uart.rx_at) / byte_us() * byte_us();
+		if (g_uart.rx_credit > UART_FIFO_SIZE)
+			g_uart.rx_credit = UART_FIFO_SIZE;
+		if (g_uart.rx_credit < 16) {
+			/* leave the bytes in the pty until the line caught up */
+			sim_watch(g_uart.master, 0, NULL, NULL);
+			g_uart.rx_paused = true;
+			os_timer_disarm(&g_uart.rx_timer);
+			os_timer_setfn(&g_uart.rx_timer, uart_rx_resume, NULL);
+			os_timer_arm_us(&g_uart.rx_timer, (16 - g_uart.rx_credit) * byte_us(), 0);
+			return;
+		}
+		want = g_uart.rx_credit;
+	}
+	n = read(fd, buf, want);
+	if (n <= 0)
+		return;
+	if (g_uart.baud)
+		g_uart.rx_credit -= n;
+
+	TRACE(TRACE_ISR_ENTER, 0);
+	for (i = 0; i < n; i++) {
+		metrics_inc(METRIC_UART_RX_BYTES);
+		if (g_uart.rx)
+			g_uart.rx(buf[i]);
+	}
+	sim_stats.uart_rx += n;
+	TRACE(TRACE_ISR_EXIT, n);
+}
+
+void ICACHE_FLASH_ATTR uart_init(UartBautRate uart0_br, UartBautRate uart1_br)
+{
+	g_uart.baud = sim_opts.baud >= 0 ? (uint32_t)sim_opts.baud : uart0_br;
+	if (g_uart.master < 0)
+		uart_open();
+#ifdef NEURITE_RELEASE
+	os_install_putc1((void *)uart1_write_char);
+#else
+	os_install_putc1((void *)uart0_write_char);
+#endif
+}
+
+void ICACHE_FLASH_ATTR uart_reattach(void)
+{
+	uart_init(BIT_RATE_74880, BIT_RATE_74880);
+}
@@ -0,0 +1,302 @@
+/*
+ * Station mode against one simulated AP: any SSID is accepted after
+ * sim_opts.wifi_delay_ms, DHCP hands out the loopback address. A
+ * connect locked to another BSSID fails with REASON_NO_AP_FOUND, like
+ * a stale cached AP would. The gateway answers pings, unless -G.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "ping.h"
+#include "sim.h"
+
+#define SIM_AP_CHANNEL	6
+
+static const uint8_t g_ap_bssid[6] = { 0x02, 0x51, 0x4d, 0x00, 0x00, 0x01 };
+
+struct sim_wifi_s {
+	uint8_t opmode;
+	uint8_t status;
+	bool auto_connect;
+	bool dhcpc;
+	struct station_config config;
+	struct ip_info info;
+	uint8_t channel;
+	wifi_event_handler_cb_t handler;
+	ETSTimer timer;
+	/* one ping run at a time */
+	struct ping_option *ping;
+	struct ping_resp ping_resp;
+	ETSTimer ping_timer;
+};
+
+static struct sim_wifi_s g_wifi = {
+	.opmode = STATION_MODE,
+	.dhcpc = true,
+	.channel = SIM_AP_CHANNEL,
+};
+
+static void wifi_event(System_Event_t *evt)
+{
+	if (g_wifi.handler)
+		g_wifi.handler(evt);
+}
+
+static void wifi_got_ip(void *arg)
+{
+	System_Event_t evt;
+
+	if (g_wifi.status != STATION_CONNECTING)
+		return;
+	if (g_wifi.dhcpc) {
+		IP4_ADDR(&g_wifi.info.ip, 127, 0, 0, 1);
+		IP4_ADDR(&g_wifi.info.netmask, 255, 0, 0, 0);
+		IP4_ADDR(&g_wifi.info.gw, 127, 0, 0, 1);
+	}
+	g_wifi.status = STATION_GOT_IP;
+	os_memset(&evt, 0, sizeof(evt));
+	evt.event = EVENT_STAMODE_GOT_IP;
+	evt.event_info.got_ip.ip = g_wifi.info.ip;
+	evt.event_info.got_ip.mask = g_wifi.info.netmask;
+	evt.event_info.got_ip.gw = g_wifi.info.gw;
+	wifi_event(&evt);
+}
+
+static void wifi_associated(void *arg)
+{
+	System_Event_t evt;
+	size_t len;
+
+	if (g_wifi.status != STATION_CONNECTING)
+		return;
+	os_memset(&evt, 0, sizeof(evt));
+	len = strnlen((char *)g_wifi.config.ssid, sizeof(g_wifi.config.ssid));
+	if (len == 0 || (g_wifi.config.bssid_set &&
+			os_memcmp(g_wifi.config.bssid, g_ap_bssid, sizeof(g_ap_bssid)))) {
+		g_wifi.status = STATION_NO_AP_FOUND;
+		evt.event = EVENT_STAMODE_DISCONNECTED;
+		os_memcpy(evt.event_info.disconnected.ssid, g_wifi.config.ssid, len);
+		evt.event_info.disconnected.ssid_len = len;
+		evt.event_info.disconnected.reason = REASON_NO_AP_FOUND;
+		wifi_event(&evt);
+		return;
+	}
+	evt.event = EVENT_STAMODE_CONNECTED;
+	os_memcpy(evt.event_info.connected.ssid, g_wifi.config.ssid, len);
+	evt.event_info.connected.ssid_len = len;
+	os_memcpy(evt.event_info.connected.bssid, g_ap_bssid, sizeof(g_ap_bssid));
+	evt.event_info.connected.channel = SIM_AP_CHANNEL;
+	g_wifi.channel = SIM_AP_CHANNEL;
+	wifi_event(&evt);
+
+	/* DHCP takes the other half, a static address none */
+	os_timer_disarm(&g_wifi.timer);
+	os_timer_setfn(&g_wifi.timer, wifi_got_ip, NULL);
+	os_timer_arm(&g_wifi.timer, g_wifi.dhcpc ? sim_opts.wifi_delay_ms / 2 : 0, 0);
+}
+
+bool wifi_station_connect(void)
+{
+	if (!(g_wifi.opmode & STATION_MODE))
+		return false;
+	g_wifi.status = STATION_CONNECTING;
+	os_timer_disarm(&g_wifi.timer);
+	os_timer_setfn(&g_wifi.timer, wifi_associated, NULL);
+	os_timer_arm(&g_wifi.timer, sim_opts.wifi_delay_ms / 2, 0);
+	return true;
+}
+
+bool wifi_station_disconnect(void)
+{
+	System_Event_t evt;
+	bool was_up = g_wifi.status == STATION_GOT_IP;
+
+	os_timer_disarm(&g_wifi.timer);
+	g_wifi.status = STATION_IDLE;
+	if (was_up) {
+		os_memset(&evt, 0, sizeof(evt));
+		evt.event = EVENT_STAMODE_DISCONNECTED;
+		evt.event_info.disconnected.reason = REASON_ASSOC_LEAVE;
+		wifi_event(&evt);
+	}
+	return true;
+}
+
+uint8 wifi_station_get_connect_status(void)
+{
+	return g_wifi.status;
+}
+
+uint8 wifi_get_opmode(void)
+{
+	return g_wifi.opmode;
+}
+
+bool wifi_set_opmode(uint8 opmode)
+{
+	if (opmode > STATIONAP_MODE)
+		return false;
+	g_wifi.opmode = opmode;
+	return true;
+}
+
+bool wifi_set_opmode_current(uint8 opmode)
+{
+	return wifi_set_opmode(opmode);
+}
+
+bool wifi_station_get_config(struct station_config *config)
+{
+	os_memcpy(config, &g_wifi.config, sizeof(*config));
+	return true;
+}
+
+bool wifi_station_set_config(struct station_config *config)
+{
+	os_memcpy(&g_wifi.config, config, sizeof(*config));
+	return true;
+}
+
+bool wifi_station_set_config_current(struct station_config *config)
+{
+	return wifi_station_set_config(config);
+}
+
+bool wifi_station_get_auto_connect(void)
+{
+	return g_wifi.auto_connect;
+}
+
+bool wifi_station_set_auto_connect(uint8 set)
+{
+	g_wifi.auto_connect = set;
+	return true;
+}
+
+bool wifi_station_set_reconnect_policy(bool set)
+{
+	return true;
+}
+
+bool wifi_station_dhcpc_start(void)
+{
+	g_wifi.dhcpc = true;
+	return true;
+}
+
+bool wifi_station_dhcpc_stop(void)
+{
+	g_wifi.dhcpc = false;
+	return true;
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info)
+{
+	if (if_index != STATION_IF)
+		return false;
+	os_memcpy(info, &g_wifi.info, sizeof(*info));
+	return true;
+}
+
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info)
+{
+	if (if_index != STATION_IF || g_wifi.dhcpc)
+		return false;
+	os_memcpy(&g_wifi.info, info, sizeof(*info));
+	return true;
+}
+
+bool wifi_get_macaddr(uint8 if_index, uint8 *macaddr)
+{
+	uint32_t id = sim_opts.chip_id;
+
+	macaddr[0] = if_index == STATION_IF ? 0x5c : 0x5e;
+	macaddr[1] = 0xcf;
+	macaddr[2] = 0x7f;
+	macaddr[3] = id >> 16;
+	macaddr[4] = id >> 8;
+	macaddr[5] = id;
+	return true;
+}
+
+uint8 wifi_get_channel(void)
+{
+	return g_wifi.channel;
+}
+
+bool wifi_set_channel(uint8 channel)
+{
+	if (channel < 1 || channel > 14)
+		return false;
+	g_wifi.channel = channel;
+	return true;
+}
+
+sint8 wifi_station_get_rssi(void)
+{
+	return g_wifi.status == STATION_GOT_IP ? -50 : 31;
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb)
+{
+	g_wifi.handler = cb;
+}
+
+#define SIM_PING_MS		5
+#define SIM_PING_TIMEOUT_MS	1000
+
+static void ping_next(void *arg)
+{
+	struct ping_option *opt = g_wifi.ping;
+	struct ping_resp *resp = &g_wifi.ping_resp;
+	bool answer = opt->ip == g_wifi.info.gw.addr && g_wifi.status == STATION_GOT_IP &&
+		!sim_opts.gw_down;
+
+	resp->seqno++;
+	resp->ping_err = answer ? 0 : -1;
+	resp->resp_time = answer ? SIM_PING_MS : SIM_PING_TIMEOUT_MS;
+	resp->total_time += resp->resp_time;
+	if (answer) {
+		resp->bytes = 32;
+		resp->total_bytes += 32;
+	} else {
+		resp->timeout_count++;
+	}
+	if (opt->recv_function)
+		opt->recv_function(opt, resp);
+	if (resp->seqno < opt->count) {
+		os_timer_arm(&g_wifi.ping_timer, answer ? SIM_PING_MS : SIM_PING_TIMEOUT_MS, 0);
+		return;
+	}
+	g_wifi.ping = NULL;
+	if (opt->sent_function)
+		opt->sent_function(opt, resp);
+}
+
+bool ping_start(struct ping_option *ping_opt)
+{
+	bool answer;
+
+	if (g_wifi.ping || ping_opt->count == 0)
+		return false;
+	g_wifi.ping = ping_opt;
+	os_memset(&g_wifi.ping_resp, 0, sizeof(g_wifi.ping_resp));
+	g_wifi.ping_resp.total_count = ping_opt->count;
+	answer = ping_opt->ip == g_wifi.info.gw.addr && !sim_opts.gw_down;
+	os_timer_disarm(&g_wifi.ping_timer);
+	os_timer_setfn(&g_wifi.ping_timer, ping_next, NULL);
+	os_timer_arm(&g_wifi.ping_timer, answer ? SIM_PING_MS : SIM_PING_TIMEOUT_MS, 0);
+	return true;
+}
+
+bool ping_regist_recv(struct ping_option *ping_opt, ping_recv_function ping_recv)
+{
+	ping_opt->recv_function = ping_recv;
+	return true;
+}
+
+bool ping_regist_sent(struct ping_option *ping_opt, ping_sent_function ping_sent)
+{
+	ping_opt->sent_function = ping_sent;
+	return true;
+}
@@ -0,0 +1,274 @@
+"""
+bridge_sim for the tests, driven over its UART0 pty with the SLIP framed
+CMD protocol of modules/cmd.c. Frames are built and parsed the way
+tools/sim_load.py does it.
+"""
+import os
+import select
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+SIM_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+TOOLS_DIR = os.path.join(os.path.dirname(SIM_DIR), 'tools')
+sys.path.insert(0, TOOLS_DIR)
+
+from sim_load import crc16, MqttClient, Uart, SLIP_START, SLIP_END, SLIP_REPL  # noqa: E402
+
+# modules/include/cmd.h
+CMD_IS_READY = 2
+CMD_WIFI_CONNECT = 3
+CMD_MQTT_SETUP = 4
+CMD_MQTT_CONNECT = 5
+CMD_MQTT_PUBLISH = 7
+CMD_MQTT_SUBSCRIBE = 8
+CMD_MQTT_EVENTS = 10
+CMD_REST_SETUP = 11
+CMD_REST_REQUEST = 12
+CMD_REST_EVENTS = 14
+CMD_STATS = 15
+CMD_OTA = 18
+CMD_OTA_EVENTS = 19
+CMD_TX_SETUP = 20
+CMD_TX_FRAGMENT = 21
+CMD_MQTT_PUB_START = 22
+CMD_MQTT_PUB_PART = 23
+CMD_MQTT_SUB_BATCH = 25
+CMD_MQTT_UNSUB_BATCH = 26
+CMD_MQTT_FILTER = 27
+CMD_MQTT_AGGREGATE = 28
+CMD_REST_EXTRACT = 29
+
+CMD_RETURN_TAG = 0x80000000
+
+STATION_GOT_IP = 5
+
+# include/metrics.h
+METRIC_MQTT_PUB_FAIL = 6
+METRIC_TX_FRAGS = 17
+METRIC_TX_SPILLS = 18
+METRIC_MQTT_RESUBSCRIBE = 22
+METRIC_MQTT_SESSION_KEPT = 23
+METRIC_MQTT_ALIAS_SAVED = 24
+METRIC_MQTT_INFLIGHT_WAIT = 25
+
+# callbacks the tests hand to MQTT_SETUP
+CB_WIFI = 0x100
+CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA, CB_QUEUE = 0x201, 0x202, 0x203, 0x204, 0x205
+CB_STATS = 0x300
+CB_REST = 0x301
+
+
+def parse_frame(frame):
+    """ (cmd, callback, ret, args) of a frame after SLIP, None when it is cut short """
+    if len(frame) < 14:
+        return None
+    cmd, callback, ret, argc = struct.unpack_from('<HIIH', frame, 0)
+    off = 12
+    args = []
+    for i in range(argc):
+        if off + 2 > len(frame) - 2:
+            return None
+        n, = struct.unpack_from('<H', frame, off)
+        args.append(frame[off + 2:off + 2 + n])
+        off += 2 + n
+    if off != len(frame) - 2 or crc16(frame[:off]) != struct.unpack_from('<H', frame, off)[0]:
+        raise AssertionError('bad frame from the bridge: %r' % frame)
+    return cmd, callback, ret, args
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def tool(name, *args, **kw):
+    """ one of tools/*.py as a child process """
+    return subprocess.Popen([sys.executable, os.path.join(TOOLS_DIR, name)] + [str(a) for a in args], **kw)
+
+
+class Broker(object):
+    """ tools/sim_broker.py on free ports """
+    def __init__(self, workdir, *opts):
+        self.mqtt_port = free_port()
+        self.http_port = free_port()
+        self.log_path = os.path.join(workdir, 'broker.log')
+        self.log_file = open(self.log_path, 'wb')
+        self.p = tool('sim_broker.py', '--mqtt-port', self.mqtt_port, '--http-port', self.http_port, '-v',
+                *opts, stdout=self.log_file, stderr=subprocess.STDOUT)
+        end = time.time() + 5
+        while True:
+            try:
+                socket.create_connection(('127.0.0.1', self.http_port), 1).close()
+                break
+            except socket.error:
+                if time.time() > end or self.p.poll() is not None:
+                    self.stop()
+                    raise RuntimeError('sim_broker.py did not start:\n%s' % self.log())
+                time.sleep(0.02)
+
+    def client(self, client_id=b'test'):
+        return MqttClient('127.0.0.1', self.mqtt_port, client_id)
+
+    def drop(self):
+        """ every MQTT connection closed, the clients reconnect """
+        self.p.send_signal(signal.SIGUSR1)
+
+    def stop(self):
+        if self.p.poll() is None:
+            self.p.terminate()
+        self.p.wait(5)
+        self.log_file.close()
+
+    def log(self):
+        with open(self.log_path, 'rb') as f:
+            return f.read().decode('latin-1')
+
+
+class Bridge(object):
+    def __init__(self, workdir, binary='bridge_sim', args=()):
+        self.link = os.path.join(workdir, 'uart0')
+        self.log_path = os.path.join(workdir, 'sim.log')
+        self.log_file = open(self.log_path, 'wb')
+        self.p = subprocess.Popen([os.path.join(SIM_DIR, binary), '-u', self.link, '-b', '0',
+                '-l', os.path.join(workdir, 'uart1.log')] + list(args),
+                stdout=self.log_file, stderr=subprocess.STDOUT)
+        end = time.time() + 5
+        while not os.path.exists(self.link):
+            if time.time() > end or self.p.poll() is not None:
+                self.stop()
+                raise RuntimeError('%s did not start:\n%s' % (binary, self.log()))
+            time.sleep(0.01)
+        self.uart = Uart(self.link)
+        self.frame = None
+        self.escape = False
+        self.events = []
+
+    def stop(self):
+        if self.p.poll() is None:
+            self.p.terminate()
+        code = self.p.wait(5)
+        self.log_file.close()
+        return code
+
+    def log(self):
+        with open(self.log_path, 'rb') as f:
+            return f.read().decode('latin-1')
+
+    def cmd(self, cmd, args=(), callback=0, ret=0):
+        """ ret 1 asks for the return value, CMD_RETURN_TAG | n for a tagged answer """
+        body = struct.pack('<HIIH', cmd, callback, ret, len(args))
+        for a in args:
+            if isinstance(a, int):
+                a = struct.pack('<I', a)
+            pad = (4 - len(a) % 4) % 4
+            body += struct.pack('<H', len(a) + pad) + a + b'\x00' * pad
+        body += struct.pack('<H', crc16(body))
+        out = bytearray([SLIP_START])
+        for b in bytearray(body):
+            if b in (SLIP_START, SLIP_END, SLIP_REPL):
+                out += bytearray([SLIP_REPL, b ^ 0x20])
+            else:
+                out.append(b)
+        out.append(SLIP_END)
+        self.uart.write(bytes(out))
+
+    def call(self, cmd, args=(), callback=0, timeout=5):
+        """ cmd asking for its return value, which this returns """
+        self.cmd(cmd, args, callback, 1)
+        ev = self.wait_event(lambda e: e[0] == cmd and e[1] == 0, timeout)
+        if ev is None:
+            raise AssertionError('no answer to command %d' % cmd)
+        return ev[2]
+
+    def mqtt(self, broker, client_id=b'sim-bridge', queue_size=0, protocol=0, clean=1, keepalive=120, buf_size=0):
+        """ WiFi up and an MQTT client connected to broker, returns its handle """
+        self.wifi()
+        args = [client_id, b'', b'', keepalive, clean, CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA]
+        if queue_size or protocol or buf_size:
+            args += [queue_size, CB_QUEUE]
+        if protocol or buf_size:
+            args.append(protocol)
+        if buf_size:
+            args.append(buf_size)
+        handle = self.call(CMD_MQTT_SETUP, args)
+        self.assertion(handle, 'MQTT setup failed')
+        self.cmd(CMD_MQTT_CONNECT, (handle, b'127.0.0.1', broker.mqtt_port, 0))
+        self.assertion(self.wait_event(lambda e: e[1] == CB_CONNECTED), 'no connection to the broker')
+        return handle
+
+    def stats(self):
+        """ the metrics counters and gauges, indexed by metrics_id_e """
+        self.cmd(CMD_STATS, (), CB_STATS)
+        ev = self.wait_event(lambda e: e[0] == CMD_STATS and e[1] == CB_STATS)
+        self.assertion(ev, 'no stats')
+        m = ev[3][0]
+        return struct.unpack('<%dI' % (len(m) // 4), bytes(m))
+
+    def wifi(self):
+        self.assertion(self.call(CMD_IS_READY) == 1, 'bridge not ready')
+        self.cmd(CMD_WIFI_CONNECT, (b'sim', b'password'), CB_WIFI)
+        self.assertion(self.wait_event(lambda e: e[1] == CB_WIFI and e[3] and bytearray(e[3][0])[0] == STATION_GOT_IP),
+                'no wifi')
+
+    def assertion(self, ok, what):
+        if not ok:
+            raise AssertionError('%s\n%s' % (what, self.log()))
+
+    def poll(self, timeout):
+        self.uart.flush()
+        r, _, _ = select.select([self.uart.fd], [], [], timeout)
+        if r:
+            self.input(self.uart.read())
+
+    def wait(self, timeout, until=None):
+        end = time.time() + timeout
+        while time.time() < end:
+            if until and until():
+                return True
+            if self.p.poll() is not None:
+                break
+            self.poll(min(0.01, max(end - time.time(), 0)))
+        return until() if until else True
+
+    def wait_event(self, match, timeout=5):
+        """ first event (cmd, callback, ret, args) that match() takes, or None """
+        found = []
+
+        def check():
+            for e in self.events:
+                if match(e):
+                    self.events.remove(e)
+                    found.append(e)
+                    return True
+            return False
+
+        self.wait(timeout, check)
+        return found[0] if found else None
+
+    def input(self, data):
+        for c in bytearray(data):
+            if c == SLIP_START:
+                self.frame = bytearray()
+                self.escape = False
+            elif self.frame is None:
+                continue
+            elif c == SLIP_END:
+                self.frame_done(bytes(self.frame))
+                self.frame = None
+            elif c == SLIP_REPL:
+                self.escape = True
+            else:
+                self.frame.append(c ^ 0x20 if self.escape else c)
+                self.escape = False
+
+    def frame_done(self, frame):
+        ev = parse_frame(frame)
+        if ev:
+            self.events.append(ev)
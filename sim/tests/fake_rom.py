@@ -0,0 +1,142 @@
+"""
+Emulated ESP8266 ROM loader on a pty, for testing tools/esptool.py.
+
+It speaks the loader's SLIP protocol: SYNC, FLASH_BEGIN/DATA/END,
+MEM_BEGIN/DATA/END and READ/WRITE_REG, with a file as flash. A MEM_END
+that jumps into the loaded code starts the flasher stub: sim/stub_sim,
+the tools/stub sources built for the host, serves the pty until the port
+is closed. Closing the port resets the chip back into the loader, the way
+an adapter that resets on open behaves, so esptool.py runs with
+--before no_reset.
+
+drop_data drops that many FLASH_DATA requests without an answer, so the
+host times out and retries. A dead loader never answers.
+"""
+import os
+import pty
+import select
+import struct
+import subprocess
+import threading
+import time
+import tty
+
+SIM_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+STUB_SIM = os.path.join(SIM_DIR, 'stub_sim')
+
+ROM_RESET_VECTOR = 0x40000080
+
+
+def slip(data):
+    return b'\xc0' + data.replace(b'\xdb', b'\xdb\xdd').replace(b'\xc0', b'\xdb\xdc') + b'\xc0'
+
+
+class FakeRom(threading.Thread):
+    def __init__(self, flash_path, flash_size=0x100000, drop_data=0, dead=False):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.flash_path = flash_path
+        self.flash_size = flash_size
+        self.drop_data = drop_data
+        self.dead = dead
+        self.running = True
+        self.stub = None
+        self.stub_runs = 0
+        self.syncs = 0
+        if not os.path.exists(flash_path):
+            with open(flash_path, 'wb') as f:
+                f.write(b'\xff' * flash_size)
+        self.master, slave = pty.openpty()
+        tty.setraw(slave)
+        self.port = os.ttyname(slave)
+        os.close(slave)
+        self.start()
+
+    def flash(self, offset=0, size=None):
+        with open(self.flash_path, 'rb') as f:
+            f.seek(offset)
+            return f.read(self.flash_size - offset if size is None else size)
+
+    def stop(self):
+        self.running = False
+        if self.stub:
+            self.stub.kill()
+        self.join(5)
+        os.close(self.master)
+
+    def send(self, data):
+        os.write(self.master, slip(data))
+
+    def respond(self, op, value=0, body=b'', status=0):
+        self.send(struct.pack('<BBHI', 1, op, len(body) + 2, value) + body + struct.pack('BB', status, 0))
+
+    def run(self):
+        frame = None
+        while self.running:
+            r, _, _ = select.select([self.master], [], [], 0.05)
+            if not r:
+                continue
+            try:
+                data = os.read(self.master, 4096)
+            except OSError:
+                # nobody has the port open, the chip is held in reset
+                frame = None
+                time.sleep(0.02)
+                continue
+            for c in bytearray(data):
+                if c == 0xc0:
+                    if frame:
+                        self.handle(bytes(frame.replace(b'\xdb\xdc', b'\xc0').replace(b'\xdb\xdd', b'\xdb')))
+                        frame = None
+                    else:
+                        frame = bytearray()
+                elif frame is not None:
+                    frame.append(c)
+                if self.stub:
+                    break
+            if self.stub:
+                self.run_stub()
+
+    def run_stub(self):
+        # the stub has the line until the host closes the port
+        self.stub.wait()
+        self.stub = None
+
+    def write(self, offset, data):
+        with open(self.flash_path, 'r+b') as f:
+            f.seek(offset)
+            f.write(data)
+
+    def handle(self, pkt):
+        if self.dead or len(pkt) < 8:
+            return
+        _, op, length, _ = struct.unpack('<BBHI', pkt[:8])
+        data = pkt[8:8 + length]
+        if op == 0x08:
+            self.syncs += 1
+            for _ in range(8):
+                self.respond(op)
+        elif op == 0x02:
+            # FLASH_BEGIN: erase size, blocks, block size, offset
+            size, _, self.block_size, self.offset = struct.unpack('<IIII', data[:16])
+            self.write(self.offset, b'\xff' * min(size, self.flash_size - self.offset))
+            self.respond(op)
+        elif op == 0x03:
+            if self.drop_data > 0:
+                self.drop_data -= 1
+                return
+            n, seq = struct.unpack('<II', data[:8])
+            self.write(self.offset + seq * self.block_size, data[16:16 + n])
+            self.respond(op)
+        elif op == 0x06:
+            stay, entry = struct.unpack('<II', data[:8])
+            self.respond(op)
+            if stay == 0 and entry != ROM_RESET_VECTOR:
+                self.stub_runs += 1
+                self.stub = subprocess.Popen([STUB_SIM, '-f', self.flash_path, '-s', str(self.flash_size)],
+                        stdin=self.master, stdout=self.master)
+        elif op in (0x04, 0x05, 0x07, 0x09, 0x0a):
+            self.respond(op)
+        else:
+            # stub only commands, the ROM fails them
+            self.respond(op, status=1)
@@ -0,0 +1,216 @@
+"""
+modules/cmd.c in bridge_sim: the TX lanes with CMD_TX_SETUP fragments and
+frames that spill over their lane, and tagged and deferred answers.
+"""
+import os
+import struct
+import unittest
+
+from bridge import (SIM_DIR, parse_frame, CMD_IS_READY, CMD_MQTT_CONNECT, CMD_MQTT_EVENTS, CMD_MQTT_SETUP,
+                    CMD_WIFI_CONNECT, CMD_TX_SETUP, CMD_TX_FRAGMENT, CMD_RETURN_TAG, STATION_GOT_IP,
+                    CB_WIFI, CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA, METRIC_TX_FRAGS, METRIC_TX_SPILLS)
+from test_mqtt_app import BridgeCase
+
+# modules/include/cmd.h
+CMD_TX_BULK_SIZE = 2048
+CMD_TX_FRAG_MIN = 16
+
+STATION_IDLE = 0
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestTxLanes(BridgeCase):
+    # Paced, so the bulk lane backs up. The 3.1 library drops a segment that
+    # does not fit its 1024 byte buffer next to the packet it is joining, so
+    # small segments and publishes of at most 400 bytes.
+    bridge_args = ('-b', '115200', '-m', '536')
+
+    def tx_setup(self, *size):
+        return self.bridge.call(CMD_TX_SETUP, size)
+
+    def rejoin(self, events, frag):
+        """ events with the fragments joined back into frames, and the ids of those """
+        out, parts, ids = [], {}, []
+        for e in events:
+            if e[0] != CMD_TX_FRAGMENT:
+                out.append(e)
+                continue
+            frag_id, total, offset, piece = e[1], e[2] >> 16, e[2] & 0xffff, bytes(e[3][0])
+            buf = parts.setdefault(frag_id, bytearray())
+            self.assertEqual(offset, len(buf))
+            # frag bytes each but the last, which is padded to 4
+            self.assertEqual(len(piece), min(frag, (total - offset + 3) & ~3))
+            buf += piece[:total - offset]
+            if len(buf) == total:
+                out.append(parse_frame(bytes(buf)))
+                ids.append(frag_id)
+                del parts[frag_id]
+        self.assertEqual(parts, {})
+        return out, ids
+
+    def last_pieces(self, events):
+        return sum(1 for e in events if e[0] == CMD_TX_FRAGMENT and (e[2] & 0xffff) + len(e[3][0]) >= e[2] >> 16)
+
+    def flood(self, count, size, until):
+        """ count publishes of size bytes to the bridge, the events until until(events) """
+        handle = self.bridge.mqtt(self.broker)
+        self.bridge_subscribe(handle, b'tx/#', 0)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        payloads = [struct.pack('>H', i) * (size // 2) for i in range(count)]
+        del self.bridge.events[:]
+        for p in payloads:
+            pub.publish(b'tx/bulk', p)
+        self.bridge.assertion(self.bridge.wait(10, lambda: until(self.bridge.events)), 'flood did not arrive')
+        return payloads
+
+    def test_fragment_size(self):
+        # off until asked, 0 args reads it back
+        self.assertEqual(self.tx_setup(), 0)
+        for asked, size in ((64, 64), (5, CMD_TX_FRAG_MIN), (101, 100), (99999, CMD_TX_BULK_SIZE), (0, 0)):
+            self.assertEqual(self.tx_setup(asked), size)
+        self.tx_setup(64)
+        self.assertEqual(self.tx_setup(), 64)
+
+    def test_fragments_rejoin(self):
+        frags = self.bridge.stats()[METRIC_TX_FRAGS]
+        self.assertEqual(self.tx_setup(64), 64)
+        payloads = self.flood(20, 400, lambda events: self.last_pieces(events) == 20)
+        events = list(self.bridge.events)
+        pieces = [e for e in events if e[0] == CMD_TX_FRAGMENT]
+        frames, ids = self.rejoin(events, 64)
+        # args are padded to 4 bytes, the payloads are a multiple of that
+        data = [(bytes(e[3][0]).rstrip(b'\0'), bytes(e[3][1])) for e in frames
+                if e[0] == CMD_MQTT_EVENTS and e[1] == CB_DATA]
+        self.assertEqual(data, [(b'tx/bulk', p) for p in payloads])
+        # each data frame came in pieces, under ids that count up
+        self.assertEqual(len(ids), len(payloads))
+        self.assertEqual(ids, list(range(ids[0], ids[0] + len(ids))))
+        self.assertEqual(self.bridge.stats()[METRIC_TX_FRAGS] - frags, len(pieces))
+
+    def test_control_between_fragments(self):
+        self.assertEqual(self.tx_setup(64), 64)
+        handle = self.bridge.mqtt(self.broker)
+        self.bridge_subscribe(handle, b'tx/#', 0)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        del self.bridge.events[:]
+        for i in range(40):
+            pub.publish(b'tx/bulk', b'\x55' * 400)
+        # answers asked for while the bulk lane is backed up, 16K take 1.4s at 115200
+        self.bridge.assertion(self.bridge.wait(5, lambda: any(e[0] == CMD_TX_FRAGMENT for e in self.bridge.events)),
+                              'no fragments')
+        tags = [CMD_RETURN_TAG | i for i in range(1, 21)]
+        for tag in tags:
+            self.bridge.cmd(CMD_IS_READY, (), 0, tag)
+            self.bridge.wait(0.02)
+        self.bridge.assertion(self.bridge.wait(10, lambda: self.last_pieces(self.bridge.events) == 40 and
+                                               sum(1 for e in self.bridge.events if e[0] == CMD_IS_READY) == len(tags)),
+                              'answers or data missing')
+        events = list(self.bridge.events)
+        self.rejoin(events, 64)
+        # an answer between two pieces of one frame did not wait for all of it
+        inside = 0
+        for i, e in enumerate(events):
+            if e[0] != CMD_IS_READY:
+                continue
+            self.assertEqual(e[2], 1)
+            before = [f for f in events[:i] if f[0] == CMD_TX_FRAGMENT]
+            after = [f for f in events[i + 1:] if f[0] == CMD_TX_FRAGMENT]
+            if before and after and before[-1][1] == after[0][1]:
+                inside += 1
+        self.assertEqual(sorted(e[1] for e in events if e[0] == CMD_IS_READY), tags)
+        self.assertGreater(inside, 0)
+
+    def test_spills(self):
+        # STATS, 12 + 2 + 120 + 2 + 240 + 2 bytes, is over the control lane; each
+        # one shows in the next
+        spills = self.bridge.stats()[METRIC_TX_SPILLS]
+        self.assertEqual(self.bridge.stats()[METRIC_TX_SPILLS], spills + 1)
+
+        # a data event over the bulk lane goes out whole, fragments or not
+        handle = self.bridge.mqtt(self.broker, protocol=5, buf_size=4096)
+        self.bridge_subscribe(handle, b'tx/#', 0)
+        self.assertEqual(self.tx_setup(64), 64)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        spills = self.bridge.stats()[METRIC_TX_SPILLS]
+        del self.bridge.events[:]
+        payload = os.urandom(3000)
+        self.assertGreater(len(payload), CMD_TX_BULK_SIZE)
+        pub.publish(b'tx/big', payload)
+        ev = self.bridge.wait_event(lambda e: e[0] == CMD_MQTT_EVENTS and e[1] == CB_DATA)
+        self.bridge.assertion(ev, 'no data')
+        self.assertEqual((bytes(ev[3][0]).rstrip(b'\0'), bytes(ev[3][1])), (b'tx/big', payload))
+        self.assertEqual([e for e in self.bridge.events if e[0] == CMD_TX_FRAGMENT], [])
+        # the data, and the STATS before it
+        self.assertEqual(self.bridge.stats()[METRIC_TX_SPILLS], spills + 2)
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestTaggedAnswers(BridgeCase):
+    def events_until(self, match, timeout=5):
+        """ the events in wire order up to the first match() takes, which ends the list """
+        self.bridge.wait(timeout, lambda: any(match(e) for e in self.bridge.events))
+        for i, e in enumerate(self.bridge.events):
+            if match(e):
+                events = self.bridge.events[:i + 1]
+                del self.bridge.events[:i + 1]
+                return events
+        raise AssertionError('no event matched\n%s' % self.bridge.log())
+
+    def answer(self, cmd, tag):
+        return lambda e: e[0] == cmd and e[1] == tag
+
+    def test_tag_comes_back(self):
+        self.bridge.cmd(CMD_IS_READY, (), 0, 1)
+        self.bridge.cmd(CMD_IS_READY, (), 0, CMD_RETURN_TAG | 5)
+        self.bridge.cmd(CMD_IS_READY, (), 0, CMD_RETURN_TAG | 0x7fffffff)
+        events = self.events_until(self.answer(CMD_IS_READY, 0xffffffff))
+        self.assertEqual([e[:3] for e in events],
+                         [(CMD_IS_READY, 0, 1), (CMD_IS_READY, CMD_RETURN_TAG | 5, 1),
+                          (CMD_IS_READY, 0xffffffff, 1)])
+
+    def test_deferred_after_later_requests(self):
+        self.assertEqual(self.bridge.call(CMD_IS_READY), 1)
+        wifi = CMD_RETURN_TAG | 1
+        self.bridge.cmd(CMD_WIFI_CONNECT, (b'sim', b'password'), CB_WIFI, wifi)
+        self.bridge.cmd(CMD_IS_READY, (), 0, CMD_RETURN_TAG | 2)
+        events = self.events_until(self.answer(CMD_WIFI_CONNECT, wifi))
+        # no answer from CMD_Exec, CMD_Complete sends it after the status that ends connecting
+        self.assertEqual(events[0][:3], (CMD_IS_READY, CMD_RETURN_TAG | 2, 1))
+        self.assertEqual([e for e in events if e[0] == CMD_WIFI_CONNECT and e[1] == wifi], [events[-1]])
+        self.assertEqual(events[-1][2], STATION_GOT_IP)
+        self.assertEqual(events[-2][:2], (CMD_WIFI_CONNECT, CB_WIFI))
+        self.assertEqual(bytearray(events[-2][3][0])[0], STATION_GOT_IP)
+
+    def test_untagged_answers_at_once(self):
+        self.bridge.cmd(CMD_WIFI_CONNECT, (b'sim', b'password'), CB_WIFI, 1)
+        events = self.events_until(lambda e: e[1] == CB_WIFI and bytearray(e[3][0])[0] == STATION_GOT_IP)
+        self.assertEqual(events[0][:3], (CMD_WIFI_CONNECT, 0, 0))
+        self.assertEqual([e for e in events if e[1] & CMD_RETURN_TAG], [])
+
+    def test_superseded(self):
+        first, second = CMD_RETURN_TAG | 1, CMD_RETURN_TAG | 2
+        self.bridge.cmd(CMD_WIFI_CONNECT, (b'sim', b'password'), CB_WIFI, first)
+        self.bridge.cmd(CMD_WIFI_CONNECT, (b'sim', b'password'), CB_WIFI, second)
+        events = self.events_until(self.answer(CMD_WIFI_CONNECT, second))
+        self.assertEqual([e[2] for e in events if e[1] == first], [STATION_IDLE])
+        self.assertEqual(events[-1][2], STATION_GOT_IP)
+
+    def test_deferred_with_args(self):
+        self.bridge.wifi()
+        setup = CMD_RETURN_TAG | 3
+        self.bridge.cmd(CMD_MQTT_SETUP, (b'tagged', b'', b'', 120, 1, CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED,
+                                         CB_DATA, 0, 0), 0, setup)
+        ev = self.events_until(self.answer(CMD_MQTT_SETUP, setup))[-1]
+        handle = ev[2]
+        self.assertNotEqual(handle, 0)
+        # queue and buffer size in effect
+        self.assertEqual([struct.unpack('<I', bytes(a))[0] for a in ev[3]], [2048, 1024])
+
+        connect = CMD_RETURN_TAG | 4
+        self.bridge.cmd(CMD_MQTT_CONNECT, (handle, b'127.0.0.1', self.broker.mqtt_port, 0), 0, connect)
+        events = self.events_until(self.answer(CMD_MQTT_CONNECT, connect))
+        self.assertEqual(events[-1][2], 1)
+        self.assertEqual([e[1] for e in events], [CB_CONNECTED, connect])
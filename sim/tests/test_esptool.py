@@ -0,0 +1,329 @@
+"""
+tools/esptool.py write_flash against tests/fake_rom.py, with and without
+the flasher stub (sim/stub_sim).
+
+esptool.py is python 2 with pyserial, ESPTOOL_PYTHON is the command that
+runs it, 'python2' by default.
+"""
+import base64
+import hashlib
+import json
+import os
+import random
+import shlex
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+import zlib
+
+from fake_rom import FakeRom, STUB_SIM, slip
+
+ROOT = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+ESPTOOL = os.path.join(ROOT, 'tools', 'esptool.py')
+PYTHON = shlex.split(os.environ.get('ESPTOOL_PYTHON', 'python2'))
+
+
+def have_esptool_python():
+    try:
+        return subprocess.call(PYTHON + ['-c', 'import serial'],
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL) == 0
+    except OSError:
+        return False
+
+
+def image(size, seed, compressible=True):
+    rnd = random.Random(seed)
+    if compressible:
+        words = [b'neurite', b'mqtt', b'\x00' * 16, b'\xff' * 8, b'esp8266']
+        data = b''.join(rnd.choice(words) for _ in range(size // 4))
+    else:
+        data = bytes(rnd.getrandbits(8) for _ in range(size))
+    return data[:size]
+
+
+class EsptoolCase(unittest.TestCase):
+    flash_size = 0x100000
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix='esptool_')
+        self.roms = []
+        # only the entry matters to the fake loader, stub_sim is the stub
+        self.stub = os.path.join(self.dir, 'stub.json')
+        with open(self.stub, 'w') as f:
+            json.dump({'entry': 0x4010e004, 'text_start': 0x4010e000,
+                    'text': base64.b64encode(b'\x00' * 256).decode()}, f)
+
+    def tearDown(self):
+        for rom in self.roms:
+            rom.stop()
+        shutil.rmtree(self.dir)
+
+    def rom(self, name='flash', **kw):
+        rom = FakeRom(os.path.join(self.dir, name + '.bin'), self.flash_size, **kw)
+        self.roms.append(rom)
+        return rom
+
+    def file(self, name, data):
+        path = os.path.join(self.dir, name)
+        with open(path, 'wb') as f:
+            f.write(data)
+        return path
+
+    def esptool(self, ports, *args, timeout=120):
+        cmd = PYTHON + [ESPTOOL, '-p', ','.join(ports), '--before', 'no_reset'] + list(args)
+        p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=timeout)
+        return p.returncode, p.stdout.decode('latin-1')
+
+    def write_flash(self, rom, *args):
+        code, out = self.esptool([rom.port], 'write_flash', *args)
+        self.assertEqual(code, 0, out)
+        return out
+
+
+@unittest.skipUnless(os.path.exists(STUB_SIM), 'stub_sim not built')
+@unittest.skipUnless(have_esptool_python(), 'no python 2 with pyserial for esptool.py')
+class TestWriteFlash(EsptoolCase):
+    def test_rom_plain(self):
+        rom = self.rom()
+        boot = b'\xe9\x01\x02\x20' + image(0x2ff0, 1)
+        app = image(0x5123, 2)
+        self.write_flash(rom, '0x0', self.file('boot.bin', boot), '0x40000', self.file('app.bin', app))
+        # qio, 4m and 40m by default
+        self.assertEqual(rom.flash(0, len(boot)), b'\xe9\x01\x00\x00' + boot[4:])
+        self.assertEqual(rom.flash(0x40000, len(app)), app)
+        # padding of the last block
+        self.assertEqual(rom.flash(0x40000 + len(app), 0x100), b'\xff' * 0x100)
+        self.assertEqual(rom.stub_runs, 0)
+
+    def test_stub_plain(self):
+        rom = self.rom()
+        app = image(0x8000, 3)
+        self.write_flash(rom, '--stub', self.stub, '0x10000', self.file('app.bin', app))
+        self.assertEqual(rom.stub_runs, 1)
+        self.assertEqual(rom.flash(0x10000, len(app)), app)
+
+    def test_stub_compressed(self):
+        rom = self.rom()
+        app = image(0x23456, 4)
+        out = self.write_flash(rom, '--stub', self.stub, '-z', '0x20000', self.file('app.bin', app))
+        self.assertEqual(rom.flash(0x20000, len(app)), app)
+        written, sent = map(int, out.split('Wrote ')[1].split(' at ')[0].replace('(', '').split()[::2])
+        self.assertEqual(written, len(app))
+        self.assertLess(sent, written // 4)
+
+    def test_stub_compressed_random(self):
+        # stored deflate blocks, and a last block that is not word aligned
+        rom = self.rom()
+        app = image(0x9003, 5, compressible=False)
+        self.write_flash(rom, '--stub', self.stub, '-z', '0x3000', self.file('app.bin', app))
+        self.assertEqual(rom.flash(0x3000, len(app)), app)
+
+    def test_stub_compressed_keeps_neighbours(self):
+        # erase goes sector by sector, the tail of the last one is erased too
+        rom = self.rom()
+        self.write_flash(rom, '0x0', self.file('fill.bin', b'\x5a' * 0x8000))
+        app = image(0x1800, 6)
+        self.write_flash(rom, '--stub', self.stub, '-z', '0x2000', self.file('app.bin', app))
+        self.assertEqual(rom.flash(0, 0x2000), b'\x5a' * 0x2000)
+        self.assertEqual(rom.flash(0x2000, len(app)), app)
+        self.assertEqual(rom.flash(0x2000 + len(app), 0x800), b'\xff' * 0x800)
+        self.assertEqual(rom.flash(0x4000, 0x4000), b'\x5a' * 0x4000)
+
+    def test_stub_skip_unchanged(self):
+        rom = self.rom()
+        app = bytearray(image(0x10000, 7))
+        path = self.file('app.bin', bytes(app))
+        self.write_flash(rom, '--stub', self.stub, '-z', '0x40000', path)
+        app[0x3010] ^= 0xff
+        app[0x9000:0xb000] = image(0x2000, 8)
+        self.file('app.bin', bytes(app))
+        out = self.write_flash(rom, '--stub', self.stub, '-z', '-s', '0x40000', path)
+        self.assertIn('3 of 16 sectors at 0x00040000 changed', out)
+        self.assertEqual(rom.flash(0x40000, len(app)), bytes(app))
+        out = self.write_flash(rom, '--stub', self.stub, '-s', '0x40000', path)
+        self.assertIn('0 of 16 sectors at 0x00040000 changed', out)
+
+    def test_stub_fast_baud(self):
+        rom = self.rom()
+        app = image(0x4000, 9)
+        self.write_flash(rom, '--stub', self.stub, '-z', '-fb', '921600', '0x0', self.file('app.bin', app))
+        self.assertEqual(rom.flash(0, len(app)), app)
+
+    def test_options_need_stub(self):
+        rom = self.rom()
+        code, out = self.esptool([rom.port], 'write_flash', '-z', '0x0', self.file('app.bin', b'x' * 16))
+        self.assertNotEqual(code, 0)
+        self.assertIn('need --stub', out)
+        self.assertEqual(rom.syncs, 0)
+
+
+
+@unittest.skipUnless(os.path.exists(STUB_SIM), 'stub_sim not built')
+@unittest.skipUnless(have_esptool_python(), 'no python 2 with pyserial for esptool.py')
+class TestWriteFlashMany(EsptoolCase):
+    """ several ports in one write_flash, one thread each """
+    def summary(self, out, rom):
+        """ result, attempts, seconds and bytes in the table at the end """
+        table = out.split('\nport ')[-1]
+        for line in table.splitlines():
+            if line.startswith(rom.port + ' '):
+                return line.split()[1:5]
+        self.fail('%s not in the summary:\n%s' % (rom.port, out))
+
+    def test_rom_plain(self):
+        roms = [self.rom('flash%d' % i) for i in range(3)]
+        app = image(0x6000, 20)
+        code, out = self.esptool([r.port for r in roms], 'write_flash', '0x10000', self.file('app.bin', app))
+        self.assertEqual(code, 0, out)
+        self.assertIn('3 of 3 devices flashed', out)
+        for rom in roms:
+            self.assertEqual(self.summary(out, rom)[:2], ['ok', '1'])
+            self.assertEqual(rom.flash(0x10000, len(app)), app)
+
+    def test_stub_compressed(self):
+        roms = [self.rom('flash%d' % i) for i in range(4)]
+        boot = image(0x1000, 21)
+        app = image(0x30000, 22)
+        code, out = self.esptool([r.port for r in roms], 'write_flash', '--stub', self.stub, '-z',
+                '0x0', self.file('boot.bin', boot), '0x10000', self.file('app.bin', app))
+        self.assertEqual(code, 0, out)
+        for rom in roms:
+            result = self.summary(out, rom)
+            self.assertEqual((result[0], result[1], result[3]), ('ok', '1', str(len(boot) + len(app))))
+            self.assertEqual(rom.stub_runs, 1)
+            self.assertEqual(rom.flash(0, len(boot)), boot)
+            self.assertEqual(rom.flash(0x10000, len(app)), app)
+
+    def test_retry(self):
+        # the lost FLASH_DATA times out, the second attempt starts over
+        good = self.rom('good')
+        flaky = self.rom('flaky', drop_data=1)
+        app = image(0x3000, 23)
+        code, out = self.esptool([good.port, flaky.port], 'write_flash', '0x0', self.file('app.bin', app))
+        self.assertEqual(code, 0, out)
+        self.assertEqual(self.summary(out, good)[:2], ['ok', '1'])
+        self.assertEqual(self.summary(out, flaky)[:2], ['ok', '2'])
+        self.assertEqual(flaky.flash(0, len(app)), app)
+        self.assertIn('Failed: ', out)
+
+    def test_dead_port(self):
+        good = self.rom('good')
+        dead = self.rom('dead', dead=True)
+        app = image(0x2000, 24)
+        code, out = self.esptool([good.port, dead.port], 'write_flash', '--stub', self.stub, '-z', '-r', '1',
+                '0x0', self.file('app.bin', app))
+        self.assertEqual(code, 1, out)
+        self.assertIn('1 of 2 devices flashed', out)
+        self.assertEqual(self.summary(out, good)[:2], ['ok', '1'])
+        self.assertEqual(self.summary(out, dead)[:2], ['FAIL', '2'])
+        self.assertIn('Failed to connect', out)
+        self.assertEqual(good.flash(0, len(app)), app)
+        self.assertEqual(dead.flash(0, len(app)), b'\xff' * len(app))
+
+
+class StubClient(object):
+    """ stub_sim on pipes, requests framed as esptool.py sends them """
+    def __init__(self, flash_path, flash_size):
+        self.p = subprocess.Popen([STUB_SIM, '-f', flash_path, '-s', str(flash_size)],
+                stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        assert self.read() == b'OHAI'
+
+    def read(self):
+        while self.p.stdout.read(1) != b'\xc0':
+            pass
+        frame = b''
+        while True:
+            c = self.p.stdout.read(1)
+            if c == b'\xc0':
+                if frame:
+                    return frame.replace(b'\xdb\xdc', b'\xc0').replace(b'\xdb\xdd', b'\xdb')
+                continue
+            frame += c
+
+    def command(self, op, data=b'', chk=0):
+        self.p.stdin.write(slip(struct.pack('<BBHI', 0, op, len(data), chk) + data))
+        self.p.stdin.flush()
+        r = self.read()
+        resp, rop, n, value = struct.unpack('<BBHI', r[:8])
+        assert resp == 1 and rop == op, r
+        body = r[8:8 + n]
+        return value, body[:-2], body[-2], body[-1]
+
+    @staticmethod
+    def checksum(data):
+        state = 0xef
+        for c in bytearray(data):
+            state ^= c
+        return state
+
+    def data(self, op, payload, seq):
+        return self.command(op, struct.pack('<IIII', len(payload), seq, 0, 0) + payload, self.checksum(payload))
+
+
+@unittest.skipUnless(os.path.exists(STUB_SIM), 'stub_sim not built')
+class TestStub(unittest.TestCase):
+    size = 0x40000
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix='stub_')
+        self.flash = os.path.join(self.dir, 'flash.bin')
+        with open(self.flash, 'wb') as f:
+            f.write(b'\xff' * self.size)
+        self.stub = StubClient(self.flash, self.size)
+
+    def tearDown(self):
+        self.stub.p.kill()
+        self.stub.p.wait()
+        self.stub.p.stdin.close()
+        self.stub.p.stdout.close()
+        shutil.rmtree(self.dir)
+
+    def test_md5(self):
+        data = image(0x6001, 10, compressible=False)
+        with open(self.flash, 'r+b') as f:
+            f.seek(0x1000)
+            f.write(data)
+        for (off, n) in ((0x1000, len(data)), (0x1003, 1), (0, 0), (0, 0x40000), (0x1000, 55), (0x1000, 64)):
+            _, body, status, _ = self.stub.command(0x13, struct.pack('<IIII', off, n, 0, 0))
+            self.assertEqual(status, 0)
+            with open(self.flash, 'rb') as f:
+                f.seek(off)
+                self.assertEqual(body, hashlib.md5(f.read(n)).digest(), (off, n))
+
+    def test_bad_inflate(self):
+        _, _, status, _ = self.stub.command(0x10, struct.pack('<IIII', 0x2000, 1, 0x4000, 0))
+        self.assertEqual(status, 0)
+        bad = bytearray(zlib.compress(image(0x2000, 11), 9))
+        bad[-3] ^= 0x10
+        _, _, status, err = self.stub.data(0x11, bytes(bad), 0)
+        self.assertEqual((status, err), (1, 9))
+        # one block short of the size from BEGIN
+        _, _, status, err = self.stub.data(0x11, zlib.compress(image(0x1000, 11)), 0)
+        self.assertEqual((status, err), (1, 9))
+
+    def test_checksum_and_sequence(self):
+        self.stub.command(0x10, struct.pack('<IIII', 0x8000, 2, 0x4000, 0))
+        comp = zlib.compress(image(0x4000, 12))
+        _, _, status, err = self.stub.command(0x11, struct.pack('<IIII', len(comp), 0, 0, 0) + comp,
+                self.stub.checksum(comp) ^ 1)
+        self.assertEqual((status, err), (1, 7))
+        _, _, status, err = self.stub.data(0x11, comp, 1)
+        self.assertEqual((status, err), (1, 8))
+        _, _, status, _ = self.stub.data(0x11, comp, 0)
+        self.assertEqual(status, 0)
+
+    def test_unknown_command(self):
+        _, _, status, err = self.stub.command(0x42)
+        self.assertEqual((status, err), (1, 5))
+
+    def test_reboot(self):
+        self.assertEqual(self.stub.command(0x12, struct.pack('<I', 1))[2], 0)
+        self.assertIsNone(self.stub.p.poll())
+        self.assertEqual(self.stub.command(0x12, struct.pack('<I', 0))[2], 0)
+        self.assertEqual(self.stub.p.wait(5), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
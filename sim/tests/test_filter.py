@@ -0,0 +1,76 @@
+"""
+user/edge_filter.c and user/aggregate.c in bridge_sim, through MQTT_FILTER,
+MQTT_AGGREGATE and MQTT_PUBLISH.
+"""
+import json
+import os
+import unittest
+
+from bridge import SIM_DIR, CMD_MQTT_AGGREGATE, CMD_MQTT_FILTER, CMD_MQTT_PUBLISH
+from test_mqtt_app import BridgeCase
+
+# include/edge_filter.h
+EDGE_FILTER_CHANGE = 0x01
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestEdgeFilter(BridgeCase):
+    def filtered(self, topic, readings, deadband, flags):
+        """ the readings a rule lets through to a subscriber """
+        handle = self.bridge.mqtt(self.broker)
+        sub = self.subscriber(topic)
+        self.assertEqual(self.bridge.call(CMD_MQTT_FILTER, (topic, deadband, 0, 0, flags)), 1)
+        for r in readings:
+            self.assertEqual(self.bridge.call(CMD_MQTT_PUBLISH, (handle, topic, r, len(r), 0, 0)), 1)
+        # one more past the rule, so nothing is left in flight when receive() stops
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUBLISH, (handle, topic, b'end', 3, 0, 0)), 1)
+        got = [p for t, p in self.receive(sub, len(readings) + 1)]
+        self.assertEqual(got[-1:], [b'end'])
+        self.assertEqual(self.bridge.call(CMD_MQTT_FILTER, (topic,)), len(readings) + 1 - len(got))
+        return got[:-1]
+
+    def test_large_values(self):
+        readings = [b'20000', b'20000.5', b'25000', b'30000', b'30000.9', b'-25000', b'-25000.2',
+                    b'123456.7 lux', b'123457.8 lux']
+        self.assertEqual(self.filtered(b'f/big', readings, 1000, EDGE_FILTER_CHANGE),
+                         [b'20000', b'25000', b'30000', b'-25000', b'123456.7 lux', b'123457.8 lux'])
+
+    def test_saturates(self):
+        # past 2147483.647 readings compare as that, either sign
+        readings = [b'2147483', b'2147484', b'99999999999', b'-99999999999', b'-2147483.647', b'-2147482']
+        self.assertEqual(self.filtered(b'f/sat', readings, 1000, EDGE_FILTER_CHANGE),
+                         [b'2147483', b'-99999999999', b'-2147482'])
+
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestAggregate(BridgeCase):
+    def test_large_values(self):
+        handle = self.bridge.mqtt(self.broker)
+        sub = self.subscriber(b'agg/big')
+        # a window longer than the test, MQTT_AGGREGATE 0 closes it
+        self.assertEqual(self.bridge.call(CMD_MQTT_AGGREGATE, (b'agg/big', 60000)), 1)
+        for r in [b'20000', b'30000.5', b'123456.789', b'99999999999', b'-25000']:
+            self.assertEqual(self.bridge.call(CMD_MQTT_PUBLISH, (handle, b'agg/big', r, len(r), 0, 0)), 1)
+        self.assertEqual(self.bridge.call(CMD_MQTT_AGGREGATE, (b'agg/big', 0)), 1)
+        got = [p for t, p in self.receive(sub, 2)]
+        # past the range it goes out as it is, rather than skew the summary
+        self.assertEqual(got[0], b'99999999999')
+        self.assertEqual(json.loads(got[1].decode()),
+                         {'min': -25000, 'max': 123456.789, 'mean': 37114.322, 'count': 4, 'last': -25000})
+
+    def test_sum_of_many(self):
+        handle = self.bridge.mqtt(self.broker)
+        sub = self.subscriber(b'agg/sum')
+        self.assertEqual(self.bridge.call(CMD_MQTT_AGGREGATE, (b'agg/sum', 60000)), 1)
+        for i in range(200):
+            r = b'%d.5' % (2000000 + i)
+            self.assertEqual(self.bridge.call(CMD_MQTT_PUBLISH, (handle, b'agg/sum', r, len(r), 0, 0)), 1)
+        self.assertEqual(self.bridge.call(CMD_MQTT_AGGREGATE, (b'agg/sum', 0)), 1)
+        got = [p for t, p in self.receive(sub, 1)]
+        self.assertEqual(json.loads(got[0].decode()),
+                         {'min': 2000000.5, 'max': 2000199.5, 'mean': 2000100, 'count': 200, 'last': 2000199.5})
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,324 @@
+"""
+modules/mqtt_app.c in bridge_sim against tools/sim_broker.py.
+"""
+import os
+import select
+import shutil
+import struct
+import tempfile
+import time
+import unittest
+
+from bridge import (Bridge, Broker, SIM_DIR, CMD_MQTT_SETUP, CMD_MQTT_CONNECT, CMD_MQTT_PUBLISH, CMD_MQTT_PUB_START,
+                    CMD_MQTT_PUB_PART, CMD_MQTT_SUBSCRIBE, CMD_MQTT_SUB_BATCH, CMD_RETURN_TAG,
+                    CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA, CB_QUEUE,
+                    METRIC_MQTT_PUB_FAIL, METRIC_MQTT_RESUBSCRIBE, METRIC_MQTT_SESSION_KEPT, METRIC_MQTT_ALIAS_SAVED,
+                    METRIC_MQTT_INFLIGHT_WAIT)
+
+# include/user_config.h and modules/mqtt_app.h
+MQTT_BUF_SIZE = 1024
+QUEUE_BUFFER_SIZE = 2048
+MQTTAPP_BUF_MAX = 4096
+
+
+class BridgeCase(unittest.TestCase):
+    broker_opts = ()
+    bridge_args = ()
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix='bridge_')
+        self.broker = Broker(self.dir, *self.broker_args())
+        self.bridge = Bridge(self.dir, args=self.bridge_args)
+        self.clients = []
+
+    def tearDown(self):
+        for c in self.clients:
+            c.sock.close()
+        self.bridge.stop()
+        self.broker.stop()
+        shutil.rmtree(self.dir)
+
+    def broker_args(self):
+        return self.broker_opts
+
+    def receive(self, sub, count, timeout=5):
+        """ (topic, payload) of count publishes to sub, keeping the bridge running """
+        msgs = []
+        end = time.time() + timeout
+        while len(msgs) < count and time.time() < end:
+            self.bridge.poll(0)
+            r, _, _ = select.select([sub.sock], [], [], 0.01)
+            if r:
+                msgs += sub.poll()
+        return msgs
+
+    def subscriber(self, topic):
+        sub = self.broker.client(b'watch')
+        self.clients.append(sub)
+        sub.subscribe(topic)
+        self.assertEqual(sub.read_packet()[0], 9)
+        return sub
+
+    def broker_lines(self, *words):
+        """ broker log lines with all of words """
+        return [l for l in self.broker.log().splitlines() if all(w in l for w in words)]
+
+    def bridge_subscribe(self, handle, topic, qos):
+        self.assertEqual(self.bridge.call(CMD_MQTT_SUBSCRIBE, (handle, topic, qos)), 1)
+        self.bridge.assertion(self.bridge.wait(5, lambda: self.broker_lines(': subscribe ', topic.decode())),
+                              'no subscribe')
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestPubParts(BridgeCase):
+    def publish_parts(self, handle, topic, payload, part):
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, topic, len(payload), 0, 0)), 1)
+        at = 0
+        while at < len(payload):
+            data = payload[at:at + part]
+            ret = self.bridge.call(CMD_MQTT_PUB_PART, (handle, at, data, len(data)))
+            at += len(data)
+            if ret != at:
+                return ret
+        return ret
+
+    def test_larger_than_a_frame(self):
+        # a 2048 byte frame, and a client with the largest buffers
+        handle = self.bridge.mqtt(self.broker, protocol=5, buf_size=MQTTAPP_BUF_MAX)
+        sub = self.subscriber(b'parts/big')
+        # SLIP specials throughout, escaped twice the size in the queue
+        payload = bytes(bytearray((0x7d, 0x7e, 0x7f, 0x41)[i % 4] for i in range(MQTTAPP_BUF_MAX - 64)))
+        self.assertEqual(self.publish_parts(handle, b'parts/big', payload, 500), len(payload))
+        self.assertEqual(self.receive(sub, 1), [(b'parts/big', payload)])
+
+    def test_one_after_another(self):
+        handle = self.bridge.mqtt(self.broker, protocol=5, buf_size=2048)
+        sub = self.subscriber(b'parts/+')
+        payloads = [os.urandom(1500), os.urandom(1800), os.urandom(1200)]
+        for i, payload in enumerate(payloads):
+            self.assertEqual(self.publish_parts(handle, b'parts/%d' % i, payload, 400), len(payload))
+        self.assertEqual(self.receive(sub, 3), [(b'parts/%d' % i, p) for i, p in enumerate(payloads)])
+
+    def test_too_big(self):
+        # over this client's buffer, though another one could take it
+        handle = self.bridge.mqtt(self.broker, protocol=5, buf_size=2048)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, b'parts/big', 2048, 0, 0)), 0)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_PART, (handle, 0, b'x' * 16, 16)), 0)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, b'parts/big', 1900, 0, 0)), 1)
+
+    def test_too_big_on_31(self):
+        handle = self.bridge.mqtt(self.broker, buf_size=MQTTAPP_BUF_MAX)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, b'parts/big', MQTT_BUF_SIZE, 0, 0)), 0)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, b'parts/big', MQTT_BUF_SIZE - 64, 0, 0)), 1)
+
+    def test_out_of_order(self):
+        handle = self.bridge.mqtt(self.broker)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_START, (handle, b'parts/x', 1000, 0, 0)), 1)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_PART, (handle, 0, b'a' * 400, 400)), 400)
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_PART, (handle, 800, b'a' * 200, 200)), 0)
+        # the publish is gone, the rest of it too
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUB_PART, (handle, 400, b'a' * 400, 400)), 0)
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestSession(BridgeCase):
+    def subscribes(self):
+        return sum(1 for l in self.broker.log().splitlines() if ': subscribe ' in l and 'session/in' in l)
+
+    def reconnect(self, protocol):
+        """ clean session off, subscribed, the broker drops the connection; stats after the reconnect """
+        handle = self.bridge.mqtt(self.broker, b'sim-session', protocol=protocol, clean=0)
+        self.assertEqual(self.bridge.call(CMD_MQTT_SUBSCRIBE, (handle, b'session/in', 1)), 1)
+        self.bridge.assertion(self.bridge.wait(5, self.subscribes), 'no subscribe')
+        self.broker.drop()
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_DISCONNECTED), 'not dropped')
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_CONNECTED, 15), 'no reconnect')
+        # subscribed either way
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        pub.publish(b'session/in', b'hello')
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_DATA), 'no data after the reconnect')
+        return self.bridge.stats()
+
+    def test_mqtt5_kept(self):
+        m = self.reconnect(5)
+        self.assertEqual((m[METRIC_MQTT_SESSION_KEPT], m[METRIC_MQTT_RESUBSCRIBE]), (1, 0))
+        self.assertEqual(self.subscribes(), 1)
+
+    def test_mqtt31_resubscribes(self):
+        # the broker keeps the session, a 3.1 CONNACK cannot say so
+        m = self.reconnect(0)
+        self.assertEqual((m[METRIC_MQTT_SESSION_KEPT], m[METRIC_MQTT_RESUBSCRIBE]), (0, 1))
+        self.assertEqual(self.subscribes(), 2)
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestMqtt5Limits(BridgeCase):
+    """ user/mqtt5.c against the limits the broker announces """
+    broker_opts = ('--receive-max', 1, '--alias-max', 2, '--packet-max', 600, '--puback-delay', 3000)
+
+    def publish(self, handle, topic, payload, qos=0):
+        return self.bridge.call(CMD_MQTT_PUBLISH, (handle, topic, payload, len(payload), qos, 0))
+
+    def test_held_publish_lets_acks_and_pings_by(self):
+        # a ping every 2 s, the broker gives up after 3 s without one
+        handle = self.bridge.mqtt(self.broker, protocol=5, keepalive=2)
+        self.bridge_subscribe(handle, b'm5/down', 1)
+        self.assertEqual(self.publish(handle, b'm5/up', b'one!', 1), 1)
+        self.assertEqual(self.publish(handle, b'm5/up', b'two!', 1), 1)
+        # the second waits 3 s for the first PUBACK, the broker's QoS 1 publish is acked meanwhile
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        pub.send(0x32, struct.pack('>H', 7) + b'm5/down' + struct.pack('>H', 1) + b'down')
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_DATA, 2), 'no data')
+        self.bridge.assertion(self.bridge.wait(2, lambda: self.broker_lines('sim-bridge', ': puback ')),
+                              'not acked behind the held publish')
+        for i in range(2):
+            ev = self.bridge.wait_event(lambda e: e[1] == CB_PUBLISHED, 5)
+            self.bridge.assertion(ev, 'publish %d not acked' % i)
+        self.assertFalse([e for e in self.bridge.events if e[1] == CB_DISCONNECTED])
+        self.assertFalse(self.broker_lines('keepalive expired'))
+        self.assertTrue(self.broker_lines('sim-bridge', ': ping'))
+        self.assertEqual(self.bridge.stats()[METRIC_MQTT_INFLIGHT_WAIT], 1)
+
+    def test_held_publish_over_a_reconnect(self):
+        # the broker keeps the session, so the bridge hears its own publishes on either connection
+        handle = self.bridge.mqtt(self.broker, b'sim-held', protocol=5, clean=0)
+        self.bridge_subscribe(handle, b'm5/up', 1)
+        self.publish(handle, b'm5/up', b'one!', 1)
+        self.publish(handle, b'm5/up', b'two!', 1)
+        ev = self.bridge.wait_event(lambda e: e[1] == CB_DATA)
+        self.bridge.assertion(ev and bytes(ev[3][1]) == b'one!', 'no first publish')
+        self.broker.drop()
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_CONNECTED, 15), 'no reconnect')
+        ev = self.bridge.wait_event(lambda e: e[1] == CB_DATA)
+        self.bridge.assertion(ev and bytes(ev[3][1]) == b'two!', 'held publish lost')
+        self.assertFalse(self.broker_lines('malformed'))
+
+    def test_aliases(self):
+        handle = self.bridge.mqtt(self.broker, protocol=5)
+        sub = self.subscriber(b'm5/#')
+        # two aliases, the third topic goes out in full every time
+        topics = [b'm5/alias/first-topic', b'm5/alias/second-topic', b'm5/alias/third-topic']
+        sent = [(topics[i % 3], b'%04d' % i) for i in range(9)]
+        for topic, payload in sent:
+            self.assertEqual(self.publish(handle, topic, payload), 1)
+        self.assertEqual(self.receive(sub, len(sent)), sent)
+        saved = sum(len(t) - 3 for t in topics[:2]) * 2
+        self.assertEqual(self.bridge.stats()[METRIC_MQTT_ALIAS_SAVED], saved)
+        self.assertFalse(self.broker_lines(': disconnect, reason'))
+
+    def test_packet_max(self):
+        handle = self.bridge.mqtt(self.broker, protocol=5)
+        sub = self.subscriber(b'm5/max')
+        # refused here rather than over the broker's limit
+        self.publish(handle, b'm5/max', b'x' * 700)
+        self.publish(handle, b'm5/max', b'y' * 500)
+        self.assertEqual(self.receive(sub, 1), [(b'm5/max', b'y' * 500)])
+        self.assertEqual(self.bridge.stats()[METRIC_MQTT_PUB_FAIL], 1)
+        self.assertFalse(self.broker_lines(': disconnect, reason'))
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestMqtt5Recv(BridgeCase):
+    def test_segments_across_packets(self):
+        # 1460 byte segments that end inside packets of about as much, past in_buffer together
+        handle = self.bridge.mqtt(self.broker, protocol=5, buf_size=2048)
+        self.bridge_subscribe(handle, b'm5/big', 0)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        payloads = [os.urandom(1500 + 100 * (i % 4)) for i in range(12)]
+        for p in payloads:
+            pub.publish(b'm5/big', p)
+        got = []
+        for i in range(len(payloads)):
+            ev = self.bridge.wait_event(lambda e: e[1] == CB_DATA)
+            self.bridge.assertion(ev, 'only %d of %d publishes' % (i, len(payloads)))
+            got.append(bytes(ev[3][1]))
+        self.assertEqual(got, payloads)
+        self.assertNotIn('rx overflow', self.bridge.log())
+
+    def test_packet_max_per_client(self):
+        # the broker holds each client to the Maximum Packet Size it announced
+        small = self.bridge.mqtt(self.broker, b'small', protocol=5)
+        big = self.bridge.mqtt(self.broker, b'big', protocol=5, buf_size=2048)
+        for handle in (small, big):
+            self.bridge_subscribe(handle, b'm5/size', 0)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        pub.publish(b'm5/size', b's' * 1500)
+        ev = self.bridge.wait_event(lambda e: e[1] == CB_DATA)
+        self.bridge.assertion(ev and len(bytes(ev[3][1]).rstrip(b'\0')) == 1500, 'no publish to the big client')
+        self.assertTrue(self.broker_lines('small', 'over its maximum'))
+        self.assertFalse(self.broker_lines('big', 'over its maximum'))
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestQueueSize(BridgeCase):
+    def setup_tagged(self, queue_size, protocol=0, buf_size=0):
+        """ (handle, queue size, buffer size) in effect after a tagged MQTT_SETUP """
+        self.bridge.wifi()
+        tag = CMD_RETURN_TAG | 3
+        self.bridge.cmd(CMD_MQTT_SETUP, (b'sim-bridge', b'', b'', 120, 1, CB_CONNECTED, CB_DISCONNECTED,
+                                         CB_PUBLISHED, CB_DATA, queue_size, CB_QUEUE, protocol, buf_size), 0, tag)
+        ev = self.bridge.wait_event(lambda e: e[0] == CMD_MQTT_SETUP and e[1] == tag)
+        self.bridge.assertion(ev and ev[2], 'MQTT setup failed')
+        return (ev[2],) + struct.unpack('<II', bytes(ev[3][0] + ev[3][1]))
+
+    def publish_through(self, handle):
+        self.bridge.cmd(CMD_MQTT_CONNECT, (handle, b'127.0.0.1', self.broker.mqtt_port, 0))
+        self.bridge.assertion(self.bridge.wait_event(lambda e: e[1] == CB_CONNECTED), 'no connection to the broker')
+        sub = self.subscriber(b'q/t')
+        self.assertEqual(self.bridge.call(CMD_MQTT_PUBLISH, (handle, b'q/t', b'hello', 5, 0, 0)), 1)
+        self.assertEqual(self.receive(sub, 1), [(b'q/t', b'hello')])
+
+    def test_size_in_effect(self):
+        # room for every client's queue and buffers
+        self.bridge.stop()
+        self.bridge = Bridge(self.dir, args=('-H', '98304'))
+        self.assertEqual(self.setup_tagged(8192)[1:], (8192, MQTT_BUF_SIZE))
+        self.assertEqual(self.setup_tagged(100)[1:], (2 * MQTT_BUF_SIZE, MQTT_BUF_SIZE))
+        # the library keeps 3.1 clients at MQTT_BUF_SIZE
+        self.assertEqual(self.setup_tagged(0, 0, 4000)[1:], (QUEUE_BUFFER_SIZE, MQTT_BUF_SIZE))
+        # the queue grows with the buffers
+        self.assertEqual(self.setup_tagged(0, 5, 3000)[1:], (6000, 3000))
+        self.assertEqual(self.setup_tagged(0, 5, 99999)[1:], (2 * MQTTAPP_BUF_MAX, MQTTAPP_BUF_MAX))
+
+    def test_no_memory_keeps_the_default(self):
+        # 20000 bytes of heap has no room for a 16384 byte queue or two 8K buffers
+        self.bridge.stop()
+        self.bridge = Bridge(self.dir, args=('-H', '20000'))
+        handle, queue, buf = self.setup_tagged(16384)
+        self.assertEqual((queue, buf), (QUEUE_BUFFER_SIZE, MQTT_BUF_SIZE))
+        self.publish_through(handle)
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestSubBatch(BridgeCase):
+    # the 3.1 library drops segments over its 1024 byte buffer
+    bridge_args = ('-m', '536')
+
+    def flood(self, pub, count):
+        # mostly tiny packets, so segments often end inside a fixed header;
+        # read out of step, 0xff payload makes lengths of megabytes
+        for i in range(count):
+            pub.publish(b'fl/x', b'\xff' * (200 if i % 50 == 0 else i % 5))
+
+    def test_ack_behind_a_downlink_flood(self):
+        handle = self.bridge.mqtt(self.broker)
+        self.bridge_subscribe(handle, b'fl/#', 0)
+        pub = self.broker.client(b'pub')
+        self.clients.append(pub)
+        self.flood(pub, 4000)
+        self.bridge.wait(0.1)
+        tag = CMD_RETURN_TAG | 7
+        self.bridge.cmd(CMD_MQTT_SUB_BATCH, (handle, b'sb/1', 0, b'sb/2', 1), 0, tag)
+        self.flood(pub, 1000)
+        ev = self.bridge.wait_event(lambda e: e[0] == CMD_MQTT_SUB_BATCH and e[1] == tag, 15)
+        self.bridge.assertion(ev, 'no SUBACK answer')
+        self.assertEqual(ev[2], 2)
+        self.assertEqual(bytes(ev[3][0]).rstrip(b'\0'), b'\0\1')
+
+
+if __name__ == '__main__':
+    unittest.main()
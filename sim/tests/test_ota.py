@@ -0,0 +1,155 @@
+"""
+Delta OTA end to end: a tools/ota_diff.py delta served by
+tools/ota_server.py, applied by modules/ota.c in bridge_ota_sim.
+"""
+import hashlib
+import os
+import random
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+
+from bridge import Bridge, CMD_IS_READY, CMD_OTA, CMD_OTA_EVENTS, SIM_DIR, free_port, tool
+
+# include/user_config.h
+SLOT1, SLOT2, SLOT_SIZE = 0x01000, 0x81000, 0x7B000
+FLASH_SIZE = 0x100000
+
+# modules/include/ota.h
+EV_PROGRESS, EV_DONE, EV_FAIL = 0, 1, 2
+ERR_HTTP, ERR_BASE, ERR_TRUNCATED, ERR_VERIFY = 1, 4, 6, 8
+
+CB_OTA = 0x500
+SIM_EXIT_RESTART = 3
+
+
+def firmware(size, seed, base=0x40200000):
+    """ code like bytes with literal pools holding addresses into the slot """
+    rnd = random.Random(seed)
+    out = bytearray()
+    while len(out) < size:
+        out += bytes(rnd.choice((0x0c, 0x12, 0x22, 0x31, 0x41, 0x66, 0xa5, 0xc0, 0xe0)) for _ in range(rnd.randrange(16, 64)))
+        for _ in range(rnd.randrange(1, 6)):
+            out += struct.pack('<I', base + rnd.randrange(0, 0x40000) * 4)
+    return bytes(out[:size])
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_ota_sim')), 'bridge_ota_sim not built')
+class TestOta(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix='ota_')
+        self.server = None
+        self.bridge = None
+        self.old = firmware(0x30000, 1)
+        # the same source linked for slot 2, and a change in the middle
+        new = bytearray(firmware(0x30000, 1, base=0x40280000))
+        new[0x12000:0x12000] = firmware(0x1234, 2)
+        self.new = bytes(new)
+        self.flash = os.path.join(self.dir, 'flash.bin')
+        image = bytearray(b'\xff' * FLASH_SIZE)
+        image[SLOT1:SLOT1 + len(self.old)] = self.old
+        with open(self.flash, 'wb') as f:
+            f.write(image)
+
+    def tearDown(self):
+        if self.bridge:
+            self.bridge.stop()
+        if self.server:
+            self.server.terminate()
+            self.server.wait()
+            self.server.stdout.close()
+        shutil.rmtree(self.dir)
+
+    def delta(self, old, new):
+        path = os.path.join(self.dir, 'update.delta')
+        paths = [os.path.join(self.dir, n) for n in ('old.bin', 'new.bin')]
+        for p, data in zip(paths, (old, new)):
+            with open(p, 'wb') as f:
+                f.write(data)
+        self.assertEqual(tool('ota_diff.py', 'diff', paths[0], paths[1], '-o', path, stdout=subprocess.DEVNULL).wait(), 0)
+        with open(path, 'rb') as f:
+            return f.read()
+
+    def serve(self, delta, *opts):
+        path = os.path.join(self.dir, 'served.delta')
+        with open(path, 'wb') as f:
+            f.write(delta)
+        port = free_port()
+        self.server = tool('ota_server.py', path, '--bind', '127.0.0.1', '--port', port, *opts,
+                stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        self.assertIn(b'serving', self.server.stdout.readline())
+        return port
+
+    def update(self, delta, *opts):
+        """ OTA events up to the first DONE or FAIL """
+        port = self.serve(delta, *opts)
+        self.bridge = Bridge(self.dir, 'bridge_ota_sim', ['-f', self.flash])
+        self.assertEqual(self.bridge.call(CMD_IS_READY), 1)
+        self.assertEqual(self.bridge.call(CMD_OTA, (b'127.0.0.1', port, b'/update.delta'), CB_OTA), 1)
+        events = []
+        while not events or events[-1][0] == EV_PROGRESS:
+            ev = self.bridge.wait_event(lambda e: e[0] == CMD_OTA_EVENTS, 20)
+            self.assertIsNotNone(ev, 'no OTA event, got %r\n%s' % (events, self.bridge.log()))
+            self.assertEqual(ev[1], CB_OTA)
+            events.append((ev[2], struct.unpack('<I', ev[3][0])[0]))
+        return events
+
+    def slot(self, addr, size):
+        with open(self.flash, 'rb') as f:
+            f.seek(addr)
+            return f.read(size)
+
+    def assert_untouched(self):
+        self.assertEqual(self.slot(SLOT1, len(self.old)), self.old)
+        self.assertEqual(self.slot(SLOT2, SLOT_SIZE), b'\xff' * SLOT_SIZE)
+
+    def test_update(self):
+        delta = self.delta(self.old, self.new)
+        self.assertLess(len(delta), len(self.new) // 4)
+        events = self.update(delta, '--rate', 200000)
+        self.assertEqual(events[-1], (EV_DONE, len(self.new)))
+        self.assertIn((EV_PROGRESS, 0x10000), events)
+        # reboots into the new slot once the DONE event is out
+        self.assertEqual(self.bridge.p.wait(5), SIM_EXIT_RESTART)
+        self.assertIn('upgrade reboot, flag 2', self.bridge.log())
+        self.assertEqual(hashlib.md5(self.slot(SLOT2, len(self.new))).digest(), hashlib.md5(self.new).digest())
+        self.assertEqual(self.slot(SLOT1, len(self.old)), self.old)
+
+    def test_wrong_base(self):
+        # made against another build than the one running
+        delta = self.delta(firmware(0x30000, 3), self.new)
+        self.assertEqual(self.update(delta), [(EV_FAIL, ERR_BASE)])
+        self.assertIsNone(self.bridge.p.poll())
+        self.assert_untouched()
+
+    def test_bad_hash(self):
+        # the slot is written but does not read back as new_md5
+        delta = bytearray(self.delta(self.old, self.new))
+        delta[32] ^= 0x01
+        events = self.update(bytes(delta))
+        self.assertEqual(events[-1], (EV_FAIL, ERR_VERIFY))
+        self.bridge.wait(1)
+        self.assertIsNone(self.bridge.p.poll())
+        self.assertNotIn('upgrade reboot', self.bridge.log())
+        self.assertEqual(self.slot(SLOT1, len(self.old)), self.old)
+
+    def test_truncated(self):
+        delta = self.delta(self.old, self.new)
+        events = self.update(delta, '--cut', len(delta) // 2)
+        self.assertEqual(events[-1], (EV_FAIL, ERR_TRUNCATED))
+        self.bridge.wait(1)
+        self.assertIsNone(self.bridge.p.poll())
+        self.assertNotIn('upgrade reboot', self.bridge.log())
+        self.assertEqual(self.slot(SLOT1, len(self.old)), self.old)
+        self.assertNotEqual(hashlib.md5(self.slot(SLOT2, len(self.new))).digest(), hashlib.md5(self.new).digest())
+
+    def test_http_error(self):
+        events = self.update(self.delta(self.old, self.new), '--status', 404)
+        self.assertEqual(events, [(EV_FAIL, ERR_HTTP)])
+        self.assert_untouched()
+
+
+if __name__ == '__main__':
+    unittest.main()
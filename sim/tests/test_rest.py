@@ -0,0 +1,88 @@
+"""
+modules/rest.c in bridge_sim against the HTTP side of tools/sim_broker.py.
+"""
+import json
+import os
+import unittest
+
+from bridge import SIM_DIR, CMD_REST_SETUP, CMD_REST_REQUEST, CMD_REST_EVENTS, CMD_REST_EXTRACT, CB_REST
+from test_mqtt_app import BridgeCase
+
+
+def document():
+    """ a few KB of JSON, the values the tests look for near its end """
+    return {'list': [{'dt': 1700000000 + 3600 * i, 'main': {'temp': 20.5 + i, 'humidity': 40 + i % 50},
+                      'weather': [{'id': 800 + i % 4, 'description': 'clear sky %d' % i}]} for i in range(48)],
+            'city': {'name': 'Chunkéville', 'id': 12345}}
+
+
+class RestCase(BridgeCase):
+    broker_opts = ()
+
+    def broker_args(self):
+        path = os.path.join(self.dir, 'doc.json')
+        with open(path, 'w') as f:
+            json.dump(document(), f, indent=1)
+        return ('--http-json', path) + self.broker_opts
+
+    def request(self, path, paths=()):
+        """ (status, args) of the REST_EVENTS answering GET path """
+        self.bridge.wifi()
+        handle = self.bridge.call(CMD_REST_SETUP, (b'127.0.0.1', self.broker.http_port, 0), CB_REST)
+        self.bridge.assertion(handle, 'REST setup failed')
+        if paths:
+            self.assertEqual(self.bridge.call(CMD_REST_EXTRACT, (handle,) + paths), len(paths))
+        self.bridge.cmd(CMD_REST_REQUEST, (handle, b'GET', path))
+        ev = self.bridge.wait_event(lambda e: e[0] == CMD_REST_EVENTS and e[1] == CB_REST)
+        self.bridge.assertion(ev, 'no response')
+        return ev[2], [bytes(a).rstrip(b'\0') for a in ev[3]]
+
+    def extract(self):
+        status, values = self.request(b'/forecast', (b'list[47].main.temp', b'list[46].weather[0]', b'city.name',
+                                                     b'list[48]'))
+        self.assertEqual(status, 200)
+        self.assertEqual(values, [b'67.5', b'{"id":802,"description":"clear sky 46"}',
+                                  b'"Chunk\\u00e9ville"', b''])
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestExtract(RestCase):
+    def test_content_length(self):
+        self.extract()
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestExtractChunked(RestCase):
+    # chunks end inside keys, numbers and the chunk framing of the packets
+    broker_opts = ('--http-chunked', 7)
+
+    def test_small_chunks(self):
+        self.extract()
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestExtractChunkedLarge(RestCase):
+    broker_opts = ('--http-chunked', 2000)
+
+    def test_chunks_over_packets(self):
+        self.extract()
+
+
+@unittest.skipUnless(os.path.exists(os.path.join(SIM_DIR, 'bridge_sim')), 'bridge_sim not built')
+class TestRequestChunked(BridgeCase):
+    """ a body that fits one packet, forwarded as it is """
+    broker_opts = ('--http-chunked', 5)
+
+    def test_body(self):
+        self.bridge.wifi()
+        handle = self.bridge.call(CMD_REST_SETUP, (b'127.0.0.1', self.broker.http_port, 0), CB_REST)
+        self.bridge.cmd(CMD_REST_REQUEST, (handle, b'GET', b'/plain'))
+        ev = self.bridge.wait_event(lambda e: e[0] == CMD_REST_EVENTS and e[1] == CB_REST)
+        self.bridge.assertion(ev, 'no response')
+        self.assertEqual(ev[2], 200)
+        body = json.loads(bytes(ev[3][0]).rstrip(b'\0').decode())
+        self.assertEqual((body['status'], body['request']), (200, 'GET /plain HTTP/1.1'))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,175 @@
+#!/usr/bin/env python
+#
+# Decoder for the deferred binary log (make DLOG=1), see include/dlog.h.
+#
+# Reads the UART1 stream from a capture file or a serial port, looks the
+# format strings up in the firmware ELF and prints the log as text. Bytes
+# outside of log frames (SDK output) are passed through.
+#
+#   dlog_decode.py build/app.out uart1.bin
+#   dlog_decode.py build/app.out -p /dev/ttyUSB1 -b 115200
+
+from __future__ import print_function
+
+import argparse
+import re
+import struct
+import sys
+
+DLOG_SYNC = 0xD1
+DLOG_HDR_WORDS = 3
+DLOG_MAX_WORDS = DLOG_HDR_WORDS + 16
+
+SHF_ALLOC = 0x2
+
+SPEC = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z)?([diouxXcsp%])')
+
+
+class Elf(object):
+    """Just enough ELF32 to read strings from allocated sections."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            data = f.read()
+        if data[:4] != b'\x7fELF' or bytearray(data)[4] != 1:
+            raise ValueError('%s: not an ELF32 file' % path)
+        shoff, = struct.unpack_from('<I', data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', data, 0x2e)
+        self.sections = []
+        for i in range(shnum):
+            off = shoff + i * shentsize
+            _, stype, flags, addr, offset, size = struct.unpack_from('<IIIIII', data, off)
+            if flags & SHF_ALLOC and stype != 8 and addr and size:    # 8: NOBITS
+                self.sections.append((addr, size, data[offset:offset + size]))
+
+    def string(self, addr):
+        for base, size, blob in self.sections:
+            if base <= addr < base + size:
+                end = blob.find(b'\0', addr - base)
+                if end < 0:
+                    end = size
+                return blob[addr - base:end].decode('latin-1')
+        return None
+
+
+def signed(v):
+    return v - (1 << 32) if v & 0x80000000 else v
+
+
+def render(elf, fmt, args):
+    args = list(args)
+
+    def sub(m):
+        flags, width, prec, _, conv = m.groups()
+        if conv == '%':
+            return '%'
+        v = args.pop(0) if args else 0
+        if conv == 's':
+            s = elf.string(v)
+            out = s if s is not None else '<ram 0x%08x>' % v
+            return ('%' + flags + width + 's') % out
+        if conv == 'p':
+            return '0x%08x' % v
+        if conv in 'di':
+            v = signed(v)
+            conv = 'd'
+        elif conv == 'u':
+            conv = 'd'
+        elif conv == 'c':
+            v = chr(v & 0xff)
+        spec = '%' + flags + width + ('.' + prec if prec else '') + conv
+        return spec % v
+
+    return SPEC.sub(sub, fmt)
+
+
+def decode_frame(elf, words):
+    fid, ts, hdr = words[:DLOG_HDR_WORDS]
+    fmt = elf.string(fid)
+    if fmt is None:
+        return None
+    nargs = hdr & 0xff
+    nhex = (hdr >> 8) & 0xff
+    body = words[DLOG_HDR_WORDS:]
+    if nhex:
+        raw = b''.join(struct.pack('<I', w) for w in body)[:nhex]
+        text = fmt + ' ' + ' '.join('%02X' % b for b in bytearray(raw)) + '\n'
+    else:
+        text = render(elf, fmt, body[:nargs])
+    return '[%6u.%03u] %s' % (ts // 1000000, ts // 1000 % 1000, text)
+
+
+class Decoder(object):
+    def __init__(self, elf, write):
+        self.elf = elf
+        self.write = write
+        self.buf = bytearray()
+
+    def feed(self, chunk):
+        buf = self.buf
+        buf += bytearray(chunk)
+        while buf:
+            if buf[0] != DLOG_SYNC:
+                i = buf.find(bytearray([DLOG_SYNC]))
+                i = len(buf) if i < 0 else i
+                self.write(bytes(buf[:i]).decode('latin-1'))
+                del buf[:i]
+                continue
+            if len(buf) < 2:
+                break
+            n = buf[1]
+            if n < DLOG_HDR_WORDS or n > DLOG_MAX_WORDS:
+                self.write(chr(buf[0]))
+                del buf[:1]
+                continue
+            if len(buf) < 2 + n * 4:
+                break
+            words = struct.unpack_from('<%dI' % n, bytes(buf[2:2 + n * 4]))
+            text = decode_frame(self.elf, words)
+            if text is None:
+                # not a frame after all, resync on the next byte
+                self.write(chr(buf[0]))
+                del buf[:1]
+                continue
+            self.write(text)
+            del buf[:2 + n * 4]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the deferred binary log')
+    parser.add_argument('elf', help='firmware ELF, e.g. build/app.out')
+    parser.add_argument('capture', nargs='?', help='raw UART1 capture, - for stdin')
+    parser.add_argument('-p', '--port', help='read from this serial port instead')
+    parser.add_argument('-b', '--baud', type=int, default=115200)
+    args = parser.parse_args()
+
+    elf = Elf(args.elf)
+    out = sys.stdout
+
+    def write(s):
+        out.write(s)
+        out.flush()
+
+    dec = Decoder(elf, write)
+    if args.port:
+        import serial
+        port = serial.Serial(args.port, args.baud, timeout=0.1)
+        try:
+            while True:
+                dec.feed(port.read(256))
+        except KeyboardInterrupt:
+            pass
+    else:
+        if args.capture in (None, '-'):
+            f = getattr(sys.stdin, 'buffer', sys.stdin)
+        else:
+            f = open(args.capture, 'rb')
+        while True:
+            chunk = f.read(4096)
+            if not chunk:
+                break
+            dec.feed(chunk)
+
+
+if __name__ == '__main__':
+    main()
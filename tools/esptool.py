@@ -26,6 +26,11 @@ import argparse
 import os
 import subprocess
 import tempfile
+import hashlib
+import zlib
+import json
+import base64
+import threading
 
 class ESPROM:
 
@@ -40,10 +45,23 @@ class ESPROM:
     ESP_WRITE_REG   = 0x09
     ESP_READ_REG    = 0x0a
 
+    # Commands only understood by a flasher stub running from RAM, see run_stub()
+    ESP_CHANGE_BAUDRATE  = 0x0f
+    ESP_FLASH_DEFL_BEGIN = 0x10
+    ESP_FLASH_DEFL_DATA  = 0x11
+    ESP_FLASH_DEFL_END   = 0x12
+    ESP_SPI_FLASH_MD5    = 0x13
+
     # Maximum block sized for RAM and Flash writes, respectively.
     ESP_RAM_BLOCK   = 0x1800
     ESP_FLASH_BLOCK = 0x400
 
+    # Bytes per compressed write through the stub, before compression.
+    # Each block is a zlib stream of its own, see tools/stub/stub.h
+    ESP_STUB_BLOCK  = 0x4000
+
+    ESP_FLASH_SECTOR = 0x1000
+
     # Default baudrate. The ROM auto-bauds, so we can use more or less whatever we want.
     ESP_ROM_BAUD    = 115200
 
@@ -70,6 +88,8 @@ class ESPROM:
         # sets), shouldn't matter for other platforms/drivers. See
         # https://github.com/themadinventor/esptool/issues/44#issuecomment-107094446
         self._port.baudrate = baud
+        self.stub = False
+        self.verbose = True
 
     """ Read bytes from the serial port while performing SLIP unescaping """
     def read(self, length = 1):
@@ -124,27 +144,48 @@ class ESPROM:
 
         return val, body
 
+    """ Read one SLIP framed packet that is not a command response """
+    def read_packet(self):
+        if self._port.read(1) != '\xc0':
+            raise Exception('Invalid head of packet')
+        b = ''
+        while True:
+            c = self._port.read(1)
+            if c == '':
+                raise Exception('Timed out waiting for packet')
+            if c == '\xc0':
+                return b
+            if c == '\xdb':
+                c = {'\xdc': '\xc0', '\xdd': '\xdb'}.get(self._port.read(1))
+                if c is None:
+                    raise Exception('Invalid SLIP escape')
+            b = b + c
+
     """ Perform a connection test """
     def sync(self):
         self.command(ESPROM.ESP_SYNC, '\x07\x07\x12\x20'+32*'\x55')
         for i in xrange(7):
             self.command()
 
-    """ Try connecting repeatedly until successful, or giving up """
-    def connect(self):
-        print 'Connecting...'
+    """ Try connecting repeatedly until successful, or giving up.
+    Without reset the chip has to be in the loader already, for ports
+    without DTR and RTS such as a pty """
+    def connect(self, reset = True):
+        if self.verbose:
+            print 'Connecting...'
 
         for _ in xrange(4):
-            # issue reset-to-bootloader:
-            # RTS = either CH_PD or nRESET (both active low = chip in reset)
-            # DTR = GPIO0 (active low = boot to flasher)
-            self._port.setDTR(False)
-            self._port.setRTS(True)
-            time.sleep(0.05)
-            self._port.setDTR(True)
-            self._port.setRTS(False)
-            time.sleep(0.05)
-            self._port.setDTR(False)
+            if reset:
+                # issue reset-to-bootloader:
+                # RTS = either CH_PD or nRESET (both active low = chip in reset)
+                # DTR = GPIO0 (active low = boot to flasher)
+                self._port.setDTR(False)
+                self._port.setRTS(True)
+                time.sleep(0.05)
+                self._port.setDTR(True)
+                self._port.setRTS(False)
+                time.sleep(0.05)
+                self._port.setDTR(False)
 
             self._port.timeout = 0.3 # worst-case latency timer should be 255ms (probably <20ms)
             for _ in xrange(4):
@@ -203,7 +244,10 @@ class ESPROM:
         if num_sectors < head_sectors:
             head_sectors = num_sectors
 
-        if num_sectors < 2 * head_sectors:
+        if self.stub:
+            # the stub erases exactly what it is told, no ROM erase bug to work around
+            erase_size = size
+        elif num_sectors < 2 * head_sectors:
             erase_size = (num_sectors + 1) / 2 * sector_size
         else:
             erase_size = (num_sectors - head_sectors) * sector_size
@@ -226,6 +270,71 @@ class ESPROM:
         if self.command(ESPROM.ESP_FLASH_END, pkt)[1] != "\0\0":
             raise Exception('Failed to leave Flash mode')
 
+    """ Load a flasher stub into RAM and start it
+
+    The stub is an esptool style JSON file: base64 'text' and 'data' with
+    their '*_start' addresses and an 'entry' point, as `make stub` builds
+    from tools/stub. It greets with 'OHAI' and then serves the ROM
+    commands plus the stub only ones above. """
+    def run_stub(self, filename):
+        stub = json.load(open(filename))
+        for field in ('text', 'data'):
+            if field not in stub:
+                continue
+            data = base64.b64decode(stub[field])
+            blocks = div_roundup(len(data), ESPROM.ESP_RAM_BLOCK)
+            self.mem_begin(len(data), blocks, ESPROM.ESP_RAM_BLOCK, stub[field + '_start'])
+            for seq in xrange(blocks):
+                self.mem_block(data[seq * ESPROM.ESP_RAM_BLOCK:(seq + 1) * ESPROM.ESP_RAM_BLOCK], seq)
+        self.mem_finish(stub['entry'])
+        if self.read_packet() != 'OHAI':
+            raise Exception('Failed to start flasher stub')
+        self.stub = True
+
+    """ Switch to a faster baud rate, needs the stub. The ROM only auto-bauds at sync """
+    def change_baud(self, baud):
+        if self.command(ESPROM.ESP_CHANGE_BAUDRATE,
+                struct.pack('<II', baud, self._port.baudrate))[1] != "\0\0":
+            raise Exception('Failed to change baud rate')
+        self._port.baudrate = baud
+        time.sleep(0.05)
+        self._port.flushInput()
+
+    """ Start a compressed download to Flash, size is the uncompressed size """
+    def flash_defl_begin(self, size, offset):
+        old_tmo = self._port.timeout
+        num_blocks = div_roundup(size, ESPROM.ESP_STUB_BLOCK)
+        self._port.timeout = 10
+        if self.command(ESPROM.ESP_FLASH_DEFL_BEGIN,
+                struct.pack('<IIII', size, num_blocks, ESPROM.ESP_STUB_BLOCK, offset))[1] != "\0\0":
+            raise Exception('Failed to enter compressed Flash download mode')
+        self._port.timeout = old_tmo
+
+    """ Write a compressed block to flash, the stub inflates it, erases and writes """
+    def flash_defl_block(self, data, seq):
+        old_tmo = self._port.timeout
+        self._port.timeout = 10
+        if self.command(ESPROM.ESP_FLASH_DEFL_DATA,
+                struct.pack('<IIII', len(data), seq, 0, 0)+data, ESPROM.checksum(data))[1] != "\0\0":
+            raise Exception('Failed to write compressed data to target Flash')
+        self._port.timeout = old_tmo
+
+    """ Leave compressed flash mode """
+    def flash_defl_finish(self, reboot = False):
+        pkt = struct.pack('<I', int(not reboot))
+        if self.command(ESPROM.ESP_FLASH_DEFL_END, pkt)[1] != "\0\0":
+            raise Exception('Failed to leave compressed Flash mode')
+
+    """ MD5 of a flash region, computed on the target by the stub """
+    def flash_md5sum(self, offset, size):
+        old_tmo = self._port.timeout
+        self._port.timeout = 10
+        res = self.command(ESPROM.ESP_SPI_FLASH_MD5, struct.pack('<IIII', offset, size, 0, 0))[1]
+        self._port.timeout = old_tmo
+        if len(res) != 18 or res[16:] != "\0\0":
+            raise Exception('Failed to read flash MD5')
+        return res[:16]
+
     """ Run application code in flash """
     def run(self, reboot = False):
         # Fake flash begin immediately followed by flash end
@@ -422,12 +531,203 @@ def div_roundup(a, b):
     """
     return (int(a) + int(b) - 1) / int(b)
 
+def changed_runs(esp, address, image):
+    """ (start, end) offsets of the sector runs in image that differ from
+    what the flash holds, compared by MD5 on the target.
+    """
+    if esp.flash_md5sum(address, len(image)) == hashlib.md5(image).digest():
+        return []
+    runs = []
+    for off in xrange(0, len(image), esp.ESP_FLASH_SECTOR):
+        chunk = image[off:off + esp.ESP_FLASH_SECTOR]
+        if esp.flash_md5sum(address + off, len(chunk)) == hashlib.md5(chunk).digest():
+            continue
+        if runs and runs[-1][1] == off:
+            runs[-1] = (runs[-1][0], off + len(chunk))
+        else:
+            runs.append((off, off + len(chunk)))
+    return runs
+
+class FlashLog:
+    """ Console output of write_flash for a single device """
+    def message(self, msg):
+        print msg
+
+    def progress(self, address, percent):
+        print '\rWriting at 0x%08x... (%d %%)' % (address, percent),
+        sys.stdout.flush()
+
+class PortLog(FlashLog):
+    """ Console output of one of several devices flashed at once: whole
+    lines prefixed with the port, progress in steps of 25 %.
+    """
+    lock = threading.Lock()
+
+    def __init__(self, port):
+        self.port = port
+        self.step = -1
+
+    def message(self, msg):
+        with PortLog.lock:
+            print '%-16s %s' % (self.port, msg.strip())
+            sys.stdout.flush()
+
+    def progress(self, address, percent):
+        if percent / 25 != self.step:
+            self.step = percent / 25
+            self.message('0x%08x %3d %%' % (address, percent))
+
+def write_flash_plain(esp, address, image, log):
+    """ Write image as is, returns the bytes sent """
+    log.message('Erasing flash...')
+    blocks = div_roundup(len(image), esp.ESP_FLASH_BLOCK)
+    esp.flash_begin(blocks*esp.ESP_FLASH_BLOCK, address)
+    seq = 0
+    while len(image) > 0:
+        log.progress(address + seq*esp.ESP_FLASH_BLOCK, 100*(seq+1)/blocks)
+        block = image[0:esp.ESP_FLASH_BLOCK]
+        # Pad the last block
+        block = block + '\xff' * (esp.ESP_FLASH_BLOCK-len(block))
+        esp.flash_block(block, seq)
+        image = image[esp.ESP_FLASH_BLOCK:]
+        seq += 1
+    return blocks*esp.ESP_FLASH_BLOCK
+
+def write_flash_deflate(esp, address, image, log):
+    """ Write image deflated a block at a time, the stub inflates each
+    block on its own. Returns the bytes sent
+    """
+    blocks = div_roundup(len(image), esp.ESP_STUB_BLOCK)
+    esp.flash_defl_begin(len(image), address)
+    sent = 0
+    for seq in xrange(blocks):
+        log.progress(address + seq*esp.ESP_STUB_BLOCK, 100*(seq+1)/blocks)
+        comp = zlib.compress(image[seq*esp.ESP_STUB_BLOCK:(seq+1)*esp.ESP_STUB_BLOCK], 9)
+        esp.flash_defl_block(comp, seq)
+        sent += len(comp)
+    return sent
+
+def read_images(args):
+    """ (address, data) of each image to write, with the SPI flash header
+    patched in. Read once, the data is shared by all devices.
+    """
+    flash_mode = {'qio':0, 'qout':1, 'dio':2, 'dout': 3}[args.flash_mode]
+    flash_size_freq = {'4m':0x00, '2m':0x10, '8m':0x20, '16m':0x30, '32m':0x40, '16m-c1': 0x50, '32m-c1':0x60, '32m-c2':0x70}[args.flash_size]
+    flash_size_freq += {'40m':0, '26m':1, '20m':2, '80m': 0xf}[args.flash_freq]
+    flash_info = struct.pack('BB', flash_mode, flash_size_freq)
+
+    images = []
+    for i in xrange(0, len(args.addr_filename), 2):
+        address = int(args.addr_filename[i], 0)
+        image = file(args.addr_filename[i + 1], 'rb').read()
+        # Fix sflash config data
+        if address == 0 and image[0] == '\xe9':
+            image = image[0:2] + flash_info + image[4:]
+        images.append((address, image))
+    return images
+
+def write_flash(esp, args, images, log):
+    """ Write images to a connected device, returns the bytes written """
+    if args.stub:
+        log.message('Running flasher stub...')
+        esp.run_stub(args.stub)
+        if args.fast_baud:
+            esp.change_baud(args.fast_baud)
+
+    total = 0
+    for (address, image) in images:
+        runs = [(0, len(image))]
+        if args.skip_unchanged:
+            runs = changed_runs(esp, address, image)
+            changed = sum(div_roundup(end - start, esp.ESP_FLASH_SECTOR) for (start, end) in runs)
+            log.message('%d of %d sectors at 0x%08x changed' % (changed, div_roundup(len(image), esp.ESP_FLASH_SECTOR), address))
+        written = 0
+        sent = 0
+        t = time.time()
+        for (start, end) in runs:
+            if args.compress:
+                sent += write_flash_deflate(esp, address + start, image[start:end], log)
+            else:
+                sent += write_flash_plain(esp, address + start, image[start:end], log)
+            written += end - start
+        t = max(time.time() - t, 0.001)
+        log.message('\rWrote %d bytes (%d sent) at 0x%08x in %.1f seconds (%.1f kbit/s)...' % (written, sent, address, t, written / t * 8 / 1000))
+        if args.stub and esp.flash_md5sum(address, len(image)) != hashlib.md5(image).digest():
+            raise Exception('Verify failed at 0x%08x' % address)
+        total += written
+
+    log.message('\nLeaving...')
+    if args.compress:
+        esp.flash_defl_finish(False)
+    elif args.flash_mode == 'dio':
+        esp.flash_unlock_dio()
+    else:
+        esp.flash_begin(0, 0)
+        esp.flash_finish(False)
+    return total
+
+class FlashWorker(threading.Thread):
+    """ Connects to and flashes one device, retrying from the reset on failure """
+    def __init__(self, port, args, images):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.port = port
+        self.args = args
+        self.images = images
+        self.log = PortLog(port)
+        self.attempts = 0
+        self.written = 0
+        self.seconds = 0
+        self.error = None
+
+    def run(self):
+        t = time.time()
+        while self.attempts <= self.args.retries:
+            self.attempts += 1
+            esp = None
+            try:
+                esp = ESPROM(self.port, self.args.baud)
+                esp.verbose = False
+                self.log.message('Connecting... (attempt %d)' % self.attempts)
+                esp.connect(self.args.before != 'no_reset')
+                self.written = write_flash(esp, self.args, self.images, self.log)
+                self.error = None
+                break
+            except Exception, e:
+                self.error = str(e) or e.__class__.__name__
+                self.log.message('Failed: %s' % self.error)
+            finally:
+                if esp is not None:
+                    esp._port.close()
+        self.seconds = time.time() - t
+
+def write_flash_many(ports, args, images):
+    """ Flash all ports at once, one thread each. Returns the number of failures """
+    workers = [FlashWorker(port, args, images) for port in ports]
+    for w in workers:
+        w.start()
+    # join with a timeout so Ctrl-C still gets through
+    for w in workers:
+        while w.is_alive():
+            w.join(0.5)
+
+    print
+    print '%-16s %-6s %8s %8s %10s' % ('port', 'result', 'attempts', 'seconds', 'bytes')
+    failed = 0
+    for w in workers:
+        print '%-16s %-6s %8d %8.1f %10d%s' % (w.port, 'FAIL' if w.error else 'ok',
+                w.attempts, w.seconds, w.written, '  ' + w.error if w.error else '')
+        if w.error:
+            failed += 1
+    print '%d of %d devices flashed' % (len(workers) - failed, len(workers))
+    return failed
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description = 'ESP8266 ROM Bootloader Utility', prog = 'esptool')
 
     parser.add_argument(
             '--port', '-p',
-            help = 'Serial port device',
+            help = 'Serial port device, several separated by commas flash in parallel',
             default = '/dev/ttyUSB0')
 
     parser.add_argument(
@@ -436,6 +736,12 @@ if __name__ == '__main__':
             type = arg_auto_int,
             default = ESPROM.ESP_ROM_BAUD)
 
+    parser.add_argument(
+            '--before',
+            help = 'Reset into the ROM loader with DTR and RTS, or not for a chip already in it',
+            choices = ['default_reset', 'no_reset'],
+            default = 'default_reset')
+
     subparsers = parser.add_subparsers(
             dest = 'operation',
             help = 'Run esptool {command} -h for additional help')
@@ -474,6 +780,11 @@ if __name__ == '__main__':
             choices = ['qio', 'qout', 'dio', 'dout'], default = 'qio')
     parser_write_flash.add_argument('--flash_size', '-fs', help = 'SPI Flash size in Mbit',
             choices = ['4m', '2m', '8m', '16m', '32m', '16m-c1', '32m-c1', '32m-c2'], default = '4m')
+    parser_write_flash.add_argument('--stub', help = 'Flasher stub (JSON) to run from RAM, needed by the options below')
+    parser_write_flash.add_argument('--compress', '-z', help = 'Send the image deflated', action = 'store_true')
+    parser_write_flash.add_argument('--skip_unchanged', '-s', help = 'Only write sectors whose MD5 differs', action = 'store_true')
+    parser_write_flash.add_argument('--fast_baud', '-fb', help = 'Baud rate to switch to once the stub runs', type = arg_auto_int)
+    parser_write_flash.add_argument('--retries', '-r', help = 'Retries per device with several ports', type = int, default = 2)
 
     parser_run = subparsers.add_parser(
             'run',
@@ -504,6 +815,12 @@ if __name__ == '__main__':
     parser_elf2image.add_argument('--flash_size', '-fs', help = 'SPI Flash size in Mbit',
             choices = ['4m', '2m', '8m', '16m', '32m', '16m-c1', '32m-c1', '32m-c2'], default = '4m')
 
+    parser_elf2stub = subparsers.add_parser(
+            'elf2stub',
+            help = 'Create a flasher stub JSON for write_flash --stub from an ELF file')
+    parser_elf2stub.add_argument('input', help = 'Input ELF file')
+    parser_elf2stub.add_argument('--output', '-o', help = 'Output filename', type = str, required = True)
+
     parser_read_mac = subparsers.add_parser(
             'read_mac',
             help = 'Read MAC address from OTP ROM')
@@ -525,11 +842,20 @@ if __name__ == '__main__':
 
     args = parser.parse_args()
 
+    if args.operation == 'write_flash':
+        assert len(args.addr_filename) % 2 == 0
+        if not args.stub and (args.compress or args.skip_unchanged or args.fast_baud):
+            raise Exception('--compress, --skip_unchanged and --fast_baud need --stub')
+
+    ports = args.port.split(',')
+    if args.operation == 'write_flash' and len(ports) > 1:
+        sys.exit(1 if write_flash_many(ports, args, read_images(args)) else 0)
+
     # Create the ESPROM connection object, if needed
     esp = None
-    if args.operation not in ('image_info','make_image','elf2image'):
+    if args.operation not in ('image_info','make_image','elf2image','elf2stub'):
         esp = ESPROM(args.port, args.baud)
-        esp.connect()
+        esp.connect(args.before != 'no_reset')
 
     # Do the actual work. Should probably be split into separate functions.
     if args.operation == 'load_ram':
@@ -569,45 +895,7 @@ if __name__ == '__main__':
         print 'Done!'
 
     elif args.operation == 'write_flash':
-        assert len(args.addr_filename) % 2 == 0
-
-        flash_mode = {'qio':0, 'qout':1, 'dio':2, 'dout': 3}[args.flash_mode]
-        flash_size_freq = {'4m':0x00, '2m':0x10, '8m':0x20, '16m':0x30, '32m':0x40, '16m-c1': 0x50, '32m-c1':0x60, '32m-c2':0x70}[args.flash_size]
-        flash_size_freq += {'40m':0, '26m':1, '20m':2, '80m': 0xf}[args.flash_freq]
-        flash_info = struct.pack('BB', flash_mode, flash_size_freq)
-
-        while args.addr_filename:
-            address = int(args.addr_filename[0], 0)
-            filename = args.addr_filename[1]
-            args.addr_filename = args.addr_filename[2:]
-            image = file(filename, 'rb').read()
-            print 'Erasing flash...'
-            blocks = div_roundup(len(image), esp.ESP_FLASH_BLOCK)
-            esp.flash_begin(blocks*esp.ESP_FLASH_BLOCK, address)
-            seq = 0
-            written = 0
-            t = time.time()
-            while len(image) > 0:
-                print '\rWriting at 0x%08x... (%d %%)' % (address + seq*esp.ESP_FLASH_BLOCK, 100*(seq+1)/blocks),
-                sys.stdout.flush()
-                block = image[0:esp.ESP_FLASH_BLOCK]
-                # Fix sflash config data
-                if address == 0 and seq == 0 and block[0] == '\xe9':
-                    block = block[0:2] + flash_info + block[4:]
-                # Pad the last block
-                block = block + '\xff' * (esp.ESP_FLASH_BLOCK-len(block))
-                esp.flash_block(block, seq)
-                image = image[esp.ESP_FLASH_BLOCK:]
-                seq += 1
-                written += len(block)
-            t = time.time() - t
-            print '\rWrote %d bytes at 0x%08x in %.1f seconds (%.1f kbit/s)...' % (written, address, t, written / t * 8 / 1000)
-        print '\nLeaving...'
-        if args.flash_mode == 'dio':
-            esp.flash_unlock_dio()
-        else:
-            esp.flash_begin(0, 0)
-            esp.flash_finish(False)
+        write_flash(esp, args, read_images(args), FlashLog())
 
     elif args.operation == 'run':
         esp.run()
@@ -658,6 +946,16 @@ if __name__ == '__main__':
         f.write(data)
         f.close()
 
+    elif args.operation == 'elf2stub':
+        e = ELFFile(args.input)
+        stub = {'entry': e.get_entry_point()}
+        for field in ('text', 'data'):
+            data = e.load_section('.' + field)
+            if len(data) > 0:
+                stub[field] = base64.b64encode(data)
+                stub[field + '_start'] = e.get_symbol_addr('_%s_start' % field)
+        json.dump(stub, open(args.output, 'w'))
+
     elif args.operation == 'read_mac':
         mac = esp.read_mac()
         print 'MAC: %s' % ':'.join(map(lambda x: '%02x'%x, mac))
@@ -0,0 +1,136 @@
+#!/usr/bin/env python
+#
+# Memory budget and hot path placement report, see include/hot.h.
+#
+#   iram_report.py build/app.out
+#   iram_report.py build/app.out --trace flash.log iram.log
+#
+# The first form prints IRAM/DRAM/flash use against the ESP8266 limits
+# and where each function of the hot set ended up. With --trace, two
+# UART1 trace dumps (make TRACE=1, without and with IRAM_HOT=1) are
+# compared stage by stage.
+
+from __future__ import print_function
+
+import argparse
+import os
+import struct
+import sys
+
+# (name, sections, budget in bytes)
+REGIONS = [
+    ('IRAM', ('.text',), 0x8000),
+    ('DRAM', ('.data', '.rodata', '.bss'), 0x14000),
+    ('flash', ('.irom0.text',), 0x3c000),
+]
+
+# functions marked HOT_ATTR, keep in sync with the sources
+HOT_SET = [
+    'crc16_add',
+    'crc16_data',
+    'CMD_ProtoWrite',
+    'CMD_ProtoWriteBuf',
+    'CMD_ResponseBody',
+    'CMD_Input',
+    'uart0_write',
+    'neurite_cmd_input',
+    'cmd_parse_byte',
+]
+
+IRAM_BASE, IRAM_END = 0x40100000, 0x40108000
+IROM_BASE = 0x40200000
+
+
+def read_elf(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF' or bytearray(data)[4] != 1:
+        raise ValueError('%s: not an ELF32 file' % path)
+    shoff, = struct.unpack_from('<I', data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from('<HHH', data, 0x2e)
+    raw = []
+    for i in range(shnum):
+        raw.append(struct.unpack_from('<IIIIIIIIII', data, shoff + i * shentsize))
+    strtab = raw[shstrndx]
+
+    def name(off, tab):
+        end = data.index(b'\0', tab[4] + off)
+        return data[tab[4] + off:end].decode('latin-1')
+
+    sections = {}
+    symbols = {}
+    for sh in raw:
+        sections[name(sh[0], strtab)] = sh[5]
+        if sh[1] == 2:    # SHT_SYMTAB
+            names = raw[sh[6]]
+            for off in range(sh[4], sh[4] + sh[5], 16):
+                st_name, value, size, info = struct.unpack_from('<IIIB', data, off)
+                if info & 0xf == 2:    # STT_FUNC
+                    symbols[name(st_name, names)] = (value, size)
+    return sections, symbols
+
+
+def placement(addr):
+    if IRAM_BASE <= addr < IRAM_END:
+        return 'IRAM'
+    if addr >= IROM_BASE:
+        return 'flash'
+    return '?'
+
+
+def budget_report(path):
+    sections, symbols = read_elf(path)
+    print('%-6s %8s %8s %6s' % ('region', 'used', 'budget', ''))
+    for region, names, budget in REGIONS:
+        used = sum(sections.get(n, 0) for n in names)
+        print('%-6s %8d %8d %5.1f%%' % (region, used, budget, 100.0 * used / budget))
+    print()
+    print('%-20s %-6s %6s' % ('hot set', 'where', 'size'))
+    iram = 0
+    for fn in HOT_SET:
+        if fn not in symbols:
+            print('%-20s %-6s' % (fn, '-'))
+            continue
+        addr, size = symbols[fn]
+        where = placement(addr)
+        if where == 'IRAM':
+            iram += size
+        print('%-20s %-6s %6d' % (fn, where, size))
+    print('hot set in IRAM: %d bytes' % iram)
+
+
+def trace_report(before, after):
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    import trace_report as tr
+
+    def load(path):
+        with open(path) as f:
+            mhz, recs = tr.read_text(f)
+        lat = tr.stage_latencies(recs, mhz or 80)
+        return dict((s, sorted(v)) for s, v in lat.items())
+
+    a, b = load(before), load(after)
+    print()
+    print('%-28s %9s %9s %9s %9s' % ('stage (us)', 'p50 a', 'p50 b', 'p99 a', 'p99 b'))
+    for s in tr.STAGES:
+        if not a[s] or not b[s]:
+            continue
+        print('%-28s %9.1f %9.1f %9.1f %9.1f' % ('%s -> %s' % s,
+              tr.percentile(a[s], 50), tr.percentile(b[s], 50),
+              tr.percentile(a[s], 99), tr.percentile(b[s], 99)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='IRAM/flash budget and hot path report')
+    parser.add_argument('elf', help='linked firmware, e.g. build/app.out')
+    parser.add_argument('--trace', nargs=2, metavar=('BEFORE', 'AFTER'),
+                        help='UART1 trace dumps to compare')
+    args = parser.parse_args()
+
+    budget_report(args.elf)
+    if args.trace:
+        trace_report(*args.trace)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,228 @@
+#!/usr/bin/env python
+#
+# Delta images for the OTA update in modules/ota.c.
+#
+#   ota_diff.py diff running.bin new.bin -o update.delta
+#   ota_diff.py apply running.bin update.delta -o check.bin
+#   ota_diff.py info update.delta
+#
+# running.bin is the image in the slot the device boots from, new.bin
+# the image linked for the other slot. The device refuses a delta whose
+# running image hash doesn't match its own. apply is a reference
+# implementation of the device side, to check a delta before serving it.
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = 0x544c444e    # "NDLT"
+VERSION = 1
+HEADER = struct.Struct('<IHHII16s16s')
+
+OP_END, OP_COPY, OP_ADD, OP_DATA = range(4)
+
+KEY = 8             # bytes hashed to find exact matches
+MAX_CANDIDATES = 16
+MIN_EXACT = 12      # exact match that starts a new alignment
+MIN_REGION = 16     # shortest COPY/ADD worth its op header
+GIVE_UP = 32        # score drop that ends an ADD region
+
+
+def index(old):
+    idx = {}
+    for i in range(len(old) - KEY + 1):
+        lst = idx.setdefault(old[i:i + KEY], [])
+        if len(lst) < MAX_CANDIDATES:
+            lst.append(i)
+    return idx
+
+
+def exact_match(old, new, idx, i):
+    best, best_len = None, 0
+    for src in idx.get(new[i:i + KEY], ()):
+        n = KEY
+        while i + n < len(new) and src + n < len(old) and old[src + n] == new[i + n]:
+            n += 1
+        if n > best_len:
+            best, best_len = src, n
+    return best, best_len
+
+
+def approx_region(old, new, i, src):
+    """ Length from (src, i) maximising matches minus mismatches, bsdiff style """
+    score = best = best_len = 0
+    k = 0
+    end = min(len(new) - i, len(old) - src)
+    while k < end:
+        score += 1 if old[src + k] == new[i + k] else -1
+        k += 1
+        if score > best:
+            best, best_len = score, k
+        elif score < best - GIVE_UP:
+            break
+    return best_len
+
+
+def add_segments(diff):
+    """ ADD payload: (skip, cnt, cnt diff bytes) covering all of diff """
+    out = bytearray()
+    k = 0
+    while k < len(diff):
+        skip = 0
+        while k < len(diff) and diff[k] == 0 and skip < 255:
+            skip += 1
+            k += 1
+        start = k
+        # short zero gaps are cheaper as diff bytes than as a new segment
+        while k < len(diff) and k - start < 255:
+            if diff[k] == 0 and (k + 3 > len(diff) or not any(diff[k:k + 3])):
+                break
+            k += 1
+        out.append(skip)
+        out.append(k - start)
+        out += diff[start:k]
+    return out
+
+
+def make_delta(old, new):
+    old, new = bytearray(old), bytearray(new)
+    idx = index(bytes(old))
+    ops = bytearray()
+    literal = bytearray()
+    stats = {'copy': 0, 'add': 0, 'data': 0}
+
+    def flush_literal():
+        if literal:
+            ops.extend(struct.pack('<BI', OP_DATA, len(literal)))
+            ops.extend(literal)
+            stats['data'] += len(literal)
+            del literal[:]
+
+    i = 0
+    align = None
+    while i < len(new):
+        if align is not None and 0 <= i + align < len(old):
+            n = approx_region(old, new, i, i + align)
+            if n >= MIN_REGION:
+                flush_literal()
+                src = i + align
+                diff = bytearray((new[i + k] - old[src + k]) & 0xff for k in range(n))
+                if any(diff):
+                    ops.extend(struct.pack('<BII', OP_ADD, src, n))
+                    ops.extend(add_segments(diff))
+                    stats['add'] += n
+                else:
+                    ops.extend(struct.pack('<BII', OP_COPY, src, n))
+                    stats['copy'] += n
+                i += n
+                continue
+        src, n = exact_match(bytes(old), bytes(new), idx, i)
+        if n >= MIN_EXACT and src - i != align:
+            align = src - i
+            continue
+        literal.append(new[i])
+        i += 1
+    flush_literal()
+    ops.append(OP_END)
+
+    header = HEADER.pack(MAGIC, VERSION, 0, len(old), len(new),
+                         hashlib.md5(bytes(old)).digest(), hashlib.md5(bytes(new)).digest())
+    return header + bytes(ops), stats
+
+
+def apply_delta(old, delta):
+    old = bytearray(old)
+    magic, version, flags, old_size, new_size, old_md5, new_md5 = HEADER.unpack_from(delta, 0)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('not a version %d delta' % VERSION)
+    if len(old) < old_size or hashlib.md5(bytes(old[:old_size])).digest() != old_md5:
+        raise ValueError('delta was not made against this image')
+    d = bytearray(delta)
+    p = HEADER.size
+    new = bytearray()
+    while True:
+        op = d[p]
+        p += 1
+        if op == OP_END:
+            break
+        if op == OP_DATA:
+            n, = struct.unpack_from('<I', delta, p)
+            new += d[p + 4:p + 4 + n]
+            p += 4 + n
+        elif op in (OP_COPY, OP_ADD):
+            src, n = struct.unpack_from('<II', delta, p)
+            p += 8
+            if src + n > old_size:
+                raise ValueError('op reads past the running image')
+            if op == OP_COPY:
+                new += old[src:src + n]
+                continue
+            k = 0
+            while k < n:
+                skip, cnt = d[p], d[p + 1]
+                p += 2
+                new += old[src + k:src + k + skip]
+                k += skip
+                for j in range(cnt):
+                    new.append((old[src + k] + d[p + j]) & 0xff)
+                    k += 1
+                p += cnt
+        else:
+            raise ValueError('bad op %d at %d' % (op, p - 1))
+    if len(new) != new_size or hashlib.md5(bytes(new)).digest() != new_md5:
+        raise ValueError('result does not match the new image hash')
+    return bytes(new)
+
+
+def read(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def write(path, data):
+    with open(path, 'wb') as f:
+        f.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='OTA delta images, see modules/ota.c')
+    sub = parser.add_subparsers(dest='cmd')
+    p = sub.add_parser('diff', help='make a delta')
+    p.add_argument('old', help='image in the running slot')
+    p.add_argument('new', help='image for the other slot')
+    p.add_argument('-o', '--output', required=True)
+    p = sub.add_parser('apply', help='apply a delta like the device does')
+    p.add_argument('old')
+    p.add_argument('delta')
+    p.add_argument('-o', '--output', required=True)
+    p = sub.add_parser('info', help='show a delta header')
+    p.add_argument('delta')
+    args = parser.parse_args()
+
+    if args.cmd == 'diff':
+        old, new = read(args.old), read(args.new)
+        delta, stats = make_delta(old, new)
+        apply_delta(old, delta)
+        write(args.output, delta)
+        print('%d -> %d bytes, delta %d bytes (%.1f%%): copy %d, add %d, data %d' % (
+              len(old), len(new), len(delta), 100.0 * len(delta) / len(new),
+              stats['copy'], stats['add'], stats['data']))
+    elif args.cmd == 'apply':
+        write(args.output, apply_delta(read(args.old), read(args.delta)))
+    elif args.cmd == 'info':
+        delta = read(args.delta)
+        magic, version, flags, old_size, new_size, old_md5, new_md5 = HEADER.unpack_from(delta, 0)
+        if magic != MAGIC:
+            sys.exit('%s: not a delta' % args.delta)
+        print('version %d, %d -> %d bytes, delta %d bytes' % (version, old_size, new_size, len(delta)))
+        print('running md5 %s' % ''.join('%02x' % c for c in bytearray(old_md5)))
+        print('new md5     %s' % ''.join('%02x' % c for c in bytearray(new_md5)))
+    else:
+        parser.print_help()
+
+
+if __name__ == '__main__':
+    main()
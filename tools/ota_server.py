@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+#
+# Local HTTP stand-in for OTA deltas, see modules/ota.c.
+#
+#   ota_server.py update.delta --port 8080
+#   ota_server.py update.delta --rate 2000 --cut 4096
+#
+# Serves the one file on every GET path. --chunk/--rate pace the body
+# like a slow metered link, --cut closes the connection after that many
+# body bytes and --status answers with an error, to exercise the device's
+# failure paths.
+
+from __future__ import print_function
+
+import argparse
+import socket
+import sys
+import time
+
+try:
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+except ImportError:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+def handler(args, body):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = 'HTTP/1.1'
+
+        def do_GET(self):
+            if args.status != 200:
+                self.send_response(args.status)
+                self.send_header('Content-Length', '0')
+                self.send_header('Connection', 'close')
+                self.end_headers()
+                return
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Content-Length', str(len(body)))
+            self.send_header('Connection', 'close')
+            self.end_headers()
+
+            end = len(body) if args.cut is None else min(args.cut, len(body))
+            sent = 0
+            t = time.time()
+            try:
+                while sent < end:
+                    n = min(args.chunk, end - sent)
+                    self.wfile.write(body[sent:sent + n])
+                    self.wfile.flush()
+                    sent += n
+                    if args.rate:
+                        delay = t + float(sent) / args.rate - time.time()
+                        if delay > 0:
+                            time.sleep(delay)
+            except socket.error as e:
+                print('%s: %s after %d bytes' % (self.client_address[0], e, sent))
+                return
+            print('%s: sent %d of %d bytes in %.1fs' % (self.client_address[0], sent, len(body), time.time() - t))
+            self.close_connection = True
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description='HTTP stand-in serving an OTA delta')
+    parser.add_argument('file', help='delta made by ota_diff.py')
+    parser.add_argument('--bind', default='0.0.0.0')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--chunk', type=int, default=1460, help='bytes per write')
+    parser.add_argument('--rate', type=int, default=0, help='bytes per second, 0 for no limit')
+    parser.add_argument('--cut', type=int, help='close after this many body bytes')
+    parser.add_argument('--status', type=int, default=200, help='HTTP status to answer with')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as f:
+        body = f.read()
+    server = HTTPServer((args.bind, args.port), handler(args, body))
+    print('serving %s (%d bytes) on %s:%d' % (args.file, len(body), args.bind, args.port))
+    sys.stdout.flush()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,564 @@
+#!/usr/bin/env python
+#
+# Local MQTT broker and HTTP stand-in for the simulator, see sim/README.md.
+#
+#   sim_broker.py
+#   sim_broker.py --mqtt-port 11883 --http-port 18080 --http-body 512
+#
+# MQTT 3.1/3.1.1 with what the firmware uses: CONNECT, SUBSCRIBE with + and
+# # wildcards, PUBLISH at QoS 0/1, PINGREQ and the last will. A client
+# that connects without clean session gets its subscriptions back and, from
+# level 4 on, session present set; messages for it are not kept while it is away.
+# Retained messages and QoS 2 are not supported. SIGUSR1 drops every MQTT
+# connection, to test reconnects. The HTTP side answers every request
+# with --http-status and a JSON body of --http-body bytes in a single write,
+# --http-delay ms after it arrived, then closes, like the small servers the
+# bridge talks to; --http-json FILE sends that file as the body instead,
+# --http-chunked BYTES sends it with Transfer-Encoding: chunked. --flood
+# publishes to a topic at a fixed rate, each message led by its send time
+# as a big-endian double, for downlink load that does not go over the
+# UART first.
+#
+# A client that connects with protocol level 5 speaks MQTT 5: properties
+# are parsed and mostly ignored, topic aliases work both ways, PUBACK
+# carries 0x10 when nobody subscribed, and --receive-max, --alias-max and
+# --packet-max go out in the CONNACK and are enforced with a DISCONNECT.
+# --puback-delay holds QoS 1 acks so the Receive Maximum fills up.
+
+from __future__ import print_function
+
+import argparse
+import errno
+import json
+import select
+import signal
+import socket
+import struct
+import sys
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK = 1, 2, 3, 4
+SUBSCRIBE, SUBACK, UNSUBSCRIBE, UNSUBACK = 8, 9, 10, 11
+PINGREQ, PINGRESP, DISCONNECT = 12, 13, 14
+
+# MQTT 5 property ids by value type
+PROP_BYTE = (0x01, 0x17, 0x19, 0x24, 0x25, 0x28, 0x29, 0x2a)
+PROP_U16 = (0x13, 0x21, 0x22, 0x23)
+PROP_U32 = (0x02, 0x11, 0x18, 0x27)
+PROP_RECEIVE_MAX, PROP_ALIAS_MAX, PROP_ALIAS, PROP_PACKET_MAX = 0x21, 0x22, 0x23, 0x27
+RC_NO_SUBSCRIBERS, RC_PROTOCOL_ERROR, RC_ALIAS_INVALID = 0x10, 0x82, 0x94
+RC_RECEIVE_MAX_EXCEEDED, RC_PACKET_TOO_LARGE = 0x93, 0x95
+
+
+def encode_len(n):
+    out = bytearray()
+    while True:
+        b = n % 128
+        n //= 128
+        if n:
+            b |= 0x80
+        out.append(b)
+        if not n:
+            return bytes(out)
+
+
+def mqtt_str(s):
+    return struct.pack('>H', len(s)) + s
+
+
+def decode_len(buf, off):
+    n, mul = 0, 1
+    while True:
+        b = buf[off]
+        off += 1
+        n += (b & 0x7f) * mul
+        mul *= 128
+        if not b & 0x80:
+            return n, off
+
+
+def read_props(body, off):
+    # the property block at off as {id: value}, and the offset after it
+    n, off = decode_len(body, off)
+    end, props = off + n, {}
+    while off < end:
+        pid = body[off]
+        off += 1
+        if pid in PROP_BYTE:
+            props[pid] = body[off]
+            off += 1
+        elif pid in PROP_U16:
+            props[pid], = struct.unpack_from('>H', body, off)
+            off += 2
+        elif pid in PROP_U32:
+            props[pid], = struct.unpack_from('>I', body, off)
+            off += 4
+        elif pid == 0x0b:
+            props[pid], off = decode_len(body, off)
+        elif pid == 0x26:
+            for _ in range(2):
+                n, = struct.unpack_from('>H', body, off)
+                off += 2 + n
+        else:
+            n, = struct.unpack_from('>H', body, off)
+            props[pid] = bytes(body[off + 2:off + 2 + n])
+            off += 2 + n
+    if off != end:
+        raise IndexError('properties')
+    return props, end
+
+
+def props(*items):
+    # a property block from (id, struct format, value)
+    out = b''.join(struct.pack('>B' + fmt, pid, value) for pid, fmt, value in items)
+    return encode_len(len(out)) + out
+
+
+def packet(ptype, flags, body):
+    return bytes(bytearray([(ptype << 4) | flags])) + encode_len(len(body)) + body
+
+
+def topic_match(pattern, topic):
+    p = pattern.split(b'/')
+    t = topic.split(b'/')
+    for i, level in enumerate(p):
+        if level == b'#':
+            return True
+        if i >= len(t) or (level != b'+' and level != t[i]):
+            return False
+    return len(p) == len(t)
+
+
+class Conn(object):
+    def __init__(self, sock, addr):
+        self.sock = sock
+        self.addr = addr
+        self.rx = bytearray()
+        self.tx = bytearray()
+        self.closing = False
+
+    def send(self, data):
+        self.tx += data
+
+
+class MqttConn(Conn):
+    def __init__(self, sock, addr):
+        Conn.__init__(self, sock, addr)
+        self.client_id = None
+        self.subs = {}
+        self.will = None
+        self.next_id = 0
+        self.last_rx = time.time()
+        self.keepalive = 0
+        # MQTT 5
+        self.level = 4
+        self.alias_in = {}
+        self.alias_out = {}
+        self.alias_max = 0	# the client's Topic Alias Maximum
+        self.packet_max = 0
+        self.inflight = 0	# QoS 1 publishes from it not acked yet
+        self.acks = []		# (due, packet) held by --puback-delay
+
+
+class HttpConn(Conn):
+    def __init__(self, sock, addr):
+        Conn.__init__(self, sock, addr)
+        self.held = None
+        self.due = 0
+
+
+class Broker(object):
+    def __init__(self, args):
+        self.args = args
+        self.conns = {}
+        self.listeners = {}
+        self.stats = dict(connects=0, pub_in=0, pub_out=0, bytes_in=0, bytes_out=0, http=0, alias_in=0)
+        self.http_seq = 0
+        self.flood_due = time.time()
+        self.sessions = {}
+        self.drop = False
+        if args.mqtt_port:
+            self.listen(args.mqtt_port, MqttConn)
+        if args.http_port:
+            self.listen(args.http_port, HttpConn)
+
+    def listen(self, port, kind):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind((self.args.bind, port))
+        s.listen(64)
+        s.setblocking(False)
+        self.listeners[s] = kind
+
+    def log(self, msg):
+        if self.args.verbose:
+            print(msg)
+            sys.stdout.flush()
+
+    def close(self, c, clean=True):
+        if c.sock not in self.conns:
+            return
+        del self.conns[c.sock]
+        c.sock.close()
+        if isinstance(c, MqttConn):
+            self.log('%s:%d: %s gone%s' % (c.addr[0], c.addr[1], c.client_id, '' if clean else ', will sent'))
+            if not clean and c.will:
+                self.publish(c.will[0], c.will[1], c.will[2])
+
+    # MQTT
+
+    def publish(self, topic, payload, qos):
+        # returns the number of subscribers it went to
+        self.stats['pub_in'] += 1
+        sent = 0
+        for c in list(self.conns.values()):
+            if not isinstance(c, MqttConn):
+                continue
+            for pattern, sub_qos in c.subs.items():
+                if not topic_match(pattern, topic):
+                    continue
+                q = min(qos, sub_qos)
+                name, prop = topic, b''
+                if c.level == 5:
+                    alias = c.alias_out.get(topic)
+                    if alias:
+                        name = b''
+                    elif len(c.alias_out) < c.alias_max:
+                        alias = c.alias_out[topic] = len(c.alias_out) + 1
+                    prop = props((PROP_ALIAS, 'H', alias)) if alias else props()
+                body = mqtt_str(name)
+                if q:
+                    c.next_id = c.next_id % 0xffff + 1
+                    body += struct.pack('>H', c.next_id)
+                p = packet(PUBLISH, q << 1, body + prop + payload)
+                if c.packet_max and len(p) > c.packet_max:
+                    self.log('%s: %d byte publish over its maximum, not sent' % (c.client_id, len(p)))
+                    break
+                c.send(p)
+                self.stats['pub_out'] += 1
+                sent += 1
+                break
+        return sent
+
+    def disconnect(self, c, reason):
+        # MQTT 5 broker DISCONNECT, then close
+        self.log('%s: disconnect, reason 0x%02x' % (c.client_id, reason))
+        c.send(packet(DISCONNECT, 0, struct.pack('BB', reason, 0)))
+        c.closing = True
+
+    def mqtt_packet(self, c, ptype, flags, body):
+        if ptype == CONNECT:
+            n, = struct.unpack_from('>H', body, 0)
+            off = 2 + n
+            c.level, cflags, c.keepalive = struct.unpack_from('>BBH', body, off)
+            off += 4
+            if c.level == 5:
+                p, off = read_props(body, off)
+                c.alias_max = p.get(PROP_ALIAS_MAX, 0)
+                c.packet_max = p.get(PROP_PACKET_MAX, 0)
+            n, = struct.unpack_from('>H', body, off)
+            c.client_id = bytes(body[off + 2:off + 2 + n])
+            off += 2 + n
+            if cflags & 0x04:
+                if c.level == 5:
+                    _, off = read_props(body, off)
+                n, = struct.unpack_from('>H', body, off)
+                topic = bytes(body[off + 2:off + 2 + n])
+                off += 2 + n
+                n, = struct.unpack_from('>H', body, off)
+                msg = bytes(body[off + 2:off + 2 + n])
+                c.will = (topic, msg, (cflags >> 3) & 3)
+            self.stats['connects'] += 1
+            present = 0
+            if cflags & 0x02:
+                self.sessions.pop(c.client_id, None)
+            else:
+                # 3.1 keeps the session too, but its CONNACK has no flag for it
+                present = int(c.client_id in self.sessions and c.level >= 4)
+                c.subs = self.sessions.setdefault(c.client_id, c.subs)
+            self.log('%s:%d: connect %s, level %d, keepalive %d%s' % (c.addr[0], c.addr[1], c.client_id, c.level,
+                                                                      c.keepalive,
+                                                                      ', session present' if present else ''))
+            ack = struct.pack('BB', present, 0)
+            if c.level == 5:
+                a = self.args
+                ack += props(*[p for p in ((PROP_RECEIVE_MAX, 'H', a.receive_max),
+                                           (PROP_ALIAS_MAX, 'H', a.alias_max),
+                                           (PROP_PACKET_MAX, 'I', a.packet_max)) if p[2]])
+            c.send(packet(CONNACK, 0, ack))
+        elif ptype == PUBLISH:
+            qos = (flags >> 1) & 3
+            n, = struct.unpack_from('>H', body, 0)
+            topic = bytes(body[2:2 + n])
+            off = 2 + n
+            if qos:
+                pid, = struct.unpack_from('>H', body, off)
+                off += 2
+            if c.level == 5:
+                if self.args.packet_max and 1 + len(encode_len(len(body))) + len(body) > self.args.packet_max:
+                    return self.disconnect(c, RC_PACKET_TOO_LARGE)
+                p, off = read_props(body, off)
+                alias = p.get(PROP_ALIAS)
+                if alias:
+                    if alias > self.args.alias_max:
+                        return self.disconnect(c, RC_ALIAS_INVALID)
+                    if topic:
+                        c.alias_in[alias] = topic
+                    elif alias in c.alias_in:
+                        topic = c.alias_in[alias]
+                        self.stats['alias_in'] += 1
+                    else:
+                        return self.disconnect(c, RC_PROTOCOL_ERROR)
+                if qos:
+                    c.inflight += 1
+                    if self.args.receive_max and c.inflight > self.args.receive_max:
+                        return self.disconnect(c, RC_RECEIVE_MAX_EXCEEDED)
+            sent = self.publish(topic, bytes(body[off:]), qos)
+            if qos:
+                ack = struct.pack('>H', pid)
+                if c.level == 5 and not sent:
+                    ack += struct.pack('B', RC_NO_SUBSCRIBERS)
+                c.acks.append((time.time() + self.args.puback_delay / 1000.0, packet(PUBACK, 0, ack)))
+        elif ptype == SUBSCRIBE:
+            pid, = struct.unpack_from('>H', body, 0)
+            off = 2
+            if c.level == 5:
+                _, off = read_props(body, off)
+            granted = bytearray()
+            while off < len(body):
+                n, = struct.unpack_from('>H', body, off)
+                topic = bytes(body[off + 2:off + 2 + n])
+                qos = min(body[off + 2 + n] & 3, 1)
+                off += 3 + n
+                c.subs[topic] = qos
+                granted.append(qos)
+                self.log('%s: subscribe %s' % (c.client_id, topic))
+            c.send(packet(SUBACK, 0, struct.pack('>H', pid) + (b'\0' if c.level == 5 else b'') + bytes(granted)))
+        elif ptype == UNSUBSCRIBE:
+            pid, = struct.unpack_from('>H', body, 0)
+            off = 2
+            if c.level == 5:
+                _, off = read_props(body, off)
+            codes = bytearray()
+            while off < len(body):
+                n, = struct.unpack_from('>H', body, off)
+                # MQTT 5: 0x11 when there was no such subscription
+                codes.append(0 if c.subs.pop(bytes(body[off + 2:off + 2 + n]), None) is not None else 0x11)
+                off += 2 + n
+            c.send(packet(UNSUBACK, 0, struct.pack('>H', pid) + (b'\0' + bytes(codes) if c.level == 5 else b'')))
+        elif ptype == PUBACK:
+            self.log('%s: puback %d' % (c.client_id, struct.unpack_from('>H', body, 0)[0]))
+        elif ptype == PINGREQ:
+            self.log('%s: ping' % c.client_id)
+            c.send(packet(PINGRESP, 0, b''))
+        elif ptype == DISCONNECT:
+            # MQTT 5 reason 0x04 asks for the will anyway
+            if not (c.level == 5 and body and body[0] == 0x04):
+                c.will = None
+            c.closing = True
+
+    def mqtt_input(self, c):
+        while len(c.rx) >= 2:
+            n, mul, i = 0, 1, 1
+            while True:
+                if i >= len(c.rx):
+                    return
+                n += (c.rx[i] & 0x7f) * mul
+                mul *= 128
+                i += 1
+                if not c.rx[i - 1] & 0x80:
+                    break
+            if len(c.rx) < i + n:
+                return
+            ptype, flags = c.rx[0] >> 4, c.rx[0] & 0x0f
+            body = c.rx[i:i + n]
+            del c.rx[:i + n]
+            try:
+                self.mqtt_packet(c, ptype, flags, body)
+            except (struct.error, IndexError):
+                self.log('%s: malformed packet type %d' % (c.client_id, ptype))
+                self.close(c, False)
+                return
+
+    # HTTP
+
+    def http_input(self, c):
+        end = c.rx.find(b'\r\n\r\n')
+        if end < 0:
+            return
+        head = bytes(c.rx[:end]).decode('latin-1')
+        length = 0
+        for line in head.split('\r\n')[1:]:
+            name, _, value = line.partition(':')
+            if name.strip().lower() == 'content-length':
+                length = int(value.strip() or 0)
+        if len(c.rx) < end + 4 + length:
+            return
+        self.http_seq += 1
+        self.stats['http'] += 1
+        if self.args.http_json:
+            with open(self.args.http_json) as f:
+                body = f.read()
+        else:
+            body = json.dumps({'status': self.args.http_status, 'seq': self.http_seq,
+                               'request': head.split('\r\n')[0], 'pad': ''})
+            pad = max(self.args.http_body - len(body), 0)
+            body = body[:-2] + 'x' * pad + body[-2:]
+        if self.args.http_chunked:
+            # sizes in both cases, and an extension on every other chunk
+            n = self.args.http_chunked
+            chunks = [body[i:i + n] for i in range(0, len(body), n)]
+            body = ''.join(('%x\r\n' % len(b) if i % 2 else '%X;sim=%d\r\n' % (len(b), i)) + b + '\r\n'
+                           for i, b in enumerate(chunks)) + '0\r\n\r\n'
+            length = 'Transfer-Encoding: chunked'
+        else:
+            length = 'Content-Length: %d' % len(body)
+        resp = 'HTTP/1.1 %d Sim\r\nContent-Type: application/json\r\n' \
+               '%s\r\nConnection: close\r\n\r\n%s' % (self.args.http_status, length, body)
+        c.held = resp.encode('latin-1')
+        c.due = time.time() + self.args.http_delay / 1000.0
+        c.rx = bytearray()
+
+    def http_release(self, now):
+        # the select timeout, until the next held response is due
+        wait = 1.0
+        for c in self.conns.values():
+            if isinstance(c, HttpConn) and c.held is not None:
+                if c.due <= now:
+                    c.send(c.held)
+                    c.held = None
+                    c.closing = True
+                else:
+                    wait = min(wait, c.due - now)
+        return wait
+
+    def ack_release(self, now):
+        # --puback-delay: send the held acks that are due, returns the wait
+        wait = 1.0
+        for c in self.conns.values():
+            if not isinstance(c, MqttConn):
+                continue
+            while c.acks and c.acks[0][0] <= now:
+                c.send(c.acks.pop(0)[1])
+                c.inflight -= 1
+            if c.acks:
+                wait = min(wait, c.acks[0][0] - now)
+        return wait
+
+    def flood(self, now):
+        # --flood: publish to subscribers at a steady rate, returns the wait
+        if not self.args.flood:
+            return 1.0
+        topic, rate, size = self.args.flood
+        while self.flood_due <= now:
+            payload = struct.pack('>d', now) + b'x' * max(size - 8, 0)
+            self.publish(topic, payload, 0)
+            self.flood_due += 1.0 / rate
+        return self.flood_due - now
+
+    # loop
+
+    def run(self):
+        now = time.time()
+        while True:
+            wait = min(self.http_release(time.time()), self.flood(time.time()), self.ack_release(time.time()))
+            rl = list(self.listeners) + list(self.conns)
+            wl = [s for s, c in self.conns.items() if c.tx]
+            r, w, _ = select.select(rl, wl, [], wait)
+            for s in r:
+                if s in self.listeners:
+                    try:
+                        sock, addr = s.accept()
+                    except socket.error:
+                        continue
+                    sock.setblocking(False)
+                    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                    self.conns[sock] = self.listeners[s](sock, addr)
+                    continue
+                c = self.conns.get(s)
+                if c is None:
+                    continue
+                try:
+                    data = s.recv(65536)
+                except socket.error as e:
+                    if e.errno in (errno.EAGAIN, errno.EINTR):
+                        continue
+                    data = b''
+                if not data:
+                    self.close(c, False)
+                    continue
+                self.stats['bytes_in'] += len(data)
+                c.rx += data
+                if isinstance(c, MqttConn):
+                    c.last_rx = time.time()
+                    self.mqtt_input(c)
+                else:
+                    self.http_input(c)
+            for c in list(self.conns.values()):
+                if c.tx and c.sock.fileno() >= 0:
+                    try:
+                        n = c.sock.send(c.tx)
+                    except socket.error as e:
+                        if e.errno in (errno.EAGAIN, errno.EINTR):
+                            continue
+                        self.close(c, False)
+                        continue
+                    self.stats['bytes_out'] += n
+                    del c.tx[:n]
+                if c.closing and not c.tx:
+                    self.close(c)
+            if self.drop:
+                self.drop = False
+                for c in list(self.conns.values()):
+                    if isinstance(c, MqttConn):
+                        self.close(c, False)
+            if time.time() - now >= 1.0:
+                now = time.time()
+                for c in list(self.conns.values()):
+                    if isinstance(c, MqttConn) and c.keepalive and now - c.last_rx > 1.5 * c.keepalive:
+                        self.log('%s: keepalive expired' % c.client_id)
+                        self.close(c, False)
+
+
+def flood_arg(s):
+    try:
+        topic, rate, size = s.rsplit(',', 2)
+        return topic.encode(), float(rate), max(int(size), 8)
+    except ValueError:
+        raise argparse.ArgumentTypeError('expected TOPIC,RATE,BYTES')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='MQTT broker and HTTP stand-in for the simulator')
+    parser.add_argument('--bind', default='127.0.0.1')
+    parser.add_argument('--mqtt-port', type=int, default=1883, help='0 to disable')
+    parser.add_argument('--http-port', type=int, default=8080, help='0 to disable')
+    parser.add_argument('--http-status', type=int, default=200)
+    parser.add_argument('--http-body', type=int, default=64, help='response body size in bytes')
+    parser.add_argument('--http-delay', type=int, default=0, help='response delay in ms')
+    parser.add_argument('--http-json', help='answer with the contents of this file instead')
+    parser.add_argument('--http-chunked', type=int, default=0, help='send the body chunked, in chunks of this size')
+    parser.add_argument('--flood', type=flood_arg, metavar='TOPIC,RATE,BYTES',
+                        help='publish BYTES to TOPIC RATE times a second, led by the send time')
+    parser.add_argument('--receive-max', type=int, default=0,
+                        help='MQTT 5 Receive Maximum in the CONNACK, 0 to leave it out')
+    parser.add_argument('--alias-max', type=int, default=10, help='MQTT 5 Topic Alias Maximum, 0 for none')
+    parser.add_argument('--packet-max', type=int, default=0, help='MQTT 5 Maximum Packet Size, 0 for none')
+    parser.add_argument('--puback-delay', type=int, default=0, help='QoS 1 PUBACK delay in ms')
+    parser.add_argument('-v', '--verbose', action='store_true')
+    args = parser.parse_args()
+
+    broker = Broker(args)
+    signal.signal(signal.SIGTERM, lambda sig, frame: sys.exit(0))
+    signal.signal(signal.SIGUSR1, lambda sig, frame: setattr(broker, 'drop', True))
+    print('mqtt on %s:%d, http on %s:%d' % (args.bind, args.mqtt_port, args.bind, args.http_port))
+    sys.stdout.flush()
+    try:
+        broker.run()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    print(', '.join('%s %d' % kv for kv in sorted(broker.stats.items())))
+
+
+if __name__ == '__main__':
+    main()
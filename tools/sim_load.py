@@ -0,0 +1,545 @@
+#!/usr/bin/env python
+#
+# Load generator for the simulator, see sim/README.md.
+#
+#   sim_load.py neurite --uart /tmp/neurite0 --rate 20 --count 1000
+#   sim_load.py bridge --uart /tmp/bridge0 --rate 50 --rest-rate 5
+#
+# Drives the MCU side of UART0 at --rate messages per second and watches the
+# other end through its own connection to the broker (sim_broker.py):
+#
+#   uplink    UART -> device -> broker
+#   echo      UART -> device -> broker -> device -> UART
+#   downlink  broker -> device -> UART
+#   rest      REST request -> HTTP stand-in -> REST event (bridge only)
+#
+# neurite speaks its line protocol, bridge the SLIP framed CMD protocol of
+# modules/cmd.c. Messages carry a sequence number and send time, so each
+# direction reports throughput, losses and p50/p99 latency at the end.
+
+from __future__ import print_function
+
+import argparse
+import errno
+import os
+import re
+import select
+import socket
+import struct
+import sys
+import termios
+import time
+import tty
+
+SLIP_START, SLIP_END, SLIP_REPL = 0x7E, 0x7F, 0x7D
+
+CMD_IS_READY = 2
+CMD_WIFI_CONNECT = 3
+CMD_MQTT_SETUP = 4
+CMD_MQTT_CONNECT = 5
+CMD_MQTT_PUBLISH = 7
+CMD_MQTT_SUBSCRIBE = 8
+CMD_MQTT_EVENTS = 10
+CMD_REST_SETUP = 11
+CMD_REST_REQUEST = 12
+CMD_REST_EVENTS = 14
+
+STATION_GOT_IP = 5
+
+# callback values handed to the bridge, they come back in the events
+CB_WIFI = 0x100
+CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA = 0x201, 0x202, 0x203, 0x204
+CB_REST = 0x301
+
+MSG = re.compile(br'([UD])(\d+) (\d+\.\d+) ')
+
+
+def crc16_add(b, acc):
+    acc ^= b
+    acc = ((acc >> 8) | (acc << 8)) & 0xffff
+    acc ^= (acc & 0xff00) << 4
+    acc &= 0xffff
+    acc ^= (acc >> 8) >> 4
+    acc ^= (acc & 0xff00) >> 5
+    return acc & 0xffff
+
+
+def crc16(data, acc=0):
+    for b in bytearray(data):
+        acc = crc16_add(b, acc)
+    return acc
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[int(round(p / 100.0 * (len(sorted_values) - 1)))]
+
+
+class Direction(object):
+    def __init__(self, name):
+        self.name = name
+        self.sent = {}
+        self.seen = set()
+        self.lat = []
+        self.dups = 0
+        self.first = None
+        self.last = None
+
+    def send(self, seq, t):
+        self.sent[seq] = t
+
+    def recv(self, seq, t_sent, now):
+        if seq in self.seen:
+            self.dups += 1
+            return
+        if seq not in self.sent:
+            return
+        self.seen.add(seq)
+        self.lat.append((now - t_sent) * 1000.0)
+        if self.first is None:
+            self.first = now
+        self.last = now
+
+    def report(self, duration, size):
+        lat = sorted(self.lat)
+        n = len(self.seen)
+        rate = n / duration if duration > 0 else 0.0
+        print('%-9s %7d %7d %6d %5d %9.1f %9.0f %8.1f %8.1f %8.1f' % (
+            self.name, len(self.sent), n, len(self.sent) - n, self.dups,
+            rate, rate * size, percentile(lat, 50), percentile(lat, 99), lat[-1] if lat else 0.0))
+
+
+class MqttClient(object):
+    """QoS 0 client, just enough to watch and feed the device's topics."""
+
+    def __init__(self, host, port, client_id):
+        self.sock = socket.create_connection((host, port), 5)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.rx = bytearray()
+        self.next_id = 0
+        body = struct.pack('>H', 4) + b'MQTT' + struct.pack('>BBH', 4, 0x02, 60)
+        body += struct.pack('>H', len(client_id)) + client_id
+        self.send(0x10, body)
+        if self.read_packet()[0] != 2:
+            raise IOError('broker refused the connection')
+        self.last_tx = time.time()
+
+    def send(self, hdr, body):
+        n = len(body)
+        ln = bytearray()
+        while True:
+            b = n % 128
+            n //= 128
+            ln.append(b | (0x80 if n else 0))
+            if not n:
+                break
+        data = bytes(bytearray([hdr])) + bytes(ln) + body
+        self.sock.sendall(data)
+        self.last_tx = time.time()
+
+    def read_packet(self):
+        while True:
+            pkt = self.parse()
+            if pkt:
+                return pkt
+            data = self.sock.recv(4096)
+            if not data:
+                raise IOError('broker closed the connection')
+            self.rx += data
+
+    def parse(self):
+        if len(self.rx) < 2:
+            return None
+        n, mul, i = 0, 1, 1
+        while True:
+            if i >= len(self.rx):
+                return None
+            n += (self.rx[i] & 0x7f) * mul
+            mul *= 128
+            i += 1
+            if not self.rx[i - 1] & 0x80:
+                break
+        if len(self.rx) < i + n:
+            return None
+        ptype, flags = self.rx[0] >> 4, self.rx[0] & 0x0f
+        body = bytes(self.rx[i:i + n])
+        del self.rx[:i + n]
+        return ptype, flags, body
+
+    def subscribe(self, topic):
+        self.next_id += 1
+        self.send(0x82, struct.pack('>H', self.next_id) + struct.pack('>H', len(topic)) + topic + b'\x00')
+
+    def publish(self, topic, payload):
+        self.send(0x30, struct.pack('>H', len(topic)) + topic + payload)
+
+    def poll(self):
+        """Returns the (topic, payload) of the publishes received, call when readable."""
+        msgs = []
+        data = self.sock.recv(65536)
+        if not data:
+            raise IOError('broker closed the connection')
+        self.rx += data
+        while True:
+            pkt = self.parse()
+            if pkt is None:
+                break
+            ptype, flags, body = pkt
+            if ptype == 3:
+                n, = struct.unpack_from('>H', body, 0)
+                off = 2 + n + (2 if flags & 0x06 else 0)
+                msgs.append((body[2:2 + n], body[off:]))
+        return msgs
+
+    def keepalive(self):
+        if time.time() - self.last_tx > 20:
+            self.send(0xc0, b'')
+
+
+class Uart(object):
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+        tty.setraw(self.fd)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.tx = bytearray()
+        self.tx_bytes = 0
+        self.rx_bytes = 0
+
+    def write(self, data):
+        self.tx += data
+        self.flush()
+
+    def flush(self):
+        while self.tx:
+            try:
+                n = os.write(self.fd, bytes(self.tx))
+            except OSError as e:
+                if e.errno in (errno.EAGAIN, errno.EINTR):
+                    return
+                raise
+            self.tx_bytes += n
+            del self.tx[:n]
+
+    def read(self):
+        try:
+            data = os.read(self.fd, 65536)
+        except OSError as e:
+            if e.errno in (errno.EAGAIN, errno.EINTR, errno.EIO):
+                return b''
+            raise
+        self.rx_bytes += len(data)
+        return data
+
+
+class Load(object):
+    def __init__(self, args):
+        self.args = args
+        self.uart = Uart(args.uart)
+        self.mqtt = MqttClient(args.host, args.mqtt_port, b'sim-load-%d' % os.getpid())
+        self.topic = args.topic.encode()
+        self.mqtt.subscribe(self.topic)
+        self.up = Direction('uplink')
+        self.echo = Direction('echo')
+        self.down = Direction('downlink')
+        self.rest = Direction('rest')
+        self.seq = 0
+        self.down_seq = 0
+
+    def payload(self, kind, seq, t):
+        msg = b'%s%d %.6f ' % (kind, seq, t)
+        return msg + b'x' * max(self.args.size - len(msg), 0)
+
+    def wait(self, timeout, until=None):
+        """Runs the receive side for timeout seconds or until until() holds."""
+        end = time.time() + timeout
+        while time.time() < end:
+            if until and until():
+                return True
+            self.poll(min(0.01, max(end - time.time(), 0)))
+        return until() if until else True
+
+    def poll(self, timeout):
+        wl = [self.uart.fd] if self.uart.tx else []
+        r, w, _ = select.select([self.uart.fd, self.mqtt.sock], wl, [], timeout)
+        now = time.time()
+        if self.uart.fd in w:
+            self.uart.flush()
+        if self.uart.fd in r:
+            self.uart_input(self.uart.read(), now)
+        if self.mqtt.sock in r:
+            for topic, payload in self.mqtt.poll():
+                m = MSG.match(payload)
+                if m and m.group(1) == b'U':
+                    self.up.recv(int(m.group(2)), float(m.group(3)), now)
+        self.mqtt.keepalive()
+
+    def device_msg(self, data, now):
+        """A message the device passed to the MCU side."""
+        m = MSG.match(data)
+        if not m:
+            return
+        d = self.echo if m.group(1) == b'U' else self.down
+        d.recv(int(m.group(2)), float(m.group(3)), now)
+
+    def run(self):
+        args = self.args
+        self.setup()
+        print('running %s at %.1f msg/s, %d bytes%s' % (
+            args.mode, args.rate, args.size,
+            ', rest %.1f req/s' % args.rest_rate if getattr(args, 'rest_rate', 0) else ''))
+        sys.stdout.flush()
+        start = time.time()
+        next_up = next_down = next_rest = start
+        down_every = 1.0 / args.down_rate if args.down_rate else None
+        rest_rate = getattr(args, 'rest_rate', 0)
+        while True:
+            now = time.time()
+            if (args.count and self.seq >= args.count) or now - start >= args.duration:
+                break
+            if now >= next_up:
+                self.seq += 1
+                self.up.send(self.seq, now)
+                self.echo.send(self.seq, now)
+                self.send_up(self.payload(b'U', self.seq, now))
+                next_up += 1.0 / args.rate
+            if down_every and now >= next_down:
+                self.down_seq += 1
+                self.down.send(self.down_seq, now)
+                self.mqtt.publish(self.topic, self.payload(b'D', self.down_seq, now))
+                next_down += down_every
+            if rest_rate and now >= next_rest and self.rest_idle(now):
+                self.send_rest(now)
+                next_rest = max(next_rest + 1.0 / rest_rate, now)
+            self.poll(max(min(next_up, next_down if down_every else next_up) - time.time(), 0))
+        duration = time.time() - start
+        self.wait(args.drain)
+        self.report(duration)
+
+    def report(self, duration):
+        args = self.args
+        print()
+        print('%.1f s, uart tx %d rx %d bytes' % (duration, self.uart.tx_bytes, self.uart.rx_bytes))
+        print('%-9s %7s %7s %6s %5s %9s %9s %8s %8s %8s' % (
+            '', 'sent', 'recv', 'lost', 'dup', 'msg/s', 'B/s', 'p50 ms', 'p99 ms', 'max ms'))
+        for d in self.directions():
+            if d.sent:
+                d.report(duration, args.size)
+
+    def directions(self):
+        return [self.up, self.echo, self.down, self.rest]
+
+
+class NeuriteLoad(Load):
+    """user/neurite.c: a line on UART0 is published, the topic comes back as lines."""
+
+    def __init__(self, args):
+        Load.__init__(self, args)
+        self.line = bytearray()
+
+    def setup(self):
+        print('waiting for the device to come up on %s' % self.args.topic)
+        sys.stdout.flush()
+        probe = []
+        self.up.send(0, time.time())
+
+        def up():
+            if self.up.seen:
+                return True
+            if not probe or time.time() - probe[-1] > 1.0:
+                probe.append(time.time())
+                self.send_up(self.payload(b'U', 0, probe[-1]))
+            return False
+
+        if not self.wait(self.args.setup_timeout, up):
+            raise SystemExit('device did not publish, is it connected to the broker?')
+        self.up = Direction('uplink')
+        self.wait(0.5)
+
+    def send_up(self, payload):
+        self.uart.write(payload + b'\r')
+
+    def uart_input(self, data, now):
+        for c in bytearray(data):
+            if c in (0x0d, 0x0a):
+                if self.line:
+                    self.device_msg(bytes(self.line), now)
+                    del self.line[:]
+            else:
+                self.line.append(c)
+
+    def rest_idle(self, now):
+        return False
+
+
+class BridgeLoad(Load):
+    """modules/: SLIP framed CMD packets, MQTT and REST events come back as frames."""
+
+    def __init__(self, args):
+        Load.__init__(self, args)
+        self.frame = None
+        self.escape = False
+        self.events = []
+        self.crc_errors = 0
+        self.mqtt_handle = None
+        self.rest_handle = None
+        self.rest_pending = None
+        self.published = 0
+
+    def cmd(self, cmd, args=(), callback=0, want_return=False):
+        body = struct.pack('<HIIH', cmd, callback, 1 if want_return else 0, len(args))
+        for a in args:
+            if isinstance(a, int):
+                a = struct.pack('<I', a)
+            pad = (4 - len(a) % 4) % 4
+            body += struct.pack('<H', len(a) + pad) + a + b'\x00' * pad
+        body += struct.pack('<H', crc16(body))
+        out = bytearray([SLIP_START])
+        for b in bytearray(body):
+            if b in (SLIP_START, SLIP_END, SLIP_REPL):
+                out += bytearray([SLIP_REPL, b ^ 0x20])
+            else:
+                out.append(b)
+        out.append(SLIP_END)
+        self.uart.write(bytes(out))
+
+    def call(self, cmd, args=(), callback=0):
+        """Sends cmd asking for its return value and waits for it."""
+        self.cmd(cmd, args, callback, True)
+        ev = self.wait_event(lambda e: e[0] == cmd and e[1] == 0)
+        if ev is None:
+            raise SystemExit('no answer to command %d' % cmd)
+        return ev[2]
+
+    def wait_event(self, match, timeout=None):
+        found = []
+
+        def check():
+            for e in self.events:
+                if match(e):
+                    self.events.remove(e)
+                    found.append(e)
+                    return True
+            return False
+
+        self.wait(timeout or self.args.setup_timeout, check)
+        return found[0] if found else None
+
+    def setup(self):
+        a = self.args
+        print('setting up the bridge')
+        sys.stdout.flush()
+        self.call(CMD_IS_READY)
+        self.cmd(CMD_WIFI_CONNECT, (a.ssid.encode(), a.password.encode()), CB_WIFI)
+        if not self.wait_event(lambda e: e[1] == CB_WIFI and e[3] and bytearray(e[3][0])[0] == STATION_GOT_IP):
+            raise SystemExit('no wifi')
+        self.mqtt_handle = self.call(CMD_MQTT_SETUP, (
+            b'sim-bridge', b'', b'', 120, 1, CB_CONNECTED, CB_DISCONNECTED, CB_PUBLISHED, CB_DATA))
+        if not self.mqtt_handle:
+            raise SystemExit('MQTT setup failed')
+        self.cmd(CMD_MQTT_CONNECT, (self.mqtt_handle, a.host.encode(), a.mqtt_port, 0))
+        if not self.wait_event(lambda e: e[1] == CB_CONNECTED):
+            raise SystemExit('bridge did not connect to the broker')
+        self.cmd(CMD_MQTT_SUBSCRIBE, (self.mqtt_handle, self.topic, 0))
+        if a.rest_rate:
+            self.rest_handle = self.call(CMD_REST_SETUP, (a.host.encode(), a.http_port, 0), CB_REST)
+            if not self.rest_handle:
+                raise SystemExit('REST setup failed')
+        self.wait(0.5)
+
+    def send_up(self, payload):
+        self.cmd(CMD_MQTT_PUBLISH, (self.mqtt_handle, self.topic, payload, len(payload), 0, 0))
+
+    def rest_idle(self, now):
+        if self.rest_pending and now - self.rest_pending[1] > self.args.rest_timeout:
+            self.rest_pending = None
+        return self.rest_pending is None
+
+    def send_rest(self, now):
+        seq = len(self.rest.sent) + 1
+        self.rest.send(seq, now)
+        self.rest_pending = (seq, now)
+        self.cmd(CMD_REST_REQUEST, (self.rest_handle, b'GET', b'/sim/%d' % seq))
+
+    def uart_input(self, data, now):
+        for c in bytearray(data):
+            if c == SLIP_START:
+                self.frame = bytearray()
+                self.escape = False
+            elif self.frame is None:
+                continue
+            elif c == SLIP_END:
+                self.frame_done(bytes(self.frame), now)
+                self.frame = None
+            elif c == SLIP_REPL:
+                self.escape = True
+            else:
+                self.frame.append(c ^ 0x20 if self.escape else c)
+                self.escape = False
+
+    def frame_done(self, frame, now):
+        if len(frame) < 14:
+            return
+        cmd, callback, ret, argc = struct.unpack_from('<HIIH', frame, 0)
+        off = 12
+        args = []
+        for i in range(argc):
+            if off + 2 > len(frame) - 2:
+                break
+            n, = struct.unpack_from('<H', frame, off)
+            args.append(frame[off + 2:off + 2 + n])
+            off += 2 + n
+        if crc16(frame[:off]) != struct.unpack_from('<H', frame, len(frame) - 2)[0] or off != len(frame) - 2:
+            self.crc_errors += 1
+            return
+        if cmd == CMD_MQTT_EVENTS and callback == CB_DATA and len(args) == 2:
+            self.device_msg(args[1], now)
+        elif cmd == CMD_MQTT_EVENTS and callback == CB_PUBLISHED:
+            self.published += 1
+        elif cmd == CMD_REST_EVENTS and callback == CB_REST:
+            if self.rest_pending and (ret == 200 or not self.args.strict_status):
+                self.rest.recv(self.rest_pending[0], self.rest_pending[1], now)
+            self.rest_pending = None
+        else:
+            self.events.append((cmd, callback, ret, args))
+
+    def report(self, duration):
+        Load.report(self, duration)
+        print('published events %d, bad frames %d' % (self.published, self.crc_errors))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='load generator for neurite_sim and bridge_sim')
+    parser.add_argument('mode', choices=('neurite', 'bridge'))
+    parser.add_argument('--uart', required=True, help='UART0 pty of the simulator (its -u link)')
+    parser.add_argument('--host', default='127.0.0.1', help='broker and HTTP stand-in address')
+    parser.add_argument('--mqtt-port', type=int, default=1883)
+    parser.add_argument('--http-port', type=int, default=8080)
+    parser.add_argument('--topic', help='default /neuro/chatroom for neurite, /sim/load for bridge')
+    parser.add_argument('--rate', type=float, default=10.0, help='uplink messages per second')
+    parser.add_argument('--down-rate', type=float, default=0.0, help='downlink messages per second')
+    parser.add_argument('--rest-rate', type=float, default=0.0, help='REST requests per second, one in flight (bridge)')
+    parser.add_argument('--rest-timeout', type=float, default=5.0)
+    parser.add_argument('--strict-status', action='store_true', help='count non 200 REST answers as lost')
+    parser.add_argument('--size', type=int, default=32, help='payload bytes')
+    parser.add_argument('--count', type=int, default=0, help='stop after this many uplink messages')
+    parser.add_argument('--duration', type=float, default=10.0, help='seconds')
+    parser.add_argument('--drain', type=float, default=2.0, help='seconds to wait for stragglers')
+    parser.add_argument('--setup-timeout', type=float, default=15.0)
+    parser.add_argument('--ssid', default='sim')
+    parser.add_argument('--password', default='sim')
+    args = parser.parse_args()
+
+    if args.topic is None:
+        args.topic = '/neuro/chatroom' if args.mode == 'neurite' else '/sim/load'
+    if args.mode == 'neurite' and args.rest_rate:
+        parser.error('--rest-rate needs bridge mode')
+    load = (NeuriteLoad if args.mode == 'neurite' else BridgeLoad)(args)
+    try:
+        load.run()
+    except KeyboardInterrupt:
+        load.report(0)
+
+
+if __name__ == '__main__':
+    main()
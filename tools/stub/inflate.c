@@ -0,0 +1,359 @@
+/*
+ * inflate.c
+ *
+ * Deflate decoder (RFC 1951) in a zlib wrapper (RFC 1950), see inflate.h.
+ * Codes are decoded a bit at a time from canonical counts, which needs
+ * no lookup tables and is fast enough next to a flash write.
+ */
+#include "inflate.h"
+
+#define MAX_BITS	15
+#define MAX_LCODES	286
+#define MAX_DCODES	30
+#define FIX_LCODES	288
+
+struct huffman {
+	uint16_t count[MAX_BITS + 1];	/* codes of each length, count[0] unused lengths */
+	uint16_t symbol[FIX_LCODES];	/* symbols in code order */
+};
+
+struct state {
+	uint8_t *out;
+	uint32_t out_size;
+	uint32_t out_len;
+	const uint8_t *in;
+	uint32_t in_len;
+	uint32_t in_pos;
+	uint32_t bitbuf;
+	uint8_t bitcnt;
+	int8_t err;			/* sticky, checked where a loop could go on */
+};
+
+/* one block at a time, the stub is single threaded */
+static struct huffman lencode, distcode;
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+/* order the code length code lengths come in */
+static const uint8_t clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* need bits, least significant first; 0 and err set once the input runs out */
+static uint32_t bits(struct state *s, uint8_t need)
+{
+	uint32_t v = s->bitbuf;
+
+	while (s->bitcnt < need) {
+		if (s->in_pos == s->in_len) {
+			s->err = INFLATE_ERR_INPUT;
+			return 0;
+		}
+		v |= (uint32_t)s->in[s->in_pos++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = v >> need;
+	s->bitcnt -= need;
+	return v & ((1u << need) - 1);
+}
+
+/* symbol of the next code, codes come most significant bit first */
+static int decode(struct state *s, const struct huffman *h)
+{
+	int code = 0, first = 0, index = 0, count, len;
+
+	for (len = 1; len <= MAX_BITS; len++) {
+		code |= bits(s, 1);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	s->err = INFLATE_ERR_DATA;
+	return -1;
+}
+
+/*
+ * Canonical code from the code lengths. Returns 0 for a complete code,
+ * more for an incomplete one, less for one with too many codes.
+ */
+static int construct(struct huffman *h, const uint8_t *length, int n)
+{
+	uint16_t offs[MAX_BITS + 1];
+	int len, sym, left;
+
+	for (len = 0; len <= MAX_BITS; len++)
+		h->count[len] = 0;
+	for (sym = 0; sym < n; sym++)
+		h->count[length[sym]]++;
+	if (h->count[0] == n)
+		return 0;
+
+	left = 1;
+	for (len = 1; len <= MAX_BITS; len++) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return left;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (sym = 0; sym < n; sym++)
+		if (length[sym] != 0)
+			h->symbol[offs[length[sym]]++] = sym;
+	return left;
+}
+
+/* an incomplete code is only allowed when it is a single code of one bit */
+static int construct_check(struct huffman *h, const uint8_t *length, int n)
+{
+	int left = construct(h, length, n);
+
+	return left < 0 || (left > 0 && n != h->count[0] + h->count[1]);
+}
+
+static void stored(struct state *s)
+{
+	uint32_t len;
+
+	/* the rest of the current byte is padding */
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	if (s->in_pos + 4 > s->in_len) {
+		s->err = INFLATE_ERR_INPUT;
+		return;
+	}
+	len = s->in[s->in_pos] | (s->in[s->in_pos + 1] << 8);
+	if ((s->in[s->in_pos + 2] | (s->in[s->in_pos + 3] << 8)) != (~len & 0xffff)) {
+		s->err = INFLATE_ERR_DATA;
+		return;
+	}
+	s->in_pos += 4;
+	if (s->in_pos + len > s->in_len) {
+		s->err = INFLATE_ERR_INPUT;
+		return;
+	}
+	if (s->out_len + len > s->out_size) {
+		s->err = INFLATE_ERR_OUTPUT;
+		return;
+	}
+	while (len--)
+		s->out[s->out_len++] = s->in[s->in_pos++];
+}
+
+static void codes(struct state *s)
+{
+	int sym;
+	uint32_t len, dist;
+
+	for (;;) {
+		sym = decode(s, &lencode);
+		if (s->err)
+			return;
+		if (sym < 256) {
+			if (s->out_len == s->out_size) {
+				s->err = INFLATE_ERR_OUTPUT;
+				return;
+			}
+			s->out[s->out_len++] = sym;
+			continue;
+		}
+		if (sym == 256)
+			return;
+
+		sym -= 257;
+		if (sym >= 29) {
+			s->err = INFLATE_ERR_DATA;
+			return;
+		}
+		len = len_base[sym] + bits(s, len_extra[sym]);
+		sym = decode(s, &distcode);
+		if (s->err)
+			return;
+		if (sym >= 30) {
+			s->err = INFLATE_ERR_DATA;
+			return;
+		}
+		dist = dist_base[sym] + bits(s, dist_extra[sym]);
+		if (s->err)
+			return;
+		if (dist > s->out_len) {
+			s->err = INFLATE_ERR_DATA;
+			return;
+		}
+		if (s->out_len + len > s->out_size) {
+			s->err = INFLATE_ERR_OUTPUT;
+			return;
+		}
+		while (len--) {
+			s->out[s->out_len] = s->out[s->out_len - dist];
+			s->out_len++;
+		}
+	}
+}
+
+static void fixed(struct state *s)
+{
+	uint8_t lengths[FIX_LCODES];
+	int sym;
+
+	for (sym = 0; sym < FIX_LCODES; sym++)
+		lengths[sym] = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+	construct(&lencode, lengths, FIX_LCODES);
+	for (sym = 0; sym < MAX_DCODES; sym++)
+		lengths[sym] = 5;
+	construct(&distcode, lengths, MAX_DCODES);
+	codes(s);
+}
+
+static void dynamic(struct state *s)
+{
+	uint8_t lengths[MAX_LCODES + MAX_DCODES];
+	int nlen, ndist, ncode, index, sym;
+	uint8_t len;
+
+	nlen = bits(s, 5) + 257;
+	ndist = bits(s, 5) + 1;
+	ncode = bits(s, 4) + 4;
+	if (s->err)
+		return;
+	if (nlen > MAX_LCODES || ndist > MAX_DCODES) {
+		s->err = INFLATE_ERR_DATA;
+		return;
+	}
+
+	/* the code length code, which has to be complete */
+	for (index = 0; index < 19; index++)
+		lengths[clen_order[index]] = index < ncode ? bits(s, 3) : 0;
+	if (s->err)
+		return;
+	if (construct(&lencode, lengths, 19) != 0) {
+		s->err = INFLATE_ERR_DATA;
+		return;
+	}
+
+	index = 0;
+	while (index < nlen + ndist) {
+		sym = decode(s, &lencode);
+		if (s->err)
+			return;
+		if (sym < 16) {
+			lengths[index++] = sym;
+			continue;
+		}
+		len = 0;
+		if (sym == 16) {
+			if (index == 0) {
+				s->err = INFLATE_ERR_DATA;
+				return;
+			}
+			len = lengths[index - 1];
+			sym = 3 + bits(s, 2);
+		} else if (sym == 17) {
+			sym = 3 + bits(s, 3);
+		} else {
+			sym = 11 + bits(s, 7);
+		}
+		if (s->err)
+			return;
+		if (index + sym > nlen + ndist) {
+			s->err = INFLATE_ERR_DATA;
+			return;
+		}
+		while (sym--)
+			lengths[index++] = len;
+	}
+
+	/* without an end of block code the block never ends */
+	if (lengths[256] == 0 ||
+			construct_check(&lencode, lengths, nlen) ||
+			construct_check(&distcode, lengths + nlen, ndist)) {
+		s->err = INFLATE_ERR_DATA;
+		return;
+	}
+	codes(s);
+}
+
+/* big endian, as zlib stores it */
+static uint32_t adler32(const uint8_t *buf, uint32_t len)
+{
+	uint32_t a = 1, b = 0, n;
+
+	while (len) {
+		/* the most bytes before b can overflow */
+		n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *buf++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+int32_t inflate_zlib(uint8_t *out, uint32_t out_size, const uint8_t *in, uint32_t in_len)
+{
+	struct state s;
+	uint32_t last, type, check;
+
+	/* 2 bytes of header, 4 of Adler-32 */
+	if (in_len < 6)
+		return INFLATE_ERR_INPUT;
+	if ((in[0] & 0x0f) != 8 || (in[0] >> 4) > 7 || (in[1] & 0x20) ||
+			((in[0] << 8) | in[1]) % 31 != 0)
+		return INFLATE_ERR_HEADER;
+
+	s.out = out;
+	s.out_size = out_size;
+	s.out_len = 0;
+	s.in = in + 2;
+	s.in_len = in_len - 6;
+	s.in_pos = 0;
+	s.bitbuf = 0;
+	s.bitcnt = 0;
+	s.err = 0;
+
+	do {
+		last = bits(&s, 1);
+		type = bits(&s, 2);
+		if (s.err)
+			break;
+		if (type == 0)
+			stored(&s);
+		else if (type == 1)
+			fixed(&s);
+		else if (type == 2)
+			dynamic(&s);
+		else
+			s.err = INFLATE_ERR_DATA;
+	} while (!last && !s.err);
+	if (s.err)
+		return s.err;
+
+	in += in_len - 4;
+	check = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | (in[2] << 8) | in[3];
+	if (check != adler32(out, s.out_len))
+		return INFLATE_ERR_CHECK;
+	return s.out_len;
+}
@@ -0,0 +1,23 @@
+/*
+ * inflate.h
+ *
+ * zlib stream decoder for the flasher stub. The whole stream comes in
+ * one buffer and the whole output goes into another, so nothing is kept
+ * between calls and no window is needed beyond the output itself. The
+ * Adler-32 at the end of the stream is checked.
+ */
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <stdint.h>
+
+#define INFLATE_ERR_HEADER	-1	/* not a zlib stream, or one with a dictionary */
+#define INFLATE_ERR_INPUT	-2	/* the stream ends early */
+#define INFLATE_ERR_OUTPUT	-3	/* more output than out_size */
+#define INFLATE_ERR_DATA	-4	/* bad block type, code or distance */
+#define INFLATE_ERR_CHECK	-5	/* Adler-32 mismatch */
+
+/* returns the bytes written to out, or one of the errors above */
+int32_t inflate_zlib(uint8_t *out, uint32_t out_size, const uint8_t *in, uint32_t in_len);
+
+#endif /* INFLATE_H_ */
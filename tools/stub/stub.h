@@ -0,0 +1,74 @@
+/*
+ * stub.h
+ *
+ * Flasher stub for tools/esptool.py write_flash --stub. esptool loads it
+ * into RAM through the ROM loader; it greets with "OHAI" and then serves
+ * the ROM's flash commands plus compressed writes, flash MD5 and a baud
+ * rate change, over the same SLIP framing.
+ *
+ * Compressed writes come as blocks of at most STUB_BLOCK bytes before
+ * compression, each one a zlib stream of its own. A block is inflated
+ * into RAM whole, its sectors erased and written, so no window has to be
+ * kept across blocks.
+ *
+ * The hardware is behind the few functions below: stub_hw.c has them
+ * for the chip, sim/sim_stub.c for the Linux host build.
+ */
+#ifndef STUB_H_
+#define STUB_H_
+
+#include <stdint.h>
+
+#define STUB_FLASH_BEGIN	0x02
+#define STUB_FLASH_DATA		0x03
+#define STUB_FLASH_END		0x04
+#define STUB_SYNC		0x08
+#define STUB_WRITE_REG		0x09
+#define STUB_READ_REG		0x0a
+#define STUB_CHANGE_BAUDRATE	0x0f
+#define STUB_FLASH_DEFL_BEGIN	0x10
+#define STUB_FLASH_DEFL_DATA	0x11
+#define STUB_FLASH_DEFL_END	0x12
+#define STUB_SPI_FLASH_MD5	0x13
+
+/* response status, the second byte says why */
+#define STUB_OK			0
+#define STUB_FAIL		1
+#define STUB_ERR_CMD		0x05	/* unknown command */
+#define STUB_ERR_CHECKSUM	0x07
+#define STUB_ERR_STATE		0x08	/* no BEGIN before DATA, or seq out of order */
+#define STUB_ERR_INFLATE	0x09	/* corrupt block or wrong length */
+#define STUB_ERR_FLASH		0x0a
+#define STUB_ERR_LEN		0x0b
+
+#define STUB_SECTOR		0x1000
+#define STUB_BLOCK		0x4000	/* bytes per compressed block, before compression */
+/* a block that does not compress grows by a few bytes of zlib framing */
+#define STUB_PACKET_MAX		(8 + 16 + STUB_BLOCK + 64)
+
+/* stub_hw.c, or the host stand-ins */
+int stub_uart_rx(void);		/* blocks, -1 when the line is gone */
+void stub_uart_tx(uint8_t c);
+void stub_uart_baud(uint32_t baud, uint32_t prior);
+uint32_t stub_read_reg(uint32_t addr);
+void stub_write_reg(uint32_t addr, uint32_t value, uint32_t mask, uint32_t delay_us);
+int stub_flash_erase(uint32_t sector);
+int stub_flash_write(uint32_t addr, const uint32_t *data, uint32_t len);
+int stub_flash_read(uint32_t addr, uint32_t *data, uint32_t len);
+void stub_reboot(void);
+
+/* MD5 of the ROM, the host build brings its own */
+struct MD5Context {
+	uint32_t buf[4];
+	uint32_t bits[2];
+	uint8_t in[64];
+};
+
+void MD5Init(struct MD5Context *ctx);
+void MD5Update(struct MD5Context *ctx, const void *buf, uint32_t len);
+void MD5Final(uint8_t digest[16], struct MD5Context *ctx);
+
+/* stub_flasher.c, returns once the line is gone */
+void stub_main(void);
+
+#endif /* STUB_H_ */
@@ -0,0 +1,300 @@
+/*
+ * stub_flasher.c
+ *
+ * Command loop of the flasher stub, see stub.h. Requests and responses
+ * are framed like the ROM loader's: a request is 0x00, op, length,
+ * checksum and data, a response 0x01, op, length, value and a body that
+ * ends with a status and an error byte.
+ *
+ * Flash is erased as writes reach it, one sector ahead of the data, so a
+ * BEGIN returns at once however large the image is.
+ */
+#include "stub.h"
+#include "inflate.h"
+
+#define SLIP_END	0xc0
+#define SLIP_ESC	0xdb
+#define SLIP_ESC_END	0xdc
+#define SLIP_ESC_ESC	0xdd
+
+#define CHECKSUM_MAGIC	0xef
+
+struct write_s {
+	uint32_t addr;		/* where the next block goes */
+	uint32_t erased;	/* flash from the first sector up to here is erased */
+	uint32_t remaining;	/* bytes still to come, compressed writes */
+	uint32_t block_size;
+	uint32_t seq;
+	uint8_t active;
+	uint8_t deflate;
+};
+
+static uint8_t packet[STUB_PACKET_MAX] __attribute__((aligned(4)));
+/* an inflated block, or flash read back for an MD5 */
+static uint32_t block[STUB_BLOCK / 4];
+static struct write_s w;
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void slip_tx(uint8_t c)
+{
+	if (c == SLIP_END) {
+		stub_uart_tx(SLIP_ESC);
+		stub_uart_tx(SLIP_ESC_END);
+	} else if (c == SLIP_ESC) {
+		stub_uart_tx(SLIP_ESC);
+		stub_uart_tx(SLIP_ESC_ESC);
+	} else {
+		stub_uart_tx(c);
+	}
+}
+
+/*
+ * Next frame into buf. Returns its length, 0 for one that did not fit,
+ * or -1 once the line is gone.
+ */
+static int32_t slip_rx(uint8_t *buf, uint32_t size)
+{
+	uint32_t len = 0;
+	uint8_t esc = 0, over = 0;
+	int c;
+
+	do {
+		c = stub_uart_rx();
+		if (c < 0)
+			return -1;
+	} while (c != SLIP_END);
+
+	for (;;) {
+		c = stub_uart_rx();
+		if (c < 0)
+			return -1;
+		if (c == SLIP_END) {
+			/* an empty frame is the start of the next one */
+			if (len == 0 && !over)
+				continue;
+			return over ? 0 : len;
+		}
+		if (esc) {
+			esc = 0;
+			c = c == SLIP_ESC_END ? SLIP_END : c == SLIP_ESC_ESC ? SLIP_ESC : c;
+		} else if (c == SLIP_ESC) {
+			esc = 1;
+			continue;
+		}
+		if (len < size)
+			buf[len++] = c;
+		else
+			over = 1;
+	}
+}
+
+static void respond(uint8_t op, uint32_t value, const uint8_t *body, uint16_t len,
+		uint8_t status, uint8_t err)
+{
+	uint16_t i, n = len + 2;
+
+	stub_uart_tx(SLIP_END);
+	slip_tx(0x01);
+	slip_tx(op);
+	slip_tx(n & 0xff);
+	slip_tx(n >> 8);
+	for (i = 0; i < 4; i++)
+		slip_tx(value >> (i * 8));
+	for (i = 0; i < len; i++)
+		slip_tx(body[i]);
+	slip_tx(status);
+	slip_tx(err);
+	stub_uart_tx(SLIP_END);
+}
+
+static uint8_t checksum(const uint8_t *data, uint32_t len)
+{
+	uint8_t state = CHECKSUM_MAGIC;
+
+	while (len--)
+		state ^= *data++;
+	return state;
+}
+
+static uint8_t erase_to(uint32_t end)
+{
+	while (w.erased < end) {
+		if (stub_flash_erase(w.erased / STUB_SECTOR))
+			return STUB_ERR_FLASH;
+		w.erased += STUB_SECTOR;
+	}
+	return 0;
+}
+
+/* data is word aligned, len a multiple of 4 */
+static uint8_t write_block(const uint32_t *data, uint32_t len)
+{
+	uint8_t err = erase_to(w.addr + len);
+
+	if (err)
+		return err;
+	if (stub_flash_write(w.addr, data, len))
+		return STUB_ERR_FLASH;
+	w.addr += len;
+	w.seq++;
+	return 0;
+}
+
+/* FLASH_BEGIN and FLASH_DEFL_BEGIN: size, blocks, block size, offset */
+static uint8_t write_begin(const uint8_t *data, uint8_t deflate)
+{
+	w.remaining = get32(data);
+	w.block_size = get32(data + 8);
+	w.addr = get32(data + 12);
+	w.erased = w.addr & ~(STUB_SECTOR - 1);
+	w.seq = 0;
+	w.deflate = deflate;
+	w.active = 0;
+	if (deflate && (w.block_size == 0 || w.block_size > STUB_BLOCK))
+		return STUB_ERR_LEN;
+	w.active = 1;
+	return 0;
+}
+
+/* FLASH_DATA and FLASH_DEFL_DATA: length, seq, 0, 0, then the data */
+static uint8_t write_data(const uint8_t *data, uint16_t len, uint32_t chk, uint8_t deflate)
+{
+	uint32_t n = get32(data), seq = get32(data + 4), expect;
+	int32_t got;
+	uint8_t *out = (uint8_t *)block;
+
+	if (!w.active || w.deflate != deflate || seq != w.seq)
+		return STUB_ERR_STATE;
+	if (len < 16 || n != len - 16u)
+		return STUB_ERR_LEN;
+	data += 16;
+	if (checksum(data, n) != chk)
+		return STUB_ERR_CHECKSUM;
+
+	if (!deflate) {
+		/* the ROM loader's blocks, padded by the host */
+		if (n & 3)
+			return STUB_ERR_LEN;
+		return write_block((const uint32_t *)data, n);
+	}
+
+	expect = w.remaining < w.block_size ? w.remaining : w.block_size;
+	got = inflate_zlib(out, expect, data, n);
+	if (got < 0 || (uint32_t)got != expect)
+		return STUB_ERR_INFLATE;
+	w.remaining -= expect;
+	while (expect & 3)
+		out[expect++] = 0xff;
+	return write_block(block, expect);
+}
+
+static void flash_md5(const uint8_t *data)
+{
+	struct MD5Context ctx;
+	uint32_t addr = get32(data), size = get32(data + 4), n;
+	uint8_t digest[16];
+
+	MD5Init(&ctx);
+	while (size) {
+		n = size < sizeof(block) ? size : sizeof(block);
+		if (stub_flash_read(addr, block, (n + 3) & ~3)) {
+			respond(STUB_SPI_FLASH_MD5, 0, 0, 0, STUB_FAIL, STUB_ERR_FLASH);
+			return;
+		}
+		MD5Update(&ctx, block, n);
+		addr += n;
+		size -= n;
+	}
+	MD5Final(digest, &ctx);
+	respond(STUB_SPI_FLASH_MD5, 0, digest, sizeof(digest), STUB_OK, 0);
+}
+
+static void handle(const uint8_t *p, uint32_t n)
+{
+	uint8_t op = p[1], err = 0;
+	uint16_t len = p[2] | (p[3] << 8);
+	uint32_t chk = get32(p + 4);
+	const uint8_t *data = p + 8;
+	int i;
+
+	if (n < 8 || p[0] != 0x00 || 8u + len > n) {
+		respond(op, 0, 0, 0, STUB_FAIL, STUB_ERR_LEN);
+		return;
+	}
+
+	switch (op) {
+	case STUB_SYNC:
+		/* as many answers as the ROM gives */
+		for (i = 0; i < 8; i++)
+			respond(op, 0, 0, 0, STUB_OK, 0);
+		return;
+	case STUB_READ_REG:
+		if (len < 4)
+			break;
+		respond(op, stub_read_reg(get32(data)), 0, 0, STUB_OK, 0);
+		return;
+	case STUB_WRITE_REG:
+		if (len < 16)
+			break;
+		stub_write_reg(get32(data), get32(data + 4), get32(data + 8), get32(data + 12));
+		respond(op, 0, 0, 0, STUB_OK, 0);
+		return;
+	case STUB_FLASH_BEGIN:
+	case STUB_FLASH_DEFL_BEGIN:
+		if (len < 16)
+			break;
+		err = write_begin(data, op == STUB_FLASH_DEFL_BEGIN);
+		respond(op, 0, 0, 0, err ? STUB_FAIL : STUB_OK, err);
+		return;
+	case STUB_FLASH_DATA:
+	case STUB_FLASH_DEFL_DATA:
+		err = write_data(data, len, chk, op == STUB_FLASH_DEFL_DATA);
+		respond(op, 0, 0, 0, err ? STUB_FAIL : STUB_OK, err);
+		return;
+	case STUB_FLASH_END:
+	case STUB_FLASH_DEFL_END:
+		w.active = 0;
+		respond(op, 0, 0, 0, STUB_OK, 0);
+		/* 0 is reboot, anything else stays in the stub */
+		if (len >= 4 && get32(data) == 0)
+			stub_reboot();
+		return;
+	case STUB_SPI_FLASH_MD5:
+		if (len < 8)
+			break;
+		flash_md5(data);
+		return;
+	case STUB_CHANGE_BAUDRATE:
+		/* the new divider is scaled from the current one, which needs the rate it is for */
+		if (len < 8 || get32(data) == 0 || get32(data + 4) == 0)
+			break;
+		respond(op, 0, 0, 0, STUB_OK, 0);
+		stub_uart_baud(get32(data), get32(data + 4));
+		return;
+	default:
+		respond(op, 0, 0, 0, STUB_FAIL, STUB_ERR_CMD);
+		return;
+	}
+	respond(op, 0, 0, 0, STUB_FAIL, STUB_ERR_LEN);
+}
+
+void stub_main(void)
+{
+	int32_t n;
+
+	stub_uart_tx(SLIP_END);
+	slip_tx('O');
+	slip_tx('H');
+	slip_tx('A');
+	slip_tx('I');
+	stub_uart_tx(SLIP_END);
+
+	while ((n = slip_rx(packet, sizeof(packet))) >= 0) {
+		if (n > 0)
+			handle(packet, n);
+	}
+}
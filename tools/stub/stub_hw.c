@@ -0,0 +1,104 @@
+/*
+ * stub_hw.c
+ *
+ * The chip side of stub.h: UART0 registers, the ROM's SPI flash calls
+ * and the entry point the ROM loader jumps to. Built by `make stub`.
+ */
+#include "stub.h"
+
+#ifndef BIT
+#define BIT(nr)		(1UL << (nr))
+#endif
+#include "driver/uart_register.h"
+
+#define REG(addr)		(*(volatile uint32_t *)(addr))
+#define UART_TX_FIFO_SIZE	128
+#define ETS_UART_INUM		5
+#define ROM_RESET_VECTOR	0x40000080
+
+/* in the ROM, the addresses come from the SDK's eagle.rom.addr.v6.ld */
+extern int SPIEraseSector(uint32_t sector);
+extern int SPIWrite(uint32_t addr, const uint32_t *src, uint32_t len);
+extern int SPIRead(uint32_t addr, uint32_t *dst, uint32_t len);
+extern int SPIUnlock(void);
+extern void ets_delay_us(uint32_t us);
+extern void ets_isr_mask(uint32_t mask);
+
+/* stub.ld */
+extern uint32_t _bss_start, _bss_end;
+
+int stub_uart_rx(void)
+{
+	while (((REG(UART_STATUS(0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT) == 0)
+		;
+	return REG(UART_FIFO(0)) & 0xff;
+}
+
+void stub_uart_tx(uint8_t c)
+{
+	while (((REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT) >= UART_TX_FIFO_SIZE - 1)
+		;
+	REG(UART_FIFO(0)) = c;
+}
+
+/*
+ * The UART clock depends on the crystal, so the divider for the new rate
+ * is scaled from the one the ROM picked for the prior rate.
+ */
+void stub_uart_baud(uint32_t baud, uint32_t prior)
+{
+	uint32_t div = REG(UART_CLKDIV(0)) & UART_CLKDIV_CNT;
+
+	/* the ack goes out at the old rate, the last character included */
+	while ((REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT)
+		;
+	ets_delay_us(20000000 / prior + 1);
+	div = (div * prior + baud / 2) / baud;
+	REG(UART_CLKDIV(0)) = div & UART_CLKDIV_CNT;
+}
+
+uint32_t stub_read_reg(uint32_t addr)
+{
+	return REG(addr);
+}
+
+void stub_write_reg(uint32_t addr, uint32_t value, uint32_t mask, uint32_t delay_us)
+{
+	REG(addr) = (REG(addr) & ~mask) | (value & mask);
+	if (delay_us)
+		ets_delay_us(delay_us);
+}
+
+int stub_flash_erase(uint32_t sector)
+{
+	return SPIEraseSector(sector);
+}
+
+int stub_flash_write(uint32_t addr, const uint32_t *data, uint32_t len)
+{
+	return SPIWrite(addr, data, len);
+}
+
+int stub_flash_read(uint32_t addr, uint32_t *data, uint32_t len)
+{
+	return SPIRead(addr, data, len);
+}
+
+void stub_reboot(void)
+{
+	((void (*)(void))ROM_RESET_VECTOR)();
+}
+
+void stub_entry(void)
+{
+	uint32_t *p;
+
+	/* only text and data are loaded */
+	for (p = &_bss_start; p < &_bss_end; p++)
+		*p = 0;
+	/* the loader's UART interrupt would take bytes meant for us */
+	ets_isr_mask(1 << ETS_UART_INUM);
+	/* as the ROM's FLASH_BEGIN does, for chips that come write protected */
+	SPIUnlock();
+	stub_main();
+}
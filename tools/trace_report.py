@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+#
+# Per-stage latency report for the hot path trace (make TRACE=1).
+#
+# Input is either the UART1 text dump ("TRACE BEGIN <mhz>" / "T <ccount>
+# <ev> <arg>" lines) or the raw CMD_TRACE payload (8 byte little endian
+# records: u32 ccount, u16 ev, u16 arg).
+#
+#   trace_report.py uart1.log
+#   trace_report.py --raw --mhz 160 trace.bin
+
+from __future__ import print_function
+
+import argparse
+import struct
+import sys
+
+# keep in sync with enum trace_ev_e in include/trace.h
+EVENTS = [
+    'NONE',
+    'ISR_ENTER',
+    'ISR_EXIT',
+    'FRAME_DONE',
+    'CRC_DONE',
+    'DISPATCH',
+    'DISPATCH_DONE',
+    'PUB_QUEUED',
+    'MQTT_DATA',
+    'TX_DONE',
+]
+EV = dict((name, i) for i, name in enumerate(EVENTS))
+
+# (from, to), latency is measured from the latest 'from' to each 'to'
+STAGES = [
+    ('ISR_ENTER', 'ISR_EXIT'),
+    ('ISR_ENTER', 'FRAME_DONE'),
+    ('FRAME_DONE', 'CRC_DONE'),
+    ('CRC_DONE', 'DISPATCH'),
+    ('DISPATCH', 'DISPATCH_DONE'),
+    ('FRAME_DONE', 'PUB_QUEUED'),
+    ('DISPATCH', 'PUB_QUEUED'),
+    ('MQTT_DATA', 'TX_DONE'),
+]
+
+
+def read_text(f):
+    mhz = None
+    recs = []
+    for line in f:
+        fields = line.split()
+        if len(fields) == 3 and fields[0] == 'TRACE' and fields[1] == 'BEGIN':
+            mhz = int(fields[2])
+        elif len(fields) == 4 and fields[0] == 'T':
+            recs.append((int(fields[1], 16), int(fields[2]), int(fields[3])))
+    return mhz, recs
+
+
+def read_raw(data):
+    recs = []
+    for off in range(0, len(data) - len(data) % 8, 8):
+        recs.append(struct.unpack_from('<IHH', data, off))
+    return recs
+
+
+def percentile(sorted_vals, p):
+    idx = int(round(p / 100.0 * (len(sorted_vals) - 1)))
+    return sorted_vals[idx]
+
+
+def stage_latencies(recs, mhz):
+    last = {}
+    lat = dict((s, []) for s in STAGES)
+    for ccount, ev, arg in recs:
+        for s in STAGES:
+            if ev == EV[s[1]] and EV[s[0]] in last:
+                # ccount wraps every 2^32 cycles, ~26s at 160MHz
+                cycles = (ccount - last[EV[s[0]]]) & 0xffffffff
+                lat[s].append(cycles / float(mhz))
+        last[ev] = ccount
+    return lat
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Hot path trace latency report')
+    parser.add_argument('file', help='UART1 log or raw CMD_TRACE payload, - for stdin')
+    parser.add_argument('--raw', action='store_true', help='input is raw binary records')
+    parser.add_argument('--mhz', type=int, help='CPU clock, overrides the dump header')
+    args = parser.parse_args()
+
+    mhz = None
+    if args.raw:
+        if args.file == '-':
+            data = getattr(sys.stdin, 'buffer', sys.stdin).read()
+        else:
+            with open(args.file, 'rb') as f:
+                data = f.read()
+        recs = read_raw(data)
+    elif args.file == '-':
+        mhz, recs = read_text(sys.stdin)
+    else:
+        with open(args.file) as f:
+            mhz, recs = read_text(f)
+
+    mhz = args.mhz or mhz or 80
+    print('%d records, %d MHz' % (len(recs), mhz))
+    print('%-28s %7s %9s %9s %9s %9s' % ('stage (us)', 'n', 'p50', 'p90', 'p99', 'max'))
+    lat = stage_latencies(recs, mhz)
+    for s in STAGES:
+        vals = sorted(lat[s])
+        name = '%s -> %s' % s
+        if not vals:
+            print('%-28s %7d' % (name, 0))
+            continue
+        print('%-28s %7d %9.1f %9.1f %9.1f %9.1f' % (name, len(vals),
+              percentile(vals, 50), percentile(vals, 90), percentile(vals, 99), vals[-1]))
+
+
+if __name__ == '__main__':
+    main()
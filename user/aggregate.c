@@ -0,0 +1,147 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "user_utils.h"
+#include "metrics.h"
+#include "mqtt5.h"
+#include "edge_filter.h"
+#include "aggregate.h"
+
+/* a summary record with five values at their longest */
+#define AGGREGATE_RECORD_LEN	112
+
+static struct aggregate_s g_series[AGGREGATE_SERIES];
+
+static struct aggregate_s *ICACHE_FLASH_ATTR series_find(const char *topic)
+{
+	int i;
+
+	for (i = 0; i < AGGREGATE_SERIES; i++)
+		if (g_series[i].topic[0] && os_strcmp(g_series[i].topic, topic) == 0)
+			return &g_series[i];
+	return NULL;
+}
+
+/* thousandths as a decimal, without trailing zeros */
+static int ICACHE_FLASH_ATTR milli_str(char *buf, int32_t v)
+{
+	uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v, frac = u % 1000;
+	int n;
+
+	n = os_sprintf(buf, "%s%u", v < 0 ? "-" : "", u / 1000);
+	if (frac == 0)
+		return n;
+	n += os_sprintf(buf + n, ".%03u", frac);
+	while (buf[n - 1] == '0')
+		n--;
+	buf[n] = 0;
+	return n;
+}
+
+static void ICACHE_FLASH_ATTR series_close(struct aggregate_s *s)
+{
+	char rec[AGGREGATE_RECORD_LEN];
+	int n;
+
+	if (s->count == 0)
+		return;
+	n = os_sprintf(rec, "{\"min\":");
+	n += milli_str(rec + n, s->min);
+	n += os_sprintf(rec + n, ",\"max\":");
+	n += milli_str(rec + n, s->max);
+	n += os_sprintf(rec + n, ",\"mean\":");
+	n += milli_str(rec + n, (int32_t)(s->sum / (sint64)s->count));
+	n += os_sprintf(rec + n, ",\"count\":%u,\"last\":", s->count);
+	n += milli_str(rec + n, s->last);
+	n += os_sprintf(rec + n, "}");
+
+	if (mqtt5_publish(s->client, s->topic, rec, n, s->qos, s->retain))
+		metrics_inc(METRIC_MQTT_PUB);
+	else
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+	metrics_inc(METRIC_AGG_WINDOWS);
+	s->count = 0;
+	s->sum = 0;
+}
+
+static void ICACHE_FLASH_ATTR series_timer_cb(void *arg)
+{
+	series_close((struct aggregate_s *)arg);
+}
+
+static void ICACHE_FLASH_ATTR series_arm(struct aggregate_s *s)
+{
+	os_timer_disarm(&s->timer);
+	os_timer_setfn(&s->timer, series_timer_cb, s);
+	os_timer_arm(&s->timer, s->window_ms, 1);
+}
+
+int ICACHE_FLASH_ATTR aggregate_set(const char *topic, uint32_t window_ms)
+{
+	struct aggregate_s *s = series_find(topic);
+	int i;
+
+	if (s) {
+		series_close(s);
+		os_timer_disarm(&s->timer);
+	}
+	if (window_ms == 0) {
+		if (s)
+			os_memset(s, 0, sizeof(*s));
+		return 0;
+	}
+	if (os_strlen(topic) >= AGGREGATE_TOPIC_LEN)
+		return -1;
+	for (i = 0; s == NULL && i < AGGREGATE_SERIES; i++)
+		if (g_series[i].topic[0] == 0)
+			s = &g_series[i];
+	if (s == NULL) {
+		log_warn("no room for a series on %s\n", topic);
+		return -1;
+	}
+	os_memset(s, 0, sizeof(*s));
+	os_strcpy(s->topic, topic);
+	if (window_ms < AGGREGATE_MIN_MS)
+		window_ms = AGGREGATE_MIN_MS;
+	s->window_ms = window_ms < AGGREGATE_MAX_MS ? window_ms : AGGREGATE_MAX_MS;
+	series_arm(s);
+	log_info("%s: %ums windows\n", topic, s->window_ms);
+	return 0;
+}
+
+bool ICACHE_FLASH_ATTR aggregate_add(MQTT_Client *client, const char *topic, const char *data, uint16_t len, int qos, int retain)
+{
+	struct aggregate_s *s = series_find(topic);
+	int32_t v;
+
+	if (s == NULL || !edge_filter_value(data, len, &v))
+		return false;
+	/* saturated, it would skew the summary */
+	if (v == EDGE_FILTER_VALUE_MAX || v == -EDGE_FILTER_VALUE_MAX)
+		return false;
+	if (s->count == 0 || v < s->min)
+		s->min = v;
+	if (s->count == 0 || v > s->max)
+		s->max = v;
+	s->last = v;
+	s->sum += v;
+	s->count++;
+	s->client = client;
+	s->qos = qos;
+	s->retain = retain;
+	metrics_inc(METRIC_AGG_SAMPLES);
+	return true;
+}
+
+void ICACHE_FLASH_ATTR aggregate_flush(MQTT_Client *client)
+{
+	int i;
+
+	for (i = 0; i < AGGREGATE_SERIES; i++) {
+		if (g_series[i].topic[0] == 0 || g_series[i].client != client || g_series[i].count == 0)
+			continue;
+		series_close(&g_series[i]);
+		/* the next window is a whole one */
+		series_arm(&g_series[i]);
+	}
+}
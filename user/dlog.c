@@ -0,0 +1,168 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "user_utils.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "mem_track.h"
+
+#ifdef NEURITE_DLOG
+
+#define DLOG_TASK_PRIO		USER_TASK_PRIO_0
+#define DLOG_TASK_QUEUE_SIZE	1
+#define DLOG_RETRY_MS		2	/* tx fifo full, 128 bytes drain in ~11ms at 115200 */
+#define DLOG_HDR_WORDS		3
+
+static uint32_t dlog_ring[DLOG_RING_WORDS];
+static uint32_t dlog_head;
+static uint32_t dlog_tail;
+static bool dlog_posted;
+static bool dlog_ready;
+
+static os_event_t dlog_queue[DLOG_TASK_QUEUE_SIZE];
+static os_timer_t dlog_timer;
+
+static inline uint32_t dlog_irq_save(void)
+{
+	uint32_t ps = 0;
+#ifdef __xtensa__
+	__asm__ __volatile__("rsil %0, 15" : "=a"(ps));
+#endif
+	return ps;
+}
+
+static inline void dlog_irq_restore(uint32_t ps)
+{
+#ifdef __xtensa__
+	__asm__ __volatile__("wsr %0, ps; rsync" :: "a"(ps) : "memory");
+#endif
+}
+
+/*
+ * Reserve n words, a record never wraps so the drain can send it from
+ * the ring directly; the words skipped at the end are marked with 0.
+ * Returns NULL if the ring is full, the record is dropped.
+ */
+static uint32_t *dlog_reserve(uint32_t n)
+{
+	uint32_t pos = dlog_head & (DLOG_RING_WORDS - 1);
+	uint32_t skip = pos + n > DLOG_RING_WORDS ? DLOG_RING_WORDS - pos : 0;
+
+	if (dlog_head + skip + n - dlog_tail > DLOG_RING_WORDS) {
+		metrics_inc(METRIC_DLOG_DROPS);
+		return NULL;
+	}
+	if (skip) {
+		dlog_ring[pos] = 0;
+		dlog_head += skip;
+		pos = 0;
+	}
+	dlog_head += n;
+	return &dlog_ring[pos];
+}
+
+static void dlog_commit(void)
+{
+	if (dlog_ready && !dlog_posted) {
+		dlog_posted = true;
+		system_os_post(DLOG_TASK_PRIO, 0, 0);
+	}
+}
+
+void dlog_write(const char *fmt, uint32_t hdr, const uint32_t *args)
+{
+	uint32_t nargs = hdr & 0xff;
+	uint32_t ps, i, *rec;
+
+	ps = dlog_irq_save();
+	rec = dlog_reserve(DLOG_HDR_WORDS + nargs);
+	if (rec) {
+		rec[0] = (uint32_t)fmt;
+		rec[1] = system_get_time();
+		rec[2] = hdr;
+		for (i = 0; i < nargs; i++)
+			rec[DLOG_HDR_WORDS + i] = args[i];
+		dlog_commit();
+	}
+	dlog_irq_restore(ps);
+}
+
+void dlog_write_hex(const char *fmt, uint8_t level, const uint8_t *buf, uint16_t len)
+{
+	uint32_t ps, *rec;
+
+	if (len > DLOG_HEX_MAX)
+		len = DLOG_HEX_MAX;
+	ps = dlog_irq_save();
+	rec = dlog_reserve(DLOG_HDR_WORDS + (len + 3) / 4);
+	if (rec) {
+		rec[0] = (uint32_t)fmt;
+		rec[1] = system_get_time();
+		rec[2] = DLOG_HDR(level, 0, len);
+		os_memcpy(&rec[DLOG_HDR_WORDS], buf, len);
+		dlog_commit();
+	}
+	dlog_irq_restore(ps);
+}
+
+/* words in the record at tail, 0 marks the unused end of the ring */
+static uint32_t ICACHE_FLASH_ATTR dlog_rec_words(const uint32_t *rec)
+{
+	if (rec[0] == 0)
+		return 0;
+	return DLOG_HDR_WORDS + (rec[2] & 0xff) + (((rec[2] >> 8) & 0xff) + 3) / 4;
+}
+
+static void ICACHE_FLASH_ATTR dlog_drain(os_event_t *events)
+{
+	uint8_t frame[2];
+	uint32_t *rec;
+	uint32_t n, ps;
+
+	MEM_STACK_PROBE();
+	while (dlog_tail != dlog_head) {
+		rec = &dlog_ring[dlog_tail & (DLOG_RING_WORDS - 1)];
+		n = dlog_rec_words(rec);
+		if (n == 0) {
+			dlog_tail += DLOG_RING_WORDS - (dlog_tail & (DLOG_RING_WORDS - 1));
+			continue;
+		}
+		/* never wait on the uart, come back once the fifo has room */
+		if (uart_tx_fifo_free(UART1) < sizeof(frame) + n * 4) {
+			os_timer_disarm(&dlog_timer);
+			os_timer_arm(&dlog_timer, DLOG_RETRY_MS, 0);
+			return;
+		}
+		frame[0] = DLOG_SYNC;
+		frame[1] = n;
+		uart1_tx_buffer(frame, sizeof(frame));
+		uart1_tx_buffer((uint8_t *)rec, n * 4);
+		dlog_tail += n;
+	}
+
+	ps = dlog_irq_save();
+	dlog_posted = false;
+	dlog_irq_restore(ps);
+	/* a record may have slipped in before the flag was cleared */
+	if (dlog_tail != dlog_head)
+		dlog_commit();
+}
+
+static void ICACHE_FLASH_ATTR dlog_retry(void *arg)
+{
+	system_os_post(DLOG_TASK_PRIO, 0, 0);
+}
+
+void ICACHE_FLASH_ATTR dlog_init(void)
+{
+	system_os_task(dlog_drain, DLOG_TASK_PRIO, dlog_queue, DLOG_TASK_QUEUE_SIZE);
+	os_timer_disarm(&dlog_timer);
+	os_timer_setfn(&dlog_timer, (os_timer_func_t *)dlog_retry, NULL);
+	dlog_ready = true;
+	/* records logged before init */
+	if (dlog_tail != dlog_head)
+		dlog_commit();
+}
+
+#endif /* NEURITE_DLOG */
@@ -0,0 +1,161 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "user_utils.h"
+#include "metrics.h"
+#include "edge_filter.h"
+
+static struct edge_filter_s g_rules[EDGE_FILTER_RULES];
+static os_timer_t g_age_timer;
+static bool g_age_armed;
+
+static struct edge_filter_s *ICACHE_FLASH_ATTR rule_find(const char *topic)
+{
+	int i;
+
+	for (i = 0; i < EDGE_FILTER_RULES; i++)
+		if (g_rules[i].topic[0] && os_strcmp(g_rules[i].topic, topic) == 0)
+			return &g_rules[i];
+	return NULL;
+}
+
+bool ICACHE_FLASH_ATTR edge_filter_value(const char *data, uint16_t len, int32_t *value)
+{
+	uint16_t i = 0;
+	int32_t v = 0, scale = 1000, d;
+	bool neg = false, digits = false, dot = false;
+
+	while (i < len && data[i] == ' ')
+		i++;
+	if (i < len && (data[i] == '-' || data[i] == '+'))
+		neg = data[i++] == '-';
+	for (; i < len; i++) {
+		if (data[i] >= '0' && data[i] <= '9') {
+			digits = true;
+			/* saturate, still compares */
+			if (!dot) {
+				d = (data[i] - '0') * 1000;
+				v = v > (EDGE_FILTER_VALUE_MAX - d) / 10 ? EDGE_FILTER_VALUE_MAX : v * 10 + d;
+			} else if (scale > 1) {
+				scale /= 10;
+				d = (data[i] - '0') * scale;
+				v = v > EDGE_FILTER_VALUE_MAX - d ? EDGE_FILTER_VALUE_MAX : v + d;
+			}
+		} else if (data[i] == '.' && !dot) {
+			dot = true;
+		} else {
+			break;
+		}
+	}
+	*value = neg ? -v : v;
+	return digits;
+}
+
+/* FNV-1a, for readings that are not numbers */
+static int32_t ICACHE_FLASH_ATTR reading_hash(const char *data, uint16_t len)
+{
+	uint32_t h = 2166136261u;
+	uint16_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)data[i]) * 16777619u;
+	return (int32_t)h;
+}
+
+/* before system_get_time() wraps and makes an old reading look recent */
+static void ICACHE_FLASH_ATTR rules_age(void *arg)
+{
+	uint32_t now = system_get_time();
+	int i;
+
+	for (i = 0; i < EDGE_FILTER_RULES; i++)
+		if (g_rules[i].sent && now - g_rules[i].at_us >= EDGE_FILTER_MAX_MS * 1000u)
+			g_rules[i].aged = 1;
+}
+
+int ICACHE_FLASH_ATTR edge_filter_set(const char *topic, uint32_t deadband, uint32_t min_ms, uint32_t heartbeat_ms, uint8_t flags)
+{
+	struct edge_filter_s *r = rule_find(topic);
+	int i;
+
+	if (deadband == 0 && min_ms == 0 && heartbeat_ms == 0 && flags == 0) {
+		if (r)
+			os_memset(r, 0, sizeof(*r));
+		return 0;
+	}
+	if (os_strlen(topic) >= EDGE_FILTER_TOPIC_LEN)
+		return -1;
+	for (i = 0; r == NULL && i < EDGE_FILTER_RULES; i++)
+		if (g_rules[i].topic[0] == 0)
+			r = &g_rules[i];
+	if (r == NULL) {
+		log_warn("no room for a rule on %s\n", topic);
+		return -1;
+	}
+	/* a changed rule starts over, counters included */
+	os_memset(r, 0, sizeof(*r));
+	os_strcpy(r->topic, topic);
+	r->deadband = deadband;
+	r->min_ms = min_ms < EDGE_FILTER_MAX_MS ? min_ms : EDGE_FILTER_MAX_MS;
+	r->heartbeat_ms = heartbeat_ms < EDGE_FILTER_MAX_MS ? heartbeat_ms : EDGE_FILTER_MAX_MS;
+	r->flags = flags;
+	if (!g_age_armed) {
+		os_timer_setfn(&g_age_timer, rules_age, NULL);
+		os_timer_arm(&g_age_timer, EDGE_FILTER_AGE_MS, 1);
+		g_age_armed = true;
+	}
+	log_info("%s: deadband %u, min %ums, heartbeat %ums, flags %x\n",
+		 topic, deadband, r->min_ms, r->heartbeat_ms, flags);
+	return 0;
+}
+
+const struct edge_filter_s *ICACHE_FLASH_ATTR edge_filter_get(const char *topic)
+{
+	return rule_find(topic);
+}
+
+bool ICACHE_FLASH_ATTR edge_filter_pass(const char *topic, const char *data, uint16_t len)
+{
+	struct edge_filter_s *r = rule_find(topic);
+	uint32_t now = system_get_time(), elapsed_ms, diff;
+	int32_t value;
+	bool numeric, pass = true;
+
+	if (r == NULL)
+		return true;
+	numeric = edge_filter_value(data, len, &value);
+	if (!numeric)
+		value = reading_hash(data, len);
+	if (r->sent) {
+		elapsed_ms = r->aged ? EDGE_FILTER_MAX_MS : (now - r->at_us) / 1000;
+		if (r->min_ms && elapsed_ms < r->min_ms) {
+			pass = false;
+		} else if (r->heartbeat_ms && elapsed_ms >= r->heartbeat_ms) {
+			pass = true;
+		} else if ((r->flags & EDGE_FILTER_CHANGE) || r->deadband) {
+			if (numeric != r->numeric) {
+				pass = true;
+			} else if (numeric) {
+				/* in uint32_t, -2147483.647 to 2147483.647 does not fit an int32_t */
+				diff = value > r->value ? (uint32_t)value - (uint32_t)r->value :
+							  (uint32_t)r->value - (uint32_t)value;
+				pass = diff > r->deadband;
+			} else {
+				pass = value != r->value;
+			}
+		}
+	}
+	if (!pass) {
+		r->suppressed++;
+		metrics_inc(METRIC_FILTER_SUPPRESSED);
+		return false;
+	}
+	r->sent = 1;
+	r->numeric = numeric;
+	r->value = value;
+	r->aged = 0;
+	r->at_us = now;
+	r->passed++;
+	metrics_inc(METRIC_FILTER_PASSED);
+	return true;
+}
@@ -4,12 +4,18 @@
 #include "mem.h"
 #include "driver/uart.h"
 #include "user_utils.h"
+#include "dlog.h"
+#include "mem_track.h"
+#include "metrics.h"
 
 void ICACHE_FLASH_ATTR neurite_init(void);
 
 void ICACHE_FLASH_ATTR user_init(void)
 {
+	mem_track_init();
 	uart_init(BIT_RATE_115200, BIT_RATE_115200);
+	dlog_init();
+	metrics_init();
 	os_delay_us(100000);
 	system_init_done_cb(neurite_init);
 }
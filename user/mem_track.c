@@ -0,0 +1,318 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "user_utils.h"
+#include "mem_track.h"
+
+#define MEM_PAINT		0xA5A5A5A5
+#define MEM_PROBE_BLOCKS	16
+#define MEM_FREE_BUCKETS	16	/* log2 of the free block size */
+#define MEM_SITE_NONE		0xff
+
+static uint32_t stack_top;
+static uint32_t *stack_paint_end;
+static uint32_t stack_min_sp;
+
+static void ICACHE_FLASH_ATTR mem_stack_paint(void)
+{
+	uint32_t *p, ps = 0;
+
+	stack_top = mem_stack_pointer();
+	stack_min_sp = stack_top;
+	if (stack_top == 0)
+		return;
+	/* leave our own frame alone, nothing else may use the stack meanwhile */
+	p = (uint32_t *)((stack_top - 64) & ~3);
+	stack_paint_end = (uint32_t *)(stack_top - MEM_TRACK_STACK_PAINT);
+#ifdef __xtensa__
+	__asm__ __volatile__("rsil %0, 15" : "=a"(ps));
+#endif
+	while (--p >= stack_paint_end)
+		*p = MEM_PAINT;
+#ifdef __xtensa__
+	__asm__ __volatile__("wsr %0, ps; rsync" :: "a"(ps) : "memory");
+#endif
+	(void)ps;
+}
+
+/* deepest point the stack reached below the init stack pointer */
+static uint32_t ICACHE_FLASH_ATTR mem_stack_used(void)
+{
+	uint32_t *p = stack_paint_end;
+
+	if (p == NULL)
+		return 0;
+	while (p < (uint32_t *)stack_top && *p == MEM_PAINT)
+		p++;
+	return stack_top - (uint32_t)p;
+}
+
+void ICACHE_FLASH_ATTR mem_stack_probe(void)
+{
+	uint32_t sp = mem_stack_pointer();
+
+	if (sp < stack_min_sp)
+		stack_min_sp = sp;
+}
+
+/* largest block the heap hands out right now, by bisection */
+static uint32_t ICACHE_FLASH_ATTR mem_probe_largest(void)
+{
+	uint32_t lo = 0, hi = system_get_free_heap_size(), mid;
+	void *p;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		p = mem_raw_malloc(mid);
+		if (p) {
+			mem_raw_free(p);
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+#ifdef NEURITE_MEM_TRACK
+
+static uint8_t ICACHE_FLASH_ATTR mem_log2(uint32_t v)
+{
+	uint8_t b = 0;
+
+	while (v > 1 && b < MEM_FREE_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Free block sizes: take the largest block, hold on to it and repeat.
+ * Only the first MEM_PROBE_BLOCKS blocks are seen, which are the ones
+ * that matter for fragmentation.
+ */
+static uint32_t ICACHE_FLASH_ATTR mem_probe_free(uint16_t *buckets)
+{
+	void *held[MEM_PROBE_BLOCKS];
+	uint32_t largest = 0, size;
+	uint8_t n = 0, i;
+
+	while (n < MEM_PROBE_BLOCKS) {
+		size = mem_probe_largest();
+		if (size < 16)
+			break;
+		held[n] = mem_raw_malloc(size);
+		if (held[n] == NULL)
+			break;
+		if (n == 0)
+			largest = size;
+		buckets[mem_log2(size)]++;
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		mem_raw_free(held[i]);
+	return largest;
+}
+
+struct mem_block_s {
+	void *ptr;
+	uint16_t size;
+	uint8_t site;
+	uint32_t t_alloc;	/* ms */
+};
+
+struct mem_site_s {
+	const char *file;
+	uint16_t line;
+	uint16_t live;
+	uint32_t live_bytes;
+	uint32_t allocs;
+	uint32_t freed;
+	uint32_t life_ms;	/* sum over freed blocks */
+};
+
+static struct mem_block_s mem_blocks[MEM_TRACK_BLOCKS];
+static struct mem_site_s mem_sites[MEM_TRACK_SITES];
+static uint8_t mem_nsites;
+static uint32_t mem_untracked;
+
+static uint8_t ICACHE_FLASH_ATTR mem_site(const char *file, uint16_t line)
+{
+	uint8_t i;
+
+	for (i = 0; i < mem_nsites; i++)
+		if (mem_sites[i].line == line && mem_sites[i].file == file)
+			return i;
+	if (mem_nsites == MEM_TRACK_SITES)
+		return MEM_SITE_NONE;
+	mem_sites[i].file = file;
+	mem_sites[i].line = line;
+	mem_nsites++;
+	return i;
+}
+
+static struct mem_block_s * ICACHE_FLASH_ATTR mem_block(void *ptr)
+{
+	uint8_t i;
+
+	for (i = 0; i < MEM_TRACK_BLOCKS; i++)
+		if (mem_blocks[i].ptr == ptr)
+			return &mem_blocks[i];
+	return NULL;
+}
+
+static void ICACHE_FLASH_ATTR mem_track_add(void *ptr, size_t size, const char *file, uint16_t line)
+{
+	struct mem_block_s *b = mem_block(NULL);
+	struct mem_site_s *s;
+	uint8_t site = mem_site(file, line);
+
+	if (b == NULL || site == MEM_SITE_NONE) {
+		mem_untracked++;
+		return;
+	}
+	s = &mem_sites[site];
+	b->ptr = ptr;
+	b->size = size;
+	b->site = site;
+	b->t_alloc = system_get_time() / 1000;
+	s->live++;
+	s->live_bytes += size;
+	s->allocs++;
+}
+
+static void ICACHE_FLASH_ATTR mem_track_del(void *ptr)
+{
+	struct mem_block_s *b = mem_block(ptr);
+	struct mem_site_s *s;
+
+	if (b == NULL)
+		return;
+	s = &mem_sites[b->site];
+	s->live--;
+	s->live_bytes -= b->size;
+	s->freed++;
+	s->life_ms += system_get_time() / 1000 - b->t_alloc;
+	b->ptr = NULL;
+}
+
+void * ICACHE_FLASH_ATTR mem_track_malloc(size_t size, bool zero, const char *file, uint16_t line)
+{
+	void *p = zero ? mem_raw_zalloc(size) : mem_raw_malloc(size);
+
+	if (p)
+		mem_track_add(p, size, file, line);
+	return p;
+}
+
+void * ICACHE_FLASH_ATTR mem_track_realloc(void *ptr, size_t size, const char *file, uint16_t line)
+{
+	void *p = mem_raw_realloc(ptr, size);
+
+	if (p == NULL)
+		return NULL;
+	if (ptr)
+		mem_track_del(ptr);
+	mem_track_add(p, size, file, line);
+	return p;
+}
+
+void ICACHE_FLASH_ATTR mem_track_free(void *ptr)
+{
+	if (ptr)
+		mem_track_del(ptr);
+	mem_raw_free(ptr);
+}
+
+/* site with the most live bytes not reported yet */
+static struct mem_site_s * ICACHE_FLASH_ATTR mem_top_site(uint8_t *done)
+{
+	struct mem_site_s *top = NULL;
+	uint8_t i;
+
+	for (i = 0; i < mem_nsites; i++) {
+		if (done[i])
+			continue;
+		if (top == NULL || mem_sites[i].live_bytes > top->live_bytes)
+			top = &mem_sites[i];
+	}
+	if (top)
+		done[top - mem_sites] = 1;
+	return top;
+}
+
+#endif /* NEURITE_MEM_TRACK */
+
+void ICACHE_FLASH_ATTR mem_track_init(void)
+{
+	mem_stack_paint();
+}
+
+/*
+ * JSON report, e.g.
+ * {"heap":21400,"largest":9012,"stack":1240,"min_sp":"3fffee40",
+ *  "free":[0,...],"untracked":0,"sites":[["user/neurite.c:344",1,256,1,0],...]}
+ * a site is [where, live blocks, live bytes, allocations, avg lifetime ms].
+ * free and the rest are only there with tracking built in.
+ * Output is cut short rather than overrun.
+ */
+uint16_t ICACHE_FLASH_ATTR mem_track_report(char *buf, uint16_t size)
+{
+	char tmp[96];
+	uint16_t len = 0, n;
+	uint32_t heap, largest;
+	uint8_t i;
+#ifdef NEURITE_MEM_TRACK
+	uint16_t buckets[MEM_FREE_BUCKETS];
+	uint8_t done[MEM_TRACK_SITES];
+	struct mem_site_s *s;
+#endif
+
+#define MEM_APPEND(str) \
+	do { \
+		n = os_strlen(str); \
+		if (len + n + 2 > size) \
+			goto out; \
+		os_memcpy(buf + len, str, n); \
+		len += n; \
+	} while (0)
+
+	mem_stack_probe();
+	heap = system_get_free_heap_size();
+#ifdef NEURITE_MEM_TRACK
+	os_bzero(buckets, sizeof(buckets));
+	largest = mem_probe_free(buckets);
+#else
+	largest = mem_probe_largest();
+#endif
+
+	os_sprintf(tmp, "{\"heap\":%u,\"largest\":%u,\"stack\":%u,\"min_sp\":\"%08x\"",
+			heap, largest, mem_stack_used(), stack_min_sp);
+	MEM_APPEND(tmp);
+#ifdef NEURITE_MEM_TRACK
+	MEM_APPEND(",\"free\":[");
+	for (i = 0; i < MEM_FREE_BUCKETS; i++) {
+		os_sprintf(tmp, "%s%u", i ? "," : "", buckets[i]);
+		MEM_APPEND(tmp);
+	}
+	os_sprintf(tmp, "],\"untracked\":%u,\"sites\":[", mem_untracked);
+	MEM_APPEND(tmp);
+	os_bzero(done, sizeof(done));
+	for (i = 0; i < MEM_TRACK_TOP && (s = mem_top_site(done)) != NULL; i++) {
+		/* __FILE__ can outgrow tmp, append it on its own */
+		MEM_APPEND(i ? ",[\"" : "[\"");
+		MEM_APPEND(s->file);
+		os_sprintf(tmp, ":%d\",%u,%u,%u,%u]", s->line, s->live,
+				s->live_bytes, s->allocs,
+				s->freed ? s->life_ms / s->freed : 0);
+		MEM_APPEND(tmp);
+	}
+	MEM_APPEND("]");
+#endif
+out:
+	buf[len++] = '}';
+	buf[len] = 0;
+	return len;
+#undef MEM_APPEND
+}
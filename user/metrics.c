@@ -0,0 +1,188 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "user_utils.h"
+#include "metrics.h"
+#include "mem_track.h"
+#include "mqtt5.h"
+
+/*
+ * Holds either snapshot: all counters at 10 digits come to about 740 bytes,
+ * and go out with the topic in one MQTT_BUF_SIZE publish.
+ */
+#define METRICS_MSG_SIZE	768
+#define METRICS_SAMPLE_MS	1000
+
+uint32_t g_metrics[METRIC_NUM];
+static uint32_t g_hist[METRIC_HIST_NUM][METRICS_HIST_BUCKETS];
+
+static const char *METRIC_NAMES[METRIC_NUM] = {
+	"uart_rx",
+	"uart_tx",
+	"rb_drops",
+	"frames",
+	"crc_err",
+	"mqtt_pub",
+	"mqtt_pub_fail",
+	"mqtt_ack",
+	"mqtt_recv",
+	"rest_req",
+	"rest_resp",
+	"wifi_connect",
+	"heap_free",
+	"heap_low",
+	"uptime",
+	"dlog_drops",
+	"bad_frame",
+	"tx_frags",
+	"tx_spills",
+	"mqtt_queue",
+	"mqtt_queue_peak",
+	"mqtt_queue_high",
+	"mqtt_resubscribe",
+	"mqtt_session_kept",
+	"mqtt_alias_saved",
+	"mqtt_inflight_wait",
+	"filter_passed",
+	"filter_suppressed",
+	"agg_samples",
+	"agg_windows"
+};
+
+static const char *METRIC_HIST_NAMES[METRIC_HIST_NUM] = {
+	"cmd_exec_us",
+	"rest_rtt_ms",
+	"wifi_ip_ms"
+};
+
+struct metrics_pub_s {
+	MQTT_Client *client;
+	char topic[64];
+	os_timer_t timer;
+};
+
+static struct metrics_pub_s g_mp;
+static os_timer_t g_sample_timer;
+
+void ICACHE_FLASH_ATTR metrics_hist_add(enum metrics_hist_e hid, uint32_t value)
+{
+	uint8_t b = 0;
+
+	while (value > 1 && b < METRICS_HIST_BUCKETS - 1) {
+		value >>= 1;
+		b++;
+	}
+	g_hist[hid][b]++;
+}
+
+const uint32_t * ICACHE_FLASH_ATTR metrics_hist(void)
+{
+	return &g_hist[0][0];
+}
+
+/* refresh the gauges, called before metrics are reported */
+void ICACHE_FLASH_ATTR metrics_sample(void)
+{
+	uint32_t heap = system_get_free_heap_size();
+
+	g_metrics[METRIC_HEAP_FREE] = heap;
+	if (g_metrics[METRIC_HEAP_LOW] == 0 || heap < g_metrics[METRIC_HEAP_LOW])
+		g_metrics[METRIC_HEAP_LOW] = heap;
+	g_metrics[METRIC_UPTIME_S] = system_get_time() / 1000000;
+}
+
+/* heap_low is the lowest heap seen every METRICS_SAMPLE_MS, not only at report time */
+void ICACHE_FLASH_ATTR metrics_init(void)
+{
+	os_timer_disarm(&g_sample_timer);
+	os_timer_setfn(&g_sample_timer, (os_timer_func_t *)metrics_sample, NULL);
+	os_timer_arm(&g_sample_timer, METRICS_SAMPLE_MS, 1);
+	metrics_sample();
+}
+
+/*
+ * Entries go into buf whole or not at all, and room for the closing
+ * "]}" and NUL is kept, so a cut short snapshot is still valid JSON.
+ * An entry is the name and up to 10 digits plus 6 bytes of punctuation.
+ */
+#define METRICS_ENTRY_MAX(name)	(os_strlen(name) + 16)
+#define METRICS_ROOM(need)	(len + (need) + 3 <= size)
+
+/*
+ * JSON snapshot of the counters and gauges, e.g. {"uart_rx":12,...}.
+ * Returns the length written, output is cut short rather than overrun.
+ */
+uint16_t ICACHE_FLASH_ATTR metrics_format(char *buf, uint16_t size)
+{
+	uint16_t len = 0;
+	uint8_t i;
+
+	if (size < 3)
+		return 0;
+	metrics_sample();
+	buf[len++] = '{';
+	for (i = 0; i < METRIC_NUM && METRICS_ROOM(METRICS_ENTRY_MAX(METRIC_NAMES[i])); i++)
+		len += os_sprintf(buf + len, "%s\"%s\":%u", i ? "," : "", METRIC_NAMES[i], g_metrics[i]);
+	buf[len++] = '}';
+	buf[len] = 0;
+	return len;
+}
+
+/* the histograms, e.g. {"cmd_exec_us":[0,3,...],...}, cut short like metrics_format */
+uint16_t ICACHE_FLASH_ATTR metrics_format_hist(char *buf, uint16_t size)
+{
+	uint16_t len = 0;
+	uint8_t i, j;
+
+	if (size < 3)
+		return 0;
+	buf[len++] = '{';
+	for (i = 0; i < METRIC_HIST_NUM && METRICS_ROOM(METRICS_ENTRY_MAX(METRIC_HIST_NAMES[i])); i++) {
+		len += os_sprintf(buf + len, "%s\"%s\":[", i ? "," : "", METRIC_HIST_NAMES[i]);
+		for (j = 0; j < METRICS_HIST_BUCKETS && METRICS_ROOM(11); j++)
+			len += os_sprintf(buf + len, "%s%u", j ? "," : "", g_hist[i][j]);
+		buf[len++] = ']';
+	}
+	buf[len++] = '}';
+	buf[len] = 0;
+	return len;
+}
+
+static void ICACHE_FLASH_ATTR metrics_publish(void *arg)
+{
+	struct metrics_pub_s *mp = (struct metrics_pub_s *)arg;
+	static char msg[METRICS_MSG_SIZE];
+	char topic[sizeof(mp->topic) + 5];
+	uint16_t len;
+
+	dbg_assert(mp);
+	if (mp->client == NULL)
+		return;
+	MEM_STACK_PROBE();
+	len = metrics_format(msg, sizeof(msg));
+	mqtt5_publish(mp->client, mp->topic, msg, len, 0, 0);
+	os_sprintf(topic, "%s/hist", mp->topic);
+	len = metrics_format_hist(msg, sizeof(msg));
+	mqtt5_publish(mp->client, topic, msg, len, 0, 0);
+#ifdef NEURITE_MEM_TRACK
+	os_sprintf(topic, "%s/mem", mp->topic);
+	len = mem_track_report(msg, sizeof(msg));
+	mqtt5_publish(mp->client, topic, msg, len, 0, 0);
+#endif
+}
+
+/* interval_s == 0 stops publishing */
+void ICACHE_FLASH_ATTR metrics_publish_start(MQTT_Client *client, const char *topic, uint32_t interval_s)
+{
+	os_timer_disarm(&g_mp.timer);
+	g_mp.client = NULL;
+	if (client == NULL || topic == NULL || interval_s == 0)
+		return;
+
+	g_mp.client = client;
+	os_strncpy(g_mp.topic, topic, sizeof(g_mp.topic) - 1);
+	g_mp.topic[sizeof(g_mp.topic) - 1] = 0;
+	os_timer_setfn(&g_mp.timer, (os_timer_func_t *)metrics_publish, &g_mp);
+	os_timer_arm(&g_mp.timer, interval_s * 1000, 1);
+	log_info("publishing to %s every %ds\n", g_mp.topic, interval_s);
+}
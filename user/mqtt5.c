@@ -0,0 +1,821 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+#include "espconn.h"
+#include "mqtt.h"
+#include "queue.h"
+#include "utils.h"
+#include "user_utils.h"
+#include "user_config.h"
+#include "metrics.h"
+#include "mqtt5.h"
+
+#define MQTT5_LEVEL		5
+#define MQTT5_HEAD		5	/* room for a fixed header in front of a packet */
+
+/* the properties looked at, see props_read() */
+#define PROP_RECEIVE_MAX	0x21
+#define PROP_ALIAS_MAX		0x22
+#define PROP_ALIAS		0x23
+#define PROP_PACKET_MAX		0x27
+
+struct props_s {
+	uint16_t recv_max;
+	uint16_t alias_max;
+	uint16_t alias;
+	uint32_t packet_max;
+};
+
+static struct mqtt5_s *g_mqtt5;
+
+static void mqtt5_pump(MQTT_Client *client, struct mqtt5_s *m);
+
+/* variable byte integer at p, returns its size or 0 if malformed */
+static uint32_t ICACHE_FLASH_ATTR varint_get(const uint8_t *p, uint32_t left, uint32_t *value)
+{
+	uint32_t i, mul = 1;
+
+	*value = 0;
+	for (i = 0; i < left && i < 4; i++, mul *= 128) {
+		*value += (p[i] & 0x7F) * mul;
+		if (!(p[i] & 0x80))
+			return i + 1;
+	}
+	return 0;
+}
+
+static uint16_t ICACHE_FLASH_ATTR varint_put(uint8_t *p, uint32_t value)
+{
+	uint16_t n = 0;
+
+	do {
+		p[n] = value % 128;
+		value /= 128;
+		if (value)
+			p[n] |= 0x80;
+		n++;
+	} while (value);
+	return n;
+}
+
+static uint16_t ICACHE_FLASH_ATTR str_put(uint8_t *p, const char *s)
+{
+	uint16_t len = s ? os_strlen(s) : 0;
+
+	p[0] = len >> 8;
+	p[1] = len;
+	os_memcpy(p + 2, s, len);
+	return 2 + len;
+}
+
+/* size of a property value at p, 0 for an id MQTT 5 does not have */
+static uint32_t ICACHE_FLASH_ATTR prop_len(uint8_t id, const uint8_t *p, uint32_t left)
+{
+	uint32_t n, v;
+
+	switch (id) {
+	case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+		return 1;
+	case 0x13: case 0x21: case 0x22: case 0x23:
+		return 2;
+	case 0x02: case 0x11: case 0x18: case 0x27:
+		return 4;
+	case 0x0B:	/* subscription identifier */
+		return varint_get(p, left, &v);
+	case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+	case 0x16: case 0x1A: case 0x1C: case 0x1F:
+		return left < 2 ? 0 : 2 + (p[0] << 8 | p[1]);
+	case 0x26:	/* user property, a string pair */
+		if (left < 2)
+			return 0;
+		n = 2 + (p[0] << 8 | p[1]);
+		return left < n + 2 ? 0 : n + 2 + (p[n] << 8 | p[n + 1]);
+	}
+	return 0;
+}
+
+/* the property block at p into pr, returns its size with the length, 0 if malformed */
+static uint32_t ICACHE_FLASH_ATTR props_read(const uint8_t *p, uint32_t left, struct props_s *pr)
+{
+	uint32_t len, n, at, vl;
+	uint8_t id;
+
+	os_memset(pr, 0, sizeof(*pr));
+	n = varint_get(p, left, &len);
+	if (n == 0 || n + len > left)
+		return 0;
+	for (at = n; at < n + len; at += vl) {
+		id = p[at++];
+		vl = prop_len(id, p + at, n + len - at);
+		if (vl == 0 || at + vl > n + len)
+			return 0;
+		if (id == PROP_RECEIVE_MAX)
+			pr->recv_max = p[at] << 8 | p[at + 1];
+		else if (id == PROP_ALIAS_MAX)
+			pr->alias_max = p[at] << 8 | p[at + 1];
+		else if (id == PROP_ALIAS)
+			pr->alias = p[at] << 8 | p[at + 1];
+		else if (id == PROP_PACKET_MAX)
+			pr->packet_max = (uint32_t)p[at] << 24 | p[at + 1] << 16 | p[at + 2] << 8 | p[at + 3];
+	}
+	return n + len;
+}
+
+/*
+ * The fixed header in front of the body that starts MQTT5_HEAD bytes into
+ * buf, returns where the packet starts.
+ */
+static uint8_t *ICACHE_FLASH_ATTR head_put(uint8_t *buf, uint8_t first, uint32_t body)
+{
+	uint8_t len[4];
+	uint16_t n = varint_put(len, body);
+	uint8_t *p = buf + MQTT5_HEAD - 1 - n;
+
+	p[0] = first;
+	os_memcpy(p + 1, len, n);
+	return p;
+}
+
+struct mqtt5_s *ICACHE_FLASH_ATTR mqtt5_get(MQTT_Client *client)
+{
+	struct mqtt5_s *m;
+
+	for (m = g_mqtt5; m; m = m->next)
+		if (m->client == client)
+			return m;
+	return NULL;
+}
+
+uint8_t ICACHE_FLASH_ATTR mqtt5_reason(MQTT_Client *client)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	return m ? m->reason : 0;
+}
+
+/*
+ * From connectedCb, with the CONNACK still at the start of in_buffer. A
+ * 3.1 CONNACK has no session present flag, so without PROTOCOL_NAMEv311
+ * a client the library runs never has one.
+ */
+BOOL ICACHE_FLASH_ATTR mqtt5_session_present(MQTT_Client *client)
+{
+	uint8_t *in = client->mqtt_state.in_buffer;
+	uint32_t rl, at;
+
+#ifndef PROTOCOL_NAMEv311
+	if (mqtt5_get(client) == NULL)
+		return FALSE;
+#endif
+	if (in[0] >> 4 != MQTT_MSG_TYPE_CONNACK)
+		return FALSE;
+	at = 1 + varint_get(in + 1, 4, &rl);
+	return at > 1 && rl >= 1 && (in[at] & 1);
+}
+
+static uint16_t ICACHE_FLASH_ATTR mqtt5_next_id(MQTT_Client *client)
+{
+	uint16_t id = ++client->mqtt_state.mqtt_connection.message_id;
+
+	if (id == 0)
+		id = ++client->mqtt_state.mqtt_connection.message_id;
+	return id;
+}
+
+static BOOL ICACHE_FLASH_ATTR mqtt5_queue(MQTT_Client *client, uint8_t *p, uint16_t len)
+{
+	if (QUEUE_Puts(&client->msgQueue, p, len) == -1) {
+		log_warn("queue full\n");
+		return FALSE;
+	}
+	mqtt5_pump(client, mqtt5_get(client));
+	return TRUE;
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_send_raw(MQTT_Client *client, struct mqtt5_s *m, uint8_t *p, uint16_t len)
+{
+	m->sending = 1;
+	m->sent_type = p[0];
+	/* the keepalive counts from what we sent last */
+	client->keepAliveTick = 0;
+	if (client->security)
+		espconn_secure_sent(client->pCon, p, len);
+	else
+		espconn_sent(client->pCon, p, len);
+}
+
+/* aliases only last for their connection */
+static void ICACHE_FLASH_ATTR mqtt5_aliases_free(struct mqtt5_s *m)
+{
+	uint16_t i;
+
+	for (i = 0; i < MQTT5_ALIASES; i++) {
+		if (m->tx_alias[i])
+			os_free(m->tx_alias[i]);
+		if (m->rx_alias[i])
+			os_free(m->rx_alias[i]);
+		m->tx_alias[i] = NULL;
+		m->rx_alias[i] = NULL;
+	}
+}
+
+/*
+ * A queued PUBLISH (no properties) in out_buffer on its way out gets its
+ * topic alias: the alias alone once the topic has one on this connection,
+ * topic and a new alias while the broker takes more. Returns the length.
+ */
+static uint16_t ICACHE_FLASH_ATTR mqtt5_alias(MQTT_Client *client, struct mqtt5_s *m, uint16_t len)
+{
+	uint8_t *buf = client->mqtt_state.out_buffer, id[2], vl[4];
+	uint32_t rl;
+	uint16_t hl, tl, idlen, pay, plen, keep, nvl, nhl, npay, alias, i, p;
+
+	hl = 1 + varint_get(buf + 1, len - 1, &rl);
+	tl = buf[hl] << 8 | buf[hl + 1];
+	idlen = (buf[0] & 0x06) ? 2 : 0;
+	pay = hl + 2 + tl + idlen;
+	/* a topic no longer than the alias property saves nothing */
+	if (tl <= MQTT5_PUB_PROPS - 1 || pay >= len || buf[pay] != 0)
+		return len;
+	pay++;
+	plen = len - pay;
+
+	for (i = 0; i < m->alias_max && i < MQTT5_ALIASES && m->tx_alias[i]; i++)
+		if (os_strlen(m->tx_alias[i]) == tl && os_memcmp(m->tx_alias[i], buf + hl + 2, tl) == 0)
+			break;
+	if (i == m->alias_max || i == MQTT5_ALIASES)
+		return len;
+	alias = i + 1;
+	keep = m->tx_alias[i] ? 0 : tl;
+	nvl = varint_put(vl, 2 + keep + idlen + MQTT5_PUB_PROPS + plen);
+	nhl = 1 + nvl;
+	npay = nhl + 2 + keep + idlen + MQTT5_PUB_PROPS;
+	if (npay + plen > client->mqtt_state.out_buffer_length)
+		return len;
+	if (keep) {
+		m->tx_alias[i] = (char *)os_malloc(tl + 1);
+		if (m->tx_alias[i] == NULL)
+			return len;
+		os_memcpy(m->tx_alias[i], buf + hl + 2, tl);
+		m->tx_alias[i][tl] = 0;
+	}
+	if (idlen)
+		os_memcpy(id, buf + hl + 2 + tl, 2);
+	/* payload first, the topic sits in front of where it goes */
+	os_memmove(buf + npay, buf + pay, plen);
+	if (keep)
+		os_memmove(buf + nhl + 2, buf + hl + 2, keep);
+	os_memcpy(buf + 1, vl, nvl);
+	buf[nhl] = keep >> 8;
+	buf[nhl + 1] = keep;
+	p = nhl + 2 + keep;
+	if (idlen) {
+		buf[p++] = id[0];
+		buf[p++] = id[1];
+	}
+	buf[p++] = 3;
+	buf[p++] = PROP_ALIAS;
+	buf[p++] = alias >> 8;
+	buf[p++] = alias;
+	if (keep == 0)
+		metrics_add(METRIC_MQTT_ALIAS_SAVED, tl - (MQTT5_PUB_PROPS - 1));
+	return npay + plen;
+}
+
+/*
+ * Sends the pending acks and pings, else the next queued packet, unless
+ * one is with espconn. A QoS 1/2 publish waits in out_buffer while the
+ * broker's Receive Maximum of them is unacknowledged.
+ */
+static void ICACHE_FLASH_ATTR mqtt5_pump(MQTT_Client *client, struct mqtt5_s *m)
+{
+	uint8_t *out = client->mqtt_state.out_buffer;
+	uint16_t len;
+
+	while (!m->sending && client->connState == MQTT_DATA) {
+		if (m->ctrl_len) {
+			m->ctrl_out = m->ctrl_len;
+			mqtt5_send_raw(client, m, m->ctrl, m->ctrl_len);
+			return;
+		}
+		if (m->held == 0) {
+			if (QUEUE_Gets(&client->msgQueue, out, &len, client->mqtt_state.out_buffer_length) != 0)
+				return;
+			m->held = len;
+			if ((out[0] >> 4) == MQTT_MSG_TYPE_PUBLISH && (out[0] & 0x06) && m->inflight >= m->recv_max)
+				metrics_inc(METRIC_MQTT_INFLIGHT_WAIT);
+		}
+		if ((out[0] >> 4) == MQTT_MSG_TYPE_PUBLISH) {
+			if ((out[0] & 0x06) && m->inflight >= m->recv_max)
+				return;
+			/* before the alias goes in, which may take its property */
+			if (m->held + MQTT5_PUB_PROPS > m->packet_max) {
+				log_warn("%d byte publish over the broker's maximum, dropped\n", m->held);
+				m->held = 0;
+				metrics_inc(METRIC_MQTT_PUB_FAIL);
+				m->reason = MQTT5_RC_PACKET_TOO_LARGE;
+				if (client->publishedCb)
+					client->publishedCb((uint32_t *)client);
+				continue;
+			}
+			m->held = mqtt5_alias(client, m, m->held);
+			if (out[0] & 0x06)
+				m->inflight++;
+		}
+		len = m->held;
+		m->held = 0;
+		mqtt5_send_raw(client, m, out, len);
+	}
+}
+
+void ICACHE_FLASH_ATTR mqtt5_kick(MQTT_Client *client)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	if (m)
+		mqtt5_pump(client, m);
+	else
+		system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+}
+
+/* an ack or ping, ahead of the queue; it goes in the queue when ctrl is full */
+static void ICACHE_FLASH_ATTR mqtt5_ctrl(MQTT_Client *client, uint8_t *p, uint16_t len)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	if (m->ctrl_len + len > MQTT5_CTRL_BUF) {
+		mqtt5_queue(client, p, len);
+		return;
+	}
+	os_memcpy(m->ctrl + m->ctrl_len, p, len);
+	m->ctrl_len += len;
+	mqtt5_pump(client, m);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_ack(MQTT_Client *client, uint8_t type, uint16_t id)
+{
+	uint8_t ack[4];
+
+	ack[0] = type << 4 | (type == MQTT_MSG_TYPE_PUBREL ? 2 : 0);
+	ack[1] = 2;
+	ack[2] = id >> 8;
+	ack[3] = id;
+	mqtt5_ctrl(client, ack, 4);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_published(MQTT_Client *client, struct mqtt5_s *m, uint8_t reason)
+{
+	if (m->inflight)
+		m->inflight--;
+	m->reason = reason;
+	if (reason >= 0x80)
+		log_warn("publish refused, reason 0x%02x\n", reason);
+	if (client->publishedCb)
+		client->publishedCb((uint32_t *)client);
+}
+
+/* one whole packet at the start of in_buffer */
+static void ICACHE_FLASH_ATTR mqtt5_handle(MQTT_Client *client, struct mqtt5_s *m, uint8_t *p, uint16_t len)
+{
+	uint8_t type = p[0] >> 4, qos = (p[0] >> 1) & 3, reason;
+	uint32_t rl, at, n;
+	uint16_t id = 0, tl;
+	const char *topic;
+	char **slot;
+	struct props_s pr;
+
+	at = 1 + varint_get(p + 1, len - 1, &rl);
+	if (type != MQTT_MSG_TYPE_PUBLISH && rl >= 2)
+		id = p[at] << 8 | p[at + 1];
+	switch (type) {
+	case MQTT_MSG_TYPE_CONNACK:
+		/* a 3.1 broker refuses the protocol level without properties */
+		os_memset(&pr, 0, sizeof(pr));
+		if (rl < 2 || (rl > 2 && props_read(p + at + 2, len - at - 2, &pr) == 0))
+			break;
+		m->reason = p[at + 1];
+		if (m->reason != MQTT5_RC_SUCCESS) {
+			log_warn("connect refused, reason 0x%02x\n", m->reason);
+			m->disc_reason = m->reason;
+			if (client->security)
+				espconn_secure_disconnect(client->pCon);
+			else
+				espconn_disconnect(client->pCon);
+			break;
+		}
+		m->recv_max = pr.recv_max ? pr.recv_max : 0xFFFF;
+		m->alias_max = pr.alias_max;
+		m->packet_max = pr.packet_max ? pr.packet_max : 0xFFFFFFFF;
+		log_info("connected, receive max %d, aliases %d, packet max %u\n",
+			 m->recv_max, m->alias_max, m->packet_max);
+		client->connState = MQTT_DATA;
+		/* the CONNACK stays at the start of in_buffer while this runs */
+		if (client->connectedCb)
+			client->connectedCb((uint32_t *)client);
+		break;
+	case MQTT_MSG_TYPE_PUBLISH:
+		tl = p[at] << 8 | p[at + 1];
+		topic = (const char *)p + at + 2;
+		at += 2 + tl;
+		if (qos) {
+			id = p[at] << 8 | p[at + 1];
+			at += 2;
+		}
+		n = at < len ? props_read(p + at, len - at, &pr) : 0;
+		if (n == 0)
+			break;
+		at += n;
+		if (pr.alias) {
+			if (pr.alias > MQTT5_ALIASES)
+				break;
+			slot = &m->rx_alias[pr.alias - 1];
+			if (tl) {
+				if (*slot)
+					os_free(*slot);
+				*slot = (char *)os_malloc(tl + 1);
+				if (*slot) {
+					os_memcpy(*slot, topic, tl);
+					(*slot)[tl] = 0;
+				}
+			} else if (*slot) {
+				topic = *slot;
+				tl = os_strlen(*slot);
+			} else {
+				log_warn("unknown topic alias %d\n", pr.alias);
+				break;
+			}
+		}
+		if (qos == 1)
+			mqtt5_ack(client, MQTT_MSG_TYPE_PUBACK, id);
+		else if (qos == 2)
+			mqtt5_ack(client, MQTT_MSG_TYPE_PUBREC, id);
+		if (client->dataCb)
+			client->dataCb((uint32_t *)client, topic, tl, (const char *)p + at, len - at);
+		break;
+	case MQTT_MSG_TYPE_PUBACK:
+	case MQTT_MSG_TYPE_PUBCOMP:
+		mqtt5_published(client, m, rl > 2 ? p[at + 2] : MQTT5_RC_SUCCESS);
+		break;
+	case MQTT_MSG_TYPE_PUBREC:
+		reason = rl > 2 ? p[at + 2] : MQTT5_RC_SUCCESS;
+		if (reason >= 0x80)
+			mqtt5_published(client, m, reason);
+		else
+			mqtt5_ack(client, MQTT_MSG_TYPE_PUBREL, id);
+		break;
+	case MQTT_MSG_TYPE_PUBREL:
+		mqtt5_ack(client, MQTT_MSG_TYPE_PUBCOMP, id);
+		break;
+	case MQTT_MSG_TYPE_SUBACK:
+	case MQTT_MSG_TYPE_UNSUBACK:
+		n = rl > 2 ? props_read(p + at + 2, len - at - 2, &pr) : 0;
+		if (n && m->ack_cb)
+			m->ack_cb(client, type, id, p + at + 2 + n, len - at - 2 - n);
+		break;
+	case MQTT_MSG_TYPE_DISCONNECT:
+		/* the broker closes the connection after it */
+		m->disc_reason = rl ? p[at] : MQTT5_RC_SUCCESS;
+		log_warn("broker disconnect, reason 0x%02x\n", m->disc_reason);
+		break;
+	default:
+		break;
+	}
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_recv_cb(void *arg, char *pdata, unsigned short len)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+	struct mqtt5_s *m = mqtt5_get(client);
+	uint8_t *in = client->mqtt_state.in_buffer;
+	uint32_t have = client->mqtt_state.message_length_read, size = client->mqtt_state.in_buffer_length, rl, n;
+
+	/* a segment of up to an MSS may end in the middle of a packet, or hold several */
+	while (len) {
+		if (m->rx_skip) {
+			n = m->rx_skip < len ? m->rx_skip : len;
+			m->rx_skip -= n;
+			pdata += n;
+			len -= n;
+			continue;
+		}
+		n = size - have < len ? size - have : len;
+		os_memcpy(in + have, pdata, n);
+		have += n;
+		pdata += n;
+		len -= n;
+		while (have >= 2) {
+			n = varint_get(in + 1, have - 1, &rl);
+			if (n == 0 || have < 1 + n + rl)
+				break;
+			mqtt5_handle(client, m, in, 1 + n + rl);
+			os_memmove(in, in + 1 + n + rl, have - 1 - n - rl);
+			have -= 1 + n + rl;
+		}
+		if (have < size)
+			continue;
+		/* the broker was told in_buffer_length, a bigger packet is dropped whole */
+		n = varint_get(in + 1, have - 1, &rl);
+		if (n == 0) {
+			log_err("malformed packet\n");
+			have = 0;
+			if (client->security)
+				espconn_secure_disconnect(client->pCon);
+			else
+				espconn_disconnect(client->pCon);
+			break;
+		}
+		log_err("rx overflow, %u byte packet dropped\n", 1 + n + rl);
+		m->rx_skip = 1 + n + rl - have;
+		have = 0;
+	}
+	client->mqtt_state.message_length_read = have;
+	mqtt5_pump(client, m);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_sent_cb(void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	m->sending = 0;
+	if (m->ctrl_out) {
+		/* more may have come in behind them meanwhile */
+		os_memmove(m->ctrl, m->ctrl + m->ctrl_out, m->ctrl_len - m->ctrl_out);
+		m->ctrl_len -= m->ctrl_out;
+		m->ctrl_out = 0;
+	} else if ((m->sent_type >> 4) == MQTT_MSG_TYPE_PUBLISH && !(m->sent_type & 0x06)) {
+		/* QoS 0 is done once out, the others on their ack */
+		m->reason = MQTT5_RC_SUCCESS;
+		if (client->publishedCb)
+			client->publishedCb((uint32_t *)client);
+	}
+	mqtt5_pump(client, m);
+}
+
+/* the connection is gone; what is queued waits for the next one */
+static void ICACHE_FLASH_ATTR mqtt5_reset(MQTT_Client *client, struct mqtt5_s *m)
+{
+	client->connState = TCP_RECONNECT_REQ;
+	/* the CONNECT goes out of out_buffer, a held publish back in the queue, behind what came since */
+	if (m->held && QUEUE_Puts(&client->msgQueue, client->mqtt_state.out_buffer, m->held) == -1) {
+		log_warn("queue full, held publish dropped\n");
+		metrics_inc(METRIC_MQTT_PUB_FAIL);
+	}
+	m->held = 0;
+	/* acks and pings of the old connection, and the rest of a packet on it */
+	m->ctrl_len = 0;
+	m->ctrl_out = 0;
+	m->rx_skip = 0;
+	m->sending = 0;
+	m->inflight = 0;
+	mqtt5_aliases_free(m);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_discon_cb(void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	log_info("disconnected\n");
+	mqtt5_reset(client, m);
+	m->reason = m->disc_reason;
+	m->disc_reason = MQTT5_RC_SUCCESS;
+	if (client->disconnectedCb)
+		client->disconnectedCb((uint32_t *)client);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_recon_cb(void *arg, sint8 err)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+
+	log_info("reconnect, err %d\n", err);
+	mqtt5_reset(client, mqtt5_get(client));
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_connect_cb(void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+	struct mqtt5_s *m = mqtt5_get(client);
+	mqtt_connect_info_t *ci = &client->connect_info;
+	uint8_t *buf = client->mqtt_state.out_buffer, *b = buf + MQTT5_HEAD, *p, flags = 0;
+	uint16_t n;
+
+	espconn_regist_disconcb(pCon, mqtt5_discon_cb);
+	espconn_regist_recvcb(pCon, mqtt5_recv_cb);
+	espconn_regist_sentcb(pCon, mqtt5_sent_cb);
+
+	if (ci->clean_session)
+		flags |= 0x02;
+	if (ci->will_topic && ci->will_topic[0])
+		flags |= 0x04 | (ci->will_qos & 3) << 3 | (ci->will_retain ? 0x20 : 0);
+	if (ci->username && ci->username[0])
+		flags |= 0x80;
+	if (ci->password && ci->password[0])
+		flags |= 0x40;
+	n = str_put(b, "MQTT");
+	b[n++] = MQTT5_LEVEL;
+	b[n++] = flags;
+	b[n++] = ci->keepalive >> 8;
+	b[n++] = ci->keepalive;
+	/* what we take: Receive Maximum, Maximum Packet Size, Topic Alias Maximum */
+	b[n++] = 3 + 5 + 3;
+	b[n++] = PROP_RECEIVE_MAX;
+	b[n++] = MQTT5_RECEIVE_MAX >> 8;
+	b[n++] = MQTT5_RECEIVE_MAX & 0xFF;
+	b[n++] = PROP_PACKET_MAX;
+	b[n++] = client->mqtt_state.in_buffer_length >> 24;
+	b[n++] = client->mqtt_state.in_buffer_length >> 16;
+	b[n++] = client->mqtt_state.in_buffer_length >> 8;
+	b[n++] = client->mqtt_state.in_buffer_length & 0xFF;
+	b[n++] = PROP_ALIAS_MAX;
+	b[n++] = MQTT5_ALIASES >> 8;
+	b[n++] = MQTT5_ALIASES & 0xFF;
+	n += str_put(b + n, ci->client_id);
+	if (flags & 0x04) {
+		b[n++] = 0;	/* will properties */
+		n += str_put(b + n, ci->will_topic);
+		n += str_put(b + n, ci->will_message);
+	}
+	if (flags & 0x80)
+		n += str_put(b + n, ci->username);
+	if (flags & 0x40)
+		n += str_put(b + n, ci->password);
+
+	p = head_put(buf, MQTT_MSG_TYPE_CONNECT << 4, n);
+	client->connState = MQTT_CONNECT_SENDING;
+	client->mqtt_state.message_length_read = 0;
+	m->disc_reason = MQTT5_RC_SUCCESS;
+	mqtt5_send_raw(client, m, p, b + n - p);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_dns_found(const char *name, ip_addr_t *ip, void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+
+	if (ip == NULL) {
+		log_err("DNS failed for %s\n", name);
+		client->connState = TCP_RECONNECT_REQ;
+		return;
+	}
+	os_memcpy(pCon->proto.tcp->remote_ip, &ip->addr, 4);
+	if (client->security)
+		espconn_secure_connect(pCon);
+	else
+		espconn_connect(pCon);
+}
+
+static void ICACHE_FLASH_ATTR mqtt5_timer(void *arg)
+{
+	MQTT_Client *client = (MQTT_Client *)arg;
+	uint8_t ping[2] = { MQTT_MSG_TYPE_PINGREQ << 4, 0 };
+
+	if (client->connState == MQTT_DATA) {
+		if (++client->keepAliveTick > client->connect_info.keepalive / 2) {
+			client->keepAliveTick = 0;
+			mqtt5_ctrl(client, ping, 2);
+		}
+	} else if (client->connState == TCP_RECONNECT_REQ) {
+		if (++client->reconnectTick > MQTT_RECONNECT_TIMEOUT)
+			mqtt5_connect(client);
+	}
+}
+
+/* switches client to MQTT 5, before it connects; 0 on success */
+int ICACHE_FLASH_ATTR mqtt5_init(MQTT_Client *client, mqtt5_ack_cb ack_cb)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	if (m == NULL) {
+		m = (struct mqtt5_s *)os_zalloc(sizeof(struct mqtt5_s));
+		if (m == NULL)
+			return -1;
+		m->client = client;
+		m->next = g_mqtt5;
+		g_mqtt5 = m;
+	}
+	m->ack_cb = ack_cb;
+	return 0;
+}
+
+void ICACHE_FLASH_ATTR mqtt5_connect(MQTT_Client *client)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+
+	if (m == NULL) {
+		MQTT_Connect(client);
+		return;
+	}
+	if (client->pCon) {
+		espconn_delete(client->pCon);
+		os_free(client->pCon->proto.tcp);
+		os_free(client->pCon);
+	}
+	mqtt5_reset(client, m);
+	client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
+	client->pCon->type = ESPCONN_TCP;
+	client->pCon->state = ESPCONN_NONE;
+	client->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
+	client->pCon->proto.tcp->local_port = espconn_port();
+	client->pCon->proto.tcp->remote_port = client->port;
+	client->pCon->reverse = client;
+	espconn_regist_connectcb(client->pCon, mqtt5_connect_cb);
+	espconn_regist_reconcb(client->pCon, mqtt5_recon_cb);
+
+	client->keepAliveTick = 0;
+	client->reconnectTick = 0;
+	os_timer_disarm(&client->mqttTimer);
+	os_timer_setfn(&client->mqttTimer, (os_timer_func_t *)mqtt5_timer, client);
+	os_timer_arm(&client->mqttTimer, 1000, 1);
+
+	client->connState = TCP_CONNECTING;
+	if (UTILS_StrToIP(client->host, &client->pCon->proto.tcp->remote_ip)) {
+		if (client->security)
+			espconn_secure_connect(client->pCon);
+		else
+			espconn_connect(client->pCon);
+	} else {
+		espconn_gethostbyname(client->pCon, (const char *)client->host, &client->ip, mqtt5_dns_found);
+	}
+}
+
+void ICACHE_FLASH_ATTR mqtt5_disconnect(MQTT_Client *client)
+{
+	if (mqtt5_get(client) == NULL) {
+		MQTT_Disconnect(client);
+		return;
+	}
+	os_timer_disarm(&client->mqttTimer);
+	if (client->pCon == NULL)
+		return;
+	if (client->security)
+		espconn_secure_disconnect(client->pCon);
+	else
+		espconn_disconnect(client->pCon);
+}
+
+BOOL ICACHE_FLASH_ATTR mqtt5_publish(MQTT_Client *client, const char *topic, const char *data, int data_len, int qos, int retain)
+{
+	struct mqtt5_s *m = mqtt5_get(client);
+	uint16_t tl = os_strlen(topic), id, n;
+	uint32_t body;
+	uint8_t *buf, *p;
+	BOOL ok;
+
+	if (m == NULL)
+		return MQTT_Publish(client, topic, data, data_len, qos, retain);
+	if (qos > 2)
+		qos = 2;
+	body = 2 + tl + (qos ? 2 : 0) + 1 + data_len;
+	/* room for the alias property, and what the broker takes if we know it */
+	if (body + MQTT5_HEAD + MQTT5_PUB_PROPS - 1 > client->mqtt_state.out_buffer_length ||
+	    (client->connState == MQTT_DATA && body + 1 + MQTT5_PUB_PROPS > m->packet_max)) {
+		log_warn("publish of %d on %s too big\n", data_len, topic);
+		return FALSE;
+	}
+	buf = (uint8_t *)os_malloc(MQTT5_HEAD + body);
+	if (buf == NULL)
+		return FALSE;
+	n = MQTT5_HEAD + str_put(buf + MQTT5_HEAD, topic);
+	if (qos) {
+		id = mqtt5_next_id(client);
+		buf[n++] = id >> 8;
+		buf[n++] = id;
+	}
+	buf[n++] = 0;	/* properties, the alias goes in on the way out */
+	os_memcpy(buf + n, data, data_len);
+	p = head_put(buf, MQTT_MSG_TYPE_PUBLISH << 4 | qos << 1 | (retain ? 1 : 0), body);
+	ok = mqtt5_queue(client, p, buf + MQTT5_HEAD + body - p);
+	os_free(buf);
+	return ok;
+}
+
+BOOL ICACHE_FLASH_ATTR mqtt5_subscribe(MQTT_Client *client, char *topic, uint8_t qos)
+{
+	uint16_t tl = os_strlen(topic), id, n;
+	uint8_t *buf, *p;
+	BOOL ok;
+
+	if (mqtt5_get(client) == NULL)
+		return MQTT_Subscribe(client, topic, qos);
+	buf = (uint8_t *)os_malloc(MQTT5_HEAD + 2 + 1 + 2 + tl + 1);
+	if (buf == NULL)
+		return FALSE;
+	id = mqtt5_next_id(client);
+	n = MQTT5_HEAD;
+	buf[n++] = id >> 8;
+	buf[n++] = id;
+	buf[n++] = 0;	/* properties */
+	n += str_put(buf + n, topic);
+	buf[n++] = qos & 3;
+	p = head_put(buf, MQTT_MSG_TYPE_SUBSCRIBE << 4 | 2, n - MQTT5_HEAD);
+	ok = mqtt5_queue(client, p, buf + n - p);
+	os_free(buf);
+	return ok;
+}
@@ -6,7 +6,16 @@
 #include "driver/uart.h"
 #include "user_utils.h"
 #include "mqtt.h"
+#include "mqtt5.h"
+#include "edge_filter.h"
+#include "aggregate.h"
 #include "config.h"
+#include "neurite_cfg.h"
+#include "neurite_wifi.h"
+#include "metrics.h"
+#include "trace.h"
+#include "mem_track.h"
+#include "hot.h"
 
 #define NEURITE_CMD_TASK_QUEUE_SIZE	1
 #define NEURITE_CMD_TASK_PRIO		USER_TASK_PRIO_2
@@ -17,9 +26,6 @@
 #define NEURITE_UID_LEN			32
 #define NEURITE_TOPIC_LEN		64
 
-/* external stuffs */
-extern SYSCFG sysCfg;
-
 struct cmd_parser_s;
 typedef void (*cmd_parser_cb_fp)(struct cmd_parser_s *cp);
 
@@ -35,20 +41,31 @@ struct neurite_mqtt_cfg_s {
 	char uid[NEURITE_UID_LEN];
 	char topic_to[NEURITE_TOPIC_LEN];
 	char topic_from[NEURITE_TOPIC_LEN];
+	char topic_stats[NEURITE_TOPIC_LEN];
 };
 
 struct neurite_data_s {
 	bool wifi_connected;
 	bool mqtt_connected;
+	bool mqtt_session;	/* the broker kept our subscription over the reconnect */
 	struct neurite_mqtt_cfg_s nmcfg;
-	os_timer_t worker_timer;
 	MQTT_Client mc;
 	SYSCFG *cfg;
 	struct cmd_parser_s *cp;
 };
 
+#ifdef NEURITE_MQTT_KEEP_SESSION
+#if !defined(PROTOCOL_NAMEv311) && !defined(NEURITE_MQTT5)
+#error "NEURITE_MQTT_KEEP_SESSION needs PROTOCOL_NAMEv311 or NEURITE_MQTT5"
+#endif
+#define NEURITE_CLEAN_SESSION	0
+#else
+#define NEURITE_CLEAN_SESSION	1
+#endif
+
 struct neurite_data_s g_nd;
 struct cmd_parser_s g_cp;
+struct neurite_cfg_s g_ncfg;
 
 os_event_t neurite_worker_rx_queue[NEURITE_WORKER_TASK_QUEUE_SIZE];
 os_event_t neurite_cmd_rx_queue[NEURITE_CMD_TASK_QUEUE_SIZE];
@@ -64,10 +81,17 @@ enum worker_state_e {
 
 static enum worker_state_e worker_st = WORKER_ST_0;
 
+/* the worker only runs when something happened, no polling */
+static inline void neurite_worker_kick(void)
+{
+	system_os_post(NEURITE_WORKER_TASK_PRIO, 1, (os_param_t)&g_nd);
+}
+
 static inline void update_worker_state(int st)
 {
 	log_dbg("-> WORKER_ST_%d\n", st);
 	worker_st = st;
+	neurite_worker_kick();
 }
 
 static inline uint32_t ICACHE_FLASH_ATTR system_get_time_ms(void)
@@ -75,18 +99,28 @@ static inline uint32_t ICACHE_FLASH_ATTR system_get_time_ms(void)
 	return system_get_time()/1000;
 }
 
-void ICACHE_FLASH_ATTR neurite_cmd_input(uint8_t data)
+void HOT_ATTR neurite_cmd_input(uint8_t data)
 {
-	RINGBUF_Put(&cmd_rx_rb, data);
+	if (RINGBUF_Put(&cmd_rx_rb, data) != 0)
+		metrics_inc(METRIC_RX_RB_DROPS);
 	system_os_post(NEURITE_CMD_TASK_PRIO, 1, (os_param_t)&g_nd);
 }
 
 static void ICACHE_FLASH_ATTR cmd_completed_cb(struct cmd_parser_s *cp)
 {
 	dbg_assert(cp);
-	if (cp->data_len > 0) {
+	TRACE(TRACE_FRAME_DONE, cp->data_len);
+	if (cp->data_len > 0 && aggregate_add(&g_nd.mc, g_nd.nmcfg.topic_to, cp->buf, cp->data_len, 0, 0)) {
+		log_dbg("msg aggregated(len %d)\n", cp->data_len);
+	} else if (cp->data_len > 0 && !edge_filter_pass(g_nd.nmcfg.topic_to, cp->buf, cp->data_len)) {
+		log_dbg("msg filtered(len %d)\n", cp->data_len);
+	} else if (cp->data_len > 0) {
 		log_dbg("msg launch(len %d): %s\n", cp->data_len, cp->buf);
-		MQTT_Publish(&g_nd.mc, g_nd.nmcfg.topic_to, cp->buf, cp->data_len, 0, 0);
+		if (mqtt5_publish(&g_nd.mc, g_nd.nmcfg.topic_to, cp->buf, cp->data_len, 0, 0))
+			metrics_inc(METRIC_MQTT_PUB);
+		else
+			metrics_inc(METRIC_MQTT_PUB_FAIL);
+		TRACE(TRACE_PUB_QUEUED, cp->data_len);
 	}
 	os_bzero(cp->buf, cp->buf_size);
 	cp->data_len = 0;
@@ -102,7 +136,7 @@ uint8_t ICACHE_FLASH_ATTR cmd_parser_init(struct cmd_parser_s *cp, cmd_parser_cb
 	return 0;
 }
 
-static void ICACHE_FLASH_ATTR cmd_parse_byte(struct cmd_parser_s *cp, char value)
+static void HOT_ATTR cmd_parse_byte(struct cmd_parser_s *cp, char value)
 {
 	dbg_assert(cp);
 	switch (value) {
@@ -123,13 +157,17 @@ static void ICACHE_FLASH_ATTR neurite_cmd_task(os_event_t *events)
 	uint8_t c;
 
 	dbg_assert(nd);
+	MEM_STACK_PROBE();
 
 	/* commands make sense only if connected */
 	if (!nd->mqtt_connected)
 		return;
 
 	while (RINGBUF_Get(&cmd_rx_rb, &c) == 0) {
+#ifndef NEURITE_DLOG
+		/* echo, the whole line is logged once complete */
 		os_printf("%c", c);
+#endif
 		cmd_parse_byte(nd->cp, c);
 	}
 }
@@ -162,6 +200,7 @@ static void ICACHE_FLASH_ATTR wifi_cb(uint8_t status)
 	log_dbg("status: %d(%s)\n", status, WIFI_STATUS_STR[status]);
 	if (status == STATION_GOT_IP) {
 		g_nd.wifi_connected = true;
+		neurite_worker_kick();
 	} else {
 		if (status != STATION_IDLE) {
 			g_nd.wifi_connected = false;
@@ -172,7 +211,7 @@ static void ICACHE_FLASH_ATTR wifi_cb(uint8_t status)
 void ICACHE_FLASH_ATTR neurite_wifi_connect(struct neurite_data_s *nd)
 {
 	dbg_assert(nd);
-	WIFI_Connect(nd->cfg->sta_ssid, nd->cfg->sta_pwd, wifi_cb);
+	neurite_wifi_start(&g_ncfg, wifi_cb);
 }
 
 void mqtt_connected_cb(uint32_t *args)
@@ -180,6 +219,8 @@ void mqtt_connected_cb(uint32_t *args)
 	MQTT_Client *client = (MQTT_Client*)args;
 	log_dbg("connected\r\n");
 	g_nd.mqtt_connected = true;
+	g_nd.mqtt_session = mqtt5_session_present(client);
+	aggregate_flush(client);
 
 	/*
 	 * Each time we get here may be caused by a reconnect,
@@ -199,6 +240,7 @@ void mqtt_published_cb(uint32_t *args)
 {
 	MQTT_Client *client = (MQTT_Client*)args;
 	log_dbg("published\r\n");
+	metrics_inc(METRIC_MQTT_PUB_ACK);
 }
 
 void mqtt_data_cb(uint32_t *args, const char *topic, uint32_t topic_len, const char *data, uint32_t data_len)
@@ -209,6 +251,9 @@ void mqtt_data_cb(uint32_t *args, const char *topic, uint32_t topic_len, const c
 
 	MQTT_Client* client = (MQTT_Client*)args;
 
+	MEM_STACK_PROBE();
+	metrics_inc(METRIC_MQTT_RECV);
+	TRACE(TRACE_MQTT_DATA, data_len);
 	os_memcpy(topic_buf, topic, topic_len);
 	topic_buf[topic_len] = 0;
 
@@ -217,6 +262,7 @@ void mqtt_data_cb(uint32_t *args, const char *topic, uint32_t topic_len, const c
 
 	uart0_sendStr(data_buf);
 	uart0_write_char('\n');
+	TRACE(TRACE_TX_DONE, data_len);
 
 	log_dbg("> topic (%d): %s\n", topic_len, topic_buf);
 	log_dbg("> data (%d): %s\n", data_len, data_buf);
@@ -228,13 +274,17 @@ void mqtt_data_cb(uint32_t *args, const char *topic, uint32_t topic_len, const c
 void ICACHE_FLASH_ATTR neurite_mqtt_connect(struct neurite_data_s *nd)
 {
 	MQTT_InitConnection(&nd->mc, nd->cfg->mqtt_host, nd->cfg->mqtt_port, nd->cfg->security);
-	MQTT_InitClient(&nd->mc, nd->cfg->device_id, nd->cfg->mqtt_user, nd->cfg->mqtt_pass, nd->cfg->mqtt_keepalive, 1);
+	MQTT_InitClient(&nd->mc, nd->cfg->device_id, nd->cfg->mqtt_user, nd->cfg->mqtt_pass, nd->cfg->mqtt_keepalive, NEURITE_CLEAN_SESSION);
 	MQTT_InitLWT(&nd->mc, "/lwt", "offline", 0, 0);
 	MQTT_OnConnected(&nd->mc, mqtt_connected_cb);
 	MQTT_OnDisconnected(&nd->mc, mqtt_disconnected_cb);
 	MQTT_OnPublished(&nd->mc, mqtt_published_cb);
 	MQTT_OnData(&nd->mc, mqtt_data_cb);
-	MQTT_Connect(&nd->mc);
+#ifdef NEURITE_MQTT5
+	if (mqtt5_init(&nd->mc, NULL))
+		log_err("no memory for MQTT 5, staying on 3.1\n");
+#endif
+	mqtt5_connect(&nd->mc);
 }
 
 void ICACHE_FLASH_ATTR neurite_child_worker(struct neurite_data_s *nd)
@@ -259,6 +309,7 @@ static void ICACHE_FLASH_ATTR neurite_worker_task(os_event_t *events)
 {
 	struct neurite_data_s *nd = (struct neurite_data_s *)events->par;
 	dbg_assert(nd);
+	MEM_STACK_PROBE();
 
 	switch (worker_st) {
 		case WORKER_ST_0:
@@ -274,11 +325,13 @@ static void ICACHE_FLASH_ATTR neurite_worker_task(os_event_t *events)
 		case WORKER_ST_2:
 			if (!nd->mqtt_connected)
 				break;
-			MQTT_Subscribe(&nd->mc, nd->nmcfg.topic_from, 1);
+			if (!nd->mqtt_session)
+				mqtt5_subscribe(&nd->mc, nd->nmcfg.topic_from, 1);
+			metrics_publish_start(&nd->mc, nd->nmcfg.topic_stats, NEURITE_STATS_INTERVAL);
 			uint8_t *payload_buf = (uint8_t *)os_malloc(32);
 			dbg_assert(payload_buf);
 			os_sprintf(payload_buf, "checkin: %s", nd->nmcfg.uid);
-			MQTT_Publish(&nd->mc, nd->nmcfg.topic_to, payload_buf, strlen(payload_buf), 1, 0);
+			mqtt5_publish(&nd->mc, nd->nmcfg.topic_to, payload_buf, strlen(payload_buf), 1, 0);
 			os_free(payload_buf);
 			update_worker_state(WORKER_ST_3);
 			break;
@@ -291,13 +344,6 @@ static void ICACHE_FLASH_ATTR neurite_worker_task(os_event_t *events)
 	}
 }
 
-static inline void ICACHE_FLASH_ATTR worker_timer_handler(void *arg)
-{
-	struct neurite_data_s *nd = (struct neurite_data_s *)arg;
-	dbg_assert(nd);
-	system_os_post(NEURITE_WORKER_TASK_PRIO, 1, (os_param_t)nd);
-}
-
 void ICACHE_FLASH_ATTR neurite_worker_init(struct neurite_data_s *nd)
 {
 	dbg_assert(nd);
@@ -306,10 +352,8 @@ void ICACHE_FLASH_ATTR neurite_worker_init(struct neurite_data_s *nd)
 			neurite_worker_rx_queue,
 			NEURITE_WORKER_TASK_QUEUE_SIZE);
 
-	os_timer_disarm(&nd->worker_timer);
-	os_timer_setfn(&nd->worker_timer, (os_timer_func_t *)worker_timer_handler, nd);
-	/* FIXME wake up every 1ms, too frequent? */
-	os_timer_arm(&nd->worker_timer, 1, 1);
+	/* WiFi and MQTT callbacks kick the worker from here on */
+	neurite_worker_kick();
 }
 
 void ICACHE_FLASH_ATTR neurite_init(void)
@@ -318,10 +362,11 @@ void ICACHE_FLASH_ATTR neurite_init(void)
 	uint8_t *cmd_buf = NULL;
 	log_dbg("in\n");
 
-	CFG_Load();
+	trace_init(NEURITE_TRACE_DUMP_MS);
+	neurite_cfg_load(&g_ncfg);
 
 	os_bzero(nd, sizeof(struct neurite_data_s));
-	nd->cfg = &sysCfg;
+	nd->cfg = &g_ncfg.sys;
 
 	os_bzero(&g_cp, sizeof(struct cmd_parser_s));
 	nd->cp = &g_cp;
@@ -340,6 +385,14 @@ void ICACHE_FLASH_ATTR neurite_init(void)
 	os_sprintf(nd->nmcfg.topic_to, "/neuro/chatroom", nd->nmcfg.uid);
 	os_sprintf(nd->nmcfg.topic_from, "/neuro/chatroom", nd->nmcfg.uid);
 #endif
+	/* the %s of the format makes room for the terminator */
+	if (os_strlen(nd->nmcfg.uid) + sizeof(NEURITE_STATS_TOPIC) <= NEURITE_TOPIC_LEN)
+		os_sprintf(nd->nmcfg.topic_stats, NEURITE_STATS_TOPIC, nd->nmcfg.uid);
+	else
+		log_err("uid too long for the stats topic\n");
+	edge_filter_set(nd->nmcfg.topic_to, NEURITE_FILTER_DEADBAND, NEURITE_FILTER_MIN_MS,
+			NEURITE_FILTER_HEARTBEAT_MS, NEURITE_FILTER_FLAGS);
+	aggregate_set(nd->nmcfg.topic_to, NEURITE_AGGREGATE_MS);
 	os_sprintf(nd->cfg->sta_ssid, "%s", STA_SSID);
 	os_sprintf(nd->cfg->sta_pwd, "%s", STA_PASS);
 	log_dbg("chip id: %08x\n", system_get_chip_id());
@@ -352,7 +405,8 @@ void ICACHE_FLASH_ATTR neurite_init(void)
 	log_dbg("mqtt user: %s\n", nd->cfg->mqtt_user);
 	log_dbg("mqtt pass: %s\n", nd->cfg->mqtt_pass);
 
-	CFG_Save();
+	neurite_cfg_save(&g_ncfg);
+	log_info("boots: %d, cfg writes: %d\n", neurite_cfg_boot_count(), neurite_cfg_write_count());
 
 	neurite_worker_init(nd);
 	neurite_cmd_init(nd);
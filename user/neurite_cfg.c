@@ -0,0 +1,211 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "spi_flash.h"
+#include "user_utils.h"
+#include "neurite_cfg.h"
+
+#define CFG_SEC_NUM		2
+#define CFG_TALLY_OFFSET	2048
+#define CFG_TALLY_WORDS		64
+#define CFG_PAYLOAD_LEN		sizeof(struct neurite_cfg_s)
+
+struct cfg_hdr_s {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t len;
+	uint32_t seq;
+	uint32_t boot_base;
+	uint32_t hash;
+};
+
+struct cfg_store_s {
+	int8_t active;
+	bool tally_full;
+	uint32_t seq;
+	uint32_t hash;
+	uint32_t boots;
+};
+
+static struct cfg_store_s g_cs;
+
+static inline uint32_t ICACHE_FLASH_ATTR cfg_sec_addr(uint8_t sec)
+{
+	return (NEURITE_CFG_LOCATION + sec) * SPI_FLASH_SEC_SIZE;
+}
+
+/* FNV-1a, good enough to tell whether anything changed */
+static uint32_t ICACHE_FLASH_ATTR cfg_hash(const void *data, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t h = 2166136261UL;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static bool ICACHE_FLASH_ATTR cfg_read(uint8_t sec, struct cfg_hdr_s *hdr, struct neurite_cfg_s *cfg)
+{
+	if (spi_flash_read(cfg_sec_addr(sec), (uint32_t *)hdr, sizeof(struct cfg_hdr_s)) != SPI_FLASH_RESULT_OK)
+		return false;
+	if (hdr->magic != NEURITE_CFG_MAGIC || hdr->len == 0 ||
+			hdr->len > CFG_PAYLOAD_LEN || (hdr->len & 3) != 0)
+		return false;
+
+	os_bzero(cfg, CFG_PAYLOAD_LEN);
+	if (spi_flash_read(cfg_sec_addr(sec) + sizeof(struct cfg_hdr_s), (uint32_t *)cfg, hdr->len) != SPI_FLASH_RESULT_OK)
+		return false;
+	return cfg_hash(cfg, hdr->len) == hdr->hash;
+}
+
+/*
+ * Account for this boot in the tally of the active sector. Programming
+ * a bit from 1 to 0 needs no erase. Returns the number of boots recorded
+ * in the tally, or -1 if it is already full.
+ */
+static int32_t ICACHE_FLASH_ATTR cfg_tally_tick(uint8_t sec)
+{
+	uint32_t tally[CFG_TALLY_WORDS];
+	uint32_t addr = cfg_sec_addr(sec) + CFG_TALLY_OFFSET;
+	int32_t count = 0;
+	int8_t next = -1;
+	uint32_t w;
+	uint8_t i;
+
+	if (spi_flash_read(addr, tally, sizeof(tally)) != SPI_FLASH_RESULT_OK)
+		return -1;
+
+	for (i = 0; i < CFG_TALLY_WORDS; i++) {
+		w = ~tally[i];
+		while (w) {
+			w &= w - 1;
+			count++;
+		}
+		if (next < 0 && tally[i] != 0)
+			next = i;
+	}
+	if (next < 0)
+		return -1;
+
+	tally[next] &= tally[next] - 1;
+	spi_flash_write(addr + next * sizeof(uint32_t), &tally[next], sizeof(uint32_t));
+	return count + 1;
+}
+
+static void ICACHE_FLASH_ATTR cfg_load_legacy(struct neurite_cfg_s *cfg)
+{
+	CFG_Load();
+	os_bzero(cfg, CFG_PAYLOAD_LEN);
+	os_memcpy(&cfg->sys, &sysCfg, sizeof(SYSCFG));
+}
+
+void ICACHE_FLASH_ATTR neurite_cfg_load(struct neurite_cfg_s *cfg)
+{
+	struct cfg_hdr_s hdr;
+	uint32_t best_seq = 0;
+	int8_t best = -1;
+	int32_t tally;
+	uint8_t i;
+
+	dbg_assert(cfg);
+	dbg_assert((CFG_PAYLOAD_LEN & 3) == 0);
+	dbg_assert(sizeof(struct cfg_hdr_s) + CFG_PAYLOAD_LEN <= CFG_TALLY_OFFSET);
+
+	os_bzero(&g_cs, sizeof(struct cfg_store_s));
+	g_cs.active = -1;
+
+	for (i = 0; i < CFG_SEC_NUM; i++) {
+		if (!cfg_read(i, &hdr, cfg))
+			continue;
+		if (best < 0 || hdr.seq > best_seq) {
+			best = i;
+			best_seq = hdr.seq;
+		}
+	}
+
+	if (best < 0 || !cfg_read(best, &hdr, cfg)) {
+		log_info("no valid copy, loading legacy config\n");
+		cfg_load_legacy(cfg);
+		g_cs.boots = 1;
+		return;
+	}
+
+	g_cs.active = best;
+	g_cs.seq = hdr.seq;
+	g_cs.hash = hdr.hash;
+
+	tally = cfg_tally_tick(best);
+	if (tally < 0) {
+		/* the next save folds the tally into boot_base */
+		g_cs.tally_full = true;
+		g_cs.boots = hdr.boot_base + CFG_TALLY_WORDS * 32 + 1;
+	} else {
+		g_cs.boots = hdr.boot_base + tally;
+	}
+
+	if (hdr.version != NEURITE_CFG_VERSION)
+		log_info("migrating v%d -> v%d\n", hdr.version, NEURITE_CFG_VERSION);
+
+	if (cfg->sys.cfg_holder != CFG_HOLDER) {
+		log_info("cfg holder changed, loading defaults\n");
+		cfg_load_legacy(cfg);
+	}
+
+	log_dbg("sector %d, seq %d, boots %d\n", best, g_cs.seq, g_cs.boots);
+}
+
+/*
+ * Returns 1 if the record was written, 0 if flash already holds the same
+ * configuration, -1 on flash errors.
+ */
+int8_t ICACHE_FLASH_ATTR neurite_cfg_save(struct neurite_cfg_s *cfg)
+{
+	struct cfg_hdr_s hdr;
+	uint32_t hash;
+	uint8_t sec;
+
+	dbg_assert(cfg);
+
+	hash = cfg_hash(cfg, CFG_PAYLOAD_LEN);
+	if (g_cs.active >= 0 && hash == g_cs.hash && !g_cs.tally_full) {
+		log_dbg("unchanged, skip writing\n");
+		return 0;
+	}
+
+	sec = (g_cs.active == 0) ? 1 : 0;
+
+	hdr.magic = NEURITE_CFG_MAGIC;
+	hdr.version = NEURITE_CFG_VERSION;
+	hdr.len = CFG_PAYLOAD_LEN;
+	hdr.seq = g_cs.seq + 1;
+	hdr.boot_base = g_cs.boots;
+	hdr.hash = hash;
+
+	/* header goes last, the copy is not valid until it lands */
+	if (spi_flash_erase_sector(NEURITE_CFG_LOCATION + sec) != SPI_FLASH_RESULT_OK ||
+			spi_flash_write(cfg_sec_addr(sec) + sizeof(struct cfg_hdr_s), (uint32_t *)cfg, CFG_PAYLOAD_LEN) != SPI_FLASH_RESULT_OK ||
+			spi_flash_write(cfg_sec_addr(sec), (uint32_t *)&hdr, sizeof(struct cfg_hdr_s)) != SPI_FLASH_RESULT_OK) {
+		log_err("flash write failed, sector %d\n", sec);
+		return -1;
+	}
+
+	g_cs.active = sec;
+	g_cs.seq = hdr.seq;
+	g_cs.hash = hash;
+	g_cs.tally_full = false;
+	log_info("written to sector %d, seq %d\n", sec, g_cs.seq);
+	return 1;
+}
+
+uint32_t ICACHE_FLASH_ATTR neurite_cfg_boot_count(void)
+{
+	return g_cs.boots;
+}
+
+uint32_t ICACHE_FLASH_ATTR neurite_cfg_write_count(void)
+{
+	return g_cs.seq;
+}
@@ -0,0 +1,47 @@
+#ifndef __NEURITE_CFG_H__
+#define __NEURITE_CFG_H__
+
+#include "c_types.h"
+#include "config.h"
+
+/*
+ * Versioned configuration store.
+ *
+ * Two flash sectors hold A/B copies of the record, the newer valid copy
+ * (highest seq) wins. A save goes to the inactive sector and only becomes
+ * visible once its header is written, so a power cut never leaves us
+ * without a configuration. Saves are skipped when the payload hash
+ * matches what is already on flash.
+ *
+ * Boots are tallied by clearing one bit per boot in the active sector,
+ * which needs no erase. Compare boot count with write count to see that
+ * the flash is left alone on a normal power-up.
+ *
+ * Fields may only be appended to struct neurite_cfg_s, bump
+ * NEURITE_CFG_VERSION when doing so.
+ */
+#define NEURITE_CFG_MAGIC	0x4E434647	/* "NCFG" */
+#define NEURITE_CFG_VERSION	2
+
+/* last good association, see neurite_wifi.c */
+struct neurite_wifi_cache_s {
+	uint8_t valid;
+	uint8_t channel;
+	uint8_t bssid[6];
+	uint32_t ip;
+	uint32_t netmask;
+	uint32_t gw;
+	uint32_t lease_boot;
+};
+
+struct neurite_cfg_s {
+	SYSCFG sys;
+	struct neurite_wifi_cache_s wifi;
+};
+
+void neurite_cfg_load(struct neurite_cfg_s *cfg);
+int8_t neurite_cfg_save(struct neurite_cfg_s *cfg);
+uint32_t neurite_cfg_boot_count(void);
+uint32_t neurite_cfg_write_count(void);
+
+#endif /* __NEURITE_CFG_H__ */
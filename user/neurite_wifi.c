@@ -0,0 +1,300 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "user_utils.h"
+#ifdef NEURITE_WIFI_STATIC_IP
+#include "ping.h"
+#endif
+#include "neurite_wifi.h"
+#include "metrics.h"
+
+/*
+ * Station connect with a fast path.
+ *
+ * The last good BSSID, channel and DHCP lease are kept in the config
+ * store. The next connect locks onto that BSSID and channel so the SDK
+ * skips the full scan, and with NEURITE_WIFI_STATIC_IP the cached lease
+ * is applied as static IP for NEURITE_WIFI_LEASE_BOOTS boots, skipping
+ * DHCP as well. The static address only counts once the gateway answers
+ * a ping; when it does not (no gateway, or the address is taken and the
+ * replies go elsewhere) the lease is dropped and DHCP runs on the same
+ * AP. Any other failure on the fast path drops the cache and falls back
+ * to a full scan with DHCP.
+ *
+ * The cache is saved when the AP or the lease changes. Its age only
+ * moves when DHCP confirms a lease that was too old to reuse, so a
+ * normal power-up leaves the flash alone.
+ */
+
+struct neurite_wifi_s {
+	struct neurite_cfg_s *cfg;
+	neurite_wifi_cb_fp cb;
+	os_timer_t fast_timer;
+	uint32_t t_start;
+	bool fast;
+	bool static_ip;
+	bool got_ip;
+#ifdef NEURITE_WIFI_STATIC_IP
+	bool gw_check;		/* pinging the gateway of the static address */
+	bool gw_retry;		/* dropped the link for DHCP, not a failure */
+	struct ping_option ping;
+#endif
+	uint8_t channel;
+	uint8_t bssid[6];
+};
+
+static struct neurite_wifi_s g_nw;
+
+static void ICACHE_FLASH_ATTR wifi_attempt(struct neurite_wifi_s *nw, bool fast);
+
+static inline void ICACHE_FLASH_ATTR wifi_report(struct neurite_wifi_s *nw, uint8_t status)
+{
+	if (nw->cb)
+		nw->cb(status);
+}
+
+static void ICACHE_FLASH_ATTR wifi_fallback(struct neurite_wifi_s *nw, const char *why)
+{
+	log_warn("fast connect failed (%s), doing full scan\n", why);
+	os_timer_disarm(&nw->fast_timer);
+	nw->cfg->wifi.valid = 0;
+	wifi_station_disconnect();
+	wifi_attempt(nw, false);
+}
+
+static void ICACHE_FLASH_ATTR wifi_fast_timeout(void *arg)
+{
+	struct neurite_wifi_s *nw = (struct neurite_wifi_s *)arg;
+	dbg_assert(nw);
+	if (nw->fast && !nw->got_ip)
+		wifi_fallback(nw, "timeout");
+}
+
+#ifdef NEURITE_WIFI_STATIC_IP
+static bool ICACHE_FLASH_ATTR wifi_lease_fresh(struct neurite_wifi_cache_s *cache)
+{
+	return cache->ip != 0 &&
+		neurite_cfg_boot_count() - cache->lease_boot < NEURITE_WIFI_LEASE_BOOTS;
+}
+
+static void ICACHE_FLASH_ATTR wifi_got_ip(struct neurite_wifi_s *nw, struct ip_info *info);
+
+static void ICACHE_FLASH_ATTR wifi_ping_recv(void *arg, void *pdata)
+{
+	struct neurite_wifi_s *nw = &g_nw;
+	struct ping_resp *resp = (struct ping_resp *)pdata;
+	struct ip_info info;
+
+	if (!nw->gw_check || resp->ping_err != 0 || nw->got_ip)
+		return;
+	nw->gw_check = false;
+	wifi_get_ip_info(STATION_IF, &info);
+	wifi_got_ip(nw, &info);
+}
+
+/* all pings went out, none came back */
+static void ICACHE_FLASH_ATTR wifi_ping_done(void *arg, void *pdata)
+{
+	struct neurite_wifi_s *nw = &g_nw;
+
+	if (!nw->gw_check || nw->got_ip)
+		return;
+	nw->gw_check = false;
+	log_warn("static ip: gateway " IPSTR " does not answer, asking DHCP\n",
+			IP2STR((ip_addr_t *)&nw->cfg->wifi.gw));
+	nw->cfg->wifi.ip = 0;
+	os_timer_disarm(&nw->fast_timer);
+	nw->gw_retry = true;
+	wifi_station_disconnect();
+	wifi_attempt(nw, true);
+}
+
+static void ICACHE_FLASH_ATTR wifi_gw_check(struct neurite_wifi_s *nw)
+{
+	if (nw->gw_check)
+		return;
+	nw->gw_check = true;
+	os_bzero(&nw->ping, sizeof(struct ping_option));
+	nw->ping.count = NEURITE_WIFI_GW_PINGS;
+	nw->ping.ip = nw->cfg->wifi.gw;
+	nw->ping.coarse_time = 1;
+	ping_regist_recv(&nw->ping, wifi_ping_recv);
+	ping_regist_sent(&nw->ping, wifi_ping_done);
+	ping_start(&nw->ping);
+}
+#endif
+
+static void ICACHE_FLASH_ATTR wifi_attempt(struct neurite_wifi_s *nw, bool fast)
+{
+	struct neurite_wifi_cache_s *cache = &nw->cfg->wifi;
+	struct station_config sc;
+	uint32_t len;
+#ifdef NEURITE_WIFI_STATIC_IP
+	struct ip_info info;
+#endif
+
+	os_bzero(&sc, sizeof(struct station_config));
+	/* sc is zeroed, a 32 byte SSID goes without a terminator */
+	len = os_strlen((char *)nw->cfg->sys.sta_ssid);
+	os_memcpy(sc.ssid, nw->cfg->sys.sta_ssid, len < sizeof(sc.ssid) ? len : sizeof(sc.ssid));
+	len = os_strlen((char *)nw->cfg->sys.sta_pwd);
+	os_memcpy(sc.password, nw->cfg->sys.sta_pwd, len < sizeof(sc.password) ? len : sizeof(sc.password));
+
+	nw->fast = fast && cache->valid;
+	nw->static_ip = false;
+	nw->got_ip = false;
+#ifdef NEURITE_WIFI_STATIC_IP
+	nw->gw_check = false;
+#endif
+	nw->t_start = system_get_time();
+
+	if (nw->fast) {
+		sc.bssid_set = 1;
+		os_memcpy(sc.bssid, cache->bssid, sizeof(sc.bssid));
+		wifi_set_channel(cache->channel);
+#ifdef NEURITE_WIFI_STATIC_IP
+		if (wifi_lease_fresh(cache)) {
+			wifi_station_dhcpc_stop();
+			info.ip.addr = cache->ip;
+			info.netmask.addr = cache->netmask;
+			info.gw.addr = cache->gw;
+			wifi_set_ip_info(STATION_IF, &info);
+			nw->static_ip = true;
+		}
+#endif
+		os_timer_disarm(&nw->fast_timer);
+		os_timer_arm(&nw->fast_timer, NEURITE_WIFI_FAST_TIMEOUT, 0);
+	}
+	if (!nw->static_ip)
+		wifi_station_dhcpc_start();
+
+	log_info("%s connect, ssid: %s, ch: %d%s\n", nw->fast ? "fast" : "full",
+			sc.ssid, nw->fast ? cache->channel : 0,
+			nw->static_ip ? ", static ip" : "");
+	wifi_station_set_config_current(&sc);
+	wifi_station_connect();
+	wifi_report(nw, STATION_CONNECTING);
+}
+
+static void ICACHE_FLASH_ATTR wifi_got_ip(struct neurite_wifi_s *nw, struct ip_info *info)
+{
+	struct neurite_wifi_cache_s *cache = &nw->cfg->wifi;
+	uint32_t ms = (system_get_time() - nw->t_start) / 1000;
+
+	os_timer_disarm(&nw->fast_timer);
+	nw->got_ip = true;
+	metrics_inc(METRIC_WIFI_CONNECT);
+	metrics_hist_add(METRIC_HIST_WIFI_IP_MS, ms);
+
+	log_info("got ip " IPSTR " in %d ms (%s%s)\n", IP2STR(&info->ip), ms,
+			nw->fast ? "fast" : "full", nw->static_ip ? ", static ip" : "");
+
+	cache->valid = 1;
+	cache->channel = nw->channel;
+	os_memcpy(cache->bssid, nw->bssid, sizeof(cache->bssid));
+	if (nw->static_ip) {
+		/* the cached lease as it is */
+	} else if (cache->ip != info->ip.addr || cache->netmask != info->netmask.addr ||
+			cache->gw != info->gw.addr) {
+		cache->ip = info->ip.addr;
+		cache->netmask = info->netmask.addr;
+		cache->gw = info->gw.addr;
+		cache->lease_boot = neurite_cfg_boot_count();
+#ifdef NEURITE_WIFI_STATIC_IP
+	} else if (!wifi_lease_fresh(cache)) {
+		/* DHCP confirmed a lease too old to reuse, good for another round */
+		cache->lease_boot = neurite_cfg_boot_count();
+#endif
+	}
+	/* only hits the flash if the AP or the lease changed */
+	neurite_cfg_save(nw->cfg);
+
+	wifi_report(nw, STATION_GOT_IP);
+}
+
+static uint8_t ICACHE_FLASH_ATTR wifi_reason_status(uint8_t reason)
+{
+	switch (reason) {
+		case REASON_NO_AP_FOUND:
+			return STATION_NO_AP_FOUND;
+		case REASON_AUTH_FAIL:
+		case REASON_HANDSHAKE_TIMEOUT:
+			return STATION_WRONG_PASSWORD;
+		default:
+			return STATION_CONNECT_FAIL;
+	}
+}
+
+static void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *evt)
+{
+	struct neurite_wifi_s *nw = &g_nw;
+	struct ip_info info;
+	uint8_t reason;
+
+	switch (evt->event) {
+		case EVENT_STAMODE_CONNECTED:
+			os_memcpy(nw->bssid, evt->event_info.connected.bssid, sizeof(nw->bssid));
+			nw->channel = evt->event_info.connected.channel;
+#ifdef NEURITE_WIFI_STATIC_IP
+			/* no DHCP round on the static path, the gateway is all we wait for */
+			if (nw->static_ip && !nw->got_ip)
+				wifi_gw_check(nw);
+#endif
+			break;
+		case EVENT_STAMODE_GOT_IP:
+			if (nw->got_ip)
+				break;
+#ifdef NEURITE_WIFI_STATIC_IP
+			if (nw->static_ip) {
+				wifi_gw_check(nw);
+				break;
+			}
+#endif
+			info.ip = evt->event_info.got_ip.ip;
+			info.netmask = evt->event_info.got_ip.mask;
+			info.gw = evt->event_info.got_ip.gw;
+			wifi_got_ip(nw, &info);
+			break;
+		case EVENT_STAMODE_DHCP_TIMEOUT:
+			if (nw->fast && !nw->got_ip)
+				wifi_fallback(nw, "dhcp timeout");
+			break;
+		case EVENT_STAMODE_DISCONNECTED:
+			reason = evt->event_info.disconnected.reason;
+#ifdef NEURITE_WIFI_STATIC_IP
+			if (nw->gw_retry) {
+				nw->gw_retry = false;
+				break;
+			}
+#endif
+			if (nw->fast && !nw->got_ip) {
+				log_dbg("reason: %d\n", reason);
+				wifi_fallback(nw, "disconnected");
+				break;
+			}
+			if (nw->got_ip) {
+				/* the SDK reconnects on its own, time that one too */
+				nw->got_ip = false;
+				nw->t_start = system_get_time();
+			}
+			wifi_report(nw, wifi_reason_status(reason));
+			break;
+		default:
+			break;
+	}
+}
+
+void ICACHE_FLASH_ATTR neurite_wifi_start(struct neurite_cfg_s *cfg, neurite_wifi_cb_fp cb)
+{
+	dbg_assert(cfg);
+	os_bzero(&g_nw, sizeof(struct neurite_wifi_s));
+	g_nw.cfg = cfg;
+	g_nw.cb = cb;
+	os_timer_disarm(&g_nw.fast_timer);
+	os_timer_setfn(&g_nw.fast_timer, (os_timer_func_t *)wifi_fast_timeout, &g_nw);
+
+	wifi_station_set_auto_connect(FALSE);
+	wifi_set_opmode_current(STATION_MODE);
+	wifi_set_event_handler_cb(wifi_event_cb);
+	wifi_attempt(&g_nw, true);
+}
@@ -0,0 +1,11 @@
+#ifndef __NEURITE_WIFI_H__
+#define __NEURITE_WIFI_H__
+
+#include "c_types.h"
+#include "neurite_cfg.h"
+
+typedef void (*neurite_wifi_cb_fp)(uint8_t status);
+
+void neurite_wifi_start(struct neurite_cfg_s *cfg, neurite_wifi_cb_fp cb);
+
+#endif /* __NEURITE_WIFI_H__ */
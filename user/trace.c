@@ -0,0 +1,77 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "driver/uart.h"
+#include "user_utils.h"
+#include "trace.h"
+
+#ifdef NEURITE_TRACE
+
+struct trace_rec_s g_trace_ring[TRACE_RING_SIZE];
+uint32_t g_trace_head;
+
+static uint32_t trace_tail;
+static os_timer_t trace_timer;
+
+/* records not dumped yet, older ones have been overwritten */
+static inline uint32_t ICACHE_FLASH_ATTR trace_pending(uint32_t head)
+{
+	if (head - trace_tail > TRACE_RING_SIZE)
+		trace_tail = head - TRACE_RING_SIZE;
+	return head - trace_tail;
+}
+
+/*
+ * Copy out up to max records, oldest first. Records are consumed, the
+ * next call continues where this one stopped.
+ */
+uint16_t ICACHE_FLASH_ATTR trace_snapshot(struct trace_rec_s *out, uint16_t max)
+{
+	uint32_t n = trace_pending(g_trace_head);
+	uint32_t i;
+
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		out[i] = g_trace_ring[trace_tail++ & (TRACE_RING_SIZE - 1)];
+	return n;
+}
+
+static void ICACHE_FLASH_ATTR trace_puts(const char *s)
+{
+	while (*s)
+		uart1_write_char(*s++);
+}
+
+/* text dump, one "T <ccount> <ev> <arg>" line per record */
+void ICACHE_FLASH_ATTR trace_dump_uart1(void)
+{
+	struct trace_rec_s rec;
+	char line[32];
+
+	os_sprintf(line, "TRACE BEGIN %d\n", system_get_cpu_freq());
+	trace_puts(line);
+	while (trace_snapshot(&rec, 1) == 1) {
+		os_sprintf(line, "T %08x %d %d\n", rec.ccount, rec.ev, rec.arg);
+		trace_puts(line);
+	}
+	trace_puts("TRACE END\n");
+}
+
+static void ICACHE_FLASH_ATTR trace_timer_handler(void *arg)
+{
+	trace_dump_uart1();
+}
+
+/* dump_interval_ms == 0 leaves dumping to CMD_TRACE */
+void ICACHE_FLASH_ATTR trace_init(uint32_t dump_interval_ms)
+{
+	trace_tail = g_trace_head;
+	os_timer_disarm(&trace_timer);
+	if (dump_interval_ms == 0)
+		return;
+	os_timer_setfn(&trace_timer, (os_timer_func_t *)trace_timer_handler, NULL);
+	os_timer_arm(&trace_timer, dump_interval_ms, 1);
+}
+
+#endif /* NEURITE_TRACE */
@@ -41,6 +41,35 @@
 #define __dec		(system_get_time()/1000000)
 #define __frac		(system_get_time()/1000%1000)
 
+#ifdef NEURITE_DLOG
+/* deferred, see include/dlog.h, fatal stays synchronous as we hang right after */
+#include "dlog.h"
+
+#define log_dbg(msg, args...) \
+	do { \
+		if (LOG_LEVEL <= LOG_DEBUG) { \
+			dlog(LOG_DEBUG, "D", msg, ##args); \
+		} \
+	} while (0)
+#define log_info(msg, args...) \
+	do { \
+		if (LOG_LEVEL <= LOG_INFO) { \
+			dlog(LOG_INFO, "I", msg, ##args); \
+		} \
+	} while (0)
+#define log_warn(msg, args...) \
+	do { \
+		if (LOG_LEVEL <= LOG_WARN) { \
+			dlog(LOG_WARN, "W", msg, ##args); \
+		} \
+	} while (0)
+#define log_err(msg, args...) \
+	do { \
+		if (LOG_LEVEL <= LOG_ERROR) { \
+			dlog(LOG_ERROR, "E", msg, ##args); \
+		} \
+	} while (0)
+#else
 #define log_dbg(msg, args...) \
 	do { \
 		if (LOG_LEVEL <= LOG_DEBUG) { \
@@ -65,6 +94,7 @@
 			os_printf("[%6u.%03u] E/%s: " msg, __dec, __frac, __func__, ##args); \
 		} \
 	} while (0)
+#endif /* NEURITE_DLOG */
 #define log_fatal(msg, args...) \
 	do { \
 		if (LOG_LEVEL <= LOG_FATAL) { \